@@ -0,0 +1,296 @@
+/**
+ * @file access_log.c
+ * @brief Asynchronous access log of the imgFS server.
+ */
+
+#include "access_log.h"
+#include "error.h"
+#include "thread_slots.h"
+#include "util.h" // for clock_ns
+
+#include <arpa/inet.h>  // for inet_ntop, ntohs
+#include <netinet/in.h> // for sockaddr_in, sockaddr_in6
+#include <pthread.h>
+#include <signal.h>     // for pthread_sigmask
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>     // for memcpy, memset
+#include <sys/socket.h> // for getpeername
+#include <time.h>       // for nanosleep, strftime
+
+#define RING_SIZE 256 // records per ring, a power of two
+#define METHOD_LEN 8
+#define IDLE_WAIT_MS 10           // pause of the writer when all rings are empty
+#define WRITE_BUFFER (1u << 20)   // bytes the writer batches before a write()
+#define CACHE_LINE 64
+
+/**
+ * @brief A request, as pushed by its thread. Formatting is left to the writer.
+ */
+struct access_record {
+    uint64_t time_ns;    // CLOCK_REALTIME, when the record was pushed
+    uint64_t latency_ns;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint16_t status;
+    uint16_t port;
+    uint8_t family;      // AF_INET, AF_INET6, or 0 if the client is unknown
+    uint8_t method_len;
+    uint16_t target_len;
+    unsigned char addr[16];
+    char method[METHOD_LEN];
+    char target[ACCESS_LOG_TARGET];
+};
+
+/**
+ * @brief The records of one thread: it alone moves head, the writer alone moves tail.
+ */
+struct access_ring {
+    struct thread_slot slot;
+    atomic_ullong dropped;    // written by the owner only
+    _Alignas(CACHE_LINE) atomic_size_t head; // next record to fill
+    _Alignas(CACHE_LINE) atomic_size_t tail; // next record to write
+    struct access_record records[RING_SIZE];
+};
+
+static struct thread_slots rings = THREAD_SLOTS_INIT(struct access_ring);
+static _Thread_local struct access_ring* local_ring;
+
+// one thread serves one connection: its client is looked up once
+static _Thread_local struct {
+    int connection;
+    uint8_t family;
+    uint16_t port;
+    unsigned char addr[16];
+} peer = { -1, 0, 0, { 0 } };
+
+static struct {
+    atomic_int open;
+    atomic_int stop;
+    FILE* file;
+    pthread_t writer;
+    atomic_ullong written;
+    uint64_t dropped_noted; // drops already noted in the log, by the writer
+} state;
+
+/*******************************************************************
+ * Rings: one per thread, handed over when the thread exits
+ */
+static struct access_ring* ring_get(void)
+{
+    if (local_ring == NULL) {
+        local_ring = thread_slot_get(&rings); // NULL: this thread goes unlogged
+    }
+    return local_ring;
+}
+
+static void peer_lookup(int connection)
+{
+    if (peer.connection == connection) {
+        return;
+    }
+    peer.connection = connection;
+    peer.family = 0;
+
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    if (getpeername(connection, (struct sockaddr*) &addr, &len) != 0) {
+        return;
+    }
+    if (addr.ss_family == AF_INET) {
+        const struct sockaddr_in* in = (const struct sockaddr_in*) &addr;
+        memcpy(peer.addr, &in->sin_addr, sizeof(in->sin_addr));
+        peer.port = ntohs(in->sin_port);
+        peer.family = AF_INET;
+    } else if (addr.ss_family == AF_INET6) {
+        const struct sockaddr_in6* in6 = (const struct sockaddr_in6*) &addr;
+        memcpy(peer.addr, &in6->sin6_addr, sizeof(in6->sin6_addr));
+        peer.port = ntohs(in6->sin6_port);
+        peer.family = AF_INET6;
+    }
+}
+
+/********************************************************************
+ * See access_log.h
+ */
+void access_log_record(int connection, const char* method, size_t method_len,
+                       const char* target, size_t target_len, unsigned status,
+                       uint64_t bytes_in, uint64_t bytes_out, uint64_t start)
+{
+    if (!atomic_load_explicit(&state.open, memory_order_relaxed) || method == NULL || target == NULL) {
+        return;
+    }
+    struct access_ring* ring = ring_get();
+    if (ring == NULL) {
+        return;
+    }
+
+    const size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) >= RING_SIZE) {
+        counter_add(&ring->dropped, 1);
+        return;
+    }
+
+    struct access_record* record = &ring->records[head & (RING_SIZE - 1)];
+    record->latency_ns = clock_ns(CLOCK_MONOTONIC) - start;
+    record->time_ns = clock_ns(CLOCK_REALTIME);
+    record->bytes_in = bytes_in;
+    record->bytes_out = bytes_out;
+    record->status = (uint16_t) (status < 1000 ? status : 0);
+
+    peer_lookup(connection);
+    record->family = peer.family;
+    record->port = peer.port;
+    memcpy(record->addr, peer.addr, sizeof(record->addr));
+
+    record->method_len = (uint8_t) (method_len < METHOD_LEN ? method_len : METHOD_LEN);
+    memcpy(record->method, method, record->method_len);
+    record->target_len = (uint16_t) (target_len < ACCESS_LOG_TARGET ? target_len : ACCESS_LOG_TARGET);
+    memcpy(record->target, target, record->target_len);
+
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+/*******************************************************************
+ * Writer
+ */
+struct time_cache {
+    time_t second;
+    char text[32];
+};
+
+static void write_record(FILE* out, const struct access_record* record, struct time_cache* when)
+{
+    char host[INET6_ADDRSTRLEN] = "";
+    char client[INET6_ADDRSTRLEN + 8] = "-";
+    if (record->family != 0 && inet_ntop(record->family, record->addr, host, sizeof(host)) != NULL) {
+        snprintf(client, sizeof(client), record->family == AF_INET6 ? "[%s]:%u" : "%s:%u",
+                 host, record->port);
+    }
+
+    // strftime() once per second of records, not once per record
+    const time_t second = (time_t) (record->time_ns / 1000000000u);
+    if (second != when->second) {
+        struct tm tm;
+        when->second = second;
+        strftime(when->text, sizeof(when->text), "%d/%b/%Y:%H:%M:%S %z", localtime_r(&second, &tm));
+    }
+
+    fprintf(out, "%s [%s] \"%.*s ", client, when->text, (int) record->method_len, record->method);
+    // targets may hold any byte: keep lines parseable
+    for (size_t i = 0; i < record->target_len; i++) {
+        const unsigned char c = (unsigned char) record->target[i];
+        if (c == '"' || c == '\\' || c < 0x20 || c >= 0x7f) {
+            fprintf(out, "\\x%02X", c);
+        } else {
+            putc(c, out);
+        }
+    }
+    fprintf(out, "\" %u %llu %llu %.3f\n", record->status,
+            (unsigned long long) record->bytes_out, (unsigned long long) record->bytes_in,
+            (double) record->latency_ns / 1e6);
+}
+
+// writes the records of all the rings, returns how many
+static size_t drain(struct time_cache* when)
+{
+    size_t written = 0;
+    uint64_t dropped = 0;
+    for (struct thread_slot* slot = thread_slots_head(&rings); slot != NULL; slot = slot->next) {
+        struct access_ring* ring = (struct access_ring*) slot;
+        const size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        const size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        for (size_t i = tail; i != head; i++) {
+            write_record(state.file, &ring->records[i & (RING_SIZE - 1)], when);
+        }
+        atomic_store_explicit(&ring->tail, head, memory_order_release);
+        written += head - tail;
+        dropped += atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+    }
+
+    if (dropped > state.dropped_noted) {
+        fprintf(state.file, "# %llu record(s) dropped\n",
+                (unsigned long long) (dropped - state.dropped_noted));
+        state.dropped_noted = dropped;
+    }
+    counter_add(&state.written, written);
+    return written;
+}
+
+static void* writer_main(void* arg)
+{
+    (void) arg;
+    // signals are left to the main thread
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    struct time_cache when = { (time_t) -1, "" };
+    const struct timespec idle = { 0, IDLE_WAIT_MS * 1000000L };
+    while (!atomic_load(&state.stop)) {
+        if (drain(&when) == 0) {
+            fflush(state.file);
+            nanosleep(&idle, NULL);
+        }
+    }
+    drain(&when);
+    fflush(state.file);
+    return NULL;
+}
+
+/********************************************************************
+ * See access_log.h
+ */
+int access_log_open(const char* path)
+{
+    M_REQUIRE_NON_NULL(path);
+    if (atomic_load(&state.open)) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    state.file = fopen(path, "a");
+    if (state.file == NULL) {
+        return ERR_IO;
+    }
+    setvbuf(state.file, NULL, _IOFBF, WRITE_BUFFER);
+    atomic_store(&state.stop, 0);
+    if (pthread_create(&state.writer, NULL, writer_main, NULL) != 0) {
+        fclose(state.file);
+        state.file = NULL;
+        return ERR_THREADING;
+    }
+    atomic_store(&state.open, 1);
+    return ERR_NONE;
+}
+
+/********************************************************************
+ * See access_log.h
+ */
+void access_log_close(void)
+{
+    if (!atomic_exchange(&state.open, 0)) {
+        return;
+    }
+    atomic_store(&state.stop, 1);
+    pthread_join(state.writer, NULL);
+    fclose(state.file);
+    state.file = NULL;
+}
+
+/********************************************************************
+ * See access_log.h
+ */
+void access_log_stats(struct access_log_stats* stats)
+{
+    if (stats == NULL) {
+        return;
+    }
+    stats->written = atomic_load_explicit(&state.written, memory_order_relaxed);
+    stats->dropped = 0;
+    for (struct thread_slot* slot = thread_slots_head(&rings); slot != NULL; slot = slot->next) {
+        struct access_ring* ring = (struct access_ring*) slot;
+        stats->dropped += atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+    }
+}
@@ -0,0 +1,78 @@
+/**
+ * @file access_log.h
+ * @brief Asynchronous access log of the imgFS server.
+ *
+ * Request threads never write the log themselves: each one pushes
+ * fixed-size records into a ring of its own, without locks (a ring has
+ * one producer, its thread, and one consumer, the writer). A background
+ * thread drains all the rings, formats the records and writes them in
+ * large batches. When a ring is full, its records are dropped and
+ * counted; the writer notes the gaps in the log.
+ *
+ * Rings of finished threads are handed over to new ones, as the
+ * metrics shards are (see server_metrics.h). Lines look like
+ *
+ *   127.0.0.1:51234 [19/Oct/2026:07:29:13 +0200] "GET /imgfs/read?res=small&img_id=a" 200 1234 0 0.412
+ *
+ * that is: client, time the reply was sent, request, status, bytes sent,
+ * bytes received and latency in milliseconds.
+ */
+
+#pragma once
+
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint64_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define ACCESS_LOG_TARGET 200 // bytes of the request target kept per record
+
+struct access_log_stats {
+    uint64_t written; // records written to the log
+    uint64_t dropped; // records lost because a ring was full
+};
+
+/**
+ * @brief Opens (appends to) the log and starts its writer thread.
+ *
+ * @param path Where to write the log
+ * @return Some error code. 0 if no error.
+ */
+int access_log_open(const char* path);
+
+/**
+ * @brief Writes what is left in the rings, stops the writer and closes
+ *        the log. Does nothing if it is not open. Later records are
+ *        dropped.
+ */
+void access_log_close(void);
+
+/**
+ * @brief Queues a record of a request served by the calling thread.
+ *        Does nothing if the log is not open.
+ *
+ * @param connection The socket of the client
+ * @param method The request method (not NUL-terminated)
+ * @param method_len Its length
+ * @param target The request target (not NUL-terminated), of which at
+ *        most ACCESS_LOG_TARGET bytes are kept
+ * @param target_len Its length
+ * @param status The status code of the reply, 0 if none was sent
+ * @param bytes_in The size of the request body
+ * @param bytes_out The size of the reply body
+ * @param start CLOCK_MONOTONIC start time of the request (ns)
+ */
+void access_log_record(int connection, const char* method, size_t method_len,
+                       const char* target, size_t target_len, unsigned status,
+                       uint64_t bytes_in, uint64_t bytes_out, uint64_t start);
+
+/**
+ * @brief Takes a snapshot of the log counters.
+ */
+void access_log_stats(struct access_log_stats* stats);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,220 @@
+/**
+ * @file access_trace.c
+ * @brief Compact binary traces of the requests served by imgfs_server.
+ */
+
+#include "access_trace.h"
+#include "error.h"
+#include "util.h" // for now_ns
+
+#include <string.h> // for memcmp
+
+#define VARINT_MAX 10 // bytes of a 64-bit LEB128 value
+
+/*******************************************************************
+ * Varints
+ */
+static size_t varint_put(unsigned char* out, uint64_t value)
+{
+    size_t n = 0;
+    while (value >= 0x80) {
+        out[n++] = (unsigned char) (value | 0x80);
+        value >>= 7;
+    }
+    out[n++] = (unsigned char) value;
+    return n;
+}
+
+static int varint_get(FILE* file, uint64_t* value)
+{
+    *value = 0;
+    for (unsigned shift = 0; shift < 7 * VARINT_MAX; shift += 7) {
+        const int c = getc(file);
+        if (c == EOF) {
+            return ERR_CORRUPTED;
+        }
+        *value |= (uint64_t) (c & 0x7f) << shift;
+        if ((c & 0x80) == 0) {
+            return ERR_NONE;
+        }
+    }
+    return ERR_CORRUPTED;
+}
+
+static uint64_t zigzag(int64_t value)
+{
+    return ((uint64_t) value << 1) ^ (uint64_t) (value >> 63);
+}
+
+static int64_t unzigzag(uint64_t value)
+{
+    return (int64_t) (value >> 1) ^ -(int64_t) (value & 1);
+}
+
+/********************************************************************
+ * See access_trace.h
+ */
+int trace_writer_open(struct trace_writer* writer, const char* path)
+{
+    M_REQUIRE_NON_NULL(writer);
+    M_REQUIRE_NON_NULL(path);
+
+    memset(writer, 0, sizeof(*writer));
+    writer->file = fopen(path, "wb");
+    if (writer->file == NULL) {
+        return ERR_IO;
+    }
+    const uint32_t version = TRACE_VERSION;
+    if (fwrite(TRACE_MAGIC, 1, strlen(TRACE_MAGIC), writer->file) != strlen(TRACE_MAGIC) ||
+        fwrite(&version, sizeof(version), 1, writer->file) != 1) {
+        fclose(writer->file);
+        writer->file = NULL;
+        return ERR_IO;
+    }
+    if (pthread_mutex_init(&writer->lock, NULL) != 0) {
+        fclose(writer->file);
+        writer->file = NULL;
+        return ERR_THREADING;
+    }
+    writer->origin_ns = now_ns();
+    return ERR_NONE;
+}
+
+/********************************************************************
+ * See access_trace.h
+ */
+int trace_write(struct trace_writer* writer, uint64_t start_ns, uint8_t flags, unsigned status,
+                uint64_t bytes_in, uint64_t bytes_out, const char* target, size_t target_len)
+{
+    M_REQUIRE_NON_NULL(writer);
+    M_REQUIRE_NON_NULL(target);
+    if (target_len > TRACE_MAX_TARGET) {
+        target_len = TRACE_MAX_TARGET;
+    }
+
+    // everything but the time and the target is encoded outside the lock
+    unsigned char fields[1 + 4 * VARINT_MAX];
+    size_t n = 0;
+    fields[n++] = flags;
+    n += varint_put(fields + n, status);
+    n += varint_put(fields + n, bytes_in);
+    n += varint_put(fields + n, bytes_out);
+    n += varint_put(fields + n, target_len);
+
+    const uint64_t time_us = start_ns > writer->origin_ns ? (start_ns - writer->origin_ns) / 1000 : 0;
+
+    pthread_mutex_lock(&writer->lock);
+    if (writer->file == NULL) { // closed meanwhile
+        pthread_mutex_unlock(&writer->lock);
+        return ERR_INVALID_ARGUMENT;
+    }
+    unsigned char delta[VARINT_MAX];
+    const size_t delta_len = varint_put(delta, zigzag((int64_t) time_us - (int64_t) writer->last_us));
+    writer->last_us = time_us;
+    const int ok = fwrite(delta, 1, delta_len, writer->file) == delta_len &&
+                   fwrite(fields, 1, n, writer->file) == n &&
+                   fwrite(target, 1, target_len, writer->file) == target_len;
+    writer->records++;
+    pthread_mutex_unlock(&writer->lock);
+
+    return ok ? ERR_NONE : ERR_IO;
+}
+
+/********************************************************************
+ * See access_trace.h
+ */
+void trace_writer_close(struct trace_writer* writer)
+{
+    if (writer == NULL || writer->file == NULL) {
+        return;
+    }
+    // the lock is kept: requests still being served may try to write
+    pthread_mutex_lock(&writer->lock);
+    fclose(writer->file);
+    writer->file = NULL;
+    pthread_mutex_unlock(&writer->lock);
+}
+
+/********************************************************************
+ * See access_trace.h
+ */
+int trace_reader_open(struct trace_reader* reader, const char* path)
+{
+    M_REQUIRE_NON_NULL(reader);
+    M_REQUIRE_NON_NULL(path);
+
+    memset(reader, 0, sizeof(*reader));
+    reader->file = fopen(path, "rb");
+    if (reader->file == NULL) {
+        return ERR_IO;
+    }
+    char magic[sizeof(TRACE_MAGIC) - 1];
+    uint32_t version = 0;
+    if (fread(magic, 1, sizeof(magic), reader->file) != sizeof(magic) ||
+        memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0 ||
+        fread(&version, sizeof(version), 1, reader->file) != 1 || version != TRACE_VERSION) {
+        fclose(reader->file);
+        reader->file = NULL;
+        return ERR_INVALID_ARGUMENT;
+    }
+    return ERR_NONE;
+}
+
+/********************************************************************
+ * See access_trace.h
+ */
+int trace_read(struct trace_reader* reader, struct trace_record* record, int* end)
+{
+    M_REQUIRE_NON_NULL(reader);
+    M_REQUIRE_NON_NULL(record);
+    M_REQUIRE_NON_NULL(end);
+    if (reader->file == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    *end = 0;
+    const int c = getc(reader->file);
+    if (c == EOF) {
+        *end = 1;
+        return ERR_NONE;
+    }
+    ungetc(c, reader->file);
+
+    uint64_t delta = 0, status = 0, target_len = 0;
+    int err = varint_get(reader->file, &delta);
+    const int flags = err == ERR_NONE ? getc(reader->file) : EOF;
+    if (flags == EOF) {
+        return ERR_CORRUPTED;
+    }
+    if (varint_get(reader->file, &status) != ERR_NONE ||
+        varint_get(reader->file, &record->bytes_in) != ERR_NONE ||
+        varint_get(reader->file, &record->bytes_out) != ERR_NONE ||
+        varint_get(reader->file, &target_len) != ERR_NONE ||
+        target_len > TRACE_MAX_TARGET || status > 999 ||
+        fread(record->target, 1, (size_t) target_len, reader->file) != target_len) {
+        return ERR_CORRUPTED;
+    }
+    const int64_t time_us = (int64_t) reader->last_us + unzigzag(delta);
+    if (time_us < 0) {
+        return ERR_CORRUPTED;
+    }
+    reader->last_us = (uint64_t) time_us;
+
+    record->time_us = (uint64_t) time_us;
+    record->flags = (uint8_t) flags;
+    record->status = (unsigned) status;
+    record->target[target_len] = '\0';
+    return ERR_NONE;
+}
+
+/********************************************************************
+ * See access_trace.h
+ */
+void trace_reader_close(struct trace_reader* reader)
+{
+    if (reader == NULL || reader->file == NULL) {
+        return;
+    }
+    fclose(reader->file);
+    reader->file = NULL;
+}
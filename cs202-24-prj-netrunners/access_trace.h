@@ -0,0 +1,115 @@
+/**
+ * @file access_trace.h
+ * @brief Compact binary traces of the requests served by imgfs_server.
+ *
+ * A trace starts with the magic "IMGFSTRC" and a 32-bit version, then
+ * holds one record per request, in the order requests ended:
+ *
+ *   varint   start time, zigzag delta from the previous record (us)
+ *   byte     flags (TRACE_POST)
+ *   varint   status code of the reply
+ *   varint   request body size
+ *   varint   reply body size
+ *   varint   length of the target, then the target (path and query)
+ *
+ * Varints are LEB128: a read of a small image takes about 40 bytes.
+ * Start times are those of the requests, so they may go back a little
+ * between records: readers sort them (see imgfs_bench -replay).
+ */
+
+#pragma once
+
+#include <pthread.h> // for pthread_mutex_t
+#include <stdint.h>  // for uint64_t
+#include <stdio.h>   // for FILE
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TRACE_MAGIC      "IMGFSTRC"
+#define TRACE_VERSION    1
+#define TRACE_MAX_TARGET 2047
+
+// For flags in trace_record
+#define TRACE_POST 0x01
+
+struct trace_record {
+    uint64_t time_us; // start of the request, since the trace started
+    uint8_t flags;
+    unsigned status;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    char target[TRACE_MAX_TARGET + 1]; // NUL-terminated
+};
+
+struct trace_writer {
+    FILE* file;
+    pthread_mutex_t lock;
+    uint64_t origin_ns; // CLOCK_MONOTONIC time of time_us 0
+    uint64_t last_us;
+    uint64_t records;
+};
+
+struct trace_reader {
+    FILE* file;
+    uint64_t last_us;
+};
+
+/**
+ * @brief Creates (or truncates) a trace file and writes its header.
+ *
+ * @param writer The writer to initialize
+ * @param path Where to write the trace
+ * @return Some error code. 0 if no error.
+ */
+int trace_writer_open(struct trace_writer* writer, const char* path);
+
+/**
+ * @brief Appends a record. Thread-safe.
+ *
+ * @param writer An open writer
+ * @param start_ns CLOCK_MONOTONIC start time of the request (ns)
+ * @param flags TRACE_* flags
+ * @param status The status code of the reply
+ * @param bytes_in The size of the request body
+ * @param bytes_out The size of the reply body
+ * @param target The request target, of which at most TRACE_MAX_TARGET bytes are kept
+ * @param target_len Its length
+ * @return Some error code. 0 if no error.
+ */
+int trace_write(struct trace_writer* writer, uint64_t start_ns, uint8_t flags, unsigned status,
+                uint64_t bytes_in, uint64_t bytes_out, const char* target, size_t target_len);
+
+/**
+ * @brief Flushes and closes a writer. Does nothing if it is not open.
+ *        Later writes fail with ERR_INVALID_ARGUMENT.
+ */
+void trace_writer_close(struct trace_writer* writer);
+
+/**
+ * @brief Opens a trace and checks its header.
+ *
+ * @return ERR_INVALID_ARGUMENT if the file is not a trace, some other
+ *         error code, or 0 if no error.
+ */
+int trace_reader_open(struct trace_reader* reader, const char* path);
+
+/**
+ * @brief Reads the next record.
+ *
+ * @param reader An open reader
+ * @param record Where to put the record
+ * @param end Set to 1 at the end of the trace, 0 otherwise
+ * @return ERR_CORRUPTED for a malformed record, 0 otherwise.
+ */
+int trace_read(struct trace_reader* reader, struct trace_record* record, int* end);
+
+/**
+ * @brief Closes a reader. Does nothing if it is not open.
+ */
+void trace_reader_close(struct trace_reader* reader);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,349 @@
+/**
+ * @file blob_cache.c
+ * @brief Byte-budgeted S3-FIFO cache of image variants.
+ */
+
+#include "blob_cache.h"
+#include "error.h"
+
+#include <stdlib.h> // for calloc, free
+#include <string.h> // for memcmp, memcpy
+
+#define QUEUE_SMALL 0
+#define QUEUE_MAIN  1
+#define QUEUE_NONE  2 // not (or no longer) in the cache
+
+#define SMALL_SHARE      10  // percentage of the budget for the small queue
+#define ADMIT_SHARE      50  // percentage of the budget a single blob may take
+#define FREQ_MAX         3
+#define GHOST_AVG_BLOB   8192 // bytes, to size the ghost table
+#define GHOST_MIN        1024
+#define BUCKETS_MIN      64
+
+/*******************************************************************
+ * Keys
+ */
+static uint64_t key_hash(const struct cache_key* key)
+{
+    uint64_t hash = 0;
+    memcpy(&hash, key->SHA, sizeof(hash)); // already uniform
+    hash ^= ((uint64_t) key->format << 32 | (uint64_t) key->res[0] << 16 | key->res[1]) *
+            0x9E3779B97F4A7C15ULL;
+    return hash;
+}
+
+static int key_equal(const struct cache_key* a, const struct cache_key* b)
+{
+    return !memcmp(a->SHA, b->SHA, SHA256_DIGEST_LENGTH) &&
+           a->res[0] == b->res[0] && a->res[1] == b->res[1] && a->format == b->format;
+}
+
+static size_t blob_charge(const struct cache_blob* blob)
+{
+    return sizeof(*blob) + blob->size;
+}
+
+static struct cache_shard* shard_of(struct blob_cache* cache, uint64_t hash)
+{
+    return &cache->shards[hash >> 60 & (BLOB_CACHE_SHARDS - 1)];
+}
+
+/*******************************************************************
+ * Shard internals (callers hold the shard lock)
+ */
+static struct cache_blob** shard_slot(struct cache_shard* shard, const struct cache_key* key,
+                                      uint64_t hash)
+{
+    struct cache_blob** slot = &shard->buckets[hash & (shard->nb_buckets - 1)];
+    while (*slot != NULL && ((*slot)->hash != hash || !key_equal(&(*slot)->key, key))) {
+        slot = &(*slot)->hnext;
+    }
+    return slot;
+}
+
+static void shard_grow(struct cache_shard* shard)
+{
+    const size_t nb_buckets = 2 * shard->nb_buckets;
+    struct cache_blob** buckets = calloc(nb_buckets, sizeof(*buckets));
+    if (buckets == NULL) return; // longer chains, still correct
+
+    for (size_t b = 0; b < shard->nb_buckets; b++) {
+        for (struct cache_blob* blob = shard->buckets[b], *next; blob != NULL; blob = next) {
+            next = blob->hnext;
+            struct cache_blob** slot = &buckets[blob->hash & (nb_buckets - 1)];
+            blob->hnext = *slot;
+            *slot = blob;
+        }
+    }
+    free(shard->buckets);
+    shard->buckets = buckets;
+    shard->nb_buckets = nb_buckets;
+}
+
+static void queue_push(struct cache_shard* shard, struct cache_blob* blob, uint8_t queue)
+{
+    blob->queue = queue;
+    blob->qnext = NULL;
+    if (shard->tail[queue] != NULL) {
+        shard->tail[queue]->qnext = blob;
+    } else {
+        shard->head[queue] = blob;
+    }
+    shard->tail[queue] = blob;
+    shard->bytes[queue] += blob_charge(blob);
+}
+
+static struct cache_blob* queue_pop(struct cache_shard* shard, uint8_t queue)
+{
+    struct cache_blob* blob = shard->head[queue];
+    shard->head[queue] = blob->qnext;
+    if (shard->head[queue] == NULL) {
+        shard->tail[queue] = NULL;
+    }
+    shard->bytes[queue] -= blob_charge(blob);
+    return blob;
+}
+
+static uint64_t* ghost_slot(struct cache_shard* shard, uint64_t hash)
+{
+    return &shard->ghost[(hash ^ hash >> 32) & (shard->nb_ghosts - 1)];
+}
+
+/*******************************************************************
+ * Drops a blob from the shard; returns it to be released outside the lock.
+ */
+static struct cache_blob* shard_drop(struct cache_shard* shard, struct cache_blob* blob)
+{
+    struct cache_blob** slot = shard_slot(shard, &blob->key, blob->hash);
+    *slot = blob->hnext;
+    shard->count--;
+    blob->queue = QUEUE_NONE;
+    return blob;
+}
+
+/*******************************************************************
+ * Evicts until the shard fits its budget. Evicted blobs are chained
+ * through qnext into *evicted.
+ */
+static size_t shard_evict(struct cache_shard* shard, struct cache_blob** evicted)
+{
+    size_t n = 0;
+    const size_t small_budget = shard->budget * SMALL_SHARE / 100;
+
+    while (shard->bytes[QUEUE_SMALL] + shard->bytes[QUEUE_MAIN] > shard->budget) {
+        if (shard->head[QUEUE_SMALL] != NULL &&
+            (shard->bytes[QUEUE_SMALL] > small_budget || shard->head[QUEUE_MAIN] == NULL)) {
+            struct cache_blob* blob = queue_pop(shard, QUEUE_SMALL);
+            if (blob->freq > 0) {
+                blob->freq = 0;
+                queue_push(shard, blob, QUEUE_MAIN);
+            } else {
+                *ghost_slot(shard, blob->hash) = blob->hash | 1;
+                shard_drop(shard, blob)->qnext = *evicted;
+                *evicted = blob;
+                n++;
+            }
+        } else {
+            struct cache_blob* blob = queue_pop(shard, QUEUE_MAIN);
+            if (blob->freq > 0) {
+                blob->freq--;
+                queue_push(shard, blob, QUEUE_MAIN);
+            } else {
+                shard_drop(shard, blob)->qnext = *evicted;
+                *evicted = blob;
+                n++;
+            }
+        }
+    }
+    return n;
+}
+
+static void release_chain(struct cache_blob* blob)
+{
+    while (blob != NULL) {
+        struct cache_blob* next = blob->qnext;
+        blob_release(blob);
+        blob = next;
+    }
+}
+
+/********************************************************************
+ * See blob_cache.h
+ */
+int blob_cache_init(struct blob_cache* cache, size_t budget)
+{
+    M_REQUIRE_NON_NULL(cache);
+
+    memset(cache, 0, sizeof(*cache));
+    cache->budget = budget;
+
+    size_t nb_ghosts = GHOST_MIN;
+    while (nb_ghosts < budget / BLOB_CACHE_SHARDS / GHOST_AVG_BLOB) {
+        nb_ghosts *= 2;
+    }
+
+    for (size_t s = 0; s < BLOB_CACHE_SHARDS; s++) {
+        struct cache_shard* shard = &cache->shards[s];
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->budget = budget / BLOB_CACHE_SHARDS;
+        shard->nb_buckets = BUCKETS_MIN;
+        shard->buckets = calloc(shard->nb_buckets, sizeof(*shard->buckets));
+        shard->nb_ghosts = nb_ghosts;
+        shard->ghost = calloc(nb_ghosts, sizeof(*shard->ghost));
+        if (shard->buckets == NULL || shard->ghost == NULL) {
+            blob_cache_free(cache);
+            return ERR_OUT_OF_MEMORY;
+        }
+    }
+    return ERR_NONE;
+}
+
+/********************************************************************
+ * See blob_cache.h
+ */
+void blob_cache_free(struct blob_cache* cache)
+{
+    if (cache == NULL) return;
+
+    for (size_t s = 0; s < BLOB_CACHE_SHARDS; s++) {
+        struct cache_shard* shard = &cache->shards[s];
+        for (size_t b = 0; shard->buckets != NULL && b < shard->nb_buckets; b++) {
+            for (struct cache_blob* blob = shard->buckets[b], *next; blob != NULL; blob = next) {
+                next = blob->hnext;
+                blob->queue = QUEUE_NONE;
+                blob_release(blob);
+            }
+        }
+        free(shard->buckets);
+        free(shard->ghost);
+        pthread_mutex_destroy(&shard->lock);
+    }
+    memset(cache, 0, sizeof(*cache));
+}
+
+/********************************************************************
+ * See blob_cache.h
+ */
+struct cache_blob* blob_cache_get(struct blob_cache* cache, const struct cache_key* key)
+{
+    if (cache == NULL || key == NULL || cache->budget == 0) return NULL;
+
+    const uint64_t hash = key_hash(key);
+    struct cache_shard* shard = shard_of(cache, hash);
+
+    pthread_mutex_lock(&shard->lock);
+    struct cache_blob* blob = *shard_slot(shard, key, hash);
+    if (blob != NULL) {
+        if (blob->freq < FREQ_MAX) blob->freq++;
+        atomic_fetch_add(&blob->refs, 1);
+        shard->hits++;
+    } else {
+        shard->misses++;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return blob;
+}
+
+/********************************************************************
+ * See blob_cache.h
+ */
+struct cache_blob* blob_cache_adopt(struct blob_cache* cache, const struct cache_key* key,
+                                    char* data, uint32_t size)
+{
+    if (key == NULL || data == NULL) {
+        free(data);
+        return NULL;
+    }
+
+    struct cache_blob* blob = calloc(1, sizeof(*blob));
+    if (blob == NULL) {
+        free(data);
+        return NULL;
+    }
+    blob->data = data;
+    blob->size = size;
+    blob->key = *key;
+    blob->hash = key_hash(key);
+    blob->queue = QUEUE_NONE;
+    atomic_init(&blob->refs, 1);
+
+    struct cache_shard* shard = cache != NULL ? shard_of(cache, blob->hash) : NULL;
+    if (shard == NULL || cache->budget == 0) {
+        return blob;
+    }
+    // it would flush most of its shard: served, but not cached
+    if (blob_charge(blob) > shard->budget * ADMIT_SHARE / 100) {
+        pthread_mutex_lock(&shard->lock);
+        shard->rejected++;
+        pthread_mutex_unlock(&shard->lock);
+        return blob;
+    }
+
+    struct cache_blob* evicted = NULL;
+
+    pthread_mutex_lock(&shard->lock);
+    struct cache_blob** slot = shard_slot(shard, key, blob->hash);
+    if (*slot != NULL) {
+        // someone else was faster
+        struct cache_blob* cached = *slot;
+        atomic_fetch_add(&cached->refs, 1);
+        pthread_mutex_unlock(&shard->lock);
+        blob_release(blob);
+        return cached;
+    }
+
+    *slot = blob;
+    shard->count++;
+    atomic_fetch_add(&blob->refs, 1); // the cache's own reference
+
+    uint64_t* ghost = ghost_slot(shard, blob->hash);
+    const int seen = *ghost == (blob->hash | 1);
+    if (seen) *ghost = 0;
+    queue_push(shard, blob, seen ? QUEUE_MAIN : QUEUE_SMALL);
+
+    shard->evictions += shard_evict(shard, &evicted);
+    if (shard->count > 2 * shard->nb_buckets) {
+        shard_grow(shard);
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    release_chain(evicted);
+    return blob;
+}
+
+/********************************************************************
+ * See blob_cache.h
+ */
+void blob_release(struct cache_blob* blob)
+{
+    if (blob == NULL) return;
+
+    if (atomic_fetch_sub(&blob->refs, 1) == 1) {
+        free(blob->data);
+        free(blob);
+    }
+}
+
+/********************************************************************
+ * See blob_cache.h
+ */
+void blob_cache_stats(struct blob_cache* cache, struct blob_cache_stats* stats)
+{
+    if (stats == NULL) return;
+
+    memset(stats, 0, sizeof(*stats));
+    if (cache == NULL || cache->budget == 0) return;
+
+    stats->budget = cache->budget;
+    for (size_t s = 0; s < BLOB_CACHE_SHARDS; s++) {
+        struct cache_shard* shard = &cache->shards[s];
+        pthread_mutex_lock(&shard->lock);
+        stats->hits += shard->hits;
+        stats->misses += shard->misses;
+        stats->evictions += shard->evictions;
+        stats->rejected += shard->rejected;
+        stats->entries += shard->count;
+        stats->bytes += shard->bytes[QUEUE_SMALL] + shard->bytes[QUEUE_MAIN];
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
@@ -0,0 +1,138 @@
+/**
+ * @file blob_cache.h
+ * @brief Byte-budgeted in-memory cache of image variants.
+ *
+ * Blobs are keyed by content (SHA-256 of the original), variant
+ * dimensions and encoding, so images sharing content share their cached
+ * variants.
+ * Content never changes under a given key: entries are never
+ * invalidated, only evicted.
+ *
+ * Eviction follows S3-FIFO: new entries go to a small FIFO queue (10% of
+ * the budget); those hit again before reaching its head move to the main
+ * queue, the others are evicted and remembered in a ghost table. Entries
+ * whose key is in the ghost table are admitted directly into the main
+ * queue, which works as a CLOCK with 2-bit frequencies. One-hit wonders
+ * (scans) thus never push popular variants out.
+ * A blob charged more than half of its shard's budget (the budget over
+ * BLOB_CACHE_SHARDS) is served but not cached, as it would evict most of
+ * the shard; such blobs are counted as rejected.
+ *
+ * The cache is split into independently locked shards, which also keep
+ * the hit, miss and eviction counts: no shared counter on the hot path.
+ * Blobs are
+ * reference counted: a blob returned by the cache stays valid until it is
+ * released, even if it gets evicted meanwhile, so hits are served straight
+ * from the cached bytes.
+ */
+
+#pragma once
+
+#include <openssl/sha.h> // for SHA256_DIGEST_LENGTH
+#include <pthread.h>     // for pthread_mutex_t
+#include <stdatomic.h>   // for atomic_uint
+#include <stddef.h>      // for size_t
+#include <stdint.h>      // for uint16_t, uint32_t, uint64_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BLOB_CACHE_SHARDS 16
+
+struct cache_key {
+    unsigned char SHA[SHA256_DIGEST_LENGTH]; // of the original content
+    uint16_t res[2];                         // variant dimensions, 0 x 0 for the original
+    uint8_t format;                          // enum image_format
+};
+
+struct cache_blob {
+    char* data;
+    uint32_t size;
+    // internal
+    atomic_uint refs;
+    struct cache_key key;
+    uint64_t hash;
+    struct cache_blob* hnext; // hash chain
+    struct cache_blob* qnext; // FIFO queue
+    uint8_t freq;
+    uint8_t queue;
+};
+
+struct cache_shard {
+    pthread_mutex_t lock;
+    struct cache_blob** buckets;
+    size_t nb_buckets; // power of two
+    size_t count;
+    struct cache_blob* head[2]; // small and main FIFO queues
+    struct cache_blob* tail[2];
+    size_t bytes[2];
+    size_t budget;
+    uint64_t* ghost; // fingerprints of recently evicted keys, direct-mapped
+    size_t nb_ghosts;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t rejected;
+};
+
+struct blob_cache {
+    struct cache_shard shards[BLOB_CACHE_SHARDS];
+    size_t budget;
+};
+
+struct blob_cache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t rejected; // too big to be cached
+    size_t entries;
+    size_t bytes;  // charged to the budget: blobs and their bookkeeping
+    size_t budget;
+};
+
+/**
+ * @brief Initializes an empty cache.
+ *
+ * @param cache The cache to initialize
+ * @param budget Maximum number of bytes of cached blobs (0 disables caching)
+ * @return Some error code. 0 if no error.
+ */
+int blob_cache_init(struct blob_cache* cache, size_t budget);
+
+/**
+ * @brief Frees the cache. Blobs still referenced are freed on release.
+ */
+void blob_cache_free(struct blob_cache* cache);
+
+/**
+ * @brief Looks up a blob.
+ *
+ * @return The blob, to be released with blob_release(), or NULL on a miss.
+ */
+struct cache_blob* blob_cache_get(struct blob_cache* cache, const struct cache_key* key);
+
+/**
+ * @brief Wraps a malloc()ed buffer into a blob and admits it into the cache.
+ *
+ * Ownership of data is transferred, even on failure. If the key is
+ * already cached, the cached blob is returned and data freed.
+ *
+ * @return The blob, to be released with blob_release(), or NULL if out of memory.
+ */
+struct cache_blob* blob_cache_adopt(struct blob_cache* cache, const struct cache_key* key,
+                                    char* data, uint32_t size);
+
+/**
+ * @brief Releases a blob obtained from the cache.
+ */
+void blob_release(struct cache_blob* blob);
+
+/**
+ * @brief Sums the counters of all the shards, locking them one at a time.
+ */
+void blob_cache_stats(struct blob_cache* cache, struct blob_cache_stats* stats);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,132 @@
+/**
+ * @file crc32c.c
+ * @brief CRC-32C (Castagnoli), hardware accelerated when possible.
+ */
+
+#include "crc32c.h"
+
+#include <pthread.h> // for pthread_once
+#include <string.h>  // for memcpy
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <nmmintrin.h> // for _mm_crc32_*
+#define CRC32C_X86 1
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h> // for __crc32c*
+#define CRC32C_ARM 1
+#endif
+
+#define CRC32C_POLY 0x82F63B78u // reflected Castagnoli polynomial
+
+static uint32_t crc_table[8][256];
+static pthread_once_t crc_table_once = PTHREAD_ONCE_INIT;
+
+/********************************************************************
+ * Slicing-by-8 tables, built once.
+ */
+static void crc_table_init(void)
+{
+    for (uint32_t n = 0; n < 256; ++n) {
+        uint32_t crc = n;
+        for (int k = 0; k < 8; ++k) {
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        crc_table[0][n] = crc;
+    }
+    for (uint32_t n = 0; n < 256; ++n) {
+        for (int k = 1; k < 8; ++k) {
+            const uint32_t prev = crc_table[k - 1][n];
+            crc_table[k][n] = (prev >> 8) ^ crc_table[0][prev & 0xFF];
+        }
+    }
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char* p, size_t len)
+{
+    pthread_once(&crc_table_once, crc_table_init);
+
+    while (len > 0 && ((uintptr_t) p & 7) != 0) {
+        crc = crc_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+        --len;
+    }
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        word ^= crc;
+        crc = crc_table[7][word & 0xFF] ^
+              crc_table[6][(word >> 8) & 0xFF] ^
+              crc_table[5][(word >> 16) & 0xFF] ^
+              crc_table[4][(word >> 24) & 0xFF] ^
+              crc_table[3][(word >> 32) & 0xFF] ^
+              crc_table[2][(word >> 40) & 0xFF] ^
+              crc_table[1][(word >> 48) & 0xFF] ^
+              crc_table[0][word >> 56];
+        p += 8;
+        len -= 8;
+    }
+    while (len-- > 0) {
+        crc = crc_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#ifdef CRC32C_X86
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char* p, size_t len)
+{
+    uint64_t crc64 = crc;
+    while (len > 0 && ((uintptr_t) p & 7) != 0) {
+        crc64 = _mm_crc32_u8((uint32_t) crc64, *p++);
+        --len;
+    }
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+        p += 8;
+        len -= 8;
+    }
+    while (len-- > 0) {
+        crc64 = _mm_crc32_u8((uint32_t) crc64, *p++);
+    }
+    return (uint32_t) crc64;
+}
+#elif defined(CRC32C_ARM)
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char* p, size_t len)
+{
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        crc = __crc32cd(crc, word);
+        p += 8;
+        len -= 8;
+    }
+    while (len-- > 0) {
+        crc = __crc32cb(crc, *p++);
+    }
+    return crc;
+}
+#endif
+
+/********************************************************************
+ * See crc32c.h
+ */
+uint32_t crc32c(uint32_t crc, const void* data, size_t len)
+{
+    if (data == NULL) return crc;
+
+    const unsigned char* p = data;
+    crc = ~crc;
+#if defined(CRC32C_X86)
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc = crc32c_hw(crc, p, len);
+    } else {
+        crc = crc32c_sw(crc, p, len);
+    }
+#elif defined(CRC32C_ARM)
+    crc = crc32c_hw(crc, p, len);
+#else
+    crc = crc32c_sw(crc, p, len);
+#endif
+    return ~crc;
+}
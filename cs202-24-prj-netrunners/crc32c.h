@@ -0,0 +1,30 @@
+/**
+ * @file crc32c.h
+ * @brief CRC-32C (Castagnoli) checksum.
+ *
+ * Uses the SSE 4.2 / ARMv8 CRC instructions when the CPU has them and
+ * falls back to a table-driven software implementation otherwise.
+ */
+
+#pragma once
+
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint32_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Computes (or continues) a CRC-32C checksum.
+ *
+ * @param crc The checksum of the previous chunk, 0 to start a new one.
+ * @param data The bytes to checksum.
+ * @param len The number of bytes in data.
+ * @return The updated checksum.
+ */
+uint32_t crc32c(uint32_t crc, const void* data, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
@@ -22,5 +22,8 @@ const char* const ERR_MESSAGES[] = {
     "Existing image ID",
     "Image manipulation library error",
     "Debug",
+    "Corrupted image data",
+    "Too busy, try again later",
+    "Image too large to process",
     "no error (shall not be displayed)" // ERR_LAST
 };
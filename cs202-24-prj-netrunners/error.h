@@ -42,6 +42,9 @@ enum error_codes {
     ERR_DUPLICATE_ID,
     ERR_IMGLIB,
     ERR_DEBUG,
+    ERR_CORRUPTED,
+    ERR_BUSY,
+    ERR_IMAGE_TOO_LARGE,
     ERR_LAST // not an actual error but to have e.g. the total number of errors
 };
 
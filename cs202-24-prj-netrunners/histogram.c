@@ -0,0 +1,133 @@
+/**
+ * @file histogram.c
+ * @brief HDR-style histograms of durations (or any 64-bit values).
+ */
+
+#include "histogram.h"
+#include "thread_slots.h" // for counter_add, counter_get
+
+#include <math.h> // for ceil
+
+static uint64_t bucket_high(size_t bucket)
+{
+    return bucket + 1 < HISTOGRAM_BUCKETS ? histogram_bucket_low(bucket + 1) - 1 : UINT64_MAX;
+}
+
+/********************************************************************
+ * See histogram.h
+ */
+size_t histogram_bucket(uint64_t value)
+{
+    if (value < HISTOGRAM_SUB_BUCKETS) {
+        return (size_t) value;
+    }
+    const unsigned magnitude = 63u - (unsigned) __builtin_clzll(value);
+    const unsigned shift = magnitude - HISTOGRAM_SUB_BITS;
+    return (size_t) (shift + 1) * HISTOGRAM_SUB_BUCKETS + (size_t) ((value >> shift) - HISTOGRAM_SUB_BUCKETS);
+}
+
+/********************************************************************
+ * See histogram.h
+ */
+uint64_t histogram_bucket_low(size_t bucket)
+{
+    if (bucket < HISTOGRAM_SUB_BUCKETS) {
+        return bucket;
+    }
+    const size_t group = bucket / HISTOGRAM_SUB_BUCKETS;
+    return (uint64_t) (HISTOGRAM_SUB_BUCKETS + bucket % HISTOGRAM_SUB_BUCKETS) << (group - 1);
+}
+
+/********************************************************************
+ * See histogram.h
+ */
+void histogram_record(struct histogram* histogram, uint64_t value)
+{
+    counter_add(&histogram->counts[histogram_bucket(value)], 1);
+    counter_add(&histogram->count, 1);
+    counter_add(&histogram->sum, value);
+    if (value > counter_get(&histogram->max)) {
+        atomic_store_explicit(&histogram->max, value, memory_order_relaxed);
+    }
+}
+
+/********************************************************************
+ * See histogram.h
+ */
+void histogram_merge(struct histogram* into, const struct histogram* from)
+{
+    for (size_t b = 0; b < HISTOGRAM_BUCKETS; b++) {
+        const uint64_t n = counter_get(&from->counts[b]);
+        if (n > 0) counter_add(&into->counts[b], n);
+    }
+    counter_add(&into->count, counter_get(&from->count));
+    counter_add(&into->sum, counter_get(&from->sum));
+    if (counter_get(&from->max) > counter_get(&into->max)) {
+        atomic_store_explicit(&into->max, counter_get(&from->max), memory_order_relaxed);
+    }
+}
+
+/********************************************************************
+ * See histogram.h
+ */
+void histogram_merge_corrected(struct histogram* into, const struct histogram* from,
+                               uint64_t expected_interval)
+{
+    histogram_merge(into, from);
+    if (expected_interval == 0) {
+        return;
+    }
+    // every value of a bucket is taken as its lowest one
+    for (size_t b = histogram_bucket(2 * expected_interval); b < HISTOGRAM_BUCKETS; b++) {
+        const uint64_t n = counter_get(&from->counts[b]);
+        if (n == 0) continue;
+        for (uint64_t missed = histogram_bucket_low(b) - expected_interval;
+             missed >= expected_interval; missed -= expected_interval) {
+            counter_add(&into->counts[histogram_bucket(missed)], n);
+            counter_add(&into->count, n);
+            counter_add(&into->sum, n * missed);
+        }
+    }
+}
+
+/********************************************************************
+ * See histogram.h
+ */
+uint64_t histogram_quantile(const struct histogram* histogram, double q)
+{
+    // buckets are read one by one: their total may differ from count
+    uint64_t total = 0;
+    for (size_t b = 0; b < HISTOGRAM_BUCKETS; b++) {
+        total += counter_get(&histogram->counts[b]);
+    }
+    if (total == 0) {
+        return 0;
+    }
+
+    q = q < 0 ? 0 : q > 1 ? 1 : q;
+    const double at = ceil(q * (double) total);
+    const uint64_t rank = at < 1 ? 1 : (uint64_t) at;
+
+    const uint64_t max = counter_get(&histogram->max);
+    uint64_t seen = 0;
+    for (size_t b = 0; b < HISTOGRAM_BUCKETS; b++) {
+        seen += counter_get(&histogram->counts[b]);
+        if (seen >= rank) {
+            const uint64_t high = bucket_high(b);
+            return high < max ? high : max;
+        }
+    }
+    return max;
+}
+
+/********************************************************************
+ * See histogram.h
+ */
+uint64_t histogram_count_below(const struct histogram* histogram, uint64_t bound)
+{
+    uint64_t count = 0;
+    for (size_t b = 0; b < HISTOGRAM_BUCKETS && bucket_high(b) < bound; b++) {
+        count += counter_get(&histogram->counts[b]);
+    }
+    return count;
+}
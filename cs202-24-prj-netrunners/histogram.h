@@ -0,0 +1,83 @@
+/**
+ * @file histogram.h
+ * @brief HDR-style histograms of durations (or any 64-bit values).
+ *
+ * Each power of two is split into HISTOGRAM_SUB_BUCKETS linear buckets, so
+ * any value is known within 12.5% with a fixed, small table and no
+ * configured range. Values below HISTOGRAM_SUB_BUCKETS are exact.
+ *
+ * A histogram has a single writer at a time (its owner thread, or whoever
+ * holds the lock protecting it), but may be read concurrently: counters
+ * are atomics updated without locked instructions, so readers see each
+ * of them whole, possibly a few records behind.
+ */
+
+#pragma once
+
+#include <stdatomic.h> // for atomic_ullong
+#include <stddef.h>    // for size_t
+#include <stdint.h>    // for uint64_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define HISTOGRAM_SUB_BITS    3
+#define HISTOGRAM_SUB_BUCKETS (1u << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS     ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+struct histogram {
+    atomic_ullong counts[HISTOGRAM_BUCKETS];
+    atomic_ullong count;
+    atomic_ullong sum;
+    atomic_ullong max;
+};
+
+/**
+ * @brief The bucket a value falls in.
+ */
+size_t histogram_bucket(uint64_t value);
+
+/**
+ * @brief The smallest value of a bucket; the largest one is the lowest
+ *        value of the next bucket, minus one.
+ */
+uint64_t histogram_bucket_low(size_t bucket);
+
+/**
+ * @brief Adds one value (single writer, see above).
+ */
+void histogram_record(struct histogram* histogram, uint64_t value);
+
+/**
+ * @brief Adds the counts of from to into. into must not be shared.
+ */
+void histogram_merge(struct histogram* into, const struct histogram* from);
+
+/**
+ * @brief Adds to into the values of from, plus those a closed-loop client
+ *        missed while it waited: each value v above expected_interval
+ *        also counts as v - expected_interval, v - 2 * expected_interval,
+ *        and so on down to expected_interval (coordinated omission
+ *        correction, as HdrHistogram does it). into must not be shared.
+ */
+void histogram_merge_corrected(struct histogram* into, const struct histogram* from,
+                               uint64_t expected_interval);
+
+/**
+ * @brief The value below which a fraction q (0 to 1) of the values fall,
+ *        rounded up to the end of its bucket and capped at the maximum.
+ *
+ * @return 0 for an empty histogram.
+ */
+uint64_t histogram_quantile(const struct histogram* histogram, double q);
+
+/**
+ * @brief The number of values smaller than bound. Exact when bound is a
+ *        bucket boundary, e.g. a power of two.
+ */
+uint64_t histogram_count_below(const struct histogram* histogram, uint64_t bound);
+
+#ifdef __cplusplus
+}
+#endif
@@ -17,11 +17,14 @@
 #include "http_prot.h"
 #include "http_net.h"
 #include "socket_layer.h"
+#include "request_phases.h"
 #include "error.h"
 #include <errno.h>
 
 static int passive_socket = -1;
 static EventCallback cb;
+// replies sent by the calling thread since the last http_replied()
+static _Thread_local struct { unsigned status; size_t body_len; } replied;
 
 #define MK_OUR_ERR(X) \
 static int our_ ## X = X
@@ -39,21 +42,22 @@ MK_OUR_ERR(ERR_DEBUG);
  * Handle connection
 */
 
-// ask TA mercredi about this method. 
+// One thread per connection: signals are left to the main thread
 static void *handle_connection(void *arg)
 {
-    // sigset_t mask;
-    // sigemptyset(&mask);
-    // sigaddset(&mask, SIGINT );
-    // sigaddset(&mask, SIGTERM);
-    // pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT );
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
 
     if (arg == NULL) return &our_ERR_INVALID_ARGUMENT;
     int socket = *((int*)arg);
-    //free(arg); 
+    free(arg); 
     if (socket < 0) return &our_ERR_INVALID_ARGUMENT;
 
-    char* rcvbuf = malloc(MAX_HEADER_SIZE); 
+    // http_parse_message() wants the unread part of the buffer zeroed
+    char* rcvbuf = calloc(1, MAX_HEADER_SIZE + 1); 
 
     if (rcvbuf == NULL) { 
         close(socket); 
@@ -63,14 +67,17 @@ static void *handle_connection(void *arg)
     char* buff_excess = NULL; 
     size_t total_bytes_read = 0;
     int content_len = 0; 
-    ssize_t max_read = MAX_HEADER_SIZE; 
+    size_t max_read = MAX_HEADER_SIZE; // capacity of rcvbuf, without its final '\0' 
     struct http_message message;  
     char* pos_ptr = NULL; 
 
     int already_extended = 0; 
 
     while (1) {
-        ssize_t cur_read = tcp_read(socket, rcvbuf + total_bytes_read, max_read);
+        // only the reads of a started request are timed, not keep-alive idling
+        phase_enter(PHASE_RECV);
+        ssize_t cur_read = tcp_read(socket, rcvbuf + total_bytes_read, max_read - total_bytes_read);
+        phase_leave();
         
         if (cur_read < 0) {
             close(socket); // added this 
@@ -89,7 +96,10 @@ static void *handle_connection(void *arg)
             return &our_ERR_NONE; 
         }
 
+        phases_request_begin();
+        phase_enter(PHASE_PARSE);
         int parsed = http_parse_message(rcvbuf, total_bytes_read, &message, &content_len);
+        phase_leave();
 
         if (parsed < 0) { 
             free(rcvbuf); 
@@ -99,7 +109,7 @@ static void *handle_connection(void *arg)
         }
 
         if (parsed == 0 && content_len > 0 && total_bytes_read < content_len && !already_extended) {
-            char* new_buf = realloc(rcvbuf, MAX_HEADER_SIZE + (size_t)content_len);
+            char* new_buf = realloc(rcvbuf, MAX_HEADER_SIZE + (size_t)content_len + 1);
             if (new_buf == NULL) {
                 free(rcvbuf); 
                 rcvbuf = NULL; 
@@ -107,15 +117,16 @@ static void *handle_connection(void *arg)
                 return &our_ERR_OUT_OF_MEMORY;
             }
             rcvbuf = new_buf; 
-            //new_buf = NULL;  //maybe re add this 
+            memset(rcvbuf + max_read, 0, (size_t)content_len + 1); 
             already_extended = 1; 
-            //rcvbuf+= total_bytes_read; // ? 
-            max_read = (size_t)content_len; // = ou += 
+            max_read = MAX_HEADER_SIZE + (size_t)content_len; 
             continue; //maybe remove this 
         }
         
         if (parsed > 0) {
             int ret_cb = cb(&message, socket); 
+            phases_request_end(message.method.val, message.method.len,
+                               message.uri.val, message.uri.len);
             if (ret_cb < 0) {
                 free(rcvbuf); 
                 rcvbuf = NULL; 
@@ -151,7 +162,7 @@ static void *handle_connection(void *arg)
             //}
 
 
-            char* new_buff = realloc(rcvbuf, MAX_HEADER_SIZE); 
+            char* new_buff = realloc(rcvbuf, MAX_HEADER_SIZE + 1); 
             //check si ça rate ET si excess_buff est pas nul (y'a pas forcement d ele'0xcess)
             if (new_buff == NULL) {
                 free(rcvbuf); 
@@ -168,7 +179,7 @@ static void *handle_connection(void *arg)
             max_read = MAX_HEADER_SIZE; 
             total_bytes_read = 0; 
             memset(&message, 0, sizeof(struct http_message)); 
-            memset(rcvbuf, 0, MAX_HEADER_SIZE); 
+            memset(rcvbuf, 0, MAX_HEADER_SIZE + 1); 
             content_len = 0;    
             pos_ptr = NULL; 
             already_extended = 0; 
@@ -225,41 +236,29 @@ void http_close(void)
  */
 int http_receive(void)
 {
-    int fd = tcp_accept(passive_socket);
-    if (fd < 0) {
+    int *active_socket = malloc(sizeof(int));
+    if (active_socket == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    *active_socket = tcp_accept(passive_socket);
+    if (*active_socket < 0) {
+        free(active_socket);
         return ERR_IO; 
     }
 
-    int *err = handle_connection(&fd);
-    if (*err != ERR_NONE) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_t thread;
+    const int fd = *active_socket;
+    if (pthread_create(&thread, &attr, handle_connection, active_socket) != 0) {
         close(fd);
-        return *err;
+        free(active_socket);
+        pthread_attr_destroy(&attr);
+        return ERR_THREADING;
     }
-
-    close(fd);
+    pthread_attr_destroy(&attr);
     return ERR_NONE;
-    // pthread_attr_t attr;
-    // pthread_attr_init(&attr);
-    // pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-    // int *active_socket = malloc(sizeof(int));
-    // *active_socket = tcp_accept(passive_socket);
-    // if (*active_socket < 0) {
-    //     free(active_socket);
-    //     return ERR_IO; 
-    // }
-    // pthread_t thread;
-    // if (pthread_create(&thread, &attr, handle_connection, active_socket) != 0) {
-    //     free(active_socket);
-    //     return ERR_THREADING;
-    // }
-    // if(handle_connection(*active_socket) < 0) {
-    //     pthread_attr_destroy(&attr);
-    //     free(active_socket);
-    //     return ERR_IO;
-    // }
-    // pthread_attr_destroy(&attr);
-    // free(active_socket);
-    // return ERR_NONE;
 }
 
 
@@ -320,38 +319,47 @@ int http_serve_file(int connection, const char* filename)
  * Create and send HTTP reply
  */
 int http_reply(int connection, const char* status, const char* headers, const char *body, size_t body_len) {
-    size_t header_size = strlen(HTTP_PROTOCOL_ID) + strlen(" ") + strlen(status) + strlen(HTTP_LINE_DELIM) +
-                        strlen(headers) + strlen("Content-Length: ") + sizeof(body_len) + strlen(HTTP_HDR_END_DELIM);
-
-    size_t total_size = header_size + body_len; 
-    // Allocate the buffer
-    char *buffer = malloc(total_size);
-    if (buffer == NULL) {
-        return ERR_OUT_OF_MEMORY;
-    }
-
-    //
-    int header_len = snprintf(buffer, total_size, "%s%s%s%sContent-Length: %zu%s",
-                              HTTP_PROTOCOL_ID, status, HTTP_LINE_DELIM, headers, body_len, HTTP_HDR_END_DELIM);
+    M_REQUIRE_NON_NULL(status);
+    M_REQUIRE_NON_NULL(headers);
 
-    // Copy the body to the end of the buffer
-    if (body != NULL && body_len > 0) {
-        memcpy(buffer + header_len, body, body_len);
+    const int header_len = snprintf(NULL, 0, "%s%s%s%sContent-Length: %zu%s",
+                                    HTTP_PROTOCOL_ID, status, HTTP_LINE_DELIM, headers, body_len, HTTP_HDR_END_DELIM);
+    if (header_len < 0) {
+        return ERR_RUNTIME;
     }
-    
-    // Send the buffer to the socket
-    ssize_t bytes_sent = tcp_send(connection, buffer, total_size);
-    free(buffer); // dont need it anymore s
-    if (bytes_sent < 0) {
-        return ERR_IO; 
+    char *header = malloc((size_t) header_len + 1);
+    if (header == NULL) {
+        return ERR_OUT_OF_MEMORY;
     }
-
-    if (bytes_sent != total_size || bytes_sent < 0) {
+    snprintf(header, (size_t) header_len + 1, "%s%s%s%sContent-Length: %zu%s",
+             HTTP_PROTOCOL_ID, status, HTTP_LINE_DELIM, headers, body_len, HTTP_HDR_END_DELIM);
+
+    // the body is sent from where it is (e.g. a cached image), never copied
+    struct iovec iov[2] = {
+        { .iov_base = header, .iov_len = (size_t) header_len },
+        { .iov_base = (void*) (uintptr_t) body, .iov_len = body != NULL ? body_len : 0 }
+    };
+    phase_enter(PHASE_SEND);
+    const int err = tcp_sendv(connection, iov, iov[1].iov_len > 0 ? 2 : 1);
+    phase_leave();
+    free(header);
+    replied.status = (unsigned) strtoul(status, NULL, 10);
+    replied.body_len += err == ERR_NONE ? iov[1].iov_len : 0;
+    if (err != ERR_NONE) {
         perror("send error");
-        return ERR_IO;
     }
-
-    return ERR_NONE;
+    return err;
 }
 
 
+
+/*******************************************************************
+ * What the calling thread replied
+ */
+void http_replied(unsigned* status, size_t* body_len)
+{
+    if (status != NULL) *status = replied.status;
+    if (body_len != NULL) *body_len = replied.body_len;
+    replied.status = 0;
+    replied.body_len = 0;
+}
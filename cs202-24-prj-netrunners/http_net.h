@@ -34,6 +34,10 @@ int http_serve_file(int connection, const char* filename);
 
 int http_reply(int connection, const char* status, const char* headers, const char* body, size_t body_len);
 
+// Status code of the last reply and body bytes sent by the calling thread
+// since the previous call (0 and 0 if none)
+void http_replied(unsigned* status, size_t* body_len);
+
 void http_close(void);
 
 static void* handle_connection(void* arg);
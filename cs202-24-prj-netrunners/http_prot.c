@@ -1,4 +1,6 @@
+#include <stdlib.h> // for strtod
 #include <string.h> 
+#include <strings.h> // for strncasecmp
 #include "http_prot.h"
 #include "error.h"
 
@@ -72,35 +74,37 @@ int http_parse_message(const char *stream, size_t bytes_received, struct http_me
 
 int http_get_var(const struct http_string* url, const char* name, char* out, size_t out_len) {
     M_REQUIRE_NON_NULL(url); M_REQUIRE_NON_NULL(name); M_REQUIRE_NON_NULL(out);
-    size_t len = url->len; 
-    char* val = url->val; 
+    const char* const url_end = url->val + url->len; // url is not NUL-terminated
+    const size_t name_len = strlen(name); 
+
+    // Walk the parameters of the query string: ?name=value&name=value...
+    const char* param = memchr(url->val, '?', url->len); 
+    while (param != NULL) {
+        param++; 
+        const char* end = memchr(param, '&', (size_t)(url_end - param)); 
+        if (end == NULL) {
+            end = url_end; 
+        }
 
-    
-    char name_equals[strlen(name) + 2];
-    strcpy(name_equals, name);
-    strcat(name_equals, "=");
+        if ((size_t)(end - param) > name_len && strncmp(param, name, name_len) == 0 &&
+            param[name_len] == '=') {
+            const char* start = param + name_len + 1; 
+            const size_t len = (size_t)(end - start); 
 
-    // Find the start of the variable value in the URL
-    char* start = strstr(val, name_equals); 
-    if (start == NULL) {
-        return 0; 
-    }
-    start += strlen(name_equals); 
+            // Check if the output buffer is large enough (with the final '\0')
+            if (len >= out_len) {
+                return ERR_RUNTIME; 
+            }
 
-    // Find the end of the variable value in the URL
-    char* end = strchr(start, '&'); 
-    if (end == NULL) {
-        end = url->val + url->len; 
-    }
+            // Copy the variable value to the output buffer
+            memcpy(out, start, len); 
+            out[len] = '\0'; 
+            return (int) len; 
+        }
 
-    // Check if the output buffer is large enough
-    if (end - start > out_len) {
-        return ERR_RUNTIME; 
+        param = end < url_end ? end : NULL; 
     }
-
-    // Copy the variable value to the output buffer
-    strncpy(out, start, end - start); 
-    return end - start; 
+    return 0; 
 }
 
 
@@ -170,4 +174,56 @@ static_unless_test const char* http_parse_headers(const char* header_start, stru
         output->num_headers++;
     }
     return message; 
-}
\ No newline at end of file
+}
+
+const struct http_string* http_get_header(const struct http_message* message, const char* name) {
+    if (message == NULL || name == NULL) return NULL;
+    const size_t name_len = strlen(name);
+
+    for (size_t i = 0; i < message->num_headers; i++) {
+        const struct http_string* key = &message->headers[i].key;
+        if (key->len == name_len && strncasecmp(key->val, name, name_len) == 0) {
+            return &message->headers[i].value;
+        }
+    }
+    return NULL;
+}
+
+int http_accepts(const struct http_string* accept, const char* media_type) {
+    if (accept == NULL || media_type == NULL) return 0;
+    const size_t type_len = strlen(media_type);
+    const char* const accept_end = accept->val + accept->len;
+
+    // media-range *( ";" parameter ) *( "," media-range ... )
+    for (const char* range = accept->val; range < accept_end; ) {
+        const char* end = memchr(range, ',', (size_t)(accept_end - range));
+        if (end == NULL) {
+            end = accept_end;
+        }
+        while (range < end && (*range == ' ' || *range == '\t')) {
+            range++;
+        }
+        const char* params = memchr(range, ';', (size_t)(end - range));
+        const char* type_end = params != NULL ? params : end;
+        while (type_end > range && (type_end[-1] == ' ' || type_end[-1] == '\t')) {
+            type_end--;
+        }
+
+        if ((size_t)(type_end - range) == type_len && strncasecmp(range, media_type, type_len) == 0) {
+            double q = 1.0;
+            for (const char* p = params; p != NULL && p < end; p = memchr(p + 1, ';', (size_t)(end - p - 1))) {
+                const char* v = p + 1;
+                while (v < end && *v == ' ') v++;
+                if (end - v > 2 && (v[0] == 'q' || v[0] == 'Q') && v[1] == '=') {
+                    char q_str[8] = { 0 };
+                    const size_t q_len = (size_t)(end - v - 2) < sizeof(q_str) - 1 ? (size_t)(end - v - 2) : sizeof(q_str) - 1;
+                    memcpy(q_str, v + 2, q_len);
+                    q = strtod(q_str, NULL);
+                }
+            }
+            return q > 0;
+        }
+        range = end + 1;
+    }
+    return 0;
+}
@@ -79,6 +79,21 @@ int http_get_var(const struct http_string* url, const char* name, char* out, siz
  */
 int http_match_verb(const struct http_string* method, const char* verb);
 
+/**
+ * @brief Finds a header of the message by its (case-insensitive) name.
+ *
+ * Returns its value, or NULL if the message has no such header.
+ */
+const struct http_string* http_get_header(const struct http_message* message, const char* name);
+
+/**
+ * @brief Whether an Accept header value lists the given media type with a non-zero quality.
+ *
+ * Only exact media types count: wildcards such as "image/*" do not say
+ * whether a particular format can be decoded.
+ */
+int http_accepts(const struct http_string* accept, const char* media_type);
+
 /**
  * @brief Retrieves the next token from a given message string.
  *
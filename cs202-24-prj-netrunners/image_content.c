@@ -1,7 +1,245 @@
 #include "imgfs.h"
+#include "image_content.h"
+#include "jpeg_probe.h"
+#include "imgfs_probes.h"
+#include "needle.h"
+#include "request_phases.h"
+#include "resize_engine.h"
 #include "util.h"
 #include <vips/vips.h>
 
+#define MAX_JPEG_SHRINK 8 // libjpeg can decode at 1/2, 1/4 and 1/8 scale
+#define DEFAULT_JPEG_QUALITY 75 // as libvips
+
+static const VipsForeignSubsample subsample_modes[] = {
+    [IMGFS_SUBSAMPLE_AUTO] = VIPS_FOREIGN_SUBSAMPLE_AUTO,
+    [IMGFS_SUBSAMPLE_ON]   = VIPS_FOREIGN_SUBSAMPLE_ON,
+    [IMGFS_SUBSAMPLE_OFF]  = VIPS_FOREIGN_SUBSAMPLE_OFF
+};
+
+/**
+ * @brief Largest JPEG shrink-on-load factor that keeps the decoded image
+ *        at least as big as a target x target bounding box (as libvips
+ *        picks it), to estimate how much memory decoding takes.
+ */
+static uint32_t shrink_on_load(uint32_t width, uint32_t height, uint16_t target)
+{
+    const uint32_t longest = MAX(width, height);
+    uint32_t shrink = 1;
+    while (target > 0 && shrink < MAX_JPEG_SHRINK && longest / (2 * shrink) >= target) {
+        shrink *= 2;
+    }
+    return shrink;
+}
+
+/********************************************************************
+ * See image_content.h
+ */
+int variants_prepare(const struct imgfs_file* imgfs_file, size_t index, unsigned res_mask,
+                     int replace, struct variant_job* job)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(job);
+    memset(job, 0, sizeof(*job));
+    if (index >= imgfs_file->header.max_files || !imgfs_is_valid(imgfs_file, (uint32_t) index)) {
+        return ERR_INVALID_IMGID;
+    }
+    job->index = (uint32_t) index;
+    job->replace = replace;
+    strncpy(job->img_id, imgfs_file->cold[index]->img_id, MAX_IMG_ID);
+
+    // from the largest to the smallest: each one is made from the previous one
+    for (int res = 0; res < ORIG_RES; res++) {
+        if (!(res_mask & (1u << res))) continue;
+        int pos = job->nb_res++;
+        while (pos > 0 && job->width[pos - 1] < imgfs_file->header.resized_res[res * ORIG_RES]) {
+            job->res[pos] = job->res[pos - 1];
+            job->width[pos] = job->width[pos - 1];
+            job->height[pos] = job->height[pos - 1];
+            job->profile[pos] = job->profile[pos - 1];
+            pos--;
+        }
+        job->res[pos] = res;
+        job->width[pos] = imgfs_file->header.resized_res[res * ORIG_RES];
+        job->height[pos] = imgfs_file->header.resized_res[res * ORIG_RES + 1];
+        imgfs_get_profile(&imgfs_file->header, res, &job->profile[pos]);
+    }
+    if (job->nb_res == 0) {
+        return ERR_NONE;
+    }
+
+    job->orig_size = imgfs_file->size[index][ORIG_RES];
+    job->orig_offset = imgfs_file->offset[index][ORIG_RES];
+    job->orig = malloc(job->orig_size);
+    if (job->orig == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    int check = needle_read(imgfs_file, ORIG_RES, job->orig_offset, job->orig, job->orig_size);
+    if (check != ERR_NONE) {
+        return check;
+    }
+
+    job->orig_width = imgfs_file->cold[index]->orig_res[WIDTH_I];
+    job->orig_height = imgfs_file->cold[index]->orig_res[HEIGHT_I];
+    struct jpeg_info info;
+    if ((job->orig_width == 0 || job->orig_height == 0) &&
+        jpeg_probe(job->orig, job->orig_size, &info) == ERR_NONE) {
+        job->orig_width = info.width;
+        job->orig_height = info.height;
+    }
+    return ERR_NONE;
+}
+
+/**
+ * @brief Makes one variant, encoded with the profile of its tier.
+ *
+ * @param source The image to resize, NULL to decode it from the original (with shrink-on-load)
+ * @param resized Where to put the resized image, in memory, for the next (smaller) variant
+ */
+static int resize_one(struct variant_job* job, int m, VipsImage* source, VipsImage** resized)
+{
+    VipsImage* thumbnail = NULL;
+    const int failed = source != NULL ? vips_thumbnail_image(source, &thumbnail, job->width[m], NULL)
+                                      : vips_thumbnail_buffer(job->orig, job->orig_size, &thumbnail,
+                                                              job->width[m], NULL);
+    if (failed) {
+        return ERR_IMGLIB;
+    }
+    // materialized once, so that encoding and the next resize do not redo it
+    *resized = vips_image_copy_memory(thumbnail);
+    g_object_unref(thumbnail);
+    if (*resized == NULL) {
+        return ERR_IMGLIB;
+    }
+
+    const struct encode_profile* profile = &job->profile[m];
+    if (vips_jpegsave_buffer(*resized, &job->out[m], &job->out_size[m],
+                             "Q", profile->quality > 0 ? profile->quality : DEFAULT_JPEG_QUALITY,
+                             "strip", (gboolean) profile->strip,
+                             "interlace", (gboolean) profile->progressive,
+                             "subsample_mode", subsample_modes[profile->subsample], NULL)) {
+        return ERR_IMGLIB;
+    }
+    return ERR_NONE;
+}
+
+/********************************************************************
+ * See image_content.h
+ */
+int variants_make(struct variant_job* job)
+{
+    M_REQUIRE_NON_NULL(job);
+    if (job->nb_res == 0) {
+        return ERR_NONE;
+    }
+
+    // admission: a slot of the resize engine, for what decoding will take
+    const uint32_t shrink = shrink_on_load(job->orig_width, job->orig_height, job->width[0]);
+    uint64_t start = 0;
+    int err = resize_engine_enter(job->orig_width / shrink, job->orig_height / shrink, &start);
+    if (err != ERR_NONE) {
+        return err;
+    }
+
+    // the largest variant decodes the original, the others reuse its pixels
+    VipsImage* source = NULL;
+    for (int m = 0; err == ERR_NONE && m < job->nb_res; m++) {
+        VipsImage* resized = NULL;
+        IMGFS_PROBE4(resize__start, job->img_id, job->res[m], job->width[m], job->height[m]);
+        err = resize_one(job, m, source, &resized);
+        IMGFS_PROBE4(resize__done, job->img_id, job->res[m], job->out_size[m], err);
+        if (source != NULL) {
+            g_object_unref(source);
+        }
+        source = resized;
+    }
+    if (source != NULL) {
+        g_object_unref(source);
+    }
+    resize_engine_leave(start);
+    return err;
+}
+
+/********************************************************************
+ * See image_content.h
+ */
+int variants_commit(struct imgfs_file* imgfs_file, const struct variant_job* job)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(job);
+    if (job->nb_res == 0) {
+        return ERR_NONE;
+    }
+
+    // the slot may have been deleted, or reused, since the job was prepared
+    const uint32_t index = job->index;
+    if (index >= imgfs_file->header.max_files || !imgfs_is_valid(imgfs_file, index) ||
+        strncmp(imgfs_file->cold[index]->img_id, job->img_id, MAX_IMG_ID) != 0 ||
+        imgfs_file->offset[index][ORIG_RES] != job->orig_offset ||
+        imgfs_file->size[index][ORIG_RES] != job->orig_size) {
+        return ERR_IMAGE_NOT_FOUND;
+    }
+
+    int err = ERR_NONE;
+    int appended = 0;
+    for (int m = 0; err == ERR_NONE && m < job->nb_res; m++) {
+        const int res = job->res[m];
+        if (!job->replace && imgfs_file->size[index][res] > 0) {
+            continue; // made by someone else meanwhile
+        }
+        uint64_t offset = 0;
+        err = needle_append(imgfs_file, job->img_id, res, NEEDLE_BLOB,
+                            job->out[m], (uint32_t) job->out_size[m], &offset);
+        if (err == ERR_NONE) {
+            // a variant made again replaces the old one
+            imgfs_space_unref(imgfs_file, index, 1u << res);
+            imgfs_file->size[index][res] = (uint32_t) job->out_size[m];
+            imgfs_file->offset[index][res] = offset;
+            imgfs_space_new_blob(imgfs_file, (uint32_t) job->out_size[m]);
+            appended = 1;
+        }
+    }
+
+    // Update metadata, once for all the new variants
+    if (appended && (imgfs_write_metadata(imgfs_file, index) != ERR_NONE ||
+                     imgfs_space_write(imgfs_file) != ERR_NONE)) {
+        return ERR_IO;
+    }
+    return err;
+}
+
+/********************************************************************
+ * See image_content.h
+ */
+void variants_free(struct variant_job* job)
+{
+    if (job == NULL) return;
+
+    free(job->orig);
+    for (int m = 0; m < job->nb_res; m++) {
+        g_free(job->out[m]);
+    }
+    memset(job, 0, sizeof(*job));
+}
+
+/**
+ * @brief Makes the variants of the resolutions in res_mask, out of a single
+ *        decode of the original, and writes the metadata once for all of them.
+ */
+static int make_variants(struct imgfs_file* imgfs_file, size_t index, unsigned res_mask, int replace)
+{
+    struct variant_job job;
+    int err = variants_prepare(imgfs_file, index, res_mask, replace, &job);
+    if (err == ERR_NONE) {
+        err = variants_make(&job);
+    }
+    if (err == ERR_NONE) {
+        err = variants_commit(imgfs_file, &job);
+    }
+    variants_free(&job);
+    return err;
+}
+
 int lazily_resize(int resolution, struct imgfs_file* imgfs_file, size_t index) {
     
     M_REQUIRE_NON_NULL(imgfs_file);
@@ -12,78 +250,175 @@ int lazily_resize(int resolution, struct imgfs_file* imgfs_file, size_t index) {
     }
 
     // Check if index is within bounds
-    if (index >= imgfs_file->header.nb_files) {
+    if (index >= imgfs_file->header.max_files) {
         return ERR_INVALID_IMGID;
     }
 
-    struct img_metadata * metadata = &imgfs_file->metadata[index];
-
     // Do not resize if resolution is ORIG_RES
-    if (metadata->is_valid == EMPTY || resolution == ORIG_RES || metadata->size[resolution] > 0) {
+    if (!imgfs_is_valid(imgfs_file, (uint32_t)index) || resolution == ORIG_RES || imgfs_file->size[index][resolution] > 0) {
         return ERR_NONE;
     }
 
-    // create a buffer 
-    uint32_t orig_size = metadata->size[ORIG_RES];
-    uint64_t orig_offset = metadata->offset[ORIG_RES];
-    void *buf = malloc(orig_size);
-    if (!buf) {
-        free(buf); 
-        return ERR_OUT_OF_MEMORY;
+    phase_enter(PHASE_RESIZE);
+    const int err = make_variants(imgfs_file, index, variants_missing(imgfs_file, index), 0);
+    phase_leave();
+    return err;
+}
+
+unsigned variants_missing(const struct imgfs_file* imgfs_file, size_t index)
+{
+    // all the missing variants are made at once
+    unsigned missing = 0;
+    for (int res = 0; imgfs_file != NULL && res < ORIG_RES; res++) {
+        if (imgfs_file->size[index][res] == 0) {
+            missing |= 1u << res;
+        }
     }
-    if (fseek(imgfs_file->file, (long)orig_offset, SEEK_SET)
-    || fread(buf, orig_size, 1, imgfs_file->file) != 1) {
-        free(buf);
-        return ERR_IO;
+    return missing;
+}
+
+int remake_variants(struct imgfs_file* imgfs_file, size_t index, unsigned res_mask)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    if (index >= imgfs_file->header.max_files || !imgfs_is_valid(imgfs_file, (uint32_t) index)) {
+        return ERR_INVALID_IMGID;
+    }
+
+    unsigned existing = 0;
+    for (int res = 0; res < ORIG_RES; res++) {
+        if (imgfs_file->size[index][res] > 0) {
+            existing |= 1u << res;
+        }
     }
+    return make_variants(imgfs_file, index, res_mask & existing, 1);
+}
+
+static const char* const format_names[NB_IMAGE_FORMATS] = { "jpeg", "webp", "avif" };
+static const char* const format_mimes[NB_IMAGE_FORMATS] = { "image/jpeg", "image/webp", "image/avif" };
+
+int image_format_atoi(const char* name)
+{
+    if (name == NULL) return -1;
+
+    for (int format = 0; format < NB_IMAGE_FORMATS; format++) {
+        if (!strcmp(name, format_names[format])) {
+            return format;
+        }
+    }
+    return -1;
+}
+
+const char* image_format_mime(int format)
+{
+    return format >= 0 && format < NB_IMAGE_FORMATS ? format_mimes[format] : format_mimes[IMAGE_JPEG];
+}
 
-    // Load the original image
-    VipsImage * orig_image = NULL;
-    if (vips_jpegload_buffer(buf, orig_size, &orig_image, NULL)) {
-        free(buf);
+/**
+ * @brief Encodes an image in a format, into a malloc()ed buffer.
+ */
+static int encode_variant(VipsImage* image, int format, char** out, uint32_t* out_size)
+{
+    void* encoded = NULL;
+    size_t encoded_size = 0;
+    int failed = 0;
+    switch (format) {
+    case IMAGE_WEBP:
+        failed = vips_webpsave_buffer(image, &encoded, &encoded_size, NULL);
+        break;
+    case IMAGE_AVIF:
+        failed = vips_heifsave_buffer(image, &encoded, &encoded_size,
+                                      "compression", VIPS_FOREIGN_HEIF_COMPRESSION_AV1, NULL);
+        break;
+    default:
+        failed = vips_jpegsave_buffer(image, &encoded, &encoded_size, NULL);
+        break;
+    }
+    if (failed) {
         return ERR_IMGLIB;
     }
 
-    // Resize the image
-    VipsImage * resized_image = NULL;
-    if (vips_thumbnail_image(orig_image, &resized_image, 
-        imgfs_file->header.resized_res[resolution * ORIG_RES], NULL)) {
-        g_object_unref(orig_image);
-        free(buf);
+    // vips buffers are g_free()d: hand out a malloc()ed copy
+    *out = malloc(encoded_size);
+    if (*out == NULL) {
+        g_free(encoded);
+        return ERR_OUT_OF_MEMORY;
+    }
+    memcpy(*out, encoded, encoded_size);
+    *out_size = (uint32_t) encoded_size;
+    g_free(encoded);
+    return ERR_NONE;
+}
+
+int transcode_variant(const char* jpeg, size_t jpeg_size, int format,
+                      char** out, uint32_t* out_size)
+{
+    M_REQUIRE_NON_NULL(jpeg);
+    M_REQUIRE_NON_NULL(out);
+    M_REQUIRE_NON_NULL(out_size);
+    if (format <= IMAGE_JPEG || format >= NB_IMAGE_FORMATS) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    struct jpeg_info info;
+    if (jpeg_probe(jpeg, jpeg_size, &info) != ERR_NONE) {
         return ERR_IMGLIB;
     }
-    g_object_unref(orig_image);
+    uint64_t start = 0;
+    int err = resize_engine_enter(info.width, info.height, &start);
+    if (err != ERR_NONE) {
+        return err;
+    }
 
-    // save the new resized image in a new buffer  
-    void * resized_buf = NULL;
-    size_t resized_size = 0;
-    if (vips_jpegsave_buffer(resized_image, &resized_buf, &resized_size, NULL)) {
-        g_object_unref(resized_image);
-        free(buf);
+    VipsImage* image = NULL;
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wcast-qual"
+    if (vips_jpegload_buffer((void*) jpeg, jpeg_size, &image, NULL)) {
+#pragma GCC diagnostic pop
+        resize_engine_leave(start);
         return ERR_IMGLIB;
     }
-    g_object_unref(resized_image);
-    free(buf);
 
-    // save the resized image 
+    err = encode_variant(image, format, out, out_size);
+    g_object_unref(image);
+    resize_engine_leave(start);
+    return err;
+}
+
+int resize_variant(const char* jpeg, size_t jpeg_size, uint16_t width, uint16_t height,
+                   int format, char** out, uint32_t* out_size)
+{
+    M_REQUIRE_NON_NULL(jpeg);
+    M_REQUIRE_NON_NULL(out);
+    M_REQUIRE_NON_NULL(out_size);
+    if (width == 0 || height == 0 || format < 0 || format >= NB_IMAGE_FORMATS) {
+        return ERR_INVALID_ARGUMENT;
+    }
 
-    if (fseek(imgfs_file->file, 0, SEEK_END) != 0 ||
-        fwrite(resized_buf,resized_size, 1, imgfs_file->file) != 1) {
-        g_free(resized_buf);
-        return ERR_IO;
+    struct jpeg_info info;
+    if (jpeg_probe(jpeg, jpeg_size, &info) != ERR_NONE) {
+        return ERR_IMGLIB;
+    }
+    const uint32_t shrink = shrink_on_load(info.width, info.height, MAX(width, height));
+    uint64_t start = 0;
+    int err = resize_engine_enter(info.width / shrink, info.height / shrink, &start);
+    if (err != ERR_NONE) {
+        return err;
     }
-    g_free(resized_buf);
 
-    // Update metadata
-    metadata->size[resolution] = (uint32_t)resized_size;
-    metadata->offset[resolution] = (uint64_t)(ftell(imgfs_file->file) - resized_size);
-    
-    if(fseek(imgfs_file->file, sizeof(struct imgfs_header) + index * sizeof(struct img_metadata), SEEK_SET) ||
-        fwrite(metadata, sizeof(struct img_metadata), 1, imgfs_file->file) != 1) {
-        return ERR_IO; 
+    VipsImage* thumbnail = NULL;
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wcast-qual"
+    if (vips_thumbnail_buffer((void*) jpeg, jpeg_size, &thumbnail, width,
+                              "height", (int) height, "size", VIPS_SIZE_DOWN, NULL)) {
+#pragma GCC diagnostic pop
+        resize_engine_leave(start);
+        return ERR_IMGLIB;
     }
 
-    return ERR_NONE;
+    err = encode_variant(thumbnail, format, out, out_size);
+    g_object_unref(thumbnail);
+    resize_engine_leave(start);
+    return err;
 }
 
 // Prov ded method from week 10
@@ -94,6 +429,14 @@ int get_resolution(uint32_t *height, uint32_t *width,
     M_REQUIRE_NON_NULL(width);
     M_REQUIRE_NON_NULL(image_buffer);
 
+    // the frame header is enough; libvips decides on the frames it does not accept
+    struct jpeg_info info;
+    if (jpeg_probe(image_buffer, image_size, &info) == ERR_NONE) {
+        *height = info.height;
+        *width = info.width;
+        return ERR_NONE;
+    }
+
     VipsImage* original = NULL;
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wcast-qual"
@@ -16,6 +16,59 @@
 extern "C" {
 #endif
 
+/**
+ * @brief Encodings in which resized variants can be served. Variants are
+ *        stored as JPEG; the others are derived from the JPEG on demand.
+ */
+enum image_format {
+    IMAGE_JPEG,
+    IMAGE_WEBP,
+    IMAGE_AVIF,
+    NB_IMAGE_FORMATS
+};
+
+/**
+ * @brief Transforms a format name ("jpeg", "webp" or "avif") to its value.
+ *
+ * @return The corresponding value or -1 if error.
+ */
+int image_format_atoi(const char* name);
+
+/**
+ * @brief Media type of a format, e.g. "image/webp".
+ */
+const char* image_format_mime(int format);
+
+/**
+ * @brief Re-encodes a JPEG variant in another format.
+ *
+ * @param jpeg The JPEG bytes
+ * @param jpeg_size The size of jpeg
+ * @param format The target format
+ * @param out Where to put the encoded bytes, to be freed with free()
+ * @param out_size Where to put the size of out
+ * @return Some error code. 0 if no error.
+ */
+int transcode_variant(const char* jpeg, size_t jpeg_size, int format,
+                      char** out, uint32_t* out_size);
+
+/**
+ * @brief Makes a variant of a JPEG image that fits a bounding box, keeping
+ *        its aspect ratio. Images already smaller than the box are not
+ *        enlarged.
+ *
+ * @param jpeg The JPEG bytes
+ * @param jpeg_size The size of jpeg
+ * @param width The width of the bounding box
+ * @param height The height of the bounding box
+ * @param format The format of the variant
+ * @param out Where to put the encoded bytes, to be freed with free()
+ * @param out_size Where to put the size of out
+ * @return Some error code. 0 if no error.
+ */
+int resize_variant(const char* jpeg, size_t jpeg_size, uint16_t width, uint16_t height,
+                   int format, char** out, uint32_t* out_size);
+
 /**
  * @brief Gets the resolution of an image.
  *
@@ -36,6 +89,88 @@ int get_resolution(uint32_t *height, uint32_t *width, const char *image_buffer,
  */
 int lazily_resize(int resolution, struct imgfs_file* imgfs_file, size_t index);
 
+/**
+ * @brief The making of resized variants of an image, in three steps, so
+ *        that the imgFS need not be locked while images are decoded and
+ *        encoded:
+ *
+ *   variants_prepare(), imgFS read-locked: reads the original;
+ *   variants_make(), no lock: resizes and encodes;
+ *   variants_commit(), imgFS write-locked: appends the variants, if the
+ *   slot still holds the same image.
+ *
+ * Whatever the outcome, the job is then released with variants_free().
+ */
+struct variant_job {
+    uint32_t index;
+    char img_id[MAX_IMG_ID + 1];
+    int replace;            // replace existing variants, rather than keep them
+    int nb_res;
+    int res[ORIG_RES];      // from the largest to the smallest
+    uint16_t width[ORIG_RES];
+    uint16_t height[ORIG_RES];
+    struct encode_profile profile[ORIG_RES];
+    char* orig;             // the original, as stored
+    uint32_t orig_size;
+    uint64_t orig_offset;
+    uint32_t orig_width, orig_height;
+    void* out[ORIG_RES];    // the encoded variants
+    size_t out_size[ORIG_RES];
+};
+
+/**
+ * @brief Starts a job making the variants in res_mask of an image.
+ *
+ * @param imgfs_file The main in-memory structure
+ * @param index The index of the image in the metadata array
+ * @param res_mask Bit r set to make resolution r
+ * @param replace Whether the variants replace existing ones (see remake_variants())
+ * @param job The job to initialize
+ * @return Some error code. 0 if no error.
+ */
+int variants_prepare(const struct imgfs_file* imgfs_file, size_t index, unsigned res_mask,
+                     int replace, struct variant_job* job);
+
+/**
+ * @brief Resizes and encodes the variants of a prepared job, in a slot of
+ *        the resize engine (see resize_engine.h).
+ *
+ * @return Some error code. 0 if no error.
+ */
+int variants_make(struct variant_job* job);
+
+/**
+ * @brief Appends the variants of a job and updates the metadata on the disk.
+ *        Variants made meanwhile by another job are kept, unless the job
+ *        replaces them.
+ *
+ * @return ERR_IMAGE_NOT_FOUND if the slot no longer holds the image of
+ *         the job, some other error code on failure, 0 if no error.
+ */
+int variants_commit(struct imgfs_file* imgfs_file, const struct variant_job* job);
+
+/**
+ * @brief Frees the buffers of a job.
+ */
+void variants_free(struct variant_job* job);
+
+/**
+ * @brief The resolutions an image has no variant of yet, as a mask.
+ */
+unsigned variants_missing(const struct imgfs_file* imgfs_file, size_t index);
+
+/**
+ * @brief Makes again, from the original and with the current encode
+ *        profiles, the existing resized variants of an image, and updates
+ *        the metadata on the disk.
+ *
+ * @param imgfs_file The main in-memory structure
+ * @param index The index of the image in the metadata array
+ * @param res_mask Bit r set to remake resolution r (missing ones are skipped)
+ * @return Some error code. 0 if no error.
+ */
+int remake_variants(struct imgfs_file* imgfs_file, size_t index, unsigned res_mask);
+
 #ifdef __cplusplus
 }
 #endif
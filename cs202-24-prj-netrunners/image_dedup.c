@@ -1,4 +1,5 @@
 #include "imgfs.h"  
+#include "imgfs_probes.h"
 #include <stdio.h> 
 #include <stdint.h>
 #include <error.h>
@@ -8,42 +9,47 @@ int do_name_and_content_dedup(struct imgfs_file* imgfs_file, uint32_t index) {
 
     // requireed checks 
     M_REQUIRE_NON_NULL(imgfs_file); 
-    M_REQUIRE_NON_NULL(imgfs_file->metadata);  
+    M_REQUIRE_NON_NULL(imgfs_file->cold);  
 
 
-    if (index > imgfs_file->header.nb_files || imgfs_file->metadata[index].is_valid == EMPTY) {
+    if (index >= imgfs_file->header.max_files || !imgfs_is_valid(imgfs_file, index)) {
         return ERR_IMAGE_NOT_FOUND; 
     }
 
 
 
-    struct img_metadata *indexed_image = &imgfs_file->metadata[index];
+    const struct img_cold *indexed_image = imgfs_file->cold[index];
+    const uint64_t indexed_hash = imgfs_file->id_hash[index];
+    const uint64_t indexed_prefix = imgfs_file->sha_prefix[index];
 
     int found_dup = 0; 
 
-    // go through the images and copy the one with the same SHA as the requested image
-    // also throw an error if it finds a duplicate 
+    // go through the valid images and copy the first one with the same SHA as the requested image
+    // also throw an error if it finds a duplicate ID
 
-    for (uint32_t i = 0; i < imgfs_file->header.max_files; i++) {
-        if (i != index && imgfs_file->metadata[i].is_valid == NON_EMPTY) {
-            struct img_metadata *other_image = &imgfs_file->metadata[i];
-            if (!strcmp(indexed_image->img_id, other_image->img_id)) {
+    const uint32_t words = (imgfs_file->header.max_files + IMGFS_VALID_BITS - 1) / IMGFS_VALID_BITS;
+    for (uint32_t w = 0; w < words; w++) {
+        for (uint64_t bits = imgfs_file->valid[w]; bits != 0; bits &= bits - 1) {
+            const uint32_t i = w * IMGFS_VALID_BITS + (uint32_t) __builtin_ctzll(bits);
+            if (i == index) continue;
+
+            // the hot hashes first: a cold record is only read on a likely match
+            const struct img_cold *other_image = imgfs_file->cold[i];
+            if (imgfs_file->id_hash[i] == indexed_hash && !strcmp(indexed_image->img_id, other_image->img_id)) {
                 return ERR_DUPLICATE_ID;
             }
-            if (memcmp(indexed_image->SHA, other_image->SHA, SHA256_DIGEST_LENGTH) == 0) {
-                // peutetre faire tout manuellement comme le pote de thomas 
-                memcpy(indexed_image->offset, other_image->offset, sizeof(other_image->offset));
-                memcpy(indexed_image->size, other_image->size, sizeof(other_image->size));
+            if (!found_dup && imgfs_file->sha_prefix[i] == indexed_prefix &&
+                memcmp(indexed_image->SHA, other_image->SHA, SHA256_DIGEST_LENGTH) == 0) {
+                memcpy(imgfs_file->offset[index], imgfs_file->offset[i], sizeof(imgfs_file->offset[i]));
+                memcpy(imgfs_file->size[index], imgfs_file->size[i], sizeof(imgfs_file->size[i]));
+                imgfs_file->cold[index]->saved_kib = other_image->saved_kib;
+                IMGFS_PROBE4(dedup__hit, indexed_image->img_id, index, i, imgfs_file->size[i][ORIG_RES]);
                 found_dup = 1; 
-                break; 
             }
         }
-        if (!found_dup) {
-            indexed_image->offset[ORIG_RES] = 0; 
-        }
+    }
+    if (!found_dup) {
+        imgfs_file->offset[index][ORIG_RES] = 0; 
     }
     return ERR_NONE;
-
-    
-    
-}
\ No newline at end of file
+}
@@ -20,9 +20,12 @@
                     * but we provide it here, as it is required by
                     * all the functions of this lib.
                     */
+#include "imgfs_backend.h" // for struct imgfs_backend
 #include <openssl/sha.h>   // for SHA256_DIGEST_LENGTH
+#include <stddef.h>        // for size_t
 #include <stdint.h>        // for uint32_t, uint64_t
-#include <stdio.h>         // for FILE
+#include <stdio.h>         // for printf
+#include <string.h>        // for memcpy
 
 #define CAT_TXT "EPFL ImgFS 2024"
 
@@ -43,6 +46,59 @@
 #define WIDTH_I 0
 #define HEIGHT_I 1
 
+// On-disk format versions, stored in imgfs_header.format
+#define IMGFS_FORMAT_RAW    0 // blobs are raw JPEG bytes
+#define IMGFS_FORMAT_NEEDLE 1 // each blob is wrapped in a needle (see needle.h)
+
+// For flags in imgfs_header
+#define IMGFS_FLAG_SEALED 0x0001 // read-only volume: no new images
+#define IMGFS_FLAG_TIERS  0x0002 // resized variants live in the tier file
+#define IMGFS_FLAG_OPTIMIZE 0x0004 // originals are losslessly optimized at insertion
+#define IMGFS_FLAG_SPACE  0x0008 // space counters follow the metadata table
+
+/*
+ * Space accounting: how the bytes of the stored blobs (originals and
+ * resized variants, needle framing excluded) are used.
+ *  - live: blobs some image refers to, each counted once
+ *  - shared: the part of live referred to by several images (deduplication)
+ *  - dead: blobs no image refers to any more (deleted, replaced), which
+ *    only a garbage collection would give back
+ * Files created with IMGFS_FLAG_SPACE keep them in a struct imgfs_space
+ * right after the metadata table, updated by every insert, delete and
+ * resize. For older files, live and shared are computed by a scan of the
+ * table, and dead is estimated as all the used bytes that are not live.
+ */
+
+/*
+ * Tier file: with IMGFS_FLAG_TIERS, the thumbnail and small variants are
+ * not appended to the imgFS file, among the originals, but to a sidecar
+ * file named after it. There they are packed into IMGFS_TIER_PAGE pages
+ * (a variant never straddles a page boundary unless it is bigger than a
+ * page), so the working set of small variants is compact and readahead
+ * brings in neighbouring variants rather than slices of originals. The
+ * first page is left empty: offset 0 means "no content".
+ */
+#define IMGFS_TIER_SUFFIX ".tiers"
+#define IMGFS_TIER_PAGE   4096
+
+/*
+ * Encode profiles: how the resized variants of each tier are encoded.
+ * They are packed in imgfs_header.profiles, 32 bits per resized tier
+ * (quality in bits 0-6, strip in bit 7, progressive in bit 8, chroma
+ * subsampling in bits 9-10). All zero, as in files made before profiles
+ * existed, means the library defaults.
+ */
+#define IMGFS_SUBSAMPLE_AUTO 0 // the encoder decides (4:2:0 unless high quality)
+#define IMGFS_SUBSAMPLE_ON   1 // always 4:2:0
+#define IMGFS_SUBSAMPLE_OFF  2 // always 4:4:4
+
+struct encode_profile {
+    uint8_t quality;     // 1 to 100, 0 for the library default
+    uint8_t strip;       // drop EXIF, ICC and other metadata
+    uint8_t progressive; // progressive rather than baseline JPEG
+    uint8_t subsample;   // IMGFS_SUBSAMPLE_*
+};
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -58,10 +114,18 @@ struct imgfs_header {
     uint32_t nb_files; 
     const uint32_t max_files; 
     const uint16_t resized_res[ORIG_RES*(NB_RES-1)]; 
-    uint32_t unused_32; 
-    uint64_t unused_64; 
+    uint16_t format; 
+    uint16_t flags; 
+    uint64_t profiles; // encode profiles of the resized tiers, see imgfs_get_profile()
 }; 
 
+struct imgfs_space {
+    uint64_t live_bytes;
+    uint64_t shared_bytes;
+    uint64_t dead_bytes;
+    uint64_t unused_64;
+};
+
 struct img_metadata{
     char img_id[MAX_IMG_ID+1];
     unsigned char SHA[SHA256_DIGEST_LENGTH]; 
@@ -69,15 +133,58 @@ struct img_metadata{
     uint32_t size[NB_RES];
     uint64_t offset[NB_RES]; 
     uint16_t is_valid; 
-    uint16_t unused_16; 
+    uint16_t saved_kib; // KiB saved by IMGFS_FLAG_OPTIMIZE on the original, see imgfs_saved_kib()
+};
+
+/*
+ * In memory, struct img_metadata is split by access pattern. The fields
+ * every table scan needs (validity, sizes, offsets, a hash of the ID) live
+ * in parallel hot arrays indexed by slot; everything else only exists for
+ * valid slots, in one variable-length cold record. struct img_metadata
+ * remains the on-disk format (see imgfs_get_metadata()/imgfs_set_metadata()).
+ */
+struct img_cold {
+    unsigned char SHA[SHA256_DIGEST_LENGTH]; 
+    uint32_t orig_res[2]; 
+    uint16_t saved_kib; 
+    char img_id[];      // NUL-terminated, at most MAX_IMG_ID chars
 };
 
 struct imgfs_file {
-    FILE* file; 
+    struct imgfs_backend io; // where the imgFS is stored
+    uint64_t file_end;       // where the next blob gets appended
+    struct imgfs_backend tier_io; // tier file, only with IMGFS_FLAG_TIERS
+    uint64_t tier_end;
     struct imgfs_header header; 
-    struct img_metadata* metadata; 
+    struct imgfs_space space; // only kept up to date with IMGFS_FLAG_SPACE
+    // hot arrays, max_files entries each
+    uint64_t* valid;            // one bit per slot
+    uint64_t* id_hash;          // imgfs_id_hash() of the slot's img_id
+    uint64_t* sha_prefix;       // imgfs_sha_prefix() of the slot's SHA-256, see imgfs_set_sha()
+    uint32_t (*size)[NB_RES];
+    uint64_t (*offset)[NB_RES];
+    // cold records, NULL for empty slots
+    struct img_cold** cold;
 };
 
+#define IMGFS_VALID_BITS 64
+
+/**
+ * @brief Whether a slot of the metadata table holds an image.
+ */
+static inline int imgfs_is_valid(const struct imgfs_file* imgfs_file, uint32_t index)
+{
+    return (int) ((imgfs_file->valid[index / IMGFS_VALID_BITS] >> (index % IMGFS_VALID_BITS)) & 1);
+}
+
+/**
+ * @brief Whether the content of a resolution is stored in the tier file.
+ */
+static inline int imgfs_in_tier(const struct imgfs_file* imgfs_file, int resolution)
+{
+    return resolution != ORIG_RES && imgfs_file->tier_io.ops != NULL;
+}
+
 /**
  * @brief Prints imgFS header informations.
  *
@@ -96,17 +203,30 @@ void print_metadata(const struct img_metadata* metadata);
  * @brief Open imgFS file, read the header and all the metadata.
  *
  * @param imgfs_filename Path to the imgFS file
- * @param open_mode Mode for fopen(), eg.: "rb", "rb+", etc.
- * @param imgfs_file Structure for header, metadata and file pointer.
+ * @param open_mode Mode as for fopen(), eg.: "rb", "rb+", etc.
+ * @param imgfs_file Structure for header, metadata and file descriptor.
  */
 int do_open(const char* imgfs_filename,
             const char* open_mode,
             struct imgfs_file* imgfs_file);
 
+/**
+ * @brief Same as do_open(), on a given storage backend.
+ *
+ * @param imgfs_filename Path to the imgFS file
+ * @param open_mode Mode as for fopen(), eg.: "rb", "rb+", etc.
+ * @param backend Which storage backend to use (see imgfs_backend.h)
+ * @param imgfs_file Structure for header, metadata and file descriptor.
+ */
+int do_open_backend(const char* imgfs_filename,
+                    const char* open_mode,
+                    enum imgfs_backend_kind backend,
+                    struct imgfs_file* imgfs_file);
+
 /**
  * @brief Do some clean-up for imgFS file handling.
  *
- * @param imgfs_file Structure for header, metadata and file pointer to be freed/closed.
+ * @param imgfs_file Structure for header, metadata and file descriptor to be freed/closed.
  */
 void do_close(struct imgfs_file* imgfs_file);
 
@@ -134,14 +254,37 @@ int do_list(const struct imgfs_file* imgfs_file,
             enum do_list_mode output_mode, char** json);
 
 /**
- * @brief Creates the imgFS called imgfs_filename. Writes the header and the
- *        preallocated empty metadata array to imgFS file.
+ * @brief Creates the imgFS called imgfs_filename. Writes the header and
+ *        reserves the empty metadata array, as a sparse zero-filled region,
+ *        in the imgFS file.
  *
  * @param imgfs_filename Path to the imgFS file
  * @param imgfs_file In memory structure with header and metadata.
  */
 int do_create(const char* imgfs_filename, struct imgfs_file* imgfs_file);
 
+/**
+ * @brief Same as do_create(), on a given storage backend.
+ *
+ * @param imgfs_filename Path to the imgFS file
+ * @param backend Which storage backend to use (see imgfs_backend.h)
+ * @param imgfs_file In memory structure with header and metadata.
+ */
+int do_create_backend(const char* imgfs_filename, enum imgfs_backend_kind backend,
+                      struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Reserves disk space for data_size bytes of future images.
+ *
+ * The file size (and thus where images get appended) is unchanged; the
+ * blocks are only allocated so that appends do not fragment.
+ *
+ * @param imgfs_file The main in-memory structure, opened for writing
+ * @param data_size Number of bytes to reserve after the current end
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_preallocate(struct imgfs_file* imgfs_file, uint64_t data_size);
+
 /**
  * @brief Deletes an image from a imgFS imgFS.
  *
@@ -178,6 +321,25 @@ int resolution_atoi(const char* resolution);
 int do_read(const char* img_id, int resolution, char** image_buffer,
             uint32_t* image_size, struct imgfs_file* imgfs_file);
 
+/**
+ * @brief Reads the content of an image into a caller-provided buffer.
+ *
+ * Once the requested resolution exists, the read only uses positional
+ * I/O on the storage backend: concurrent readers need no locking.
+ *
+ * @param img_id The ID of the image to be read.
+ * @param resolution The desired resolution for the image read.
+ * @param buffer Where to put the image content
+ * @param buffer_size The capacity of buffer
+ * @param image_size Location of the image size variable. If buffer is
+ *        too small, it receives the needed size and ERR_INVALID_ARGUMENT
+ *        is returned.
+ * @param imgfs_file The main in-memory data structure
+ * @return Some error code. 0 if no error.
+ */
+int do_read_into(const char* img_id, int resolution, char* buffer, size_t buffer_size,
+                 uint32_t* image_size, struct imgfs_file* imgfs_file);
+
 /**
  * @brief Insert image in the imgFS file
  *
@@ -189,6 +351,324 @@ int do_read(const char* img_id, int resolution, char** image_buffer,
 int do_insert(const char* image_buffer, size_t image_size,
               const char* img_id, struct imgfs_file* imgfs_file);
 
+/**
+ * @brief Seals an imgFS: from now on, it accepts no new images.
+ *
+ * Reads, resized variants and deletions are still possible. The seal is
+ * recorded in the header, so it survives reopening.
+ *
+ * @param imgfs_file The main in-memory data structure, opened for writing
+ * @return Some error code. 0 if no error.
+ */
+int do_seal(struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Rebuilds the metadata table from the needles of the data region.
+ *
+ * Scans the blobs appended after the metadata table in file order and
+ * replays inserts, aliases, resized variants and deletions. Only
+ * available for files in IMGFS_FORMAT_NEEDLE. Variants in a tier file
+ * are not recovered: they are created again on their next read.
+ *
+ * @param imgfs_file The main in-memory data structure, opened for writing
+ * @return Some error code. 0 if no error.
+ */
+int do_recover(struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Statistics of do_reencode().
+ */
+struct reencode_stats {
+    uint32_t variants;     // resized variants encoded again
+    uint64_t bytes_before; // their total size before
+    uint64_t bytes_after;  // and after
+};
+
+/**
+ * @brief Changes the encode profiles and applies them to the existing
+ *        resized variants.
+ *
+ * The variants are made again from the originals, then appended; the old
+ * ones become dead space. Images sharing content keep sharing their
+ * variants.
+ *
+ * @param imgfs_file The main in-memory data structure, opened for writing
+ * @param profiles The new profile per resized tier, NULL to keep it (the
+ *        array itself may be NULL to only re-encode)
+ * @param stats Where to put the statistics, may be NULL
+ * @return Some error code. 0 if no error.
+ */
+int do_reencode(struct imgfs_file* imgfs_file,
+                const struct encode_profile* const profiles[ORIG_RES],
+                struct reencode_stats* stats);
+
+/**
+ * @brief Allocates the (empty) in-memory metadata table for header.max_files slots.
+ *
+ * @param imgfs_file The main in-memory structure, with a valid header.
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_alloc_table(struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Frees the in-memory metadata table.
+ */
+void imgfs_free_table(struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Bytes of memory taken by the in-memory metadata table: the hot
+ *        arrays and the cold records (allocator overhead not included).
+ */
+size_t imgfs_table_memory(const struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Gathers one slot of the in-memory table into its on-disk form.
+ *
+ * @param imgfs_file The main in-memory structure
+ * @param index The slot to read
+ * @param metadata Where to put the result (zeroed for empty slots)
+ */
+void imgfs_get_metadata(const struct imgfs_file* imgfs_file, uint32_t index,
+                        struct img_metadata* metadata);
+
+/**
+ * @brief Scatters an on-disk metadata entry into one slot of the in-memory table.
+ *
+ * Empty entries release the slot.
+ *
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_set_metadata(struct imgfs_file* imgfs_file, uint32_t index,
+                       const struct img_metadata* metadata);
+
+/**
+ * @brief Fills a free slot with a new image (valid, no content yet).
+ *
+ * @param imgfs_file The main in-memory structure
+ * @param index The (free) slot to fill
+ * @param img_id The ID of the image
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_fill_slot(struct imgfs_file* imgfs_file, uint32_t index, const char* img_id);
+
+/**
+ * @brief Sets the SHA-256 of a filled slot, in its cold record and in
+ *        the hot sha_prefix array.
+ */
+void imgfs_set_sha(struct imgfs_file* imgfs_file, uint32_t index, const unsigned char* SHA);
+
+/**
+ * @brief The first 8 bytes of a SHA-256: comparing them first spares most
+ *        content lookups a cold record.
+ */
+static inline uint64_t imgfs_sha_prefix(const unsigned char* SHA)
+{
+    uint64_t prefix = 0;
+    memcpy(&prefix, SHA, sizeof(prefix));
+    return prefix;
+}
+
+/**
+ * @brief The saved_kib of an original optimized by saved bytes, rounded
+ *        up: it is nonzero exactly when the stored bytes differ from the
+ *        upload (and so do not hash to the SHA-256 of the slot).
+ */
+static inline uint16_t imgfs_saved_kib(uint32_t saved)
+{
+    const uint32_t kib = (saved >> 10) + ((saved & 1023) != 0);
+    return (uint16_t) (kib < UINT16_MAX ? kib : UINT16_MAX);
+}
+
+/**
+ * @brief Marks a slot as empty and releases its cold record.
+ */
+void imgfs_clear_slot(struct imgfs_file* imgfs_file, uint32_t index);
+
+/**
+ * @brief Writes one metadata entry of the in-memory table to the imgFS file.
+ *
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_write_metadata(struct imgfs_file* imgfs_file, uint32_t index);
+
+/**
+ * @brief Writes the whole in-memory metadata table to the imgFS file.
+ *
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_write_table(struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Looks up a valid image by its ID.
+ *
+ * @param imgfs_file The main in-memory structure
+ * @param img_id The ID of the image
+ * @param index Where to put the slot of the image
+ * @return ERR_IMAGE_NOT_FOUND if there is no such image, 0 otherwise.
+ */
+int imgfs_find_id(const struct imgfs_file* imgfs_file, const char* img_id, uint32_t* index);
+
+/**
+ * @brief Finds the first empty slot of the metadata table.
+ *
+ * @return ERR_IMGFS_FULL if there is none, 0 otherwise.
+ */
+int imgfs_find_free(const struct imgfs_file* imgfs_file, uint32_t* index);
+
+/**
+ * @brief Hashes an image ID (64-bit FNV-1a).
+ *
+ * @param img_id The ID of the image.
+ * @return The hash value.
+ */
+uint64_t imgfs_id_hash(const char* img_id);
+
+/**
+ * @brief Reads exactly len bytes at the given offset of the imgFS file.
+ *
+ * @return ERR_IO on failure or short read, 0 otherwise.
+ */
+int imgfs_pread(const struct imgfs_file* imgfs_file, void* buf, size_t len, uint64_t offset);
+
+/**
+ * @brief Writes exactly len bytes at the given offset of the imgFS file.
+ *
+ * Moves file_end forward if the write extends the file.
+ *
+ * @return ERR_IO on failure, 0 otherwise.
+ */
+int imgfs_pwrite(struct imgfs_file* imgfs_file, const void* buf, size_t len, uint64_t offset);
+
+/**
+ * @brief Same as imgfs_pread(), in the file holding the given resolution.
+ */
+int imgfs_res_pread(const struct imgfs_file* imgfs_file, int resolution,
+                    void* buf, size_t len, uint64_t offset);
+
+/**
+ * @brief Same as imgfs_pwrite(), in the file holding the given resolution.
+ *
+ * Moves file_end or tier_end forward if the write extends the file.
+ */
+int imgfs_res_pwrite(struct imgfs_file* imgfs_file, int resolution,
+                     const void* buf, size_t len, uint64_t offset);
+
+/**
+ * @brief Same as imgfs_res_pread(), into several buffers (at most
+ *        IMGFS_BACKEND_MAX_IOV), with a single read where the backend can.
+ */
+int imgfs_res_preadv(const struct imgfs_file* imgfs_file, int resolution,
+                     const struct iovec* iov, int iovcnt, uint64_t offset);
+
+/**
+ * @brief Same as imgfs_res_pwrite(), from several buffers (at most
+ *        IMGFS_BACKEND_MAX_IOV), with a single write where the backend can.
+ */
+int imgfs_res_pwritev(struct imgfs_file* imgfs_file, int resolution,
+                      const struct iovec* iov, int iovcnt, uint64_t offset);
+
+/**
+ * @brief Opens (or creates, if writable) the tier file of an imgFS.
+ *
+ * @param imgfs_file The main in-memory structure
+ * @param imgfs_filename Path to the imgFS file; the tier file is next to it
+ * @param flags Flags for open(), as for the imgFS file
+ * @param backend The storage backend, as for the imgFS file
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_open_tier(struct imgfs_file* imgfs_file, const char* imgfs_filename,
+                    int flags, enum imgfs_backend_kind backend);
+
+/**
+ * @brief Unpacks the encode profile of a resized tier from the header.
+ */
+void imgfs_get_profile(const struct imgfs_header* header, int resolution,
+                       struct encode_profile* profile);
+
+/**
+ * @brief Packs the encode profile of a resized tier into the header.
+ *
+ * @return ERR_RESOLUTIONS for the original, ERR_INVALID_ARGUMENT for an
+ *         out of range field, 0 otherwise.
+ */
+int imgfs_set_profile(struct imgfs_header* header, int resolution,
+                      const struct encode_profile* profile);
+
+/**
+ * @brief Parses an encode profile: comma separated "q=<1-100>", "strip"
+ *        or "keep", "progressive" or "baseline", "chroma=<auto|420|444>",
+ *        starting from the library defaults ("default" alone).
+ *
+ * @return ERR_INVALID_ARGUMENT if the string is not a valid profile, 0 otherwise.
+ */
+int encode_profile_parse(const char* str, struct encode_profile* profile);
+
+/**
+ * @brief Offset of the first byte after the metadata table and, with
+ *        IMGFS_FLAG_SPACE, the space counters.
+ *
+ * @param header The imgFS header.
+ * @return The offset where image content starts.
+ */
+uint64_t imgfs_data_start(const struct imgfs_header* header);
+
+/**
+ * @brief Accounts a blob just written, to which one image refers.
+ */
+void imgfs_space_new_blob(struct imgfs_file* imgfs_file, uint32_t size);
+
+/**
+ * @brief Accounts the variants of the resolutions in res_mask of an image,
+ *        once its slot refers to them. To be used for blobs which other
+ *        images already refer to, as after deduplication.
+ */
+void imgfs_space_ref(struct imgfs_file* imgfs_file, uint32_t index, unsigned res_mask);
+
+/**
+ * @brief Accounts the variants of the resolutions in res_mask of an image,
+ *        before its slot stops referring to them (delete, replacement).
+ */
+void imgfs_space_unref(struct imgfs_file* imgfs_file, uint32_t index, unsigned res_mask);
+
+/**
+ * @brief Reads the space counters, zeroed without IMGFS_FLAG_SPACE.
+ *
+ * @return ERR_IO on failure, 0 otherwise.
+ */
+int imgfs_space_read(struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Writes the space counters after the metadata table.
+ *        Does nothing without IMGFS_FLAG_SPACE.
+ *
+ * @return ERR_IO on failure, 0 otherwise.
+ */
+int imgfs_space_write(struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Computes live_bytes and shared_bytes from the metadata table.
+ *        dead_bytes is estimated as the used bytes that are not live.
+ *
+ * @param imgfs_file The imgFS
+ * @param space Where to put the counters
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_space_scan(const struct imgfs_file* imgfs_file, struct imgfs_space* space);
+
+/**
+ * @brief The space counters: the ones kept up to date with
+ *        IMGFS_FLAG_SPACE, those of imgfs_space_scan() otherwise.
+ *
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_space_get(const struct imgfs_file* imgfs_file, struct imgfs_space* space);
+
+/**
+ * @brief Bytes of the imgFS and tier files after the metadata: blobs,
+ *        needle framing and tier page padding.
+ */
+uint64_t imgfs_used_bytes(const struct imgfs_file* imgfs_file);
+
 /**
  * @brief Removes the deleted images by moving the existing ones
  *
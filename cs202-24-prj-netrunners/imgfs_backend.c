@@ -0,0 +1,479 @@
+/**
+ * @file imgfs_backend.c
+ * @brief Storage backends under the imgFS core: file, mmap and memory.
+ */
+
+#define _GNU_SOURCE // for fallocate
+
+#include "imgfs_backend.h"
+#include "error.h"
+
+#include <errno.h>    // for EINTR
+#include <fcntl.h>    // for open, fallocate
+#include <stdlib.h>   // for realloc, free
+#include <string.h>   // for memcpy, memset, strcmp
+#include <sys/mman.h> // for mmap
+#include <sys/stat.h> // for fstat
+#include <unistd.h>   // for pread, pwrite
+#include <sys/uio.h>  // for preadv, pwritev
+
+#define MMAP_MIN_CAPACITY   (1u << 20) // 1 MiB, the mapping may extend past the end of file
+#define MEMORY_MIN_CAPACITY (1u << 16)
+
+/*******************************************************************
+ * Positional I/O on a file descriptor, retrying short transfers.
+ */
+static int fd_pread(int fd, void* buf, size_t len, uint64_t offset)
+{
+    char* dst = buf;
+    while (len > 0) {
+        const ssize_t got = pread(fd, dst, len, (off_t) offset);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) return ERR_IO;
+        dst += got;
+        len -= (size_t) got;
+        offset += (uint64_t) got;
+    }
+    return ERR_NONE;
+}
+
+static int fd_pwrite(int fd, const void* buf, size_t len, uint64_t offset)
+{
+    const char* src = buf;
+    while (len > 0) {
+        const ssize_t put = pwrite(fd, src, len, (off_t) offset);
+        if (put < 0 && errno == EINTR) continue;
+        if (put <= 0) return ERR_IO;
+        src += put;
+        len -= (size_t) put;
+        offset += (uint64_t) put;
+    }
+    return ERR_NONE;
+}
+
+/*
+ * Same over several buffers. Works on a copy of iov, advanced past what
+ * each call transferred.
+ */
+static int fd_pv(int fd, const struct iovec* iov, int iovcnt, uint64_t offset, int write)
+{
+    if (iovcnt < 0 || iovcnt > IMGFS_BACKEND_MAX_IOV) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    struct iovec left[IMGFS_BACKEND_MAX_IOV];
+    memcpy(left, iov, (size_t) iovcnt * sizeof(*iov));
+
+    struct iovec* next = left;
+    while (iovcnt > 0) {
+        if (next->iov_len == 0) {
+            next++;
+            iovcnt--;
+            continue;
+        }
+        const ssize_t done = write ? pwritev(fd, next, iovcnt, (off_t) offset)
+                                   : preadv(fd, next, iovcnt, (off_t) offset);
+        if (done < 0 && errno == EINTR) continue;
+        if (done <= 0) return ERR_IO;
+        offset += (uint64_t) done;
+        for (size_t rest = (size_t) done; rest > 0; ) {
+            const size_t step = rest < next->iov_len ? rest : next->iov_len;
+            next->iov_base = (char*) next->iov_base + step;
+            next->iov_len -= step;
+            rest -= step;
+            if (next->iov_len == 0) {
+                next++;
+                iovcnt--;
+            }
+        }
+    }
+    return ERR_NONE;
+}
+
+static int fd_open(const char* path, int flags, uint64_t* size)
+{
+    const int fd = open(path, flags | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -1;
+    }
+    *size = (uint64_t) st.st_size;
+    return fd;
+}
+
+/*******************************************************************
+ * file backend
+ */
+static int file_open(struct imgfs_backend* backend, const char* path, int flags, uint64_t* size)
+{
+    backend->fd = fd_open(path, flags, size);
+    return backend->fd < 0 ? ERR_IO : ERR_NONE;
+}
+
+static int file_pread(const struct imgfs_backend* backend, void* buf, size_t len, uint64_t offset)
+{
+    return fd_pread(backend->fd, buf, len, offset);
+}
+
+static int file_pwrite(struct imgfs_backend* backend, const void* buf, size_t len, uint64_t offset)
+{
+    return fd_pwrite(backend->fd, buf, len, offset);
+}
+
+static int file_preadv(const struct imgfs_backend* backend, const struct iovec* iov, int iovcnt,
+                       uint64_t offset)
+{
+    return fd_pv(backend->fd, iov, iovcnt, offset, 0);
+}
+
+static int file_pwritev(struct imgfs_backend* backend, const struct iovec* iov, int iovcnt,
+                        uint64_t offset)
+{
+    return fd_pv(backend->fd, iov, iovcnt, offset, 1);
+}
+
+static int file_truncate(struct imgfs_backend* backend, uint64_t size)
+{
+    return ftruncate(backend->fd, (off_t) size) == 0 ? ERR_NONE : ERR_IO;
+}
+
+static int file_allocate(struct imgfs_backend* backend, uint64_t offset, uint64_t len)
+{
+#ifdef FALLOC_FL_KEEP_SIZE
+    if (fallocate(backend->fd, FALLOC_FL_KEEP_SIZE, (off_t) offset, (off_t) len) != 0 &&
+        errno != EOPNOTSUPP) {
+        return ERR_IO;
+    }
+#else
+    (void) backend;
+    (void) offset;
+    (void) len;
+#endif
+    return ERR_NONE;
+}
+
+static void file_close(struct imgfs_backend* backend)
+{
+    if (backend->fd >= 0) {
+        close(backend->fd);
+    }
+}
+
+/*******************************************************************
+ * mmap backend
+ */
+static int mmap_map(struct imgfs_backend* backend, uint64_t length)
+{
+    uint64_t capacity = backend->capacity > 0 ? backend->capacity : MMAP_MIN_CAPACITY;
+    while (capacity < length) {
+        capacity *= 2;
+    }
+
+    void* base = mmap(NULL, (size_t) capacity, PROT_READ, MAP_SHARED, backend->fd, 0);
+    if (base == MAP_FAILED) {
+        return ERR_IO;
+    }
+    (void) madvise(base, (size_t) capacity, MADV_RANDOM);
+
+    if (backend->base != NULL) {
+        munmap(backend->base, (size_t) backend->capacity);
+    }
+    backend->base = base;
+    backend->capacity = capacity;
+    return ERR_NONE;
+}
+
+static int mmap_open(struct imgfs_backend* backend, const char* path, int flags, uint64_t* size)
+{
+    backend->fd = fd_open(path, flags, size);
+    if (backend->fd < 0) {
+        return ERR_IO;
+    }
+    backend->length = *size;
+    return mmap_map(backend, backend->length);
+}
+
+static int mmap_pread(const struct imgfs_backend* backend, void* buf, size_t len, uint64_t offset)
+{
+    if (offset > backend->length || len > backend->length - offset) {
+        return ERR_IO;
+    }
+    memcpy(buf, backend->base + offset, len);
+    return ERR_NONE;
+}
+
+static int mmap_pwrite(struct imgfs_backend* backend, const void* buf, size_t len, uint64_t offset)
+{
+    // MAP_SHARED pages and pwrite() share the page cache: the mapping sees the write
+    if (fd_pwrite(backend->fd, buf, len, offset) != ERR_NONE) {
+        return ERR_IO;
+    }
+
+    const uint64_t end = offset + len;
+    if (end > backend->capacity && mmap_map(backend, end) != ERR_NONE) {
+        return ERR_IO;
+    }
+    if (end > backend->length) {
+        backend->length = end;
+    }
+    return ERR_NONE;
+}
+
+static int mmap_preadv(const struct imgfs_backend* backend, const struct iovec* iov, int iovcnt,
+                       uint64_t offset)
+{
+    for (int i = 0; i < iovcnt; i++) {
+        if (mmap_pread(backend, iov[i].iov_base, iov[i].iov_len, offset) != ERR_NONE) {
+            return ERR_IO;
+        }
+        offset += iov[i].iov_len;
+    }
+    return ERR_NONE;
+}
+
+static int mmap_pwritev(struct imgfs_backend* backend, const struct iovec* iov, int iovcnt,
+                        uint64_t offset)
+{
+    if (fd_pv(backend->fd, iov, iovcnt, offset, 1) != ERR_NONE) {
+        return ERR_IO;
+    }
+
+    uint64_t end = offset;
+    for (int i = 0; i < iovcnt; i++) {
+        end += iov[i].iov_len;
+    }
+    if (end > backend->capacity && mmap_map(backend, end) != ERR_NONE) {
+        return ERR_IO;
+    }
+    if (end > backend->length) {
+        backend->length = end;
+    }
+    return ERR_NONE;
+}
+
+static int mmap_truncate(struct imgfs_backend* backend, uint64_t size)
+{
+    if (file_truncate(backend, size) != ERR_NONE) {
+        return ERR_IO;
+    }
+    if (size > backend->capacity && mmap_map(backend, size) != ERR_NONE) {
+        return ERR_IO;
+    }
+    backend->length = size;
+    return ERR_NONE;
+}
+
+static void mmap_close(struct imgfs_backend* backend)
+{
+    if (backend->base != NULL) {
+        munmap(backend->base, (size_t) backend->capacity);
+    }
+    file_close(backend);
+}
+
+/*******************************************************************
+ * memory backend
+ */
+static int memory_reserve(struct imgfs_backend* backend, uint64_t length)
+{
+    if (length <= backend->capacity) {
+        return ERR_NONE;
+    }
+
+    uint64_t capacity = backend->capacity > 0 ? backend->capacity : MEMORY_MIN_CAPACITY;
+    while (capacity < length) {
+        capacity *= 2;
+    }
+    if (capacity > SIZE_MAX) {
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    unsigned char* base = realloc(backend->base, (size_t) capacity);
+    if (base == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    backend->base = base;
+    backend->capacity = capacity;
+    return ERR_NONE;
+}
+
+static int memory_open(struct imgfs_backend* backend, const char* path, int flags, uint64_t* size)
+{
+    *size = 0;
+
+    // the file, if any, is only a seed: start empty unless there is something to load
+    if ((flags & O_TRUNC) == 0) {
+        uint64_t file_size = 0;
+        const int fd = fd_open(path, flags & ~(O_CREAT | O_ACCMODE), &file_size);
+        if (fd < 0) {
+            return (flags & O_CREAT) ? ERR_NONE : ERR_IO;
+        }
+
+        int err = memory_reserve(backend, file_size);
+        if (err == ERR_NONE && file_size > 0) {
+            err = fd_pread(fd, backend->base, (size_t) file_size, 0);
+        }
+        close(fd);
+        if (err != ERR_NONE) {
+            return err;
+        }
+        backend->length = file_size;
+        *size = file_size;
+    }
+    return ERR_NONE;
+}
+
+static int memory_pread(const struct imgfs_backend* backend, void* buf, size_t len, uint64_t offset)
+{
+    return mmap_pread(backend, buf, len, offset);
+}
+
+static int memory_pwrite(struct imgfs_backend* backend, const void* buf, size_t len, uint64_t offset)
+{
+    const uint64_t end = offset + len;
+    int err = memory_reserve(backend, end);
+    if (err != ERR_NONE) {
+        return err;
+    }
+
+    if (offset > backend->length) {
+        memset(backend->base + backend->length, 0, (size_t) (offset - backend->length));
+    }
+    memcpy(backend->base + offset, buf, len);
+    if (end > backend->length) {
+        backend->length = end;
+    }
+    return ERR_NONE;
+}
+
+static int memory_preadv(const struct imgfs_backend* backend, const struct iovec* iov, int iovcnt,
+                         uint64_t offset)
+{
+    return mmap_preadv(backend, iov, iovcnt, offset);
+}
+
+static int memory_pwritev(struct imgfs_backend* backend, const struct iovec* iov, int iovcnt,
+                          uint64_t offset)
+{
+    for (int i = 0; i < iovcnt; i++) {
+        const int err = memory_pwrite(backend, iov[i].iov_base, iov[i].iov_len, offset);
+        if (err != ERR_NONE) {
+            return err;
+        }
+        offset += iov[i].iov_len;
+    }
+    return ERR_NONE;
+}
+
+static int memory_truncate(struct imgfs_backend* backend, uint64_t size)
+{
+    int err = memory_reserve(backend, size);
+    if (err != ERR_NONE) {
+        return err;
+    }
+    if (size > backend->length) {
+        memset(backend->base + backend->length, 0, (size_t) (size - backend->length));
+    }
+    backend->length = size;
+    return ERR_NONE;
+}
+
+static int memory_allocate(struct imgfs_backend* backend, uint64_t offset, uint64_t len)
+{
+    return memory_reserve(backend, offset + len);
+}
+
+static void memory_close(struct imgfs_backend* backend)
+{
+    free(backend->base);
+}
+
+/*******************************************************************
+ * Dispatch
+ */
+static const struct imgfs_backend_ops backends[NB_IMGFS_BACKENDS] = {
+    [IMGFS_BACKEND_FILE]   = { "file",   file_open,   file_pread,   file_pwrite,   file_preadv,
+                               file_pwritev,   file_truncate,   file_allocate,   file_close },
+    [IMGFS_BACKEND_MMAP]   = { "mmap",   mmap_open,   mmap_pread,   mmap_pwrite,   mmap_preadv,
+                               mmap_pwritev,   mmap_truncate,   file_allocate,   mmap_close },
+    [IMGFS_BACKEND_MEMORY] = { "memory", memory_open, memory_pread, memory_pwrite, memory_preadv,
+                               memory_pwritev, memory_truncate, memory_allocate, memory_close }
+};
+
+/********************************************************************
+ * See imgfs_backend.h
+ */
+int imgfs_backend_open(struct imgfs_backend* backend, enum imgfs_backend_kind kind,
+                       const char* path, int flags, uint64_t* size)
+{
+    M_REQUIRE_NON_NULL(backend);
+    M_REQUIRE_NON_NULL(path);
+    M_REQUIRE_NON_NULL(size);
+    if (kind < 0 || kind >= NB_IMGFS_BACKENDS) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    memset(backend, 0, sizeof(*backend));
+    backend->fd = -1;
+
+    int err = backends[kind].open(backend, path, flags, size);
+    backend->ops = &backends[kind];
+    if (err != ERR_NONE) {
+        imgfs_backend_close(backend);
+    }
+    return err;
+}
+
+/********************************************************************
+ * See imgfs_backend.h
+ */
+int imgfs_backend_truncate(struct imgfs_backend* backend, uint64_t size)
+{
+    M_REQUIRE_NON_NULL(backend);
+    M_REQUIRE_NON_NULL(backend->ops);
+
+    return backend->ops->truncate(backend, size);
+}
+
+/********************************************************************
+ * See imgfs_backend.h
+ */
+int imgfs_backend_allocate(struct imgfs_backend* backend, uint64_t offset, uint64_t len)
+{
+    M_REQUIRE_NON_NULL(backend);
+    M_REQUIRE_NON_NULL(backend->ops);
+
+    if (len == 0) return ERR_NONE;
+    return backend->ops->allocate(backend, offset, len);
+}
+
+/********************************************************************
+ * See imgfs_backend.h
+ */
+void imgfs_backend_close(struct imgfs_backend* backend)
+{
+    if (backend == NULL || backend->ops == NULL) return;
+
+    backend->ops->close(backend);
+    memset(backend, 0, sizeof(*backend));
+    backend->fd = -1;
+}
+
+/********************************************************************
+ * See imgfs_backend.h
+ */
+int imgfs_backend_atoi(const char* name)
+{
+    if (name == NULL) return -1;
+
+    for (int kind = 0; kind < NB_IMGFS_BACKENDS; ++kind) {
+        if (!strcmp(name, backends[kind].name)) {
+            return kind;
+        }
+    }
+    return -1;
+}
@@ -0,0 +1,109 @@
+/**
+ * @file imgfs_backend.h
+ * @brief Storage backends under the imgFS core.
+ *
+ * The core never touches the storage directly: it goes through
+ * imgfs_pread()/imgfs_pwrite(), which dispatch to one of these backends.
+ *
+ *  - file:   positional I/O on a file descriptor (the default);
+ *  - mmap:   reads are copies out of a shared read-only mapping of the
+ *            file, writes still go through the file descriptor. Meant for
+ *            read-heavy replicas;
+ *  - memory: the whole imgFS lives in a growable heap buffer, optionally
+ *            loaded from a file at open time. Nothing is ever written back,
+ *            which makes it suitable for benchmarks and RAM-only tiers.
+ *
+ * A backend does not synchronize concurrent writers; readers may run
+ * concurrently with each other, but not with a writer.
+ */
+
+#pragma once
+
+#include <stddef.h>  // for size_t
+#include <stdint.h>  // for uint64_t
+#include <sys/uio.h> // for struct iovec
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum imgfs_backend_kind {
+    IMGFS_BACKEND_FILE,
+    IMGFS_BACKEND_MMAP,
+    IMGFS_BACKEND_MEMORY,
+    NB_IMGFS_BACKENDS
+};
+
+struct imgfs_backend;
+
+struct imgfs_backend_ops {
+    const char* name;
+    int  (*open)(struct imgfs_backend* backend, const char* path, int flags, uint64_t* size);
+    int  (*pread)(const struct imgfs_backend* backend, void* buf, size_t len, uint64_t offset);
+    int  (*pwrite)(struct imgfs_backend* backend, const void* buf, size_t len, uint64_t offset);
+    // the same over several buffers, contiguous in the storage, in one system call where possible
+    int  (*preadv)(const struct imgfs_backend* backend, const struct iovec* iov, int iovcnt, uint64_t offset);
+    int  (*pwritev)(struct imgfs_backend* backend, const struct iovec* iov, int iovcnt, uint64_t offset);
+    int  (*truncate)(struct imgfs_backend* backend, uint64_t size);
+    int  (*allocate)(struct imgfs_backend* backend, uint64_t offset, uint64_t len);
+    void (*close)(struct imgfs_backend* backend);
+};
+
+struct imgfs_backend {
+    const struct imgfs_backend_ops* ops; // NULL when closed
+    int fd;              // file and mmap backends, -1 otherwise
+    unsigned char* base; // mmap and memory backends
+    uint64_t length;     // bytes of valid content at base
+    uint64_t capacity;   // bytes mapped/allocated at base
+};
+
+/**
+ * @brief Opens a backend on the given path.
+ *
+ * @param backend The backend to initialize
+ * @param kind Which implementation to use
+ * @param path Path to the imgFS file
+ * @param flags open() flags (O_RDONLY, O_RDWR, O_CREAT, O_TRUNC, ...)
+ * @param size Where to put the current size of the storage
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_backend_open(struct imgfs_backend* backend, enum imgfs_backend_kind kind,
+                       const char* path, int flags, uint64_t* size);
+
+#define IMGFS_BACKEND_MAX_IOV 4 // buffers per preadv()/pwritev()
+
+/**
+ * @brief Sets the size of the storage; new bytes read as zeros.
+ *
+ * On files this is ftruncate(): growing creates a hole, so no disk
+ * blocks are used until something is written there.
+ *
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_backend_truncate(struct imgfs_backend* backend, uint64_t size);
+
+/**
+ * @brief Reserves room for len bytes at offset, without changing the size.
+ *
+ * On files this is fallocate(FALLOC_FL_KEEP_SIZE), so later appends land
+ * in contiguous preallocated blocks. Does nothing where not supported.
+ *
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_backend_allocate(struct imgfs_backend* backend, uint64_t offset, uint64_t len);
+
+/**
+ * @brief Closes a backend. Does nothing if it is not open.
+ */
+void imgfs_backend_close(struct imgfs_backend* backend);
+
+/**
+ * @brief Transforms a backend name ("file", "mmap", "memory") to its kind.
+ *
+ * @return The corresponding kind or -1 if error.
+ */
+int imgfs_backend_atoi(const char* name);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,970 @@
+/**
+ * @file imgfs_bench.c
+ * @brief HTTP load generator for imgfs_server.
+ *
+ * Every connection is a keep-alive HTTP/1.1 connection driven by its own
+ * thread. Requests follow a read/insert/delete/list mix; reads pick image
+ * IDs with a Zipfian popularity and resolutions with given weights.
+ * Inserted images are new IDs, and deletions remove them oldest first, so
+ * the set of images read stays the same during a run.
+ *
+ * With -rate, the load is open-loop: every connection sends on a fixed
+ * schedule and latencies are measured from the scheduled send time, so a
+ * stalled server is charged for the requests it delayed. Without it, each
+ * connection sends as soon as the previous reply is in, and the latencies
+ * are corrected afterwards for the requests a stall kept from being sent
+ * (see histogram_merge_corrected()). Service times, from send to reply,
+ * are reported too.
+ *
+ * With -replay, the requests of a trace recorded by imgfs_server -trace
+ * are sent again, open-loop, keeping their original inter-arrival times
+ * (or dividing them by -speed). A reply is expected to have the status
+ * it had when the trace was recorded.
+ */
+
+#include "access_trace.h"
+#include "error.h"
+#include "histogram.h"
+#include "http_prot.h" // for HTTP_LINE_DELIM
+#include "util.h"      // for now_ns
+
+#include <json-c/json.h>
+#include <math.h>        // for pow
+#include <netdb.h>       // for getaddrinfo
+#include <netinet/in.h>  // for IPPROTO_TCP
+#include <netinet/tcp.h> // for TCP_NODELAY
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>     // for strncasecmp
+#include <sys/socket.h>
+#include <sys/uio.h>     // for writev
+#include <time.h>        // for clock_nanosleep, time
+#include <unistd.h>      // for close, read
+
+enum bench_op { OP_READ, OP_INSERT, OP_DELETE, OP_LIST, OP_OTHER, NB_OPS };
+#define NB_MIX_OPS OP_OTHER // only met in replayed traces
+static const char* const op_names[NB_OPS] = { "read", "insert", "delete", "list", "other" };
+static const unsigned op_expected[NB_OPS] = { 200, 302, 302, 200, 200 };
+
+#define NB_BENCH_RES 3
+static const char* const res_names[NB_BENCH_RES] = { "thumb", "small", "orig" };
+
+#define MAX_IMAGES     16
+#define RESPONSE_CHUNK 65536
+#define REQUEST_MAX    512 // request line and headers
+
+struct bench_config {
+    const char* host;
+    const char* port;
+    unsigned connections;
+    double duration;           // seconds
+    double rate;               // requests per second over all connections, 0 for closed-loop
+    unsigned mix[NB_OPS];      // weights
+    unsigned res[NB_BENCH_RES]; // weights of the resolutions read
+    uint32_t ids;              // images read: <prefix>0 to <prefix><ids - 1>
+    double zipf;               // exponent of the popularity, 0 for uniform
+    const char* prefix;
+    struct { char* data; size_t size; } images[MAX_IMAGES]; // inserted, in turn
+    size_t nb_images;
+    int populate;              // insert the images read before the run
+    const char* json;          // where to save the results
+    const char* label;
+    const char* replay;        // trace to replay instead of the mix
+    double speed;              // of the replay, 1 for the recorded timing
+};
+
+/**
+ * @brief The requests of the trace replayed, by start time.
+ */
+struct replay_request {
+    uint64_t time_us;
+    uint8_t flags;
+    unsigned status;
+    char* target;
+};
+
+static struct {
+    struct replay_request* requests;
+    size_t count;
+    atomic_size_t next; // next request to send
+} replay;
+
+/**
+ * @brief Images inserted during the run, deleted oldest first.
+ */
+static struct {
+    pthread_mutex_t lock;
+    uint32_t* ids;
+    size_t head, count, capacity;
+    uint32_t next_id;
+} inserted = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, 0, 0 };
+
+static double* zipf_cdf; // cumulative popularity of the IDs, by rank
+
+struct worker {
+    pthread_t thread;
+    const struct bench_config* config;
+    unsigned index;
+    uint64_t rng;
+    int populate; // this pass only inserts the images read
+    uint64_t start, end; // run window (ns)
+    // results
+    struct histogram latency[NB_OPS]; // from the intended send time (open-loop)
+    struct histogram service[NB_OPS]; // from the actual send time
+    uint64_t errors[NB_OPS];
+    uint64_t bytes_in;
+    int err;
+};
+
+/*******************************************************************
+ * Time and randomness
+ */
+static void sleep_until(uint64_t t)
+{
+    struct timespec ts = { (time_t) (t / 1000000000u), (long) (t % 1000000000u) };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0);
+}
+
+static uint64_t rng_next(uint64_t* state) // xorshift64*
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+static double rng_uniform(uint64_t* state)
+{
+    return (double) (rng_next(state) >> 11) * 0x1.0p-53;
+}
+
+static size_t pick_weighted(const unsigned* weights, size_t n, uint64_t* rng)
+{
+    unsigned total = 0;
+    for (size_t i = 0; i < n; i++) total += weights[i];
+    unsigned r = (unsigned) (rng_next(rng) % total);
+    for (size_t i = 0; i < n; i++) {
+        if (r < weights[i]) return i;
+        r -= weights[i];
+    }
+    return n - 1;
+}
+
+static int zipf_init(uint32_t ids, double exponent)
+{
+    zipf_cdf = calloc(ids, sizeof(*zipf_cdf));
+    if (zipf_cdf == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    double sum = 0;
+    for (uint32_t k = 0; k < ids; k++) {
+        sum += 1.0 / pow((double) k + 1, exponent);
+        zipf_cdf[k] = sum;
+    }
+    for (uint32_t k = 0; k < ids; k++) {
+        zipf_cdf[k] /= sum;
+    }
+    return ERR_NONE;
+}
+
+static uint32_t zipf_pick(uint32_t ids, uint64_t* rng)
+{
+    const double u = rng_uniform(rng);
+    uint32_t lo = 0, hi = ids - 1;
+    while (lo < hi) {
+        const uint32_t mid = lo + (hi - lo) / 2;
+        if (zipf_cdf[mid] < u) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/*******************************************************************
+ * Images inserted during the run
+ */
+static uint32_t inserted_new(void)
+{
+    pthread_mutex_lock(&inserted.lock);
+    const uint32_t id = inserted.next_id++;
+    pthread_mutex_unlock(&inserted.lock);
+    return id;
+}
+
+static void inserted_push(uint32_t id)
+{
+    pthread_mutex_lock(&inserted.lock);
+    if (inserted.count == inserted.capacity) {
+        const size_t capacity = inserted.capacity > 0 ? 2 * inserted.capacity : 1024;
+        uint32_t* ids = malloc(capacity * sizeof(*ids));
+        if (ids == NULL) { // the image just won't be deleted
+            pthread_mutex_unlock(&inserted.lock);
+            return;
+        }
+        for (size_t i = 0; i < inserted.count; i++) {
+            ids[i] = inserted.ids[(inserted.head + i) % inserted.capacity];
+        }
+        free(inserted.ids);
+        inserted.ids = ids;
+        inserted.head = 0;
+        inserted.capacity = capacity;
+    }
+    inserted.ids[(inserted.head + inserted.count) % inserted.capacity] = id;
+    inserted.count++;
+    pthread_mutex_unlock(&inserted.lock);
+}
+
+static int inserted_pop(uint32_t* id)
+{
+    pthread_mutex_lock(&inserted.lock);
+    const int found = inserted.count > 0;
+    if (found) {
+        *id = inserted.ids[inserted.head];
+        inserted.head = (inserted.head + 1) % inserted.capacity;
+        inserted.count--;
+    }
+    pthread_mutex_unlock(&inserted.lock);
+    return found;
+}
+
+/*******************************************************************
+ * HTTP client connection
+ */
+struct connection {
+    int fd;
+    char* buf;
+};
+
+static int connection_open(struct connection* c, const struct bench_config* config)
+{
+    struct addrinfo hints, *addresses = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(config->host, config->port, &hints, &addresses) != 0) {
+        return ERR_IO;
+    }
+    c->fd = -1;
+    for (struct addrinfo* a = addresses; a != NULL && c->fd < 0; a = a->ai_next) {
+        c->fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (c->fd >= 0 && connect(c->fd, a->ai_addr, a->ai_addrlen) < 0) {
+            close(c->fd);
+            c->fd = -1;
+        }
+    }
+    freeaddrinfo(addresses);
+    if (c->fd < 0) {
+        return ERR_IO;
+    }
+    const int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return ERR_NONE;
+}
+
+static void connection_close(struct connection* c)
+{
+    if (c->fd >= 0) {
+        close(c->fd);
+        c->fd = -1;
+    }
+}
+
+static int send_all(int fd, struct iovec* iov, int iovcnt)
+{
+    while (iovcnt > 0) {
+        ssize_t sent = writev(fd, iov, iovcnt);
+        if (sent <= 0) {
+            return ERR_IO;
+        }
+        while (iovcnt > 0 && (size_t) sent >= iov->iov_len) {
+            sent -= (ssize_t) iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char*) iov->iov_base + sent;
+            iov->iov_len -= (size_t) sent;
+        }
+    }
+    return ERR_NONE;
+}
+
+/**
+ * @brief Sends one request and reads its whole response.
+ *
+ * @param status Where to put the status code of the response
+ * @param received Where to add the number of bytes received
+ * @return ERR_IO if the connection failed (it is then closed), 0 otherwise.
+ */
+static int connection_request(struct connection* c, const struct bench_config* config,
+                              const char* method, const char* target,
+                              const char* body, size_t body_len,
+                              unsigned* status, uint64_t* received)
+{
+    if (c->fd < 0 && connection_open(c, config) != ERR_NONE) {
+        return ERR_IO;
+    }
+
+    // like curl, no Content-Length without a body
+    char head[REQUEST_MAX];
+    const int head_len = body_len > 0 ?
+                         snprintf(head, sizeof(head),
+                                  "%s %s HTTP/1.1" HTTP_LINE_DELIM "Host: %s" HTTP_LINE_DELIM
+                                  "Content-Length: %zu" HTTP_LINE_DELIM HTTP_LINE_DELIM,
+                                  method, target, config->host, body_len) :
+                         snprintf(head, sizeof(head),
+                                  "%s %s HTTP/1.1" HTTP_LINE_DELIM "Host: %s" HTTP_LINE_DELIM HTTP_LINE_DELIM,
+                                  method, target, config->host);
+    if (head_len < 0 || (size_t) head_len >= sizeof(head)) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    struct iovec iov[2] = {
+        { .iov_base = head, .iov_len = (size_t) head_len },
+        { .iov_base = (void*) (uintptr_t) body, .iov_len = body_len }
+    };
+    if (send_all(c->fd, iov, body_len > 0 ? 2 : 1) != ERR_NONE) {
+        connection_close(c);
+        return ERR_IO;
+    }
+
+    // headers, then as much of the body as needed, in RESPONSE_CHUNK pieces
+    size_t len = 0;
+    char* end = NULL;
+    while (end == NULL) {
+        const ssize_t n = read(c->fd, c->buf + len, RESPONSE_CHUNK - 1 - len);
+        if (n <= 0) {
+            connection_close(c);
+            return ERR_IO;
+        }
+        len += (size_t) n;
+        c->buf[len] = '\0';
+        end = strstr(c->buf, HTTP_LINE_DELIM HTTP_LINE_DELIM);
+        if (end == NULL && len == RESPONSE_CHUNK - 1) {
+            connection_close(c);
+            return ERR_IO;
+        }
+    }
+    *received += len;
+
+    unsigned code = 0;
+    size_t content_length = 0;
+    if (sscanf(c->buf, "HTTP/1.%*c %u", &code) != 1) {
+        connection_close(c);
+        return ERR_IO;
+    }
+    for (const char* line = strstr(c->buf, HTTP_LINE_DELIM); line != NULL && line < end;
+         line = strstr(line + 2, HTTP_LINE_DELIM)) {
+        if (!strncasecmp(line + 2, "Content-Length:", 15)) {
+            content_length = strtoul(line + 2 + 15, NULL, 10);
+        }
+    }
+
+    size_t body_read = len - (size_t) (end + 4 - c->buf);
+    while (body_read < content_length) {
+        const size_t want = content_length - body_read;
+        const ssize_t n = read(c->fd, c->buf, want < RESPONSE_CHUNK ? want : RESPONSE_CHUNK);
+        if (n <= 0) {
+            connection_close(c);
+            return ERR_IO;
+        }
+        body_read += (size_t) n;
+        *received += (uint64_t) n;
+    }
+    *status = code;
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Workers
+ */
+static int insert_image(struct worker* w, struct connection* c, uint32_t id, uint64_t n,
+                        unsigned* status)
+{
+    const struct bench_config* config = w->config;
+    char target[REQUEST_MAX];
+    snprintf(target, sizeof(target), "/imgfs/insert?name=%s%u", config->prefix, id);
+    const size_t image = n % config->nb_images;
+    return connection_request(c, config, "POST", target, config->images[image].data,
+                              config->images[image].size, status, &w->bytes_in);
+}
+
+static void* worker_populate(struct worker* w, struct connection* c)
+{
+    const struct bench_config* config = w->config;
+    for (uint32_t id = w->index; id < config->ids; id += config->connections) {
+        unsigned status = 0;
+        if (insert_image(w, c, id, id, &status) != ERR_NONE || status != op_expected[OP_INSERT]) {
+            w->errors[OP_INSERT]++;
+        }
+    }
+    return NULL;
+}
+
+static enum bench_op target_op(const char* target)
+{
+    static const char* const paths[NB_MIX_OPS] = {
+        "/imgfs/read", "/imgfs/insert", "/imgfs/delete", "/imgfs/list"
+    };
+    for (int op = 0; op < NB_MIX_OPS; op++) {
+        const size_t len = strlen(paths[op]);
+        if (!strncmp(target, paths[op], len) && (target[len] == '\0' || target[len] == '?')) {
+            return (enum bench_op) op;
+        }
+    }
+    return OP_OTHER;
+}
+
+static void worker_replay(struct worker* w, struct connection* c)
+{
+    const struct bench_config* config = w->config;
+    const uint64_t origin = replay.requests[0].time_us;
+    for (size_t i = atomic_fetch_add(&replay.next, 1); i < replay.count;
+         i = atomic_fetch_add(&replay.next, 1)) {
+        const struct replay_request* r = &replay.requests[i];
+        const uint64_t intended = w->start + (uint64_t) ((double) (r->time_us - origin) * 1e3 / config->speed);
+        if (now_ns() < intended) sleep_until(intended);
+
+        const enum bench_op op = target_op(r->target);
+        const int post = r->flags & TRACE_POST;
+        const size_t image = i % (config->nb_images > 0 ? config->nb_images : 1);
+        unsigned status = 0;
+        const uint64_t sent = now_ns();
+        const int err = connection_request(c, config, post ? "POST" : "GET", r->target,
+                                           post ? config->images[image].data : NULL,
+                                           post ? config->images[image].size : 0,
+                                           &status, &w->bytes_in);
+        const uint64_t done = now_ns();
+
+        histogram_record(&w->latency[op], done - intended);
+        histogram_record(&w->service[op], done - sent);
+        if (err != ERR_NONE || status != r->status) {
+            w->errors[op]++;
+        }
+    }
+}
+
+static void* worker_main(void* arg)
+{
+    struct worker* w = arg;
+    const struct bench_config* config = w->config;
+    struct connection c = { -1, malloc(RESPONSE_CHUNK) };
+    if (c.buf == NULL) {
+        w->err = ERR_OUT_OF_MEMORY;
+        return NULL;
+    }
+    if (w->populate || config->replay != NULL) {
+        if (w->populate) worker_populate(w, &c);
+        else worker_replay(w, &c);
+        connection_close(&c);
+        free(c.buf);
+        return NULL;
+    }
+
+    // each connection sends on its own schedule, spread over the interval
+    const uint64_t interval = config->rate > 0 ? (uint64_t) (1e9 * config->connections / config->rate) : 0;
+    uint64_t next = w->start + (interval * w->index) / config->connections;
+    uint64_t n = 0;
+
+    for (uint64_t now = now_ns(); now < w->end; now = now_ns(), n++) {
+        uint64_t intended = now;
+        if (interval > 0) {
+            if (next >= w->end) break;
+            if (now < next) sleep_until(next);
+            intended = next;
+            next += interval;
+        }
+
+        size_t op = pick_weighted(config->mix, NB_MIX_OPS, &w->rng);
+        uint32_t id = 0;
+        if (op == OP_DELETE && !inserted_pop(&id)) {
+            op = OP_READ; // nothing to delete without touching the images read
+        }
+
+        char target[REQUEST_MAX];
+        unsigned status = 0;
+        const uint64_t sent = now_ns();
+        int err = ERR_NONE;
+        switch (op) {
+        case OP_READ:
+            snprintf(target, sizeof(target), "/imgfs/read?res=%s&img_id=%s%u",
+                     res_names[pick_weighted(config->res, NB_BENCH_RES, &w->rng)],
+                     config->prefix, zipf_pick(config->ids, &w->rng));
+            err = connection_request(&c, config, "GET", target, NULL, 0, &status, &w->bytes_in);
+            break;
+        case OP_INSERT:
+            id = inserted_new();
+            err = insert_image(w, &c, id, n, &status);
+            if (err == ERR_NONE && status == op_expected[OP_INSERT]) {
+                inserted_push(id);
+            }
+            break;
+        case OP_DELETE:
+            snprintf(target, sizeof(target), "/imgfs/delete?img_id=%s%u", config->prefix, id);
+            err = connection_request(&c, config, "GET", target, NULL, 0, &status, &w->bytes_in);
+            break;
+        default:
+            err = connection_request(&c, config, "GET", "/imgfs/list", NULL, 0, &status, &w->bytes_in);
+            break;
+        }
+        const uint64_t done = now_ns();
+
+        histogram_record(&w->latency[op], done - intended);
+        histogram_record(&w->service[op], done - sent);
+        if (err != ERR_NONE || status != op_expected[op]) {
+            w->errors[op]++;
+        }
+    }
+
+    connection_close(&c);
+    free(c.buf);
+    return NULL;
+}
+
+static int run_workers(struct worker* workers, const struct bench_config* config, int populate)
+{
+    const uint64_t start = now_ns();
+    for (unsigned i = 0; i < config->connections; i++) {
+        struct worker* w = &workers[i];
+        w->config = config;
+        w->index = i;
+        w->rng = 0x9E3779B97F4A7C15ULL * (i + 1) ^ start;
+        w->populate = populate;
+        w->start = start;
+        w->end = start + (uint64_t) (config->duration * 1e9);
+        if (pthread_create(&w->thread, NULL, worker_main, w) != 0) {
+            for (unsigned j = 0; j < i; j++) pthread_join(workers[j].thread, NULL);
+            return ERR_THREADING;
+        }
+    }
+    for (unsigned i = 0; i < config->connections; i++) {
+        pthread_join(workers[i].thread, NULL);
+        if (workers[i].err != ERR_NONE) return workers[i].err;
+    }
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Results
+ */
+struct bench_results {
+    double elapsed; // seconds
+    uint64_t requests;
+    uint64_t errors;
+    uint64_t bytes_in;
+    uint64_t ops[NB_OPS];
+    uint64_t op_errors[NB_OPS];
+    struct histogram latency[NB_OPS + 1]; // last: all requests
+    struct histogram service[NB_OPS + 1];
+};
+
+static int open_loop(const struct bench_config* config)
+{
+    return config->rate > 0 || config->replay != NULL;
+}
+
+static void results_gather(const struct bench_config* config, const struct worker* workers,
+                           double elapsed, struct bench_results* r)
+{
+    r->elapsed = elapsed;
+    struct histogram* all_service = &r->service[NB_OPS];
+    for (unsigned i = 0; i < config->connections; i++) {
+        for (int op = 0; op < NB_OPS; op++) {
+            histogram_merge(&r->service[op], &workers[i].service[op]);
+            histogram_merge(all_service, &workers[i].service[op]);
+            if (open_loop(config)) {
+                histogram_merge(&r->latency[op], &workers[i].latency[op]);
+                histogram_merge(&r->latency[NB_OPS], &workers[i].latency[op]);
+            }
+            r->op_errors[op] += workers[i].errors[op];
+        }
+        r->bytes_in += workers[i].bytes_in;
+    }
+
+    // closed loop: a connection would have sent one request per mean service time
+    const uint64_t count = atomic_load(&all_service->count);
+    const uint64_t interval = count > 0 ? atomic_load(&all_service->sum) / count : 0;
+    for (int op = 0; op <= NB_OPS; op++) {
+        if (!open_loop(config)) {
+            histogram_merge_corrected(&r->latency[op], &r->service[op], interval);
+        }
+        if (op < NB_OPS) {
+            r->ops[op] = atomic_load(&r->service[op].count);
+            r->requests += r->ops[op];
+            r->errors += r->op_errors[op];
+        }
+    }
+}
+
+static const double report_quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+static const char* const report_names[] = { "p50", "p90", "p99", "p999" };
+#define NB_REPORT_QUANTILES (sizeof(report_quantiles) / sizeof(report_quantiles[0]))
+
+static void print_row(const char* name, uint64_t count, uint64_t errors, const struct histogram* h)
+{
+    printf("%-8s %10llu %8llu", name, (unsigned long long) count, (unsigned long long) errors);
+    for (size_t q = 0; q < NB_REPORT_QUANTILES; q++) {
+        const uint64_t ns = histogram_quantile(h, report_quantiles[q]);
+        printf(" %9.3f", (double) ns / 1e6);
+    }
+    const uint64_t max = atomic_load(&h->max);
+    printf(" %9.3f\n", (double) max / 1e6);
+}
+
+static void results_print(const struct bench_config* config, const struct bench_results* r)
+{
+    printf("%u connection(s), %.1f s, %llu request(s), %.1f req/s, %llu error(s), %.1f MB received\n",
+           config->connections, r->elapsed, (unsigned long long) r->requests,
+           (double) r->requests / r->elapsed, (unsigned long long) r->errors, (double) r->bytes_in / 1e6);
+    printf("latency (ms, %s)\n", open_loop(config) ? "from the scheduled send time"
+           : "corrected for coordinated omission");
+    printf("%-8s %10s %8s %9s %9s %9s %9s %9s\n", "", "requests", "errors", "p50", "p90", "p99", "p99.9", "max");
+    for (int op = 0; op < NB_OPS; op++) {
+        if (r->ops[op] > 0) print_row(op_names[op], r->ops[op], r->op_errors[op], &r->latency[op]);
+    }
+    print_row("all", r->requests, r->errors, &r->latency[NB_OPS]);
+    printf("service time (ms)\n");
+    print_row("all", r->requests, r->errors, &r->service[NB_OPS]);
+}
+
+static struct json_object* json_histogram(const struct histogram* h)
+{
+    struct json_object* o = json_object_new_object();
+    if (o == NULL) return NULL;
+    const uint64_t count = atomic_load(&h->count);
+    const uint64_t sum = atomic_load(&h->sum);
+    const uint64_t max = atomic_load(&h->max);
+    json_object_object_add(o, "mean", json_object_new_double(count > 0 ? (double) sum / (double) count / 1e3 : 0.0));
+    for (size_t q = 0; q < NB_REPORT_QUANTILES; q++) {
+        const uint64_t ns = histogram_quantile(h, report_quantiles[q]);
+        json_object_object_add(o, report_names[q], json_object_new_double((double) ns / 1e3));
+    }
+    json_object_object_add(o, "max", json_object_new_double((double) max / 1e3));
+    return o;
+}
+
+static int results_save(const struct bench_config* config, const struct bench_results* r)
+{
+    struct json_object* root = json_object_new_object();
+    struct json_object* conf = json_object_new_object();
+    struct json_object* ops = json_object_new_object();
+    if (root == NULL || conf == NULL || ops == NULL) {
+        json_object_put(root);
+        json_object_put(conf);
+        json_object_put(ops);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    if (config->label != NULL) {
+        json_object_object_add(root, "label", json_object_new_string(config->label));
+    }
+    json_object_object_add(root, "timestamp", json_object_new_int64((int64_t) time(NULL)));
+
+    json_object_object_add(conf, "host", json_object_new_string(config->host));
+    json_object_object_add(conf, "port", json_object_new_string(config->port));
+    json_object_object_add(conf, "connections", json_object_new_int64(config->connections));
+    json_object_object_add(conf, "duration", json_object_new_double(config->duration));
+    json_object_object_add(conf, "rate", json_object_new_double(config->rate));
+    json_object_object_add(conf, "ids", json_object_new_int64(config->ids));
+    json_object_object_add(conf, "zipf", json_object_new_double(config->zipf));
+    if (config->replay != NULL) {
+        json_object_object_add(conf, "replay", json_object_new_string(config->replay));
+        json_object_object_add(conf, "speed", json_object_new_double(config->speed));
+    }
+    for (int op = 0; op < NB_MIX_OPS; op++) {
+        char key[32];
+        snprintf(key, sizeof(key), "mix_%s", op_names[op]);
+        json_object_object_add(conf, key, json_object_new_int64(config->mix[op]));
+    }
+    for (int res = 0; res < NB_BENCH_RES; res++) {
+        char key[32];
+        snprintf(key, sizeof(key), "res_%s", res_names[res]);
+        json_object_object_add(conf, key, json_object_new_int64(config->res[res]));
+    }
+    json_object_object_add(root, "config", conf);
+
+    json_object_object_add(root, "elapsed", json_object_new_double(r->elapsed));
+    json_object_object_add(root, "requests", json_object_new_int64((int64_t) r->requests));
+    json_object_object_add(root, "errors", json_object_new_int64((int64_t) r->errors));
+    json_object_object_add(root, "throughput", json_object_new_double((double) r->requests / r->elapsed));
+    json_object_object_add(root, "bytes_in", json_object_new_int64((int64_t) r->bytes_in));
+    json_object_object_add(root, "latency_us", json_histogram(&r->latency[NB_OPS]));
+    json_object_object_add(root, "service_us", json_histogram(&r->service[NB_OPS]));
+    for (int op = 0; op < NB_OPS; op++) {
+        struct json_object* o = json_object_new_object();
+        if (o == NULL) continue;
+        json_object_object_add(o, "requests", json_object_new_int64((int64_t) r->ops[op]));
+        json_object_object_add(o, "errors", json_object_new_int64((int64_t) r->op_errors[op]));
+        json_object_object_add(o, "latency_us", json_histogram(&r->latency[op]));
+        json_object_object_add(o, "service_us", json_histogram(&r->service[op]));
+        json_object_object_add(ops, op_names[op], o);
+    }
+    json_object_object_add(root, "ops", ops);
+
+    const int err = json_object_to_file_ext(config->json, root, JSON_C_TO_STRING_PRETTY) < 0 ? ERR_IO : ERR_NONE;
+    json_object_put(root);
+    return err;
+}
+
+/*******************************************************************
+ * Replay
+ */
+static int replay_compare(const void* a, const void* b)
+{
+    const struct replay_request* ra = a;
+    const struct replay_request* rb = b;
+    return ra->time_us < rb->time_us ? -1 : ra->time_us > rb->time_us;
+}
+
+static int replay_load(const struct bench_config* config)
+{
+    struct trace_reader reader;
+    int err = trace_reader_open(&reader, config->replay);
+    if (err != ERR_NONE) {
+        return err;
+    }
+    struct trace_record* record = malloc(sizeof(*record)); // big target: not on the stack
+    size_t capacity = 0, posts = 0;
+    err = record == NULL ? ERR_OUT_OF_MEMORY : ERR_NONE;
+    while (err == ERR_NONE) {
+        int end = 0;
+        err = trace_read(&reader, record, &end);
+        if (err != ERR_NONE || end) break;
+        if (replay.count == capacity) {
+            capacity = capacity > 0 ? 2 * capacity : 4096;
+            struct replay_request* requests = realloc(replay.requests, capacity * sizeof(*requests));
+            if (requests == NULL) {
+                err = ERR_OUT_OF_MEMORY;
+                break;
+            }
+            replay.requests = requests;
+        }
+        struct replay_request* r = &replay.requests[replay.count];
+        r->time_us = record->time_us;
+        r->flags = record->flags;
+        r->status = record->status;
+        r->target = strdup(record->target);
+        if (r->target == NULL) {
+            err = ERR_OUT_OF_MEMORY;
+            break;
+        }
+        posts += (r->flags & TRACE_POST) != 0;
+        replay.count++;
+    }
+    free(record);
+    trace_reader_close(&reader);
+    if (err != ERR_NONE) {
+        return err;
+    }
+    if (replay.count == 0) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    if (posts > 0 && config->nb_images == 0) {
+        return ERR_NOT_ENOUGH_ARGUMENTS;
+    }
+
+    qsort(replay.requests, replay.count, sizeof(*replay.requests), replay_compare);
+    const uint64_t span = replay.requests[replay.count - 1].time_us - replay.requests[0].time_us;
+    printf("Replaying %zu request(s) recorded over %.1f s, in %.1f s\n", replay.count,
+           (double) span / 1e6, (double) span / 1e6 / config->speed);
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Command line
+ */
+static void usage(void)
+{
+    printf("imgfs_bench <port> [options]: load imgfs_server and report latencies.\n"
+           "  -host <name>: server host (default: localhost)\n"
+           "  -connections <N>: keep-alive connections, one thread each (default: 16)\n"
+           "  -duration <seconds>: length of the run (default: 10; not for -replay)\n"
+           "  -rate <req/s>: open-loop total request rate (default: closed loop)\n"
+           "  -mix <op=weight,...>: weights of read, insert, delete, list\n"
+           "                        (default: read=95,insert=3,delete=1,list=1)\n"
+           "  -res <res=weight,...>: weights of thumb, small, orig reads\n"
+           "                         (default: thumb=50,small=30,orig=20)\n"
+           "  -ids <N>: images read are <prefix>0 to <prefix><N-1> (default: 1000)\n"
+           "  -zipf <s>: Zipf exponent of their popularity, 0 for uniform (default: 0.99)\n"
+           "  -prefix <text>: image ID prefix (default: bench_)\n"
+           "  -image <file>: JPEG to insert, repeatable (required to insert)\n"
+           "  -populate: insert the images read before the run\n"
+           "  -json <file>: save the run\n"
+           "  -label <text>: name of the run in the JSON file, e.g. a commit\n"
+           "  -replay <trace>: send the requests of a trace (imgfs_server -trace)\n"
+           "                   instead; inserts send the -image files\n"
+           "  -speed <x>: replay x times faster than recorded (default: 1)\n");
+}
+
+static int parse_weights(const char* list, const char* const* names, unsigned* weights, size_t n)
+{
+    memset(weights, 0, n * sizeof(*weights));
+    while (*list != '\0') {
+        const char* eq = strchr(list, '=');
+        if (eq == NULL) return ERR_INVALID_ARGUMENT;
+        size_t i = 0;
+        while (i < n && (strlen(names[i]) != (size_t) (eq - list) || strncmp(names[i], list, (size_t) (eq - list)))) i++;
+        char* end = NULL;
+        const unsigned long weight = strtoul(eq + 1, &end, 10);
+        if (i == n || end == eq + 1 || (*end != ',' && *end != '\0') || weight > 1000000) {
+            return ERR_INVALID_ARGUMENT;
+        }
+        weights[i] = (unsigned) weight;
+        list = *end == ',' ? end + 1 : end;
+    }
+    unsigned total = 0;
+    for (size_t i = 0; i < n; i++) total += weights[i];
+    return total > 0 ? ERR_NONE : ERR_INVALID_ARGUMENT;
+}
+
+static int read_image(const char* path, char** data, size_t* size)
+{
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) return ERR_IO;
+    int err = ERR_IO;
+    long len = -1;
+    if (fseek(file, 0, SEEK_END) == 0 && (len = ftell(file)) > 0 && fseek(file, 0, SEEK_SET) == 0) {
+        *data = malloc((size_t) len);
+        err = *data == NULL ? ERR_OUT_OF_MEMORY :
+              fread(*data, 1, (size_t) len, file) == (size_t) len ? ERR_NONE : ERR_IO;
+        *size = (size_t) len;
+    }
+    fclose(file);
+    return err;
+}
+
+static int parse_args(int argc, char* argv[], struct bench_config* config)
+{
+    if (argc < 2 || argv[1][0] == '-') return ERR_NOT_ENOUGH_ARGUMENTS;
+    config->port = argv[1];
+
+    for (int i = 2; i < argc; i++) {
+        const char* opt = argv[i];
+        if (!strcmp(opt, "-populate")) {
+            config->populate = 1;
+            continue;
+        }
+        if (i + 1 >= argc) return ERR_NOT_ENOUGH_ARGUMENTS;
+        const char* value = argv[++i];
+        int err = ERR_NONE;
+        if (!strcmp(opt, "-host")) {
+            config->host = value;
+        } else if (!strcmp(opt, "-connections")) {
+            config->connections = (unsigned) strtoul(value, NULL, 10);
+            if (config->connections == 0 || config->connections > 10000) err = ERR_INVALID_ARGUMENT;
+        } else if (!strcmp(opt, "-duration")) {
+            config->duration = strtod(value, NULL);
+            if (config->duration <= 0) err = ERR_INVALID_ARGUMENT;
+        } else if (!strcmp(opt, "-rate")) {
+            config->rate = strtod(value, NULL);
+            if (config->rate < 0) err = ERR_INVALID_ARGUMENT;
+        } else if (!strcmp(opt, "-mix")) {
+            err = parse_weights(value, op_names, config->mix, NB_MIX_OPS);
+        } else if (!strcmp(opt, "-res")) {
+            err = parse_weights(value, res_names, config->res, NB_BENCH_RES);
+        } else if (!strcmp(opt, "-ids")) {
+            const unsigned long ids = strtoul(value, NULL, 10);
+            config->ids = (uint32_t) ids;
+            if (ids == 0 || ids > UINT32_MAX / 2) err = ERR_INVALID_ARGUMENT;
+        } else if (!strcmp(opt, "-zipf")) {
+            config->zipf = strtod(value, NULL);
+            if (config->zipf < 0) err = ERR_INVALID_ARGUMENT;
+        } else if (!strcmp(opt, "-prefix")) {
+            config->prefix = value;
+        } else if (!strcmp(opt, "-image")) {
+            if (config->nb_images >= MAX_IMAGES) return ERR_INVALID_ARGUMENT;
+            err = read_image(value, &config->images[config->nb_images].data,
+                             &config->images[config->nb_images].size);
+            if (err == ERR_NONE) config->nb_images++;
+        } else if (!strcmp(opt, "-json")) {
+            config->json = value;
+        } else if (!strcmp(opt, "-label")) {
+            config->label = value;
+        } else if (!strcmp(opt, "-replay")) {
+            config->replay = value;
+        } else if (!strcmp(opt, "-speed")) {
+            config->speed = strtod(value, NULL);
+            if (config->speed <= 0) err = ERR_INVALID_ARGUMENT;
+        } else {
+            err = ERR_INVALID_COMMAND;
+        }
+        if (err != ERR_NONE) return err;
+    }
+
+    if ((config->populate || (config->mix[OP_INSERT] > 0 && config->replay == NULL)) &&
+        config->nb_images == 0) {
+        return ERR_NOT_ENOUGH_ARGUMENTS;
+    }
+    return ERR_NONE;
+}
+
+/*******************************************************************************
+ * MAIN
+ */
+int main(int argc, char* argv[])
+{
+    struct bench_config config = {
+        .host = "localhost", .connections = 16, .duration = 10, .rate = 0,
+        .mix = { 95, 3, 1, 1 }, .res = { 50, 30, 20 }, .ids = 1000, .zipf = 0.99,
+        .prefix = "bench_", .speed = 1
+    };
+
+    int err = parse_args(argc, argv, &config);
+    if (err == ERR_NONE) {
+        err = zipf_init(config.ids, config.zipf);
+    }
+    if (err == ERR_NONE && config.replay != NULL) {
+        err = replay_load(&config);
+    }
+    inserted.next_id = config.ids;
+
+    struct worker* workers = NULL;
+    struct bench_results* results = NULL;
+    if (err == ERR_NONE) {
+        workers = calloc(config.connections, sizeof(*workers));
+        results = calloc(1, sizeof(*results));
+        err = workers == NULL || results == NULL ? ERR_OUT_OF_MEMORY : ERR_NONE;
+    }
+
+    if (err == ERR_NONE && config.populate) {
+        err = run_workers(workers, &config, 1);
+        uint64_t failed = 0;
+        for (unsigned i = 0; i < config.connections; i++) {
+            failed += workers[i].errors[OP_INSERT];
+        }
+        printf("Populated %u image(s), %llu failed\n", config.ids, (unsigned long long) failed);
+        memset(workers, 0, config.connections * sizeof(*workers));
+    }
+
+    if (err == ERR_NONE) {
+        const uint64_t start = now_ns();
+        err = run_workers(workers, &config, 0);
+        const double elapsed = (double) (now_ns() - start) / 1e9;
+        if (err == ERR_NONE) {
+            results_gather(&config, workers, elapsed, results);
+            results_print(&config, results);
+            if (config.json != NULL) {
+                err = results_save(&config, results);
+            }
+        }
+    }
+
+    if (err != ERR_NONE) {
+        fprintf(stderr, "ERROR: %s\n", ERR_MSG(err));
+        if (err == ERR_NOT_ENOUGH_ARGUMENTS || err == ERR_INVALID_ARGUMENT || err == ERR_INVALID_COMMAND) {
+            usage();
+        }
+    }
+    for (size_t i = 0; i < config.nb_images; i++) {
+        free(config.images[i].data);
+    }
+    free(workers);
+    free(results);
+    free(zipf_cdf);
+    free(inserted.ids);
+    for (size_t i = 0; i < replay.count; i++) {
+        free(replay.requests[i].target);
+    }
+    free(replay.requests);
+    return err;
+}
@@ -6,47 +6,68 @@
 #include <stdio.h>         // for sprintf
 #include <stdlib.h>        // for calloc
 #include <string.h>  
+#include <fcntl.h>         // for O_RDWR, O_CREAT, O_TRUNC
 
 
 int do_create(const char* imgfs_filename, struct imgfs_file* imgfs_file) {
+    return do_create_backend(imgfs_filename, IMGFS_BACKEND_FILE, imgfs_file);
+}
+
+int do_create_backend(const char* imgfs_filename, enum imgfs_backend_kind backend,
+                      struct imgfs_file* imgfs_file) {
     //  required checks 
     M_REQUIRE_NON_NULL(imgfs_filename);
     M_REQUIRE_NON_NULL(imgfs_file);
     
     // open the file in which we save the imgfs_file 
-    FILE* outfile = fopen(imgfs_filename,"wb");
-    if(outfile == NULL) {
-        fclose(outfile);
-        return ERR_IO;
+    memset(&imgfs_file->tier_io, 0, sizeof(imgfs_file->tier_io));
+    int err = imgfs_backend_open(&imgfs_file->io, backend, imgfs_filename,
+                                 O_RDWR | O_CREAT | O_TRUNC, &imgfs_file->file_end);
+    if(err != ERR_NONE) {
+        return err;
     }
     
     // create header 
     strcpy(imgfs_file->header.name, CAT_TXT);
     imgfs_file->header.version = 0; // start at version 0 !
     imgfs_file->header.nb_files = 0;
-    imgfs_file->header.unused_32 = 0;
-    imgfs_file->header.unused_64 = 0;
-    imgfs_file->file = outfile;
+    imgfs_file->header.format = IMGFS_FORMAT_NEEDLE;
+    imgfs_file->header.flags &= IMGFS_FLAG_TIERS | IMGFS_FLAG_OPTIMIZE; // the flags chosen at creation
+    imgfs_file->header.flags |= IMGFS_FLAG_SPACE;
+    memset(&imgfs_file->space, 0, sizeof(imgfs_file->space)); // left a hole on disk too
+    // header.profiles, as chosen by the caller
     
-    if(fwrite(&imgfs_file->header, sizeof(struct imgfs_header), 1, outfile) != 1) {
-        fclose(outfile);
+    if(imgfs_pwrite(imgfs_file, &imgfs_file->header, sizeof(struct imgfs_header), 0) != ERR_NONE) {
         return ERR_IO;
     }
 
-    // create metadata array
-    imgfs_file->metadata = (struct img_metadata*)calloc(sizeof(struct img_metadata), imgfs_file->header.max_files);
-    if(imgfs_file->metadata == NULL) {
-        fclose(outfile);
-        return ERR_IO;
+    // create metadata array: an all-zero table is all EMPTY entries,
+    // so the on-disk one is only a hole up to the data region
+    err = imgfs_alloc_table(imgfs_file);
+    if(err != ERR_NONE) {
+        return err;
     }
 
-    if(fwrite(imgfs_file->metadata, sizeof(struct img_metadata), imgfs_file->header.max_files, outfile) != imgfs_file->header.max_files) {
-        fclose(outfile);
-        free(imgfs_file->metadata);
-        return ERR_IO;
+    err = imgfs_backend_truncate(&imgfs_file->io, imgfs_data_start(&imgfs_file->header));
+    if(err != ERR_NONE) {
+        return err;
+    }
+    imgfs_file->file_end = imgfs_data_start(&imgfs_file->header);
+
+    if (imgfs_file->header.flags & IMGFS_FLAG_TIERS) {
+        err = imgfs_open_tier(imgfs_file, imgfs_filename, O_RDWR | O_CREAT | O_TRUNC, backend);
+        if(err != ERR_NONE) {
+            return err;
+        }
     }
 
     printf("%d item(s) written\n", imgfs_file->header.max_files + 1);
     
     return ERR_NONE;
 }
+
+int imgfs_preallocate(struct imgfs_file* imgfs_file, uint64_t data_size) {
+    M_REQUIRE_NON_NULL(imgfs_file);
+
+    return imgfs_backend_allocate(&imgfs_file->io, imgfs_file->file_end, data_size);
+}
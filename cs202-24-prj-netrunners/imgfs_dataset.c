@@ -0,0 +1,288 @@
+/**
+ * @file imgfs_dataset.c
+ * @brief Fills an imgFS with generated JPEG images, for benchmarks.
+ *
+ * Image dimensions are drawn uniformly or log-normally between bounds;
+ * JPEG quality and the amount of noise (which drives the compressed size
+ * at given dimensions) are drawn uniformly. A chosen fraction of the
+ * inserts repeat the content of an earlier image under a new ID, to
+ * exercise deduplication. Generation is deterministic for a given -seed.
+ */
+
+#include "error.h"
+#include "imgfs.h"
+#include "util.h" // for atouint32
+
+#include <math.h>   // for exp, log, sqrt
+#include <stdio.h>  // needed by jpeglib.h
+#include <stdlib.h>
+#include <string.h>
+#include <jpeglib.h>
+#include <vips/vips.h>
+
+#define RECENT_IMAGES 64 // earlier images duplicates are drawn from
+
+enum dim_distribution { DIST_UNIFORM, DIST_LOGNORMAL };
+
+struct range {
+    double min, max;
+};
+
+struct dataset_config {
+    const char* imgfs_filename;
+    uint32_t count;
+    struct range width, height, quality, noise;
+    enum dim_distribution dist;
+    double dup;         // fraction of inserts which are duplicates
+    const char* prefix;
+    uint64_t seed;
+};
+
+struct jpeg_buffer {
+    unsigned char* data;
+    unsigned long size;
+};
+
+static uint64_t rng_next(uint64_t* state) // xorshift64*
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+static double rng_uniform(uint64_t* state)
+{
+    return (double) (rng_next(state) >> 11) * 0x1.0p-53;
+}
+
+static double draw_uniform(const struct range* r, uint64_t* rng)
+{
+    return r->min + (r->max - r->min) * rng_uniform(rng);
+}
+
+/**
+ * @brief Log-normal between the bounds: their geometric mean is the
+ *        median and they lie two standard deviations away (clamped).
+ */
+static double draw_lognormal(const struct range* r, uint64_t* rng)
+{
+    const double u1 = 1.0 - rng_uniform(rng);
+    const double u2 = rng_uniform(rng);
+    const double z = sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
+    const double lo = log(r->min), hi = log(r->max);
+    const double value = exp((lo + hi) / 2 + z * (hi - lo) / 4);
+    return value < r->min ? r->min : value > r->max ? r->max : value;
+}
+
+static unsigned draw_dim(const struct dataset_config* config, const struct range* r, uint64_t* rng)
+{
+    const double value = config->dist == DIST_LOGNORMAL ? draw_lognormal(r, rng) : draw_uniform(r, rng);
+    return (unsigned) (value + 0.5);
+}
+
+/*******************************************************************
+ * Image synthesis: smooth gradients under some noise
+ */
+static int make_jpeg(unsigned width, unsigned height, int quality, double noise,
+                     uint64_t* rng, struct jpeg_buffer* out)
+{
+    unsigned char* row = malloc((size_t) width * 3);
+    if (row == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    const unsigned char base[3] = {
+        (unsigned char) rng_next(rng), (unsigned char) rng_next(rng), (unsigned char) rng_next(rng)
+    };
+    const unsigned noise_span = (unsigned) (noise * 2.55) + 1; // noise is 0 to 100
+
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+    out->data = NULL;
+    out->size = 0;
+    jpeg_mem_dest(&cinfo, &out->data, &out->size);
+    cinfo.image_width = width;
+    cinfo.image_height = height;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, quality, TRUE);
+    jpeg_start_compress(&cinfo, TRUE);
+
+    while (cinfo.next_scanline < height) {
+        const unsigned y = cinfo.next_scanline;
+        for (unsigned x = 0; x < width; x++) {
+            const unsigned gradient[3] = { 256 * x / width, 256 * y / height, 128 * (x + y) / (width + height) };
+            for (int c = 0; c < 3; c++) {
+                const unsigned jitter = (unsigned) (rng_next(rng) % noise_span);
+                row[3 * x + (unsigned) c] = (unsigned char) (base[c] + gradient[c] + jitter);
+            }
+        }
+        JSAMPROW rows[1] = { row };
+        jpeg_write_scanlines(&cinfo, rows, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    free(row);
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Generation
+ */
+static int generate(const struct dataset_config* config)
+{
+    struct imgfs_file imgfs_file;
+    int err = do_open(config->imgfs_filename, "rb+", &imgfs_file);
+    if (err != ERR_NONE) {
+        return err;
+    }
+
+    struct jpeg_buffer recent[RECENT_IMAGES];
+    memset(recent, 0, sizeof(recent));
+    size_t nb_recent = 0;
+    uint32_t generated = 0;
+    uint64_t rng = config->seed * 0x9E3779B97F4A7C15ULL + 1;
+    uint32_t inserted = 0, duplicates = 0;
+    uint64_t bytes = 0;
+
+    for (uint32_t n = 0; n < config->count && err == ERR_NONE; n++) {
+        char img_id[MAX_IMG_ID + 1];
+        snprintf(img_id, sizeof(img_id), "%s%u", config->prefix, n);
+
+        const struct jpeg_buffer* image = NULL;
+        struct jpeg_buffer fresh = { NULL, 0 };
+        if (nb_recent > 0 && rng_uniform(&rng) < config->dup) {
+            image = &recent[rng_next(&rng) % nb_recent];
+            duplicates++;
+        } else {
+            const unsigned width = draw_dim(config, &config->width, &rng);
+            const unsigned height = draw_dim(config, &config->height, &rng);
+            const int quality = (int) (draw_uniform(&config->quality, &rng) + 0.5);
+            err = make_jpeg(width, height, quality, draw_uniform(&config->noise, &rng), &rng, &fresh);
+            if (err != ERR_NONE) break;
+            // kept for later duplicates, in place of the oldest one
+            struct jpeg_buffer* slot = &recent[generated++ % RECENT_IMAGES];
+            free(slot->data);
+            *slot = fresh;
+            if (nb_recent < RECENT_IMAGES) nb_recent++;
+            image = slot;
+        }
+
+        err = do_insert((const char*) image->data, image->size, img_id, &imgfs_file);
+        if (err == ERR_NONE) {
+            inserted++;
+            bytes += image->size;
+        }
+    }
+
+    printf("%u image(s) inserted (%u duplicate(s)), %.1f MB, %.1f KB on average\n",
+           inserted, duplicates, (double) bytes / 1e6,
+           inserted > 0 ? (double) bytes / inserted / 1e3 : 0.0);
+
+    for (size_t i = 0; i < RECENT_IMAGES; i++) {
+        free(recent[i].data);
+    }
+    do_close(&imgfs_file);
+    return err;
+}
+
+/*******************************************************************
+ * Command line
+ */
+static void usage(void)
+{
+    printf("imgfs_dataset <imgFS_filename> <count> [options]: insert <count> generated JPEGs.\n"
+           "  -width <min>:<max>: image widths (default: 320:1920)\n"
+           "  -height <min>:<max>: image heights (default: 240:1080)\n"
+           "  -dist <uniform|lognormal>: distribution of the dimensions (default: lognormal)\n"
+           "  -quality <min>:<max>: JPEG quality, uniform (default: 70:95)\n"
+           "  -noise <min>:<max>: noise level, 0 to 100, uniform; more noise makes\n"
+           "                      bigger files (default: 5:40)\n"
+           "  -dup <ratio>: fraction of inserts repeating an earlier image (default: 0)\n"
+           "  -prefix <text>: image ID prefix (default: gen_)\n"
+           "  -seed <N>: random seed (default: 1)\n");
+}
+
+static int parse_range(const char* text, double lowest, double highest, struct range* r)
+{
+    char* end = NULL;
+    r->min = strtod(text, &end);
+    if (end == text || *end != ':') return ERR_INVALID_ARGUMENT;
+    const char* max = end + 1;
+    r->max = strtod(max, &end);
+    if (end == max || *end != '\0' || r->min < lowest || r->max > highest || r->min > r->max) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    return ERR_NONE;
+}
+
+static int parse_args(int argc, char* argv[], struct dataset_config* config)
+{
+    if (argc < 3) return ERR_NOT_ENOUGH_ARGUMENTS;
+    config->imgfs_filename = argv[1];
+    config->count = atouint32(argv[2]);
+    if (config->count == 0) return ERR_INVALID_ARGUMENT;
+
+    for (int i = 3; i < argc; i++) {
+        const char* opt = argv[i];
+        if (i + 1 >= argc) return ERR_NOT_ENOUGH_ARGUMENTS;
+        const char* value = argv[++i];
+        int err = ERR_NONE;
+        if (!strcmp(opt, "-width")) {
+            err = parse_range(value, 1, JPEG_MAX_DIMENSION, &config->width);
+        } else if (!strcmp(opt, "-height")) {
+            err = parse_range(value, 1, JPEG_MAX_DIMENSION, &config->height);
+        } else if (!strcmp(opt, "-dist")) {
+            if (!strcmp(value, "uniform")) config->dist = DIST_UNIFORM;
+            else if (!strcmp(value, "lognormal")) config->dist = DIST_LOGNORMAL;
+            else err = ERR_INVALID_ARGUMENT;
+        } else if (!strcmp(opt, "-quality")) {
+            err = parse_range(value, 1, 100, &config->quality);
+        } else if (!strcmp(opt, "-noise")) {
+            err = parse_range(value, 0, 100, &config->noise);
+        } else if (!strcmp(opt, "-dup")) {
+            config->dup = strtod(value, NULL);
+            if (config->dup < 0 || config->dup > 1) err = ERR_INVALID_ARGUMENT;
+        } else if (!strcmp(opt, "-prefix")) {
+            config->prefix = value;
+        } else if (!strcmp(opt, "-seed")) {
+            config->seed = strtoull(value, NULL, 10);
+        } else {
+            err = ERR_INVALID_COMMAND;
+        }
+        if (err != ERR_NONE) return err;
+    }
+    return ERR_NONE;
+}
+
+/*******************************************************************************
+ * MAIN
+ */
+int main(int argc, char* argv[])
+{
+    if (VIPS_INIT(argv[0])) {
+        vips_error_exit("unable to start VIPS");
+    }
+
+    struct dataset_config config = {
+        .width = { 320, 1920 }, .height = { 240, 1080 }, .dist = DIST_LOGNORMAL,
+        .quality = { 70, 95 }, .noise = { 5, 40 }, .dup = 0, .prefix = "gen_", .seed = 1
+    };
+
+    int err = parse_args(argc, argv, &config);
+    if (err == ERR_NONE) {
+        err = generate(&config);
+    }
+
+    if (err != ERR_NONE) {
+        fprintf(stderr, "ERROR: %s\n", ERR_MSG(err));
+        if (err == ERR_NOT_ENOUGH_ARGUMENTS || err == ERR_INVALID_ARGUMENT || err == ERR_INVALID_COMMAND) {
+            usage();
+        }
+    }
+    vips_shutdown();
+    return err;
+}
@@ -1,5 +1,6 @@
 #include "imgfs.h"
 #include "error.h"
+#include "needle.h"
 #include <string.h>
 
 /**
@@ -18,36 +19,41 @@ int do_delete(const char* img_id, struct imgfs_file* imgfs_file) {
     M_REQUIRE_NON_NULL(img_id); 
 
 
-    // look for the image we want to delete, deference it if found 
-    int found = 0;
-    for (uint32_t i = 0; i < imgfs_file->header.max_files; i++) {
-        if (strcmp(imgfs_file->metadata[i].img_id, img_id) == 0 && imgfs_file->metadata[i].is_valid == NON_EMPTY) {
-            imgfs_file->metadata[i].is_valid = EMPTY;  
-            found = 1;
-            break;
-        }
+    // look for the image we want to delete
+    uint32_t index = 0;
+    if (imgfs_find_id(imgfs_file, img_id, &index) != ERR_NONE) {
+        // throw an error if the image is not found 
+        return ERR_IMAGE_NOT_FOUND; 
     }
 
-    // throw an error if the image is not found 
-    if (!found) {
-        return ERR_IMAGE_NOT_FOUND; 
+    // record the deletion in the data region, for do_recover()
+    if (imgfs_file->header.format == IMGFS_FORMAT_NEEDLE) {
+        uint64_t tombstone = 0;
+        int append = needle_append(imgfs_file, img_id, ORIG_RES, NEEDLE_DELETE, NULL, 0, &tombstone);
+        if (append != ERR_NONE) {
+            return append;
+        }
     }
 
-    // update metadata 
-    if (fseek(imgfs_file->file, sizeof(struct imgfs_header), SEEK_SET) != 0 ||
-        fwrite(imgfs_file->metadata, sizeof(struct img_metadata), imgfs_file->header.max_files, imgfs_file->file) != imgfs_file->header.max_files) {
+    // update metadata, then dereference the image in memory
+    struct img_metadata metadata;
+    imgfs_get_metadata(imgfs_file, index, &metadata);
+    metadata.is_valid = EMPTY;
+    if (imgfs_pwrite(imgfs_file, &metadata, sizeof(struct img_metadata),
+                     sizeof(struct imgfs_header) + (uint64_t) index * sizeof(struct img_metadata)) != ERR_NONE) {
         return ERR_IO; 
     }
+    imgfs_space_unref(imgfs_file, index, (1u << NB_RES) - 1);
+    imgfs_clear_slot(imgfs_file, index);
 
     // if the metadata update was successful, update header 
     imgfs_file->header.version++;
     imgfs_file->header.nb_files--;
-    if (fseek(imgfs_file->file, 0, SEEK_SET) != 0 ||
-        fwrite(&(imgfs_file->header), sizeof(struct imgfs_header), 1, imgfs_file->file) != 1) {
+    if (imgfs_pwrite(imgfs_file, &(imgfs_file->header), sizeof(struct imgfs_header), 0) != ERR_NONE) {
         imgfs_file->header.version--; 
         imgfs_file->header.nb_files++; 
         return ERR_IO;
     }
 
-    return ERR_NONE;
+    return imgfs_space_write(imgfs_file);
 }
@@ -1,71 +1,153 @@
 #include "imgfs.h"
 #include "error.h"
 #include "image_content.h"
+#include "image_dedup.h"
+#include "jpeg_optimize.h"
+#include "imgfs_probes.h"
+#include "needle.h"
+#include "request_phases.h"
 #include "string.h"
 
+#include <stdlib.h> // for free
+
 #include <stdio.h>
 #include <openssl/sha.h> // for SHA256_DIGEST_LENGTH and SHA256()
 
+/**
+ * @brief Appends the content of a new (not duplicate) original, losslessly
+ *        optimized first with IMGFS_FLAG_OPTIMIZE. The SHA of the slot stays
+ *        the one of the uploaded bytes.
+ */
+static int insert_content(struct imgfs_file* imgfs_file, uint32_t i,
+                          const char* image_buffer, size_t image_size)
+{
+    struct img_cold* cold = imgfs_file->cold[i];
+    char* optimized = NULL;
+    size_t optimized_size = 0;
+    if ((imgfs_file->header.flags & IMGFS_FLAG_OPTIMIZE) &&
+        jpeg_optimize(image_buffer, image_size, &optimized, &optimized_size) != ERR_NONE) {
+        optimized = NULL; // unreadable by libjpeg: stored as it is
+    }
+    const char* content = optimized != NULL ? optimized : image_buffer;
+    const size_t content_size = optimized != NULL ? optimized_size : image_size;
+
+    // ADDING THE NEW IMAGE AT THE END OF THE FILE
+    imgfs_file->size[i][ORIG_RES] = (uint32_t)content_size;
+    int err = needle_append(imgfs_file, cold->img_id, ORIG_RES, NEEDLE_BLOB,
+                            content, (uint32_t)content_size, &imgfs_file->offset[i][ORIG_RES]);
+    if (err == ERR_NONE && optimized != NULL) {
+        struct needle_digest digest = { .saved = (uint32_t) (image_size - content_size) };
+        memcpy(digest.SHA, cold->SHA, SHA256_DIGEST_LENGTH);
+        cold->saved_kib = imgfs_saved_kib(digest.saved);
+        if (imgfs_file->header.format == IMGFS_FORMAT_NEEDLE) {
+            uint64_t digest_offset = 0;
+            err = needle_append(imgfs_file, cold->img_id, ORIG_RES, NEEDLE_DIGEST,
+                                &digest, sizeof(digest), &digest_offset);
+        }
+    }
+    free(optimized);
+    return err;
+}
+
 int do_insert(const char* image_buffer, size_t image_size, const char* img_id, struct imgfs_file* imgfs_file) {
     M_REQUIRE_NON_NULL(image_buffer);
     M_REQUIRE_NON_NULL(img_id);
     M_REQUIRE_NON_NULL(imgfs_file);
 
     // FIND A FREE POSITION IN THE INDEX
-    if(imgfs_file->header.max_files <= imgfs_file->header.nb_files) {
+    if(imgfs_file->header.max_files <= imgfs_file->header.nb_files ||
+       (imgfs_file->header.flags & IMGFS_FLAG_SEALED)) {
         return ERR_IMGFS_FULL;
     }
+    if(strlen(img_id) > MAX_IMG_ID) {
+        return ERR_INVALID_IMGID;
+    }
+
+    uint32_t i = 0;
+    int err = imgfs_find_free(imgfs_file, &i);
+    if(err != ERR_NONE) { return err; }
+
+    // FILLING THE FREE SLOT
+    err = imgfs_fill_slot(imgfs_file, i, img_id);
+    if(err != ERR_NONE) { return err; }
+    struct img_cold *cold = imgfs_file->cold[i];
+
+    unsigned char SHA[SHA256_DIGEST_LENGTH];
+    SHA256((const unsigned char*)image_buffer, image_size, SHA);
+    imgfs_set_sha(imgfs_file, i, SHA);
+    imgfs_file->size[i][ORIG_RES] = (uint32_t)image_size;
+
+    err = get_resolution(&cold->orig_res[HEIGHT_I], &cold->orig_res[WIDTH_I], image_buffer, image_size);
+    if(err != ERR_NONE) {
+        imgfs_clear_slot(imgfs_file, i);
+        return err;
+    }
+
+    phase_enter(PHASE_LOOKUP);
+    err = do_name_and_content_dedup(imgfs_file, i);
+    phase_leave();
+    if(err != ERR_NONE) {
+        imgfs_clear_slot(imgfs_file, i);
+        return err;
+    }
 
-    // ITERATE THROUGH ALL THE METADATA OF EACH IMAGE UNTIL WE FIND A NON-EMPTY ONE
-    for(uint32_t i = 0; i < imgfs_file->header.max_files; i++) {
-        struct img_metadata *metadata = &imgfs_file->metadata[i];
-        if(metadata->is_valid == EMPTY) {
-            SHA256((const unsigned char*)image_buffer, image_size, &metadata->SHA);
-            strcpy(metadata->img_id, img_id);
-            metadata->size[ORIG_RES] = (uint32_t)image_size;
-           
-            int is_res_valid = get_resolution(&metadata->orig_res[HEIGHT_I], &metadata->orig_res[WIDTH_I], image_buffer, image_size);
-            if(is_res_valid) { return is_res_valid; }
-            
-            metadata->is_valid = NON_EMPTY;
-            
-            int is_duplicate = do_name_and_content_dedup(imgfs_file, i);
-            if(is_duplicate) {
-                metadata->is_valid = EMPTY;
-                return is_duplicate;
-            }
-            
-            if (metadata->offset[ORIG_RES] == 0) {// IF THE IMAGE IS NOT A DUPLICATE (OFFSET == 0)
-                // GOING TO THE END OF THE FILE AND ADDING THE NEW IMAGE ON THE DISK
-                if (fseek(imgfs_file->file, 0, SEEK_END) ||
-                    fwrite(image_buffer,image_size, 1, imgfs_file->file) != 1) {
-                    return ERR_IO;
-                }
-                // UPDATING THE METADATA
-                metadata->offset[ORIG_RES] = (uint64_t)(ftell(imgfs_file->file) - image_size);
-                metadata->offset[THUMB_RES] = 0; metadata->size[THUMB_RES] = 0;
-                metadata->offset[SMALL_RES] = 0; metadata->size[SMALL_RES] = 0;
-            }
-
-
-            // GOING TO THE METADATA AND UPDATING IT ON THE DISK
-            if(fseek(imgfs_file->file, sizeof(struct imgfs_header) + i * sizeof(struct img_metadata), SEEK_SET) ||
-                fwrite(metadata, sizeof(struct img_metadata), 1, imgfs_file->file) != 1) {
-                return ERR_IO; 
-            }
-
-            // UPDATING THE HEADER
-            imgfs_file->header.version++;
-            imgfs_file->header.nb_files++;
-
-            // GOING TO THE HEADER AND UPDATING IT ON THE DISK
-            if (fseek(imgfs_file->file, 0, SEEK_SET) ||
-                fwrite(&imgfs_file->header, sizeof(struct imgfs_header), 1, imgfs_file->file) != 1){
-                return ERR_IO;
-            }
-            break;
-        }   
+    const int duplicate = imgfs_file->offset[i][ORIG_RES] != 0;
+    if (!duplicate) {// IF THE IMAGE IS NOT A DUPLICATE (OFFSET == 0)
+        err = insert_content(imgfs_file, i, image_buffer, image_size);
+        if (err != ERR_NONE) {
+            imgfs_clear_slot(imgfs_file, i);
+            return err;
+        }
+        imgfs_space_new_blob(imgfs_file, imgfs_file->size[i][ORIG_RES]);
+        // UPDATING THE METADATA
+        imgfs_file->offset[i][THUMB_RES] = 0; imgfs_file->size[i][THUMB_RES] = 0;
+        imgfs_file->offset[i][SMALL_RES] = 0; imgfs_file->size[i][SMALL_RES] = 0;
+    } else if (imgfs_file->header.format == IMGFS_FORMAT_NEEDLE) {
+        // RECORDING THE ALIAS SO THAT do_recover() CAN REBUILD IT
+        uint64_t alias_offset = 0;
+        err = needle_append(imgfs_file, img_id, ORIG_RES, NEEDLE_ALIAS,
+                            cold->SHA, SHA256_DIGEST_LENGTH, &alias_offset);
+        if (err != ERR_NONE) {
+            imgfs_clear_slot(imgfs_file, i);
+            return err;
+        }
     }
+    if (duplicate) {
+        imgfs_space_ref(imgfs_file, i, (1u << NB_RES) - 1);
+    }
+
+    // UPDATING THE METADATA ON THE DISK
+    if(imgfs_write_metadata(imgfs_file, i) != ERR_NONE) {
+        return ERR_IO; 
+    }
+
+    // UPDATING THE HEADER
+    imgfs_file->header.version++;
+    imgfs_file->header.nb_files++;
+
+    // GOING TO THE HEADER AND UPDATING IT ON THE DISK
+    if (imgfs_pwrite(imgfs_file, &imgfs_file->header, sizeof(struct imgfs_header), 0) != ERR_NONE ||
+        imgfs_space_write(imgfs_file) != ERR_NONE) {
+        return ERR_IO;
+    }
+
+    IMGFS_PROBE4(insert__commit, img_id, i, image_size, duplicate);
     return ERR_NONE;
 }
 
+int do_seal(struct imgfs_file* imgfs_file) {
+    M_REQUIRE_NON_NULL(imgfs_file);
+
+    if (imgfs_file->header.flags & IMGFS_FLAG_SEALED) {
+        return ERR_NONE;
+    }
+
+    imgfs_file->header.flags |= IMGFS_FLAG_SEALED;
+    imgfs_file->header.version++;
+    if (imgfs_pwrite(imgfs_file, &imgfs_file->header, sizeof(struct imgfs_header), 0) != ERR_NONE) {
+        imgfs_file->header.flags &= (uint16_t) ~IMGFS_FLAG_SEALED;
+        imgfs_file->header.version--;
+        return ERR_IO;
+    }
+    return ERR_NONE;
+}
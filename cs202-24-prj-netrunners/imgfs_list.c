@@ -23,8 +23,10 @@ int do_list(const struct imgfs_file* imgfs_file,
         } else {
             int is_image_found = 0;
             for(uint32_t i = 0; i < imgfs_file->header.max_files; i++) {
-                if(imgfs_file->metadata[i].is_valid == NON_EMPTY){
-                    print_metadata(&imgfs_file->metadata[i]);
+                if(imgfs_is_valid(imgfs_file, i)){
+                    struct img_metadata metadata;
+                    imgfs_get_metadata(imgfs_file, i, &metadata);
+                    print_metadata(&metadata);
                     is_image_found = 1;
                 }
             }
@@ -42,9 +44,9 @@ int do_list(const struct imgfs_file* imgfs_file,
             return ERR_RUNTIME;
         }
         for(uint32_t i = 0; i < imgfs_file->header.max_files; i++) {
-            if(imgfs_file->metadata[i].is_valid == NON_EMPTY){
+            if(imgfs_is_valid(imgfs_file, i)){
                 // Add the image id to the json array
-                struct json_object * json_obj_str = json_object_new_string(&imgfs_file->metadata[i].img_id);
+                struct json_object * json_obj_str = json_object_new_string(imgfs_file->cold[i]->img_id);
                 if(json_obj_str == NULL) {
                     return ERR_RUNTIME;
                 }
@@ -0,0 +1,556 @@
+/**
+ * @file imgfs_microbench.c
+ * @brief Microbenchmarks of the imgFS core operations.
+ *
+ * For every table size and fill ratio asked for, builds a synthetic imgFS
+ * and times do_open(), do_read(), do_insert(), do_delete(),
+ * do_name_and_content_dedup(), do_list() and the lazy resize of each
+ * tier on it. Filling millions of slots with do_insert() would take
+ * hours (each insert scans the table), so the store holds one real image
+ * and the other slots are aliases of its content, with IDs and SHAs of
+ * their own, scattered over the table.
+ *
+ * Each operation runs for a time budget (at least a few times, at most
+ * MAX_ITERATIONS); results go to stdout as one JSON object per line, to
+ * be compared across commits. Built without AddressSanitizer and
+ * optimized (see Makefile).
+ */
+
+#include "error.h"
+#include "histogram.h"
+#include "image_dedup.h"
+#include "imgfs.h"
+#include "util.h" // for now_ns
+
+#include <fcntl.h>        // for open
+#include <json-c/json.h>
+#include <openssl/sha.h>  // for SHA256
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>       // for dup, dup2, unlink
+#include <vips/vips.h>
+
+#define MIN_ITERATIONS 3
+#define MAX_ITERATIONS 1000 // inserts append to the store: bounds its growth
+#define MAX_SIZES      16
+#define MAX_FILLS      16
+
+struct bench_config {
+    uint32_t sizes[MAX_SIZES]; // max_files of each store
+    size_t nb_sizes;
+    double fills[MAX_FILLS];   // nb_files / max_files
+    size_t nb_fills;
+    enum imgfs_backend_kind backend;
+    const char* backend_name;
+    double budget;             // seconds per operation
+    const char* dir;           // where the stores are created
+    const char* label;
+    char* image;               // the real image of every store
+    size_t image_size;
+};
+
+/**
+ * @brief One store being measured.
+ */
+struct bench_store {
+    const struct bench_config* config;
+    char path[256];
+    struct imgfs_file file;
+    uint32_t max_files;
+    uint32_t nb_files;   // filled at creation, the seed included
+    uint32_t* ids;       // numbers of the filled slots' IDs ("img_<n>"), in random order
+    uint64_t rng;
+    uint32_t next_new;   // next ID number for inserts
+    size_t next_resize[NB_RES]; // next entry of ids whose variant was never made
+};
+
+static uint64_t rng_next(uint64_t* state) // xorshift64*
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+static void make_id(char* id, size_t len, uint32_t n)
+{
+    snprintf(id, len, "img_%u", n);
+}
+
+/*******************************************************************
+ * Synthetic stores
+ */
+
+/**
+ * @brief do_create() reports on stdout, which only carries results here.
+ */
+static int create_quietly(const char* path, struct imgfs_file* file)
+{
+    fflush(stdout);
+    const int saved = dup(STDOUT_FILENO);
+    const int null = open("/dev/null", O_WRONLY);
+    if (saved >= 0 && null >= 0) dup2(null, STDOUT_FILENO);
+    const int err = do_create(path, file);
+    fflush(stdout);
+    if (saved >= 0) {
+        dup2(saved, STDOUT_FILENO);
+        close(saved);
+    }
+    if (null >= 0) close(null);
+    return err;
+}
+
+static int store_build(struct bench_store* s, uint32_t max_files, double fill)
+{
+    const struct bench_config* config = s->config;
+    snprintf(s->path, sizeof(s->path), "%s/imgfs_microbench_%ld.imgfs", config->dir, (long) getpid());
+    s->max_files = max_files;
+    s->rng = 0x9E3779B97F4A7C15ULL ^ max_files;
+
+    // the real image, in slot 0
+    struct imgfs_file build = {
+        .header.max_files = max_files,
+        .header.resized_res = { 64, 64, 256, 256 }
+    };
+    int err = create_quietly(s->path, &build);
+    if (err == ERR_NONE) {
+        err = do_insert(config->image, config->image_size, "seed", &build);
+    }
+    if (err != ERR_NONE) {
+        do_close(&build);
+        return err;
+    }
+
+    // aliases of it, spread over the table
+    uint32_t wanted = (uint32_t) (fill * max_files);
+    if (wanted < 1) wanted = 1;
+    s->ids = calloc(wanted, sizeof(*s->ids));
+    if (s->ids == NULL) {
+        do_close(&build);
+        return ERR_OUT_OF_MEMORY;
+    }
+    s->ids[0] = UINT32_MAX; // the seed
+    s->nb_files = 1;
+
+    struct img_metadata alias;
+    imgfs_get_metadata(&build, 0, &alias);
+    memset(alias.offset, 0, ORIG_RES * sizeof(alias.offset[0]));
+    memset(alias.size, 0, ORIG_RES * sizeof(alias.size[0]));
+    for (uint32_t i = 1; i < max_files && s->nb_files < wanted && err == ERR_NONE; i++) {
+        // keep (wanted - filled) of the (max_files - i) slots left
+        if (rng_next(&s->rng) % (max_files - i) >= wanted - s->nb_files) continue;
+        make_id(alias.img_id, sizeof(alias.img_id), i);
+        SHA256((const unsigned char*) &i, sizeof(i), alias.SHA);
+        err = imgfs_set_metadata(&build, i, &alias);
+        s->ids[s->nb_files++] = i;
+    }
+    if (err == ERR_NONE) {
+        build.header.nb_files = s->nb_files;
+        err = imgfs_write_table(&build);
+    }
+    if (err == ERR_NONE) {
+        err = imgfs_pwrite(&build, &build.header, sizeof(build.header), 0);
+    }
+    do_close(&build);
+
+    // visit the images in random order
+    for (uint32_t i = s->nb_files - 1; i > 1; i--) {
+        const uint32_t j = 1 + (uint32_t) (rng_next(&s->rng) % i);
+        const uint32_t tmp = s->ids[i];
+        s->ids[i] = s->ids[j];
+        s->ids[j] = tmp;
+    }
+    s->next_new = max_files;
+    for (int res = 0; res < NB_RES; res++) s->next_resize[res] = 1;
+    return err;
+}
+
+static void store_id(const struct bench_store* s, size_t n, char* id, size_t len)
+{
+    if (s->ids[n] == UINT32_MAX) {
+        snprintf(id, len, "seed");
+    } else {
+        make_id(id, len, s->ids[n]);
+    }
+}
+
+static void store_destroy(struct bench_store* s)
+{
+    do_close(&s->file);
+    unlink(s->path);
+    char tiers[sizeof(s->path) + sizeof(IMGFS_TIER_SUFFIX)];
+    snprintf(tiers, sizeof(tiers), "%s%s", s->path, IMGFS_TIER_SUFFIX);
+    unlink(tiers);
+    free(s->ids);
+    s->ids = NULL;
+}
+
+/*******************************************************************
+ * Operations: each runs once, timing only the operation itself
+ */
+typedef int (*bench_op)(struct bench_store* s, uint64_t* elapsed);
+
+static int op_open(struct bench_store* s, uint64_t* elapsed)
+{
+    do_close(&s->file);
+    const uint64_t start = now_ns();
+    const int err = do_open_backend(s->path, "rb+", s->config->backend, &s->file);
+    *elapsed = now_ns() - start;
+    return err;
+}
+
+static int read_res(struct bench_store* s, int resolution, size_t n, uint64_t* elapsed)
+{
+    char id[MAX_IMG_ID + 1];
+    store_id(s, n, id, sizeof(id));
+    char* buffer = NULL;
+    uint32_t size = 0;
+    const uint64_t start = now_ns();
+    const int err = do_read(id, resolution, &buffer, &size, &s->file);
+    *elapsed = now_ns() - start;
+    free(buffer);
+    return err;
+}
+
+static int op_read(struct bench_store* s, uint64_t* elapsed)
+{
+    return read_res(s, ORIG_RES, (size_t) (rng_next(&s->rng) % s->nb_files), elapsed);
+}
+
+static int op_read_missing(struct bench_store* s, uint64_t* elapsed)
+{
+    char* buffer = NULL;
+    uint32_t size = 0;
+    const uint64_t start = now_ns();
+    const int err = do_read("no_such_image", ORIG_RES, &buffer, &size, &s->file);
+    *elapsed = now_ns() - start;
+    free(buffer);
+    return err == ERR_IMAGE_NOT_FOUND ? ERR_NONE : ERR_RUNTIME;
+}
+
+/**
+ * @brief First read of a tier: the variant is made and stored.
+ */
+static int resize_tier(struct bench_store* s, int resolution, uint64_t* elapsed)
+{
+    if (s->next_resize[resolution] >= s->nb_files) {
+        return ERR_IMGFS_FULL; // every image has it already
+    }
+    return read_res(s, resolution, s->next_resize[resolution]++, elapsed);
+}
+
+static int op_resize_thumb(struct bench_store* s, uint64_t* elapsed)
+{
+    return resize_tier(s, THUMB_RES, elapsed);
+}
+
+static int op_resize_small(struct bench_store* s, uint64_t* elapsed)
+{
+    return resize_tier(s, SMALL_RES, elapsed);
+}
+
+/**
+ * @brief Read of a variant made by op_resize_thumb().
+ */
+static int op_read_thumb(struct bench_store* s, uint64_t* elapsed)
+{
+    const size_t made = s->next_resize[THUMB_RES] - 1;
+    if (made == 0) {
+        return ERR_IMAGE_NOT_FOUND;
+    }
+    return read_res(s, THUMB_RES, 1 + (size_t) (rng_next(&s->rng) % made), elapsed);
+}
+
+/**
+ * @brief Inserts then deletes a new image, timing one of the two, so the
+ *        fill ratio does not move.
+ */
+static int insert_delete(struct bench_store* s, int duplicate, int time_delete, uint64_t* elapsed)
+{
+    const struct bench_config* config = s->config;
+    char id[MAX_IMG_ID + 1];
+    make_id(id, sizeof(id), s->next_new++);
+
+    // new content: the entropy-coded data changes, not the header
+    char* image = config->image;
+    if (!duplicate) {
+        image = malloc(config->image_size);
+        if (image == NULL) return ERR_OUT_OF_MEMORY;
+        memcpy(image, config->image, config->image_size);
+        memcpy(image + config->image_size / 2, &s->next_new, sizeof(s->next_new));
+    }
+
+    uint64_t start = now_ns();
+    int err = do_insert(image, config->image_size, id, &s->file);
+    const uint64_t inserted = now_ns();
+    if (err == ERR_NONE) {
+        err = do_delete(id, &s->file);
+    }
+    *elapsed = time_delete ? now_ns() - inserted : inserted - start;
+    if (image != config->image) free(image);
+    return err;
+}
+
+static int op_insert(struct bench_store* s, uint64_t* elapsed)
+{
+    return insert_delete(s, 0, 0, elapsed);
+}
+
+static int op_insert_duplicate(struct bench_store* s, uint64_t* elapsed)
+{
+    return insert_delete(s, 1, 0, elapsed);
+}
+
+static int op_delete(struct bench_store* s, uint64_t* elapsed)
+{
+    return insert_delete(s, 1, 1, elapsed);
+}
+
+static int op_dedup(struct bench_store* s, uint64_t* elapsed)
+{
+    const size_t n = (size_t) (rng_next(&s->rng) % s->nb_files);
+    const uint32_t index = s->ids[n] == UINT32_MAX ? 0 : s->ids[n];
+
+    // the dedup of a unique image forgets its content: put it back
+    uint64_t offset[NB_RES];
+    uint32_t size[NB_RES];
+    memcpy(offset, s->file.offset[index], sizeof(offset));
+    memcpy(size, s->file.size[index], sizeof(size));
+    const uint64_t start = now_ns();
+    const int err = do_name_and_content_dedup(&s->file, index);
+    *elapsed = now_ns() - start;
+    memcpy(s->file.offset[index], offset, sizeof(offset));
+    memcpy(s->file.size[index], size, sizeof(size));
+    return err;
+}
+
+static int op_list(struct bench_store* s, uint64_t* elapsed)
+{
+    char* json = NULL;
+    const uint64_t start = now_ns();
+    const int err = do_list(&s->file, JSON, &json);
+    *elapsed = now_ns() - start;
+    free(json);
+    return err;
+}
+
+static const struct {
+    const char* name;
+    bench_op run;
+} ops[] = {
+    { "open",             op_open },
+    { "read",             op_read },
+    { "read_missing",     op_read_missing },
+    { "insert",           op_insert },
+    { "insert_duplicate", op_insert_duplicate },
+    { "delete",           op_delete },
+    { "dedup",            op_dedup },
+    { "list",             op_list },
+    { "resize_thumb",     op_resize_thumb },
+    { "resize_small",     op_resize_small },
+    { "read_thumb",       op_read_thumb },
+};
+
+#define NB_OPS (sizeof(ops) / sizeof(ops[0]))
+
+/*******************************************************************
+ * Runs and results
+ */
+static void report(const struct bench_store* s, double fill, const char* op,
+                   const struct histogram* h, int err)
+{
+    const struct bench_config* config = s->config;
+    struct json_object* o = json_object_new_object();
+    if (o == NULL) return;
+    if (config->label != NULL) {
+        json_object_object_add(o, "label", json_object_new_string(config->label));
+    }
+    json_object_object_add(o, "op", json_object_new_string(op));
+    json_object_object_add(o, "max_files", json_object_new_int64(s->max_files));
+    char fill_text[32];
+    snprintf(fill_text, sizeof(fill_text), "%g", fill);
+    json_object_object_add(o, "fill", json_object_new_double_s(fill, fill_text));
+    json_object_object_add(o, "nb_files", json_object_new_int64(s->nb_files));
+    json_object_object_add(o, "backend", json_object_new_string(config->backend_name));
+
+    const uint64_t count = atomic_load(&h->count);
+    const uint64_t sum = atomic_load(&h->sum);
+    const uint64_t max = atomic_load(&h->max);
+    json_object_object_add(o, "iterations", json_object_new_int64((int64_t) count));
+    json_object_object_add(o, "mean_ns", json_object_new_int64(count > 0 ? (int64_t) (sum / count) : 0));
+    json_object_object_add(o, "p50_ns", json_object_new_int64((int64_t) histogram_quantile(h, 0.5)));
+    json_object_object_add(o, "p99_ns", json_object_new_int64((int64_t) histogram_quantile(h, 0.99)));
+    json_object_object_add(o, "max_ns", json_object_new_int64((int64_t) max));
+    if (err != ERR_NONE) {
+        json_object_object_add(o, "error", json_object_new_string(ERR_MSG(err)));
+    }
+    puts(json_object_to_json_string_ext(o, JSON_C_TO_STRING_PLAIN));
+    fflush(stdout);
+    json_object_put(o);
+}
+
+static int bench_store(const struct bench_config* config, uint32_t max_files, double fill)
+{
+    struct bench_store s = { .config = config };
+    fprintf(stderr, "max_files %u, fill %.2f...\n", max_files, fill);
+    int err = store_build(&s, max_files, fill);
+    if (err == ERR_NONE) {
+        err = do_open_backend(s.path, "rb+", config->backend, &s.file);
+    }
+    if (err != ERR_NONE) {
+        store_destroy(&s);
+        return err;
+    }
+
+    struct histogram* h = malloc(sizeof(*h));
+    if (h == NULL) {
+        store_destroy(&s);
+        return ERR_OUT_OF_MEMORY;
+    }
+    const uint64_t budget = (uint64_t) (config->budget * 1e9);
+    for (size_t op = 0; op < NB_OPS && err == ERR_NONE; op++) {
+        memset(h, 0, sizeof(*h));
+        int op_err = ERR_NONE;
+        const uint64_t start = now_ns();
+        for (uint64_t n = 0; n < MAX_ITERATIONS && (n < MIN_ITERATIONS || now_ns() - start < budget); n++) {
+            uint64_t elapsed = 0;
+            op_err = ops[op].run(&s, &elapsed);
+            if (op_err != ERR_NONE) break;
+            histogram_record(h, elapsed);
+        }
+        if (op_err == ERR_IMGFS_FULL && atomic_load(&h->count) > 0) {
+            op_err = ERR_NONE; // ran out of images to resize
+        }
+        report(&s, fill, ops[op].name, h, op_err);
+        if (s.file.io.ops == NULL) {
+            err = op_err; // the store could not be reopened
+        }
+    }
+    free(h);
+    store_destroy(&s);
+    return err;
+}
+
+/*******************************************************************
+ * Command line
+ */
+static void usage(void)
+{
+    printf("imgfs_microbench <image> [options]: time the imgFS core operations.\n"
+           "  -sizes <N,...>: max_files of the stores (default: 1000,10000,100000,1000000;\n"
+           "                  up to 1e7, which needs about %zu MB of disk)\n"
+           "  -fills <ratio,...>: nb_files / max_files (default: 0.1,0.5,0.9)\n"
+           "  -backend <name>: file, mmap or memory (default: file)\n"
+           "  -time <seconds>: time budget of each operation (default: 0.2)\n"
+           "  -dir <path>: where to create the stores (default: /tmp)\n"
+           "  -label <text>: added to every result, e.g. a commit\n"
+           "Results: one JSON object per line on stdout.\n",
+           (size_t) 10000000 * sizeof(struct img_metadata) >> 20);
+}
+
+static int parse_list(const char* list, double* values, size_t max, size_t* count)
+{
+    *count = 0;
+    while (*list != '\0') {
+        char* end = NULL;
+        const double value = strtod(list, &end);
+        if (end == list || (*end != ',' && *end != '\0') || *count >= max) {
+            return ERR_INVALID_ARGUMENT;
+        }
+        values[(*count)++] = value;
+        list = *end == ',' ? end + 1 : end;
+    }
+    return *count > 0 ? ERR_NONE : ERR_INVALID_ARGUMENT;
+}
+
+static int read_image(const char* path, char** data, size_t* size)
+{
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) return ERR_IO;
+    int err = ERR_IO;
+    long len = -1;
+    if (fseek(file, 0, SEEK_END) == 0 && (len = ftell(file)) > 0 && fseek(file, 0, SEEK_SET) == 0) {
+        *data = malloc((size_t) len);
+        err = *data == NULL ? ERR_OUT_OF_MEMORY :
+              fread(*data, 1, (size_t) len, file) == (size_t) len ? ERR_NONE : ERR_IO;
+        *size = (size_t) len;
+    }
+    fclose(file);
+    return err;
+}
+
+static int parse_args(int argc, char* argv[], struct bench_config* config)
+{
+    if (argc < 2 || argv[1][0] == '-') return ERR_NOT_ENOUGH_ARGUMENTS;
+
+    double values[MAX_SIZES > MAX_FILLS ? MAX_SIZES : MAX_FILLS];
+    for (int i = 2; i < argc; i++) {
+        const char* opt = argv[i];
+        if (i + 1 >= argc) return ERR_NOT_ENOUGH_ARGUMENTS;
+        const char* value = argv[++i];
+        int err = ERR_NONE;
+        if (!strcmp(opt, "-sizes")) {
+            err = parse_list(value, values, MAX_SIZES, &config->nb_sizes);
+            for (size_t s = 0; s < config->nb_sizes && err == ERR_NONE; s++) {
+                if (values[s] < 1 || values[s] > 1e8) err = ERR_MAX_FILES;
+                config->sizes[s] = (uint32_t) values[s];
+            }
+        } else if (!strcmp(opt, "-fills")) {
+            err = parse_list(value, values, MAX_FILLS, &config->nb_fills);
+            for (size_t f = 0; f < config->nb_fills && err == ERR_NONE; f++) {
+                if (values[f] <= 0 || values[f] > 1) err = ERR_INVALID_ARGUMENT;
+                config->fills[f] = values[f];
+            }
+        } else if (!strcmp(opt, "-backend")) {
+            const int backend = imgfs_backend_atoi(value);
+            if (backend < 0) err = ERR_INVALID_ARGUMENT;
+            config->backend = (enum imgfs_backend_kind) backend;
+            config->backend_name = value;
+        } else if (!strcmp(opt, "-time")) {
+            config->budget = strtod(value, NULL);
+            if (config->budget < 0) err = ERR_INVALID_ARGUMENT;
+        } else if (!strcmp(opt, "-dir")) {
+            config->dir = value;
+        } else if (!strcmp(opt, "-label")) {
+            config->label = value;
+        } else {
+            err = ERR_INVALID_COMMAND;
+        }
+        if (err != ERR_NONE) return err;
+    }
+    return read_image(argv[1], &config->image, &config->image_size);
+}
+
+/*******************************************************************************
+ * MAIN
+ */
+int main(int argc, char* argv[])
+{
+    if (VIPS_INIT(argv[0])) {
+        vips_error_exit("unable to start VIPS");
+    }
+
+    struct bench_config config = {
+        .sizes = { 1000, 10000, 100000, 1000000 }, .nb_sizes = 4,
+        .fills = { 0.1, 0.5, 0.9 }, .nb_fills = 3,
+        .backend = IMGFS_BACKEND_FILE, .backend_name = "file", .budget = 0.2, .dir = "/tmp"
+    };
+
+    int err = parse_args(argc, argv, &config);
+    for (size_t s = 0; s < config.nb_sizes && err == ERR_NONE; s++) {
+        for (size_t f = 0; f < config.nb_fills && err == ERR_NONE; f++) {
+            err = bench_store(&config, config.sizes[s], config.fills[f]);
+        }
+    }
+
+    if (err != ERR_NONE) {
+        fprintf(stderr, "ERROR: %s\n", ERR_MSG(err));
+        if (err == ERR_NOT_ENOUGH_ARGUMENTS || err == ERR_INVALID_ARGUMENT || err == ERR_INVALID_COMMAND) {
+            usage();
+        }
+    }
+    free(config.image);
+    vips_shutdown();
+    return err;
+}
@@ -0,0 +1,65 @@
+/**
+ * @file imgfs_probes.h
+ * @brief USDT (SystemTap SDT) probes of imgFS, for perf and bpftrace.
+ *
+ * The probes are built in when <sys/sdt.h> is found (systemtap-sdt-dev
+ * on Debian, systemtap-sdt-devel on Fedora) and IMGFS_NO_PROBES is not
+ * defined; otherwise they compile to nothing. A probe nobody traces is a
+ * single nop, but its arguments are still evaluated (the probes use no
+ * semaphore): pass values already at hand, never the result of a call.
+ *
+ * Provider "imgfs"; in the ELF notes, "__" in the names become "-".
+ * Strings are passed as pointers (str(argN) in bpftrace); request targets
+ * are not NUL-terminated and come with their length.
+ *
+ *   request__start  (connection, target, target_len, body_len)
+ *   request__done   (connection, target, target_len, status, bytes_out, error)
+ *   lookup__hit     (img_id, index)
+ *   lookup__miss    (img_id)
+ *   disk__read__start (resolution, offset, len)        resolution -1: not an image
+ *   disk__read__done  (resolution, offset, len, error)
+ *   resize__start   (img_id, resolution, width, height) resolution -1: arbitrary size,
+ *                                                       width and height 0: transcoding
+ *   resize__done    (img_id, resolution, size, error)
+ *   insert__commit  (img_id, index, size, duplicate)
+ *   dedup__hit      (img_id, index, index of the original, size)
+ *
+ * For instance:
+ *   bpftrace -e 'usdt:./imgfs_server:imgfs:lookup-miss { @[str(arg0)] = count(); }'
+ *   perf probe -x imgfs_server sdt_imgfs:disk__read__done && perf record -e sdt_imgfs:*
+ */
+
+#pragma once
+
+#if !defined(IMGFS_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define IMGFS_PROBES 1
+#endif
+#endif
+
+#ifdef IMGFS_PROBES
+
+#define IMGFS_PROBE1(name, a)                STAP_PROBE1(imgfs, name, a)
+#define IMGFS_PROBE2(name, a, b)             STAP_PROBE2(imgfs, name, a, b)
+#define IMGFS_PROBE3(name, a, b, c)          STAP_PROBE3(imgfs, name, a, b, c)
+#define IMGFS_PROBE4(name, a, b, c, d)       STAP_PROBE4(imgfs, name, a, b, c, d)
+#define IMGFS_PROBE6(name, a, b, c, d, e, f) STAP_PROBE6(imgfs, name, a, b, c, d, e, f)
+
+#else
+
+// the arguments are not evaluated, but count as used (arrays decay in ?:)
+#define IMGFS_PROBE_ARG(x) ((void) sizeof(0 ? (x) : (x)))
+#define IMGFS_PROBE1(name, a) \
+    do { IMGFS_PROBE_ARG(a); } while (0)
+#define IMGFS_PROBE2(name, a, b) \
+    do { IMGFS_PROBE_ARG(a); IMGFS_PROBE_ARG(b); } while (0)
+#define IMGFS_PROBE3(name, a, b, c) \
+    do { IMGFS_PROBE_ARG(a); IMGFS_PROBE_ARG(b); IMGFS_PROBE_ARG(c); } while (0)
+#define IMGFS_PROBE4(name, a, b, c, d) \
+    do { IMGFS_PROBE_ARG(a); IMGFS_PROBE_ARG(b); IMGFS_PROBE_ARG(c); IMGFS_PROBE_ARG(d); } while (0)
+#define IMGFS_PROBE6(name, a, b, c, d, e, f) \
+    do { IMGFS_PROBE_ARG(a); IMGFS_PROBE_ARG(b); IMGFS_PROBE_ARG(c); \
+         IMGFS_PROBE_ARG(d); IMGFS_PROBE_ARG(e); IMGFS_PROBE_ARG(f); } while (0)
+
+#endif
@@ -1,52 +1,96 @@
 #include "imgfs.h"
 #include "error.h"
 #include "image_content.h"
+#include "needle.h"
 #include <stdio.h>
-#include <string.h> 
+#include <string.h>
 #include <stdlib.h>
 
-int do_read(const char* img_id, int resolution, char** image_buffer, uint32_t* image_size, struct imgfs_file* imgfs_file) {
-    M_REQUIRE_NON_NULL(img_id); 
-    M_REQUIRE_NON_NULL(image_buffer); 
-    M_REQUIRE_NON_NULL(image_size); 
-    M_REQUIRE_NON_NULL(imgfs_file); 
-
-    struct img_metadata* metadata = NULL; 
-    size_t index;
-
-    for (index = 0; index < imgfs_file->header.max_files; index++) {
-        if(strcmp(imgfs_file->metadata[index].img_id, img_id) == 0 && 
-                imgfs_file->metadata[index].is_valid != EMPTY) {
-                    metadata = &imgfs_file->metadata[index];
-                    break; // ok ? break since we found it 
-                }
+/**
+ * @brief Finds a valid image and makes sure the requested resolution exists.
+ *
+ * @return Some error code. 0 if no error, with the slot of the image in *found.
+ */
+static int read_lookup(const char* img_id, int resolution, struct imgfs_file* imgfs_file,
+                       uint32_t* found)
+{
+    if (resolution < 0 || resolution >= NB_RES) {
+        return ERR_RESOLUTIONS;
     }
 
-    if (metadata == NULL) {
-        return ERR_IMAGE_NOT_FOUND; 
+    uint32_t index = 0;
+    if (imgfs_find_id(imgfs_file, img_id, &index) != ERR_NONE) {
+        return ERR_IMAGE_NOT_FOUND;
     }
 
-    if (metadata->size[resolution] == 0 || metadata->offset[resolution] == 0) {
+    if (imgfs_file->size[index][resolution] == 0 || imgfs_file->offset[index][resolution] == 0) {
         if (resolution != ORIG_RES) {
-            int resize = lazily_resize(resolution, imgfs_file, index); 
+            int resize = lazily_resize(resolution, imgfs_file, index);
             if (resize) {
-                return resize; 
+                return resize;
             }
         }
     }
 
-    *image_buffer = malloc(metadata->size[resolution]);
+    *found = index;
+    return ERR_NONE;
+}
+
+/**
+ * @brief Reads and verifies the content of one resolution of an image.
+ */
+static int read_content(const struct imgfs_file* imgfs_file, uint32_t index,
+                        int resolution, char* buffer)
+{
+    return needle_read(imgfs_file, resolution, imgfs_file->offset[index][resolution],
+                       buffer, imgfs_file->size[index][resolution]);
+}
+
+int do_read(const char* img_id, int resolution, char** image_buffer, uint32_t* image_size, struct imgfs_file* imgfs_file) {
+    M_REQUIRE_NON_NULL(img_id);
+    M_REQUIRE_NON_NULL(image_buffer);
+    M_REQUIRE_NON_NULL(image_size);
+    M_REQUIRE_NON_NULL(imgfs_file);
+
+    uint32_t index = 0;
+    int lookup = read_lookup(img_id, resolution, imgfs_file, &index);
+    if (lookup != ERR_NONE) {
+        return lookup;
+    }
+
+    *image_buffer = malloc(imgfs_file->size[index][resolution]);
     if (*image_buffer == NULL) {
         return ERR_OUT_OF_MEMORY;
     }
 
-    if (fseek(imgfs_file->file, metadata->offset[resolution], SEEK_SET) != 0 ||
-        fread(*image_buffer, metadata->size[resolution], 1, imgfs_file->file) != 1) {
+    int read = read_content(imgfs_file, index, resolution, *image_buffer);
+    if (read != ERR_NONE) {
         free(*image_buffer);
         *image_buffer = NULL;
-        return ERR_IO;
+        return read;
     }
 
-    *image_size = metadata->size[resolution];
+    *image_size = imgfs_file->size[index][resolution];
     return ERR_NONE;
-}
\ No newline at end of file
+}
+
+int do_read_into(const char* img_id, int resolution, char* buffer, size_t buffer_size,
+                 uint32_t* image_size, struct imgfs_file* imgfs_file) {
+    M_REQUIRE_NON_NULL(img_id);
+    M_REQUIRE_NON_NULL(buffer);
+    M_REQUIRE_NON_NULL(image_size);
+    M_REQUIRE_NON_NULL(imgfs_file);
+
+    uint32_t index = 0;
+    int lookup = read_lookup(img_id, resolution, imgfs_file, &index);
+    if (lookup != ERR_NONE) {
+        return lookup;
+    }
+
+    *image_size = imgfs_file->size[index][resolution];
+    if (buffer_size < *image_size) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    return read_content(imgfs_file, index, resolution, buffer);
+}
@@ -0,0 +1,346 @@
+/**
+ * @file imgfs_recover.c
+ * @brief Rebuilds the metadata table from the needles of the data region.
+ */
+
+#include "imgfs.h"
+#include "error.h"
+#include "image_content.h"
+#include "needle.h"
+#include "crc32c.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <openssl/sha.h> // for SHA256()
+
+/*
+ * Lookups of the replay, by img_id and by content, in open addressing
+ * tables over the hot arrays: each needle costs O(1) rather than a scan
+ * of the metadata table. A bucket holds a slot plus one (0 for an empty
+ * bucket), at the home of id_hash[slot] or sha_prefix[slot]: entries
+ * leave a table before their key changes.
+ */
+struct recover_index {
+    uint32_t* by_id;  // every valid slot
+    uint32_t* by_sha; // every valid slot
+    size_t mask;
+    size_t free_word; // the valid bitset has no free slot before this word
+};
+
+static void index_add(uint32_t* table, size_t mask, const uint64_t* keys, uint32_t slot)
+{
+    size_t b = (size_t) keys[slot] & mask;
+    while (table[b] != 0) {
+        b = (b + 1) & mask;
+    }
+    table[b] = slot + 1;
+}
+
+static void index_remove(uint32_t* table, size_t mask, const uint64_t* keys, uint32_t slot)
+{
+    size_t b = (size_t) keys[slot] & mask;
+    while (table[b] != slot + 1) {
+        if (table[b] == 0) return;
+        b = (b + 1) & mask;
+    }
+    table[b] = 0;
+
+    // backward shift, as in the directory of imgfs_store.c
+    for (size_t next = (b + 1) & mask; table[next] != 0; next = (next + 1) & mask) {
+        const size_t home = (size_t) keys[table[next] - 1] & mask;
+        if (((next - home) & mask) >= ((next - b) & mask)) {
+            table[b] = table[next];
+            table[next] = 0;
+            b = next;
+        }
+    }
+}
+
+static int index_init(struct recover_index* index, uint32_t max_files)
+{
+    size_t capacity = 16;
+    while (capacity < 2 * (size_t) max_files) {
+        capacity *= 2;
+    }
+    index->by_id = calloc(capacity, sizeof(*index->by_id));
+    index->by_sha = calloc(capacity, sizeof(*index->by_sha));
+    index->mask = capacity - 1;
+    index->free_word = 0;
+    return index->by_id != NULL && index->by_sha != NULL ? ERR_NONE : ERR_OUT_OF_MEMORY;
+}
+
+static void index_free(struct recover_index* index)
+{
+    free(index->by_id);
+    free(index->by_sha);
+}
+
+/**
+ * @brief Same as imgfs_find_id(), through the index.
+ */
+static int recover_find_id(const struct imgfs_file* imgfs_file, const struct recover_index* index,
+                           const char* img_id, uint32_t* slot)
+{
+    const uint64_t hash = imgfs_id_hash(img_id);
+    for (size_t b = (size_t) hash & index->mask; index->by_id[b] != 0; b = (b + 1) & index->mask) {
+        const uint32_t i = index->by_id[b] - 1;
+        if (imgfs_file->id_hash[i] == hash && strcmp(imgfs_file->cold[i]->img_id, img_id) == 0) {
+            *slot = i;
+            return ERR_NONE;
+        }
+    }
+    return ERR_IMAGE_NOT_FOUND;
+}
+
+/**
+ * @brief Finds the valid entry with the given content hash.
+ *
+ * @return Its index, or max_files if there is none.
+ */
+static uint32_t recover_find_sha(const struct imgfs_file* imgfs_file, const struct recover_index* index,
+                                 const unsigned char* SHA)
+{
+    const uint64_t prefix = imgfs_sha_prefix(SHA);
+    for (size_t b = (size_t) prefix & index->mask; index->by_sha[b] != 0; b = (b + 1) & index->mask) {
+        const uint32_t i = index->by_sha[b] - 1;
+        if (imgfs_file->sha_prefix[i] == prefix &&
+            memcmp(imgfs_file->cold[i]->SHA, SHA, SHA256_DIGEST_LENGTH) == 0) {
+            return i;
+        }
+    }
+    return imgfs_file->header.max_files;
+}
+
+static void recover_set_sha(struct imgfs_file* imgfs_file, struct recover_index* index,
+                            uint32_t slot, const unsigned char* SHA)
+{
+    index_remove(index->by_sha, index->mask, imgfs_file->sha_prefix, slot);
+    imgfs_set_sha(imgfs_file, slot, SHA);
+    index_add(index->by_sha, index->mask, imgfs_file->sha_prefix, slot);
+}
+
+static void recover_clear(struct imgfs_file* imgfs_file, struct recover_index* index, uint32_t slot)
+{
+    index_remove(index->by_id, index->mask, imgfs_file->id_hash, slot);
+    index_remove(index->by_sha, index->mask, imgfs_file->sha_prefix, slot);
+    imgfs_clear_slot(imgfs_file, slot);
+    imgfs_file->header.nb_files--;
+    if (slot / IMGFS_VALID_BITS < index->free_word) {
+        index->free_word = slot / IMGFS_VALID_BITS;
+    }
+}
+
+/**
+ * @brief Gives img_id a fresh entry, reusing its slot if it already exists.
+ *
+ * @return Some error code. 0 if no error, with the slot in *slot.
+ */
+static int recover_slot(struct imgfs_file* imgfs_file, struct recover_index* index,
+                        const char* img_id, uint32_t* slot)
+{
+    if (recover_find_id(imgfs_file, index, img_id, slot) == ERR_NONE) {
+        // same img_id, so same bucket in by_id; its SHA is reset
+        index_remove(index->by_sha, index->mask, imgfs_file->sha_prefix, *slot);
+        const int err = imgfs_fill_slot(imgfs_file, *slot, img_id);
+        index_add(index->by_sha, index->mask, imgfs_file->sha_prefix, *slot);
+        return err;
+    }
+
+    // the lowest free slot, as imgfs_find_free() would give
+    const size_t words = ((size_t) imgfs_file->header.max_files + IMGFS_VALID_BITS - 1) / IMGFS_VALID_BITS;
+    while (index->free_word < words && ~imgfs_file->valid[index->free_word] == 0) {
+        index->free_word++;
+    }
+    if (index->free_word == words) {
+        return ERR_IMGFS_FULL;
+    }
+    *slot = (uint32_t) (index->free_word * IMGFS_VALID_BITS) +
+            (uint32_t) __builtin_ctzll(~imgfs_file->valid[index->free_word]);
+    if (*slot >= imgfs_file->header.max_files) {
+        return ERR_IMGFS_FULL;
+    }
+    const int err = imgfs_fill_slot(imgfs_file, *slot, img_id);
+    if (err != ERR_NONE) {
+        return err;
+    }
+    index_add(index->by_id, index->mask, imgfs_file->id_hash, *slot);
+    index_add(index->by_sha, index->mask, imgfs_file->sha_prefix, *slot);
+    imgfs_file->header.nb_files++;
+    return ERR_NONE;
+}
+
+/**
+ * @brief Replays one sound needle onto the in-memory metadata table.
+ */
+static int recover_apply(struct imgfs_file* imgfs_file, struct recover_index* index,
+                         const struct needle_header* header, const char* img_id,
+                         const unsigned char* payload, uint64_t payload_offset)
+{
+    uint32_t slot = 0;
+
+    if (header->flags == NEEDLE_DELETE) {
+        if (recover_find_id(imgfs_file, index, img_id, &slot) == ERR_NONE) {
+            recover_clear(imgfs_file, index, slot);
+        }
+        return ERR_NONE;
+    }
+
+    if (header->resolution != ORIG_RES) {
+        if (header->flags != NEEDLE_BLOB || header->resolution >= NB_RES) {
+            return ERR_NONE;
+        }
+        if (recover_find_id(imgfs_file, index, img_id, &slot) == ERR_NONE) {
+            imgfs_file->size[slot][header->resolution] = header->size;
+            imgfs_file->offset[slot][header->resolution] = payload_offset;
+        }
+        return ERR_NONE;
+    }
+
+    if (header->flags == NEEDLE_DIGEST) {
+        if (header->size == sizeof(struct needle_digest) &&
+            recover_find_id(imgfs_file, index, img_id, &slot) == ERR_NONE) {
+            struct needle_digest digest;
+            memcpy(&digest, payload, sizeof(digest));
+            recover_set_sha(imgfs_file, index, slot, digest.SHA);
+            imgfs_file->cold[slot]->saved_kib = imgfs_saved_kib(digest.saved);
+        }
+        return ERR_NONE;
+    }
+
+    if (header->flags == NEEDLE_ALIAS) {
+        if (header->size != SHA256_DIGEST_LENGTH) return ERR_NONE;
+        const uint32_t source = recover_find_sha(imgfs_file, index, payload);
+        if (source == imgfs_file->header.max_files) return ERR_NONE;
+
+        struct img_metadata shared;
+        imgfs_get_metadata(imgfs_file, source, &shared);
+        int err = recover_slot(imgfs_file, index, img_id, &slot);
+        if (err != ERR_NONE) return err;
+        struct img_cold* cold = imgfs_file->cold[slot];
+        recover_set_sha(imgfs_file, index, slot, shared.SHA);
+        memcpy(cold->orig_res, shared.orig_res, sizeof(shared.orig_res));
+        cold->saved_kib = shared.saved_kib;
+        memcpy(imgfs_file->size[slot], shared.size, sizeof(shared.size));
+        memcpy(imgfs_file->offset[slot], shared.offset, sizeof(shared.offset));
+        return ERR_NONE;
+    }
+
+    int err = recover_slot(imgfs_file, index, img_id, &slot);
+    if (err != ERR_NONE) return err;
+    struct img_cold* cold = imgfs_file->cold[slot];
+    unsigned char SHA[SHA256_DIGEST_LENGTH];
+    SHA256(payload, header->size, SHA);
+    recover_set_sha(imgfs_file, index, slot, SHA);
+    imgfs_file->size[slot][ORIG_RES] = header->size;
+    imgfs_file->offset[slot][ORIG_RES] = payload_offset;
+    // an undecodable original is still worth keeping: its bytes are intact
+    (void) get_resolution(&cold->orig_res[HEIGHT_I], &cold->orig_res[WIDTH_I],
+                          (const char*) payload, header->size);
+    return ERR_NONE;
+}
+
+/********************************************************************
+ * See imgfs.h
+ */
+int do_recover(struct imgfs_file* imgfs_file)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->cold);
+
+    if (imgfs_file->header.format != IMGFS_FORMAT_NEEDLE) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    const uint64_t file_end = imgfs_file->file_end;
+
+    for (uint32_t i = 0; i < imgfs_file->header.max_files; i++) {
+        imgfs_clear_slot(imgfs_file, i);
+    }
+    imgfs_file->header.nb_files = 0;
+
+    struct recover_index index;
+    int err = index_init(&index, imgfs_file->header.max_files);
+    unsigned char* payload = NULL; // grown to the biggest payload
+    size_t payload_capacity = 0;
+    uint64_t blob_bytes = 0; // content of all the sound needles, referred to or not
+    uint64_t pos = imgfs_data_start(&imgfs_file->header);
+    while (err == ERR_NONE && pos + sizeof(struct needle_header) <= file_end) {
+        struct needle_header header;
+        if (imgfs_pread(imgfs_file, &header, sizeof(header), pos) != ERR_NONE) {
+            err = ERR_IO;
+            break;
+        }
+
+        // the needle must lie within the file: this bounds header.size
+        // before anything is allocated for it
+        const uint64_t total = needle_total_size(header.size, header.id_len);
+        if (header.magic != NEEDLE_MAGIC || header.id_len == 0 ||
+            header.id_len > MAX_IMG_ID || pos + total > file_end) {
+            // not a needle (torn write or garbage): resynchronize
+            pos += NEEDLE_ALIGN;
+            continue;
+        }
+
+        // the img_id trailer, checked against the header first: a stray
+        // magic number costs no payload read
+        char img_id[MAX_IMG_ID + 1] = { 0 };
+        if (imgfs_pread(imgfs_file, img_id, header.id_len,
+                        pos + sizeof(header) + header.size) != ERR_NONE) {
+            err = ERR_IO;
+            break;
+        }
+        if (imgfs_id_hash(img_id) != header.id_hash) {
+            pos += NEEDLE_ALIGN;
+            continue;
+        }
+
+        if (header.size > payload_capacity || payload == NULL) {
+            unsigned char* grown = realloc(payload, header.size > 0 ? header.size : 1);
+            if (grown == NULL) {
+                err = ERR_OUT_OF_MEMORY;
+                break;
+            }
+            payload = grown;
+            payload_capacity = header.size;
+        }
+        if (header.size > 0 &&
+            imgfs_pread(imgfs_file, payload, header.size, pos + sizeof(header)) != ERR_NONE) {
+            err = ERR_IO;
+            break;
+        }
+
+        // a needle with a bad checksum is skipped as a whole
+        if (crc32c(0, payload, header.size) == header.crc) {
+            err = recover_apply(imgfs_file, &index, &header, img_id, payload, pos + sizeof(header));
+            if (header.flags == NEEDLE_BLOB) {
+                blob_bytes += header.size;
+            }
+        }
+        pos += total;
+    }
+    free(payload);
+    index_free(&index);
+    if (err != ERR_NONE) {
+        return err;
+    }
+
+    // the space counters start again from what the needles hold
+    if (imgfs_file->header.flags & IMGFS_FLAG_SPACE) {
+        err = imgfs_space_scan(imgfs_file, &imgfs_file->space);
+        if (err != ERR_NONE) {
+            return err;
+        }
+        imgfs_file->space.dead_bytes = blob_bytes > imgfs_file->space.live_bytes ?
+                                       blob_bytes - imgfs_file->space.live_bytes : 0;
+        if (imgfs_space_write(imgfs_file) != ERR_NONE) {
+            return ERR_IO;
+        }
+    }
+
+    imgfs_file->header.version++;
+    if (imgfs_pwrite(imgfs_file, &imgfs_file->header, sizeof(struct imgfs_header), 0) != ERR_NONE) {
+        return ERR_IO;
+    }
+
+    return imgfs_write_table(imgfs_file);
+}
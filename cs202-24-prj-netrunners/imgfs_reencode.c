@@ -0,0 +1,176 @@
+/**
+ * @file imgfs_reencode.c
+ * @brief Applies new encode profiles to the existing resized variants.
+ */
+
+#include "imgfs.h"
+#include "error.h"
+#include "image_content.h"
+
+#include <stdlib.h> // for calloc, free, qsort
+#include <string.h> // for memcmp, memset
+
+struct sha_slot {
+    const unsigned char* SHA;
+    uint32_t index;
+};
+
+static int sha_slot_cmp(const void* a, const void* b)
+{
+    const struct sha_slot* x = a;
+    const struct sha_slot* y = b;
+    const int cmp = memcmp(x->SHA, y->SHA, SHA256_DIGEST_LENGTH);
+    if (cmp != 0) return cmp;
+    return x->index < y->index ? -1 : x->index > y->index;
+}
+
+/**
+ * @brief A variant already made again, for an image with the same content.
+ */
+struct remade {
+    int resolution;
+    uint64_t old_offset;
+    uint64_t offset;
+    uint32_t size;
+};
+
+static const struct remade* remade_find(const struct remade* remade, size_t nb_remade,
+                                        int resolution, uint64_t old_offset)
+{
+    for (size_t r = 0; r < nb_remade; r++) {
+        if (remade[r].resolution == resolution && remade[r].old_offset == old_offset) {
+            return &remade[r];
+        }
+    }
+    return NULL;
+}
+
+/*******************************************************************
+ * Writes the new profiles to the header.
+ */
+static int reencode_profiles(struct imgfs_file* imgfs_file,
+                             const struct encode_profile* const profiles[ORIG_RES])
+{
+    const uint64_t old_profiles = imgfs_file->header.profiles;
+    for (int res = 0; res < ORIG_RES; res++) {
+        const int err = profiles[res] != NULL ?
+                        imgfs_set_profile(&imgfs_file->header, res, profiles[res]) : ERR_NONE;
+        if (err != ERR_NONE) {
+            imgfs_file->header.profiles = old_profiles;
+            return err;
+        }
+    }
+
+    imgfs_file->header.version++;
+    if (imgfs_pwrite(imgfs_file, &imgfs_file->header, sizeof(struct imgfs_header), 0) != ERR_NONE) {
+        imgfs_file->header.profiles = old_profiles;
+        imgfs_file->header.version--;
+        return ERR_IO;
+    }
+    return ERR_NONE;
+}
+
+/**
+ * @brief Makes again the variants of one image, or takes those already
+ *        made for an earlier image which shared them.
+ */
+static int reencode_image(struct imgfs_file* imgfs_file, uint32_t index,
+                          struct remade* remade, size_t* nb_remade, struct reencode_stats* stats)
+{
+    uint64_t old_offset[ORIG_RES];
+    uint32_t old_size[ORIG_RES];
+    unsigned mask = 0;
+    int shared = 0;
+
+    for (int res = 0; res < ORIG_RES; res++) {
+        old_offset[res] = imgfs_file->offset[index][res];
+        old_size[res] = imgfs_file->size[index][res];
+        if (old_size[res] == 0) continue;
+
+        const struct remade* done = remade_find(remade, *nb_remade, res, old_offset[res]);
+        if (done != NULL) {
+            imgfs_space_unref(imgfs_file, index, 1u << res);
+            imgfs_file->offset[index][res] = done->offset;
+            imgfs_file->size[index][res] = done->size;
+            imgfs_space_ref(imgfs_file, index, 1u << res);
+            shared = 1;
+        } else {
+            mask |= 1u << res;
+        }
+    }
+
+    if (mask == 0) {
+        if (!shared) return ERR_NONE;
+        const int err = imgfs_write_metadata(imgfs_file, index);
+        return err != ERR_NONE ? err : imgfs_space_write(imgfs_file);
+    }
+
+    const int err = remake_variants(imgfs_file, index, mask);
+    if (err != ERR_NONE) {
+        return err;
+    }
+    for (int res = 0; res < ORIG_RES; res++) {
+        if (!(mask & (1u << res))) continue;
+        remade[(*nb_remade)++] = (struct remade) {
+            res, old_offset[res], imgfs_file->offset[index][res], imgfs_file->size[index][res]
+        };
+        stats->variants++;
+        stats->bytes_before += old_size[res];
+        stats->bytes_after += imgfs_file->size[index][res];
+    }
+    return ERR_NONE;
+}
+
+/********************************************************************
+ * See imgfs.h
+ */
+int do_reencode(struct imgfs_file* imgfs_file,
+                const struct encode_profile* const profiles[ORIG_RES],
+                struct reencode_stats* stats)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->cold);
+
+    struct reencode_stats ignored;
+    if (stats == NULL) {
+        stats = &ignored;
+    }
+    memset(stats, 0, sizeof(*stats));
+
+    int err = profiles != NULL ? reencode_profiles(imgfs_file, profiles) : ERR_NONE;
+    if (err != ERR_NONE) {
+        return err;
+    }
+
+    // images sharing content end up next to each other
+    const uint32_t max_files = imgfs_file->header.max_files;
+    struct sha_slot* slots = calloc(max_files, sizeof(*slots));
+    struct remade* remade = calloc((size_t) max_files * ORIG_RES, sizeof(*remade));
+    if (slots == NULL || remade == NULL) {
+        free(slots);
+        free(remade);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    size_t nb_slots = 0;
+    const uint32_t words = (max_files + IMGFS_VALID_BITS - 1) / IMGFS_VALID_BITS;
+    for (uint32_t w = 0; w < words; w++) {
+        for (uint64_t bits = imgfs_file->valid[w]; bits != 0; bits &= bits - 1) {
+            const uint32_t i = w * IMGFS_VALID_BITS + (uint32_t) __builtin_ctzll(bits);
+            slots[nb_slots++] = (struct sha_slot) { imgfs_file->cold[i]->SHA, i };
+        }
+    }
+    qsort(slots, nb_slots, sizeof(*slots), sha_slot_cmp);
+
+    size_t nb_remade = 0;
+    for (size_t s = 0; err == ERR_NONE && s < nb_slots; s++) {
+        if (s > 0 && memcmp(slots[s].SHA, slots[s - 1].SHA, SHA256_DIGEST_LENGTH) != 0) {
+            nb_remade = 0; // new content: nothing to share with the previous images
+        }
+        err = reencode_image(imgfs_file, slots[s].index, remade, &nb_remade, stats);
+    }
+
+    free(slots);
+    free(remade);
+    return err;
+}
@@ -0,0 +1,445 @@
+/**
+ * @file imgfs_scrub.c
+ * @brief Integrity scrubbing of an imgFS.
+ */
+
+#include "imgfs_scrub.h"
+#include "error.h"
+#include "needle.h"
+#include "util.h" // for MIN, MAX, now_ns
+
+#include <openssl/sha.h> // for SHA256()
+#include <setjmp.h>      // for setjmp, longjmp
+#include <stdio.h>       // needed by jpeglib.h
+#include <stdlib.h>      // for calloc, free, qsort, realloc
+#include <string.h>      // for memcmp, memcpy, memset, strncpy
+#include <time.h>        // for nanosleep
+#include <jpeglib.h>
+
+#define TIER_BIT (UINT64_C(1) << 63) // in the keys of the blobs of the tier file
+#define MAX_GAP_SHARE 4              // a window skips at most window / 4 bytes between blobs
+#define SLEEP_SLICE_NS 100000000u    // throttled workers look at config->stop this often
+
+/**
+ * @brief A slot referring to a blob.
+ */
+struct scrub_ref {
+    uint64_t key; // offset, with TIER_BIT for the tier file
+    uint32_t size;
+    uint32_t index;
+    int resolution;
+};
+
+/**
+ * @brief A blob to verify, with the run of refs that refer to it.
+ */
+struct scrub_blob {
+    uint64_t offset;
+    uint32_t size;
+    int resolution; // of its first ref
+    size_t first_ref;
+    size_t nb_refs;
+    unsigned char SHA[SHA256_DIGEST_LENGTH]; // originals only
+    int error;      // written by the worker that verifies it
+};
+
+/**
+ * @brief Consecutive blobs of one file, read at once.
+ */
+struct scrub_window {
+    uint64_t start;
+    uint64_t len;
+    int resolution; // picks the file
+    size_t first_blob;
+    size_t nb_blobs;
+};
+
+struct scrub_job {
+    const struct imgfs_file* file;
+    const struct scrub_config* config;
+    int needles;   // payloads are preceded by their needle header
+    int optimized; // originals may differ from the upload (IMGFS_FLAG_OPTIMIZE)
+
+    struct scrub_ref* refs;
+    size_t nb_refs;
+    struct scrub_blob* blobs;
+    size_t nb_blobs;
+    struct scrub_window* windows;
+    size_t nb_windows;
+
+    atomic_size_t next_window;
+    atomic_ullong blobs_done;
+    atomic_ullong bytes_done;
+    atomic_int stopped;
+    atomic_int error;
+
+    pthread_mutex_t throttle_lock;
+    uint64_t throttle_next; // when the next read may start (CLOCK_MONOTONIC ns)
+};
+
+static int scrub_stopping(const struct scrub_job* job)
+{
+    return job->config->stop != NULL && atomic_load_explicit(job->config->stop, memory_order_relaxed);
+}
+
+static void read_lock(const struct scrub_job* job)
+{
+    if (job->config->lock != NULL) pthread_rwlock_rdlock(job->config->lock);
+}
+
+static void read_unlock(const struct scrub_job* job)
+{
+    if (job->config->lock != NULL) pthread_rwlock_unlock(job->config->lock);
+}
+
+/*******************************************************************
+ * Decodability: the whole entropy-coded data is decoded, into DCT
+ * coefficients. libjpeg only warns about a truncated or garbled stream
+ * (and makes up the missing part): that is damage too.
+ */
+struct decode_check {
+    struct jpeg_decompress_struct src;
+    struct jpeg_error_mgr err;
+    jmp_buf jump;
+};
+
+static void check_error_exit(j_common_ptr cinfo)
+{
+    longjmp(((struct decode_check*) cinfo->client_data)->jump, 1);
+}
+
+static void check_output_message(j_common_ptr cinfo)
+{
+    (void) cinfo; // the warnings are counted, not printed
+}
+
+static int jpeg_decodes(const unsigned char* image, uint32_t size)
+{
+    struct decode_check check;
+    check.src.err = jpeg_std_error(&check.err);
+    check.err.error_exit = check_error_exit;
+    check.err.output_message = check_output_message;
+    check.src.client_data = &check;
+
+    if (setjmp(check.jump)) {
+        jpeg_destroy_decompress(&check.src);
+        return ERR_IMGLIB;
+    }
+
+    jpeg_create_decompress(&check.src);
+    jpeg_mem_src(&check.src, image, (unsigned long) size);
+    (void) jpeg_read_header(&check.src, TRUE);
+    (void) jpeg_read_coefficients(&check.src);
+    (void) jpeg_finish_decompress(&check.src);
+    const long warnings = check.err.num_warnings;
+    jpeg_destroy_decompress(&check.src);
+    return warnings == 0 ? ERR_NONE : ERR_IMGLIB;
+}
+
+static int scrub_verify(const struct scrub_job* job, const struct scrub_blob* blob,
+                        const unsigned char* payload)
+{
+    if (job->needles) {
+        struct needle_header header;
+        memcpy(&header, payload - sizeof(header), sizeof(header));
+        const int err = needle_verify(&header, blob->resolution, payload, blob->size);
+        if (err != ERR_NONE) {
+            return err;
+        }
+    }
+
+    if (blob->resolution == ORIG_RES) {
+        unsigned char SHA[SHA256_DIGEST_LENGTH];
+        SHA256(payload, blob->size, SHA);
+        if (memcmp(SHA, blob->SHA, SHA256_DIGEST_LENGTH) == 0) {
+            return ERR_NONE;
+        }
+        if (!job->optimized) {
+            return ERR_CORRUPTED;
+        }
+        // perhaps optimized: stored as a different, but sound, JPEG
+    }
+    return jpeg_decodes(payload, blob->size);
+}
+
+/*******************************************************************
+ * Snapshot of the blobs to verify (read lock held).
+ */
+static int ref_cmp(const void* a, const void* b)
+{
+    const struct scrub_ref* x = a;
+    const struct scrub_ref* y = b;
+    if (x->key != y->key) return x->key < y->key ? -1 : 1;
+    return x->index < y->index ? -1 : x->index > y->index;
+}
+
+static int scrub_snapshot(struct scrub_job* job)
+{
+    const struct imgfs_file* file = job->file;
+    job->needles = file->header.format == IMGFS_FORMAT_NEEDLE;
+    job->optimized = (file->header.flags & IMGFS_FLAG_OPTIMIZE) != 0;
+
+    const size_t max_refs = (size_t) NB_RES * file->header.nb_files;
+    job->refs = calloc(max_refs + 1, sizeof(*job->refs));
+    if (job->refs == NULL) return ERR_OUT_OF_MEMORY;
+
+    for (uint32_t i = 0; i < file->header.max_files && job->nb_refs < max_refs; i++) {
+        if (!imgfs_is_valid(file, i)) continue;
+        for (int res = 0; res < NB_RES; res++) {
+            if (file->size[i][res] == 0) continue;
+            job->refs[job->nb_refs++] = (struct scrub_ref) {
+                file->offset[i][res] | (imgfs_in_tier(file, res) ? TIER_BIT : 0),
+                file->size[i][res], i, res
+            };
+        }
+    }
+    qsort(job->refs, job->nb_refs, sizeof(*job->refs), ref_cmp);
+
+    job->blobs = calloc(job->nb_refs + 1, sizeof(*job->blobs));
+    if (job->blobs == NULL) return ERR_OUT_OF_MEMORY;
+
+    for (size_t r = 0; r < job->nb_refs; r++) {
+        const struct scrub_ref* ref = &job->refs[r];
+        if (r > 0 && ref->key == job->refs[r - 1].key) {
+            job->blobs[job->nb_blobs - 1].nb_refs++;
+            continue;
+        }
+        struct scrub_blob* blob = &job->blobs[job->nb_blobs++];
+        blob->offset = ref->key & ~TIER_BIT;
+        blob->size = ref->size;
+        blob->resolution = ref->resolution;
+        blob->first_ref = r;
+        blob->nb_refs = 1;
+        if (ref->resolution == ORIG_RES) {
+            memcpy(blob->SHA, file->cold[ref->index]->SHA, SHA256_DIGEST_LENGTH);
+        }
+    }
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Groups the blobs into windows of at most window bytes (unless a blob
+ * alone is bigger), without long gaps of bytes nobody needs.
+ */
+static int scrub_plan_windows(struct scrub_job* job, size_t window)
+{
+    job->windows = calloc(job->nb_blobs + 1, sizeof(*job->windows));
+    if (job->windows == NULL) return ERR_OUT_OF_MEMORY;
+
+    const uint64_t frame = job->needles ? sizeof(struct needle_header) : 0;
+    struct scrub_window* current = NULL;
+    uint64_t current_end = 0;
+    for (size_t b = 0; b < job->nb_blobs; b++) {
+        struct scrub_blob* blob = &job->blobs[b];
+        if (blob->offset < frame) { // no room for its needle
+            blob->error = ERR_CORRUPTED;
+            continue;
+        }
+        const uint64_t start = blob->offset - frame;
+        const uint64_t end = blob->offset + blob->size;
+        const int tier = imgfs_in_tier(job->file, blob->resolution);
+
+        if (current == NULL || tier != imgfs_in_tier(job->file, current->resolution) ||
+            start < current->start || end - current->start > window ||
+            start > current_end + window / MAX_GAP_SHARE) {
+            current = &job->windows[job->nb_windows++];
+            *current = (struct scrub_window) { start, 0, blob->resolution, b, 0 };
+            current_end = start;
+        }
+        current_end = MAX(current_end, end);
+        current->len = current_end - current->start;
+        current->nb_blobs = b + 1 - current->first_blob;
+    }
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Rate limit: each read books the next len / max_rate seconds, the
+ * workers wait for their turn.
+ */
+static void scrub_throttle(struct scrub_job* job, uint64_t len)
+{
+    const uint64_t rate = job->config->max_rate;
+    if (rate == 0) return;
+
+    pthread_mutex_lock(&job->throttle_lock);
+    const uint64_t now = now_ns();
+    const uint64_t start = MAX(now, job->throttle_next);
+    job->throttle_next = start + len * 1000000000u / rate;
+    pthread_mutex_unlock(&job->throttle_lock);
+
+    for (uint64_t t = now; t < start && !scrub_stopping(job); t = now_ns()) {
+        const uint64_t wait = MIN(start - t, SLEEP_SLICE_NS);
+        const struct timespec ts = { (time_t) (wait / 1000000000u), (long) (wait % 1000000000u) };
+        nanosleep(&ts, NULL);
+    }
+}
+
+static void* scrub_worker(void* arg)
+{
+    struct scrub_job* job = arg;
+    unsigned char* buf = NULL;
+    size_t capacity = 0;
+
+    for (;;) {
+        if (scrub_stopping(job)) {
+            atomic_store(&job->stopped, 1);
+            break;
+        }
+        const size_t w = atomic_fetch_add(&job->next_window, 1);
+        if (w >= job->nb_windows || atomic_load(&job->error) != ERR_NONE) {
+            break;
+        }
+        const struct scrub_window* window = &job->windows[w];
+        if (window->len > capacity) {
+            unsigned char* bigger = realloc(buf, window->len);
+            if (bigger == NULL) {
+                atomic_store(&job->error, ERR_OUT_OF_MEMORY);
+                break;
+            }
+            buf = bigger;
+            capacity = window->len;
+        }
+
+        scrub_throttle(job, window->len);
+        read_lock(job);
+        const int read = imgfs_res_pread(job->file, window->resolution, buf, window->len, window->start);
+        read_unlock(job);
+
+        for (size_t b = window->first_blob; b < window->first_blob + window->nb_blobs; b++) {
+            struct scrub_blob* blob = &job->blobs[b];
+            blob->error = read != ERR_NONE ? ERR_IO :
+                          scrub_verify(job, blob, buf + (blob->offset - window->start));
+        }
+        atomic_fetch_add(&job->blobs_done, window->nb_blobs);
+        atomic_fetch_add(&job->bytes_done, window->len);
+    }
+    free(buf);
+    return NULL;
+}
+
+/*******************************************************************
+ * Damage, for the slots which still refer to the damaged blobs
+ * (read lock held).
+ */
+static int damage_cmp(const void* a, const void* b)
+{
+    const struct scrub_damage* x = a;
+    const struct scrub_damage* y = b;
+    if (x->index != y->index) return x->index < y->index ? -1 : 1;
+    return (x->resolution > y->resolution) - (x->resolution < y->resolution);
+}
+
+static int scrub_collect(const struct scrub_job* job, struct scrub_report* report)
+{
+    const struct imgfs_file* file = job->file;
+    size_t count = 0;
+    for (size_t b = 0; b < job->nb_blobs; b++) {
+        if (job->blobs[b].error != ERR_NONE) count += job->blobs[b].nb_refs;
+    }
+    if (count == 0) return ERR_NONE;
+
+    report->damaged = calloc(count, sizeof(*report->damaged));
+    if (report->damaged == NULL) return ERR_OUT_OF_MEMORY;
+
+    for (size_t b = 0; b < job->nb_blobs; b++) {
+        const struct scrub_blob* blob = &job->blobs[b];
+        if (blob->error == ERR_NONE) continue;
+        for (size_t r = blob->first_ref; r < blob->first_ref + blob->nb_refs; r++) {
+            const struct scrub_ref* ref = &job->refs[r];
+            if (ref->index >= file->header.max_files || !imgfs_is_valid(file, ref->index) ||
+                file->offset[ref->index][ref->resolution] != blob->offset ||
+                file->size[ref->index][ref->resolution] != ref->size) {
+                continue; // deleted or replaced meanwhile
+            }
+            struct scrub_damage* damage = &report->damaged[report->nb_damaged++];
+            damage->index = ref->index;
+            damage->resolution = ref->resolution;
+            damage->error = blob->error;
+            strncpy(damage->img_id, file->cold[ref->index]->img_id, MAX_IMG_ID);
+        }
+    }
+    qsort(report->damaged, report->nb_damaged, sizeof(*report->damaged), damage_cmp);
+    return ERR_NONE;
+}
+
+/********************************************************************
+ * See imgfs_scrub.h
+ */
+int do_scrub(const struct imgfs_file* imgfs_file, const struct scrub_config* config,
+             struct scrub_report* report)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(config);
+    M_REQUIRE_NON_NULL(report);
+    memset(report, 0, sizeof(*report));
+
+    const uint64_t start = now_ns();
+    struct scrub_job job;
+    memset(&job, 0, sizeof(job));
+    job.file = imgfs_file;
+    job.config = config;
+    atomic_init(&job.next_window, 0);
+    atomic_init(&job.blobs_done, 0);
+    atomic_init(&job.bytes_done, 0);
+    atomic_init(&job.stopped, 0);
+    atomic_init(&job.error, ERR_NONE);
+    pthread_mutex_init(&job.throttle_lock, NULL);
+
+    read_lock(&job);
+    int err = scrub_snapshot(&job);
+    read_unlock(&job);
+    if (err == ERR_NONE) {
+        err = scrub_plan_windows(&job, config->window > 0 ? config->window : SCRUB_DEFAULT_WINDOW);
+    }
+
+    if (err == ERR_NONE) {
+        unsigned nb_threads = config->threads > 0 ? MIN(config->threads, SCRUB_MAX_THREADS)
+                                                  : SCRUB_DEFAULT_THREADS;
+        nb_threads = (unsigned) MIN(nb_threads, MAX(job.nb_windows, 1));
+        pthread_t threads[SCRUB_MAX_THREADS];
+        unsigned started = 0;
+        while (started < nb_threads &&
+               pthread_create(&threads[started], NULL, scrub_worker, &job) == 0) {
+            started++;
+        }
+        if (started == 0) {
+            scrub_worker(&job); // no thread to spare: do it here
+        }
+        for (unsigned t = 0; t < started; t++) {
+            pthread_join(threads[t], NULL);
+        }
+        err = atomic_load(&job.error);
+    }
+
+    if (err == ERR_NONE) {
+        read_lock(&job);
+        err = scrub_collect(&job, report);
+        read_unlock(&job);
+    }
+
+    report->blobs = atomic_load(&job.blobs_done);
+    report->bytes = atomic_load(&job.bytes_done);
+    report->stopped = atomic_load(&job.stopped);
+    report->elapsed_ns = now_ns() - start;
+
+    pthread_mutex_destroy(&job.throttle_lock);
+    free(job.windows);
+    free(job.blobs);
+    free(job.refs);
+    if (err != ERR_NONE) {
+        scrub_report_free(report);
+    }
+    return err;
+}
+
+/********************************************************************
+ * See imgfs_scrub.h
+ */
+void scrub_report_free(struct scrub_report* report)
+{
+    if (report == NULL) return;
+    free(report->damaged);
+    report->damaged = NULL;
+    report->nb_damaged = 0;
+}
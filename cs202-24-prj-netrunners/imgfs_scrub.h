@@ -0,0 +1,86 @@
+/**
+ * @file imgfs_scrub.h
+ * @brief Integrity scrubbing of an imgFS: finds the stored images whose
+ *        bytes went bad, before a user does.
+ *
+ * Originals are checked against the SHA-256 in their metadata, resized
+ * variants by decoding them (the entropy-coded data, without the IDCT).
+ * In the needle format, every blob is also checked against the CRC-32C
+ * of its needle. Originals optimized at insertion no longer match the
+ * SHA-256 of the upload they are named after: those are checked like
+ * variants.
+ *
+ * A scrub first takes a snapshot of the blobs the metadata refers to,
+ * each once however many images share it, sorted by location. They are
+ * then read in large windows of consecutive blobs, which worker threads
+ * take in order, throttled by a rate limit shared by all the workers.
+ * Only the windows that are being read hold the lock of the imgFS, so
+ * that requests keep being served during a scrub.
+ */
+
+#pragma once
+
+#include "imgfs.h"
+
+#include <pthread.h>   // for pthread_rwlock_t
+#include <stdatomic.h> // for atomic_int
+#include <stddef.h>    // for size_t
+#include <stdint.h>    // for uint32_t, uint64_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SCRUB_DEFAULT_THREADS 4
+#define SCRUB_MAX_THREADS 64
+#define SCRUB_DEFAULT_WINDOW (4u << 20) // bytes per read
+
+struct scrub_config {
+    unsigned threads;       // worker threads, 0 for SCRUB_DEFAULT_THREADS
+    uint64_t max_rate;      // bytes read per second by all the workers, 0 for no limit
+    size_t window;          // bytes per read, 0 for SCRUB_DEFAULT_WINDOW
+    pthread_rwlock_t* lock; // if not NULL, read-locked to snapshot, read and report
+    const atomic_int* stop; // if not NULL, the scrub ends early once it is set
+};
+
+/**
+ * @brief A damaged variant of an image.
+ */
+struct scrub_damage {
+    uint32_t index;
+    int resolution;
+    int error; // ERR_CORRUPTED (SHA-256 or needle), ERR_IMGLIB (not decodable) or ERR_IO
+    char img_id[MAX_IMG_ID + 1];
+};
+
+struct scrub_report {
+    uint64_t blobs;      // blobs verified
+    uint64_t bytes;      // bytes read
+    uint64_t elapsed_ns;
+    int stopped;         // the scrub was stopped before its end
+    size_t nb_damaged;
+    struct scrub_damage* damaged; // by slot and resolution, see scrub_report_free()
+};
+
+/**
+ * @brief Verifies all the blobs the metadata of an imgFS refers to.
+ *
+ * Damage found in a blob is reported for every image that refers to it,
+ * as long as it still does at the end of the scrub.
+ *
+ * @param imgfs_file The imgFS, opened
+ * @param config The scrub parameters
+ * @param report Where to put the result, to be freed with scrub_report_free()
+ * @return Some error code (not for damage, which is reported). 0 if no error.
+ */
+int do_scrub(const struct imgfs_file* imgfs_file, const struct scrub_config* config,
+             struct scrub_report* report);
+
+/**
+ * @brief Frees the damage list of a report.
+ */
+void scrub_report_free(struct scrub_report* report);
+
+#ifdef __cplusplus
+}
+#endif
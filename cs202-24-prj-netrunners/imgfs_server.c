@@ -53,9 +53,6 @@ int main (int argc, char *argv[])
     if (argc < 2 ) {
         return ERR_NOT_ENOUGH_ARGUMENTS; 
     }
-    if (argc > 3) {
-        return ERR_INVALID_ARGUMENT; 
-    }
 
     if(VIPS_INIT(argv[0])) {
         vips_error_exit("unable to start VIPS");
@@ -10,44 +10,274 @@
 #include <string.h>
 #include <stdint.h> // uint16_t
 #include <signal.h> // signal
-#include <pthread.h> // pthread_mutex_t
 
 #include "error.h"
 #include "util.h" // atouint16
 #include "imgfs.h"
+#include "imgfs_store.h"
+#include "image_content.h"
+#include "resize_engine.h"
+#include "access_log.h"
+#include "access_trace.h"
+#include "imgfs_probes.h"
+#include "request_phases.h"
+#include "server_metrics.h"
 #include "http_net.h"
 #include "imgfs_server_service.h"
 
-// Main in-memory structure for imgFS
-static struct imgfs_file fs_file;
+// Main in-memory structure for imgFS: all the volumes
+static struct imgfs_store store;
 static uint16_t server_port;
+// per resolution, bit f set if variants may be served in image_format f
+static unsigned tier_formats[NB_RES];
+static unsigned sized_formats; // same, for variants of arbitrary size
 
-pthread_mutex_t imgfs_mutex;
+// bounding boxes that arbitrary-size reads are snapped to
+#define MAX_SIZES 16
+static struct { uint16_t width, height; } sizes[MAX_SIZES];
+static size_t nb_sizes;
+
+// requests served, with -trace (see imgfs_bench -replay)
+static struct trace_writer trace;
 
 #define URI_ROOT "/imgfs"
+#define BLOB_URI URI_ROOT "/blob/"
+#define IMMUTABLE "Cache-Control: public, max-age=31536000, immutable" HTTP_LINE_DELIM
+#define REVALIDATE "Cache-Control: public, max-age=3600" HTTP_LINE_DELIM
+#define DEFAULT_CACHE_MB 64
+#define DEFAULT_RESIZE_MEM_MB 256u
+#define DEFAULT_VARIANT_CACHE_MB 64
+#define DEFAULT_SIZES "160x160,320x320,640x640,1280x1280,1920x1920"
+#define DEFAULT_SCRUB_THREADS 2
+#define DEFAULT_SCRUB_INTERVAL (24 * 3600) // seconds
+
+/**********************************************************************
+ * Parses a comma separated list of WxH bounding boxes into sizes.
+ ********************************************************************** */
+static int parse_sizes(const char* list)
+{
+    nb_sizes = 0;
+    while (*list != '\0') {
+        unsigned width = 0, height = 0;
+        int len = 0;
+        if (nb_sizes >= MAX_SIZES || sscanf(list, "%ux%u%n", &width, &height, &len) != 2 ||
+            width == 0 || height == 0 || width > UINT16_MAX || height > UINT16_MAX ||
+            (list[len] != ',' && list[len] != '\0')) {
+            return ERR_INVALID_ARGUMENT;
+        }
+        sizes[nb_sizes].width = (uint16_t) width;
+        sizes[nb_sizes].height = (uint16_t) height;
+        nb_sizes++;
+        list += len + (list[len] == ',');
+    }
+    return nb_sizes > 0 ? ERR_NONE : ERR_INVALID_ARGUMENT;
+}
+
+/**********************************************************************
+ * Snaps a requested size (0 for any) to the smallest allowed box holding
+ * it, or to the largest allowed box.
+ ********************************************************************** */
+static size_t snap_size(uint16_t width, uint16_t height)
+{
+    size_t best = SIZE_MAX, largest = 0;
+    for (size_t s = 0; s < nb_sizes; s++) {
+        const uint32_t area = (uint32_t) sizes[s].width * sizes[s].height;
+        if (area > (uint32_t) sizes[largest].width * sizes[largest].height) {
+            largest = s;
+        }
+        if (sizes[s].width >= width && sizes[s].height >= height &&
+            (best == SIZE_MAX || area < (uint32_t) sizes[best].width * sizes[best].height)) {
+            best = s;
+        }
+    }
+    return best != SIZE_MAX ? best : largest;
+}
 
 /********************************************************************//**
- * Startup function. Create imgFS file and load in-memory structure.
- * Pass the imgFS file name as argv[1] and optionnaly port number as argv[2]
+ * Startup function. Open the imgFS volumes and load in-memory structure.
+ * Pass the imgFS file name as argv[1], optionnaly port number as argv[2]
+ * and optionnaly the storage backend ("file", "mmap" or "memory") as argv[3].
+ * They can be followed by options:
+ *   -volume <imgFS_filename>: one more imgFS volume (repeatable)
+ *   -volume_size <MB>: seal volumes when they grow bigger than this
+ *   -cache <MB>: memory budget of the blob cache (0 disables it)
+ *   -resize_jobs <N>: resizes running at once (default: one per CPU)
+ *   -resize_queue <N>: resizes waiting for a slot before refusing more
+ *   -resize_mem <MB>: decoded size above which an image is not resized
+ *   -format <thumb|small|sized> <webp|avif>: also serve that tier (or the
+ *                    arbitrary-size variants) in that format to clients which
+ *                    accept it (repeatable)
+ *   -sizes <WxH,...>: bounding boxes arbitrary-size reads are snapped to
+ *   -variant_cache <MB>: memory budget of the arbitrary-size variants and of
+ *                        the tiers in other formats than JPEG
+ *   -trace <file>: record every request in a trace (see access_trace.h)
+ *   -access_log <file>: log every request there (see access_log.h)
+ *   -slow_ms <ms>: log the phase times of requests at least this slow
+ *   -slow_sample <N>: log only one slow request in N
+ *   -slow_log <file>: where to log slow requests (default: stderr)
+ *   -trace_events <file>: write the phases of the requests there, at
+ *                         shutdown, as Chrome trace events (see request_phases.h)
+ *   -scrub_mbps <MB>: scrub the volumes in the background, reading at most
+ *                     MB megabytes per second (see imgfs_scrub.h)
+ *   -scrub_interval <s>: seconds between the starts of two scrubs (default: a day)
+ *   -scrub_threads <N>: threads of the scrubber
  ********************************************************************** */
 int server_startup (int argc, char **argv)
 {
     if (argc < 2) return ERR_NOT_ENOUGH_ARGUMENTS;
 
-    const char* file_name = argv[1]; 
+    const char* volumes[argc];
+    size_t nb_volumes = 0;
+    volumes[nb_volumes++] = argv[1]; 
+
+    uint16_t port_number = DEFAULT_LISTENING_PORT; 
+    int backend = IMGFS_BACKEND_FILE;
+    uint64_t max_volume_size = 0;
+    size_t cache_size = (size_t) DEFAULT_CACHE_MB << 20;
+    size_t variant_cache_size = (size_t) DEFAULT_VARIANT_CACHE_MB << 20;
+    const char* size_list = DEFAULT_SIZES;
+    const char* trace_path = NULL;
+    const char* access_log_path = NULL;
+    struct phases_config phases = { 0, 1, NULL, NULL, 0 };
+    struct resize_limits resize = { 0, 0, DEFAULT_RESIZE_MEM_MB << 20, 1 };
+    struct scrub_config scrub = { DEFAULT_SCRUB_THREADS, 0, 0, NULL, NULL };
+    uint32_t scrub_interval = DEFAULT_SCRUB_INTERVAL;
+
+    int i = 2;
+    if (i < argc && argv[i][0] != '-') {
+        port_number = atouint16(argv[i++]); 
+        if (port_number == 0) {
+            return ERR_INVALID_ARGUMENT;
+        }
+    }
+    if (i < argc && argv[i][0] != '-') {
+        backend = imgfs_backend_atoi(argv[i++]);
+        if (backend < 0) {
+            return ERR_INVALID_ARGUMENT;
+        }
+    }
+    for (; i < argc; i++) {
+        if (i + 1 >= argc) {
+            return ERR_NOT_ENOUGH_ARGUMENTS;
+        }
+        if (!strcmp(argv[i], "-volume")) {
+            volumes[nb_volumes++] = argv[++i];
+        } else if (!strcmp(argv[i], "-volume_size")) {
+            const uint32_t mb = atouint32(argv[++i]);
+            if (mb == 0) {
+                return ERR_INVALID_ARGUMENT;
+            }
+            max_volume_size = (uint64_t) mb << 20;
+        } else if (!strcmp(argv[i], "-cache")) {
+            cache_size = (size_t) atouint32(argv[++i]) << 20;
+        } else if (!strcmp(argv[i], "-resize_jobs")) {
+            resize.max_jobs = atouint32(argv[++i]);
+        } else if (!strcmp(argv[i], "-resize_queue")) {
+            resize.max_queue = atouint32(argv[++i]);
+        } else if (!strcmp(argv[i], "-resize_mem")) {
+            resize.max_job_memory = (uint64_t) atouint32(argv[++i]) << 20;
+        } else if (!strcmp(argv[i], "-variant_cache")) {
+            variant_cache_size = (size_t) atouint32(argv[++i]) << 20;
+        } else if (!strcmp(argv[i], "-sizes")) {
+            size_list = argv[++i];
+        } else if (!strcmp(argv[i], "-trace")) {
+            trace_path = argv[++i];
+        } else if (!strcmp(argv[i], "-access_log")) {
+            access_log_path = argv[++i];
+        } else if (!strcmp(argv[i], "-slow_ms")) {
+            phases.slow_ns = (uint64_t) atouint32(argv[++i]) * 1000000u;
+            if (phases.slow_ns == 0) {
+                return ERR_INVALID_ARGUMENT;
+            }
+        } else if (!strcmp(argv[i], "-slow_sample")) {
+            phases.slow_sample = atouint32(argv[++i]);
+            if (phases.slow_sample == 0) {
+                return ERR_INVALID_ARGUMENT;
+            }
+        } else if (!strcmp(argv[i], "-slow_log")) {
+            phases.slow_log = argv[++i];
+        } else if (!strcmp(argv[i], "-trace_events")) {
+            phases.chrome_path = argv[++i];
+        } else if (!strcmp(argv[i], "-scrub_mbps")) {
+            scrub.max_rate = (uint64_t) atouint32(argv[++i]) << 20;
+            if (scrub.max_rate == 0) {
+                return ERR_INVALID_ARGUMENT;
+            }
+        } else if (!strcmp(argv[i], "-scrub_interval")) {
+            scrub_interval = atouint32(argv[++i]);
+            if (scrub_interval == 0) {
+                return ERR_INVALID_ARGUMENT;
+            }
+        } else if (!strcmp(argv[i], "-scrub_threads")) {
+            scrub.threads = atouint32(argv[++i]);
+            if (scrub.threads == 0 || scrub.threads > SCRUB_MAX_THREADS) {
+                return ERR_INVALID_ARGUMENT;
+            }
+        } else if (!strcmp(argv[i], "-format")) {
+            if (i + 2 >= argc) {
+                return ERR_NOT_ENOUGH_ARGUMENTS;
+            }
+            const int sized = !strcmp(argv[i + 1], "sized");
+            const int res = sized ? 0 : resolution_atoi(argv[i + 1]);
+            const int format = image_format_atoi(argv[i + 2]);
+            i += 2;
+            if (res < 0 || res == ORIG_RES || format <= IMAGE_JPEG) {
+                return ERR_INVALID_ARGUMENT;
+            }
+            *(sized ? &sized_formats : &tier_formats[res]) |= 1u << format;
+        } else {
+            return ERR_INVALID_ARGUMENT;
+        }
+    }
+
+    int err = parse_sizes(size_list);
+    if (err != ERR_NONE) { return err; }
+
+    err = resize_engine_init(&resize);
+    if (err != ERR_NONE) { return err; }
 
-    int open = do_open(file_name, "rb+", &fs_file); 
+    int open = store_open(&store, volumes, nb_volumes,
+                          (enum imgfs_backend_kind) backend, max_volume_size, cache_size,
+                          variant_cache_size); 
 
     if (open != ERR_NONE) { return open; }
 
-    print_header(&fs_file.header); 
+    if (trace_path != NULL) {
+        err = trace_writer_open(&trace, trace_path);
+        if (err != ERR_NONE) {
+            store_close(&store);
+            return err;
+        }
+    }
 
-    uint16_t port_number = DEFAULT_LISTENING_PORT; 
-    if (argc >= 3) {
-        port_number = atouint16(argv[2]); 
-        if (port_number == 0) {
-            do_close(&fs_file);
-            return ERR_INVALID_ARGUMENT;
+    if (access_log_path != NULL) {
+        err = access_log_open(access_log_path);
+        if (err != ERR_NONE) {
+            trace_writer_close(&trace);
+            store_close(&store);
+            return err;
+        }
+    }
+
+    if (phases.slow_ns > 0 || phases.chrome_path != NULL) {
+        err = phases_init(&phases);
+        if (err != ERR_NONE) {
+            access_log_close();
+            trace_writer_close(&trace);
+            store_close(&store);
+            return err;
+        }
+    }
+
+    // only with a rate limit, so that scrubs never starve the requests of disk bandwidth
+    if (scrub.max_rate > 0) {
+        err = store_scrub_start(&store, &scrub, scrub_interval);
+        if (err != ERR_NONE) {
+            phases_shutdown();
+            access_log_close();
+            trace_writer_close(&trace);
+            store_close(&store);
+            return err;
         }
     }
 
@@ -56,27 +286,38 @@ int server_startup (int argc, char **argv)
     int init = http_init(port_number, handle_http_message); 
 
     if (init < 0) {
-        do_close(&fs_file);
+        phases_shutdown();
+        access_log_close();
+        trace_writer_close(&trace);
+        store_close(&store);
         return init; 
     }
 
-    fprintf(stdout, "ImgFS server started on http://localhost:%d\n", port_number); 
-
-    pthread_mutex_init(&imgfs_mutex, NULL); // Initialize mutex
+    fprintf(stdout, "ImgFS server started on http://localhost:%d with %zu volume(s)\n",
+            port_number, nb_volumes); 
 
     return ERR_NONE; 
 
 }
 
 /********************************************************************//**
- * Shutdown function. Free the structures and close the file.
+ * Shutdown function. Free the structures and close the files.
  ********************************************************************** */
 void server_shutdown (void)
 {
     fprintf(stderr, "Shutting down...\n");
     http_close();
-    do_close(&fs_file);
-    pthread_mutex_destroy(&imgfs_mutex); // Destroy mutex
+    store_scrub_stop(&store);
+    if (atomic_load(&store.saved_stored) > 0) {
+        fprintf(stderr, "Optimized originals saved %llu bytes on disk, %llu bytes served\n",
+                atomic_load(&store.saved_stored), atomic_load(&store.saved_served));
+    }
+    if (phases_shutdown() != ERR_NONE) {
+        fprintf(stderr, "Failed to write the trace events\n");
+    }
+    access_log_close();
+    trace_writer_close(&trace);
+    store_close(&store);
 }
 
 
@@ -92,7 +333,9 @@ static int reply_error_msg(int connection, int error)
         fprintf(stderr, "reply_error_msg(): sprintf() failed...\n");
         return ERR_RUNTIME;
     }
-    return http_reply(connection, "500 Internal Server Error", "",
+    // overload is transient: tell the client to come back
+    return http_reply(connection, error == ERR_BUSY ? "503 Service Unavailable" : "500 Internal Server Error",
+                      error == ERR_BUSY ? "Retry-After: 1" HTTP_LINE_DELIM : "",
                       err_msg, strlen(err_msg));
 }
 
@@ -112,10 +355,8 @@ static int reply_302_msg(int connection)
 
 int handle_list_call(int connection, struct http_message* msg) {
     M_REQUIRE_NON_NULL(msg);
-    // pthread_mutex_lock(&imgfs_mutex);
     char* json_out = NULL; 
-    int list = do_list(&fs_file, JSON, &json_out); 
-    // pthread_mutex_unlock(&imgfs_mutex);
+    int list = store_list(&store, &json_out); 
     if (list != ERR_NONE) {
         return reply_error_msg(connection, list); 
     }
@@ -131,6 +372,32 @@ int handle_list_call(int connection, struct http_message* msg) {
     return ERR_NONE; 
 }
 
+/**********************************************************************
+ * Content negotiation: the best of the enabled formats the client accepts.
+ ********************************************************************** */
+static int negotiate_format(const struct http_message* msg, unsigned formats)
+{
+    const struct http_string* accept = http_get_header(msg, "Accept");
+    for (int f = NB_IMAGE_FORMATS - 1; f > IMAGE_JPEG; f--) {
+        if ((formats & (1u << f)) && http_accepts(accept, image_format_mime(f))) {
+            return f;
+        }
+    }
+    return IMAGE_JPEG;
+}
+
+/**********************************************************************
+ * Reads a tier (box == SIZE_MAX) or an arbitrary-size variant.
+ ********************************************************************** */
+static int read_variant(const char* img_id, int res_code, size_t box, int format,
+                        struct cache_blob** blob)
+{
+    if (box != SIZE_MAX) {
+        return store_read_sized(&store, img_id, sizes[box].width, sizes[box].height, format, blob);
+    }
+    return store_read(&store, img_id, res_code, format, blob);
+}
+
 int handle_read_call(int connection, struct http_message* msg) {
 
     M_REQUIRE_NON_NULL(msg); 
@@ -138,43 +405,193 @@ int handle_read_call(int connection, struct http_message* msg) {
     char img_id[MAX_IMG_ID + 1]; 
     memset(img_id, 0, sizeof(img_id));
     int get_id = http_get_var(&msg->uri, "img_id", img_id, sizeof(img_id)); 
-    if (get_id <= 0) {
+    if (get_id < 0) {
         return reply_error_msg(connection, get_id); 
     }
     if (get_id == 0) {
         return reply_error_msg(connection, ERR_NOT_ENOUGH_ARGUMENTS); 
     }
+
+    // w and/or h: an arbitrary size, snapped to the allowed ones
+    char width[8], height[8]; // enough for any uint16_t
+    memset(width, 0, sizeof(width));
+    memset(height, 0, sizeof(height));
+    int get_w = http_get_var(&msg->uri, "w", width, sizeof(width));
+    int get_h = http_get_var(&msg->uri, "h", height, sizeof(height));
+    if (get_w < 0 || get_h < 0) {
+        return reply_error_msg(connection, get_w < 0 ? get_w : get_h);
+    }
+
+    int res_code = ORIG_RES;
+    size_t box = SIZE_MAX;
+    if (get_w > 0 || get_h > 0) {
+        const uint16_t w = get_w > 0 ? atouint16(width) : 0;
+        const uint16_t h = get_h > 0 ? atouint16(height) : 0;
+        if ((get_w > 0 && w == 0) || (get_h > 0 && h == 0)) {
+            return reply_error_msg(connection, ERR_INVALID_ARGUMENT);
+        }
+        box = snap_size(w, h);
+    } else {
+        char res[100]; // enough for "orig" "thumb" and "small"
+        memset(res, 0, sizeof(res));
+        int get_res = http_get_var(&msg->uri, "res", res, sizeof(res)); 
+        if (get_res < 0) {
+            return reply_error_msg(connection, get_res); 
+        }
+        if (get_res == 0) {
+            return reply_error_msg(connection, ERR_NOT_ENOUGH_ARGUMENTS); 
+        }
+        res_code = resolution_atoi(res); 
+        if (res_code < 0) {
+            return reply_error_msg(connection, ERR_RESOLUTIONS);
+        }
+    }
+
+    const unsigned formats = box != SIZE_MAX ? sized_formats : tier_formats[res_code];
+    int format = negotiate_format(msg, formats);
+
+    struct cache_blob* blob = NULL; 
+    int read = read_variant(img_id, res_code, box, format, &blob); 
+    if (read != ERR_NONE && format != IMAGE_JPEG) {
+        read = read_variant(img_id, res_code, box, IMAGE_JPEG, &blob); // fall back to JPEG
+        format = IMAGE_JPEG;
+    }
+    if (read != ERR_NONE) {
+        return reply_error_msg(connection, read); 
+    }
+    char header[128];
+    snprintf(header, sizeof(header), "Content-Type: %s" HTTP_LINE_DELIM "%s", image_format_mime(format),
+             formats != 0 ? "Vary: Accept" HTTP_LINE_DELIM : "");
+    int repl = http_reply(connection, HTTP_OK, header, blob->data, blob->size); 
+    blob_release(blob); 
+    blob = NULL; 
+    if (repl != ERR_NONE) {
+        return reply_error_msg(connection, repl); 
+    } 
+    return repl; 
+}
+
+/**********************************************************************
+ * Reads by content: GET /imgfs/blob/<SHA-256 in hex>[?res=thumb|small|orig]
+ *
+ * The original behind such a URL never changes, whatever the image IDs
+ * sharing it, so that caches may keep it for good. Variants, and
+ * originals optimized at insertion, are not the bytes the SHA-256 names:
+ * they get an entity tag of what they are made with, and are
+ * revalidated. Only JPEG is served, so that replies do not vary with
+ * Accept.
+ ********************************************************************** */
+static int parse_sha(const struct http_string* uri, unsigned char* SHA)
+{
+    const size_t start = strlen(BLOB_URI);
+    const size_t end = start + 2 * SHA256_DIGEST_LENGTH;
+    if (uri->len < end || (uri->len > end && uri->val[end] != '?')) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    for (size_t i = 0; i < SHA256_DIGEST_LENGTH; i++) {
+        unsigned byte = 0;
+        for (size_t d = 0; d < 2; d++) {
+            const char c = uri->val[start + 2 * i + d];
+            const int digit = c >= '0' && c <= '9' ? c - '0' :
+                              c >= 'a' && c <= 'f' ? c - 'a' + 10 :
+                              c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+            if (digit < 0) {
+                return ERR_INVALID_ARGUMENT;
+            }
+            byte = byte << 4 | (unsigned) digit;
+        }
+        SHA[i] = (unsigned char) byte;
+    }
+    return ERR_NONE;
+}
+
+/**********************************************************************
+ * Headers of a reply by content: its entity tag names what the bytes
+ * depend on, so that it changes whenever they do.
+ ********************************************************************** */
+static void content_header(const unsigned char* SHA, int res_code, const struct content_tag* tag,
+                           char* header, size_t size)
+{
+    char hex[2 * SHA256_DIGEST_LENGTH + 1];
+    for (size_t i = 0; i < SHA256_DIGEST_LENGTH; i++) {
+        snprintf(hex + 2 * i, 3, "%02x", SHA[i]);
+    }
+
+    if (tag->immutable) {
+        snprintf(header, size, "ETag: \"%s\"" HTTP_LINE_DELIM IMMUTABLE
+                 "Content-Type: image/jpeg" HTTP_LINE_DELIM, hex);
+    } else if (res_code == ORIG_RES) {
+        snprintf(header, size, "ETag: \"%s-opt\"" HTTP_LINE_DELIM REVALIDATE
+                 "Content-Type: image/jpeg" HTTP_LINE_DELIM, hex);
+    } else {
+        const struct encode_profile* p = &tag->profile;
+        snprintf(header, size, "ETag: \"%s-%ux%u-q%us%up%um%u\"" HTTP_LINE_DELIM REVALIDATE
+                 "Content-Type: image/jpeg" HTTP_LINE_DELIM, hex, tag->res[0], tag->res[1],
+                 p->quality, p->strip, p->progressive, p->subsample);
+    }
+}
+
+// If-None-Match holds the entity tag of header (or is "*")
+static int etag_listed(const struct http_string* if_none_match, const char* header)
+{
+    if (if_none_match == NULL) return 0;
+    if (if_none_match->len == 1 && if_none_match->val[0] == '*') return 1;
+
+    const char* etag = header + strlen("ETag: ");
+    const size_t len = strcspn(etag, HTTP_LINE_DELIM);
+    for (size_t i = 0; i + len <= if_none_match->len; i++) {
+        if (!memcmp(if_none_match->val + i, etag, len)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int handle_blob_call(int connection, struct http_message* msg)
+{
+    M_REQUIRE_NON_NULL(msg);
+
+    unsigned char SHA[SHA256_DIGEST_LENGTH];
+    int parse = parse_sha(&msg->uri, SHA);
+    if (parse != ERR_NONE) {
+        return reply_error_msg(connection, parse);
+    }
+
     char res[100]; // enough for "orig" "thumb" and "small"
     memset(res, 0, sizeof(res));
-    int get_res = http_get_var(&msg->uri, "res", res, sizeof(res)); 
+    int get_res = http_get_var(&msg->uri, "res", res, sizeof(res));
     if (get_res < 0) {
-        return reply_error_msg(connection, get_res); 
-    }
-    if (get_res == 0) {
-        return reply_error_msg(connection, ERR_NOT_ENOUGH_ARGUMENTS); 
+        return reply_error_msg(connection, get_res);
     }
-    int res_code = resolution_atoi(res); 
+    const int res_code = get_res > 0 ? resolution_atoi(res) : ORIG_RES;
     if (res_code < 0) {
         return reply_error_msg(connection, ERR_RESOLUTIONS);
     }
 
-    char* buf = NULL; 
-    uint32_t size = 0; 
-    // pthread_mutex_lock(&imgfs_mutex);
-    int read = do_read(img_id, res_code, &buf, &size, &fs_file); 
-    // pthread_mutex_unlock(&imgfs_mutex);
+    // a client holding the current bytes gets a 304, without them being read (or made)
+    struct content_tag tag;
+    int read = store_read_content(&store, SHA, res_code, &tag, NULL);
     if (read != ERR_NONE) {
-        free(buf); 
-        return reply_error_msg(connection, read); 
+        return reply_error_msg(connection, read);
+    }
+    char header[256];
+    content_header(SHA, res_code, &tag, header, sizeof(header));
+    if (etag_listed(http_get_header(msg, "If-None-Match"), header)) {
+        return http_reply(connection, "304 Not Modified", header, "", 0);
     }
-    const char* header =  "Content-Type: image/jpeg" HTTP_LINE_DELIM;
-    int repl = http_reply(connection, HTTP_OK, header, buf, size); 
-    free(buf); 
-    buf = NULL; 
+
+    struct cache_blob* blob = NULL;
+    read = store_read_content(&store, SHA, res_code, &tag, &blob);
+    if (read != ERR_NONE) {
+        return reply_error_msg(connection, read);
+    }
+    content_header(SHA, res_code, &tag, header, sizeof(header)); // in case it changed meanwhile
+    int repl = http_reply(connection, HTTP_OK, header, blob->data, blob->size);
+    blob_release(blob);
     if (repl != ERR_NONE) {
-        return reply_error_msg(connection, repl); 
-    } 
-    return repl; 
+        return reply_error_msg(connection, repl);
+    }
+    return repl;
 }
 
 int handle_delete_call(int connection, struct http_message* msg) {
@@ -188,9 +605,7 @@ int handle_delete_call(int connection, struct http_message* msg) {
     if (get_id == 0) {
         return reply_error_msg(connection, ERR_NOT_ENOUGH_ARGUMENTS); 
     }
-    // pthread_mutex_lock(&imgfs_mutex);
-    int delete = do_delete(img_id, &fs_file); 
-    // pthread_mutex_unlock(&imgfs_mutex);
+    int delete = store_delete(&store, img_id); 
     if (delete != ERR_NONE) {
         return reply_error_msg(connection, delete); 
     }
@@ -226,9 +641,7 @@ int handle_insert_call(int connection, struct http_message* msg)
 
     memcpy(image_content, msg->body.val, msg->body.len);
 
-    // pthread_mutex_lock(&imgfs_mutex);
-    int insert = do_insert(image_content, msg->body.len, img_id, &fs_file);
-    // pthread_mutex_unlock(&imgfs_mutex);
+    int insert = store_insert(&store, image_content, msg->body.len, img_id);
     free(image_content); 
 
     if (insert != ERR_NONE) {
@@ -246,31 +659,93 @@ int handle_insert_call(int connection, struct http_message* msg)
 
 
 /**********************************************************************
- * Simple handling of http message. TO BE UPDATED WEEK 13
+ * Metrics: Prometheus text, or JSON with format=json
  ********************************************************************** */
-int handle_http_message(struct http_message* msg, int connection)
+static int handle_stats_call(int connection, struct http_message* msg)
 {
     M_REQUIRE_NON_NULL(msg);
-    debug_printf("handle_http_message() on connection %d. URI: %.*s\n",
-                 connection,
-                 (int) msg->uri.len, msg->uri.val);
+    char format[16]; // enough for "json" and "prometheus"
+    memset(format, 0, sizeof(format));
+    int get_format = http_get_var(&msg->uri, "format", format, sizeof(format));
+    if (get_format < 0) {
+        return reply_error_msg(connection, get_format);
+    }
+    const int json = get_format > 0 && !strcmp(format, "json");
+
+    char* body = NULL;
+    size_t body_len = 0;
+    int render = metrics_render(&store, json ? METRICS_JSON : METRICS_PROMETHEUS, &body, &body_len);
+    if (render != ERR_NONE) {
+        return reply_error_msg(connection, render);
+    }
+    int repl = http_reply(connection, HTTP_OK, json ? "Content-Type: application/json" HTTP_LINE_DELIM :
+                          "Content-Type: text/plain; version=0.0.4; charset=utf-8" HTTP_LINE_DELIM,
+                          body, body_len);
+    free(body);
+    return repl;
+}
 
+/**********************************************************************
+ * Simple handling of http message. TO BE UPDATED WEEK 13
+ ********************************************************************** */
+static int dispatch_http_message(struct http_message* msg, int connection,
+                                 enum metrics_endpoint* endpoint)
+{
     if (http_match_verb(&msg->uri, "/") || http_match_uri(msg, "/index.html")) {
         return http_serve_file(connection, BASE_FILE);
     }
 
     if (http_match_uri(msg, URI_ROOT "/list")) {
+        *endpoint = METRICS_LIST;
         return handle_list_call(connection, msg); 
     }
     else if (http_match_uri(msg, URI_ROOT "/insert") && http_match_verb(&msg->method, "POST")) {
+        *endpoint = METRICS_INSERT;
         return handle_insert_call(connection, msg); 
     }
     else if (http_match_uri(msg, URI_ROOT "/read")) {
+        *endpoint = METRICS_READ;
         return handle_read_call(connection, msg); 
     }
+    else if (http_match_uri(msg, BLOB_URI)) {
+        *endpoint = METRICS_BLOB;
+        return handle_blob_call(connection, msg);
+    }
     else if (http_match_uri(msg, URI_ROOT "/delete")) {
+        *endpoint = METRICS_DELETE;
         return handle_delete_call(connection, msg); 
     }
+    else if (http_match_uri(msg, URI_ROOT "/stats")) {
+        *endpoint = METRICS_STATS;
+        return handle_stats_call(connection, msg);
+    }
     else
         return reply_error_msg(connection, ERR_INVALID_COMMAND);
-}
\ No newline at end of file
+}
+
+int handle_http_message(struct http_message* msg, int connection)
+{
+    M_REQUIRE_NON_NULL(msg);
+    debug_printf("handle_http_message() on connection %d. URI: %.*s\n",
+                 connection,
+                 (int) msg->uri.len, msg->uri.val);
+
+    IMGFS_PROBE4(request__start, connection, msg->uri.val, msg->uri.len, msg->body.len);
+    const uint64_t start = metrics_request_begin();
+    enum metrics_endpoint endpoint = METRICS_OTHER;
+    phase_enter(PHASE_HANDLE);
+    const int ret = dispatch_http_message(msg, connection, &endpoint);
+    phase_leave();
+    unsigned status = 0;
+    size_t sent = 0;
+    http_replied(&status, &sent);
+    metrics_request_end(endpoint, start, status, msg->body.len, sent);
+    access_log_record(connection, msg->method.val, msg->method.len, msg->uri.val, msg->uri.len,
+                      status, msg->body.len, sent, start);
+    IMGFS_PROBE6(request__done, connection, msg->uri.val, msg->uri.len, status, sent, ret);
+    if (trace.file != NULL) {
+        trace_write(&trace, start, http_match_verb(&msg->method, "POST") ? TRACE_POST : 0,
+                    status, msg->body.len, sent, msg->uri.val, msg->uri.len);
+    }
+    return ret;
+}
@@ -0,0 +1,207 @@
+/**
+ * @file imgfs_space.c
+ * @brief Space accounting of an imgFS: live, shared and dead bytes.
+ */
+
+#include "imgfs.h"
+#include "error.h"
+
+#include <stdlib.h> // for calloc, free, qsort
+#include <string.h> // for memset
+
+/*******************************************************************
+ * Offset of the counters, right after the metadata table.
+ */
+static uint64_t space_offset(const struct imgfs_header* header)
+{
+    return sizeof(struct imgfs_header) + (uint64_t) header->max_files * sizeof(struct img_metadata);
+}
+
+static void sub_saturated(uint64_t* counter, uint64_t n)
+{
+    *counter = *counter > n ? *counter - n : 0;
+}
+
+/*******************************************************************
+ * How many other valid images refer to the variant of index at
+ * resolution res: 0, 1, or 2 for "more than one".
+ */
+static unsigned count_others(const struct imgfs_file* imgfs_file, uint32_t index, int res)
+{
+    const uint64_t offset = imgfs_file->offset[index][res];
+    const size_t words = (imgfs_file->header.max_files + IMGFS_VALID_BITS - 1) / IMGFS_VALID_BITS;
+    unsigned others = 0;
+    for (size_t w = 0; w < words && others < 2; w++) {
+        for (uint64_t bits = imgfs_file->valid[w]; bits != 0 && others < 2; bits &= bits - 1) {
+            const uint32_t j = (uint32_t) (w * IMGFS_VALID_BITS) + (uint32_t) __builtin_ctzll(bits);
+            if (j != index && imgfs_file->size[j][res] != 0 && imgfs_file->offset[j][res] == offset) {
+                others++;
+            }
+        }
+    }
+    return others;
+}
+
+/********************************************************************
+ * See imgfs.h
+ */
+void imgfs_space_new_blob(struct imgfs_file* imgfs_file, uint32_t size)
+{
+    if (imgfs_file == NULL || !(imgfs_file->header.flags & IMGFS_FLAG_SPACE)) {
+        return;
+    }
+    imgfs_file->space.live_bytes += size;
+}
+
+/********************************************************************
+ * See imgfs.h
+ */
+void imgfs_space_ref(struct imgfs_file* imgfs_file, uint32_t index, unsigned res_mask)
+{
+    if (imgfs_file == NULL || !(imgfs_file->header.flags & IMGFS_FLAG_SPACE)) {
+        return;
+    }
+    for (int res = 0; res < NB_RES; res++) {
+        const uint32_t size = imgfs_file->size[index][res];
+        if (!(res_mask & (1u << res)) || size == 0) continue;
+
+        switch (count_others(imgfs_file, index, res)) {
+        case 0: // nobody else: a blob of its own after all
+            imgfs_file->space.live_bytes += size;
+            break;
+        case 1: // was referred to once, now shared
+            imgfs_file->space.shared_bytes += size;
+            break;
+        default: // already shared
+            break;
+        }
+    }
+}
+
+/********************************************************************
+ * See imgfs.h
+ */
+void imgfs_space_unref(struct imgfs_file* imgfs_file, uint32_t index, unsigned res_mask)
+{
+    if (imgfs_file == NULL || !(imgfs_file->header.flags & IMGFS_FLAG_SPACE)) {
+        return;
+    }
+    for (int res = 0; res < NB_RES; res++) {
+        const uint32_t size = imgfs_file->size[index][res];
+        if (!(res_mask & (1u << res)) || size == 0) continue;
+
+        switch (count_others(imgfs_file, index, res)) {
+        case 0: // its last reference
+            sub_saturated(&imgfs_file->space.live_bytes, size);
+            imgfs_file->space.dead_bytes += size;
+            break;
+        case 1: // the other image keeps it, on its own
+            sub_saturated(&imgfs_file->space.shared_bytes, size);
+            break;
+        default: // still shared
+            break;
+        }
+    }
+}
+
+/********************************************************************
+ * See imgfs.h
+ */
+int imgfs_space_write(struct imgfs_file* imgfs_file)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+
+    if (!(imgfs_file->header.flags & IMGFS_FLAG_SPACE)) {
+        return ERR_NONE;
+    }
+    return imgfs_pwrite(imgfs_file, &imgfs_file->space, sizeof(imgfs_file->space),
+                        space_offset(&imgfs_file->header));
+}
+
+/********************************************************************
+ * See imgfs.h
+ */
+int imgfs_space_read(struct imgfs_file* imgfs_file)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+
+    memset(&imgfs_file->space, 0, sizeof(imgfs_file->space));
+    if (!(imgfs_file->header.flags & IMGFS_FLAG_SPACE)) {
+        return ERR_NONE;
+    }
+    return imgfs_pread(imgfs_file, &imgfs_file->space, sizeof(imgfs_file->space),
+                       space_offset(&imgfs_file->header));
+}
+
+/********************************************************************
+ * See imgfs.h
+ */
+uint64_t imgfs_used_bytes(const struct imgfs_file* imgfs_file)
+{
+    if (imgfs_file == NULL) return 0;
+
+    const uint64_t start = imgfs_data_start(&imgfs_file->header);
+    const uint64_t used = imgfs_file->file_end > start ? imgfs_file->file_end - start : 0;
+    return used + imgfs_file->tier_end;
+}
+
+static int location_cmp(const void* a, const void* b)
+{
+    const uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+    return x < y ? -1 : x > y;
+}
+
+/********************************************************************
+ * See imgfs.h
+ */
+int imgfs_space_scan(const struct imgfs_file* imgfs_file, struct imgfs_space* space)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(space);
+
+    // (location, size) pairs, sorted by location; tier offsets get bit 0 set
+    const size_t max_pairs = (size_t) NB_RES * imgfs_file->header.nb_files;
+    uint64_t* pairs = calloc(2 * max_pairs + 2, sizeof(*pairs));
+    if (pairs == NULL) return ERR_OUT_OF_MEMORY;
+
+    size_t nb = 0;
+    for (uint32_t i = 0; i < imgfs_file->header.max_files && nb < max_pairs; i++) {
+        if (!imgfs_is_valid(imgfs_file, i)) continue;
+        for (int res = 0; res < NB_RES; res++) {
+            if (imgfs_file->size[i][res] == 0) continue;
+            pairs[2 * nb] = imgfs_file->offset[i][res] << 1 | (uint64_t) imgfs_in_tier(imgfs_file, res);
+            pairs[2 * nb + 1] = imgfs_file->size[i][res];
+            nb++;
+        }
+    }
+    qsort(pairs, nb, 2 * sizeof(*pairs), location_cmp);
+
+    memset(space, 0, sizeof(*space));
+    for (size_t p = 0; p < nb; p++) {
+        if (p == 0 || pairs[2 * p] != pairs[2 * p - 2]) {
+            space->live_bytes += pairs[2 * p + 1];
+        } else if (p == 1 || pairs[2 * p] != pairs[2 * p - 4]) { // its second reference
+            space->shared_bytes += pairs[2 * p + 1];
+        }
+    }
+    free(pairs);
+
+    const uint64_t used = imgfs_used_bytes(imgfs_file);
+    space->dead_bytes = used > space->live_bytes ? used - space->live_bytes : 0;
+    return ERR_NONE;
+}
+
+/********************************************************************
+ * See imgfs.h
+ */
+int imgfs_space_get(const struct imgfs_file* imgfs_file, struct imgfs_space* space)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(space);
+
+    if (imgfs_file->header.flags & IMGFS_FLAG_SPACE) {
+        *space = imgfs_file->space;
+        return ERR_NONE;
+    }
+    return imgfs_space_scan(imgfs_file, space);
+}
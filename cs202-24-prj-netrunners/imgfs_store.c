@@ -0,0 +1,1036 @@
+/**
+ * @file imgfs_store.c
+ * @brief Logical imgFS store made of several imgFS volumes.
+ */
+
+#include "imgfs_store.h"
+#include "error.h"
+#include "image_content.h"
+#include "imgfs_probes.h"
+#include "request_phases.h"
+#include "util.h" // for MAX
+
+#include <json-c/json.h>
+#include <signal.h> // for pthread_sigmask
+#include <stdio.h>  // for fprintf
+#include <stdlib.h> // for calloc, free
+#include <string.h> // for strcmp, strdup
+#include <time.h>   // for nanosleep, time
+
+#define DIR_MIN_CAPACITY 1024
+#define DIR_PENDING UINT32_MAX // the insertion of the image is in progress
+#define SCRUB_WAIT_MS 100      // the scrubber looks at scrub_stop this often between passes
+#define CONTENT_RETRIES 3      // reads by content racing with deletions of the image they found
+#define RESIZE_RETRIES 3       // makings of a variant racing with the replacement of its image
+
+struct store_dir_entry {
+    char* img_id; // NULL for an empty bucket
+    uint64_t hash;
+    uint32_t volume;
+};
+
+/*******************************************************************
+ * Directory (callers hold dir_lock)
+ */
+static size_t dir_find(const struct imgfs_store* store, const char* img_id, uint64_t hash)
+{
+    const size_t mask = store->dir_capacity - 1;
+    for (size_t b = (size_t) hash & mask; store->dir[b].img_id != NULL; b = (b + 1) & mask) {
+        if (store->dir[b].hash == hash && !strcmp(store->dir[b].img_id, img_id)) {
+            return b;
+        }
+    }
+    return SIZE_MAX;
+}
+
+static void dir_place(struct store_dir_entry* dir, size_t capacity, struct store_dir_entry entry)
+{
+    size_t b = (size_t) entry.hash & (capacity - 1);
+    while (dir[b].img_id != NULL) {
+        b = (b + 1) & (capacity - 1);
+    }
+    dir[b] = entry;
+}
+
+static int dir_grow(struct imgfs_store* store)
+{
+    const size_t capacity = store->dir_capacity > 0 ? 2 * store->dir_capacity : DIR_MIN_CAPACITY;
+    struct store_dir_entry* dir = calloc(capacity, sizeof(*dir));
+    if (dir == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    for (size_t b = 0; b < store->dir_capacity; b++) {
+        if (store->dir[b].img_id != NULL) {
+            dir_place(dir, capacity, store->dir[b]);
+        }
+    }
+    free(store->dir);
+    store->dir = dir;
+    store->dir_capacity = capacity;
+    return ERR_NONE;
+}
+
+static int dir_add(struct imgfs_store* store, const char* img_id, uint32_t volume)
+{
+    const uint64_t hash = imgfs_id_hash(img_id);
+    if (store->dir_capacity > 0 && dir_find(store, img_id, hash) != SIZE_MAX) {
+        return ERR_DUPLICATE_ID;
+    }
+    if (2 * (store->dir_count + 1) > store->dir_capacity) {
+        int err = dir_grow(store);
+        if (err != ERR_NONE) return err;
+    }
+
+    const struct store_dir_entry entry = { strdup(img_id), hash, volume };
+    if (entry.img_id == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    dir_place(store->dir, store->dir_capacity, entry);
+    store->dir_count++;
+    return ERR_NONE;
+}
+
+static void dir_remove(struct imgfs_store* store, size_t b)
+{
+    const size_t mask = store->dir_capacity - 1;
+    free(store->dir[b].img_id);
+    store->dir[b].img_id = NULL;
+    store->dir_count--;
+
+    // backward shift, so that lookups never need tombstones
+    for (size_t next = (b + 1) & mask; store->dir[next].img_id != NULL; next = (next + 1) & mask) {
+        const size_t home = (size_t) store->dir[next].hash & mask;
+        if (((next - home) & mask) >= ((next - b) & mask)) {
+            store->dir[b] = store->dir[next];
+            store->dir[next].img_id = NULL;
+            b = next;
+        }
+    }
+}
+
+/*******************************************************************
+ * Content index (callers hold dir_lock, for writing under the lock of
+ * the volume whose entry changes: lock order is volume, then directory)
+ */
+struct store_content_entry {
+    unsigned char SHA[SHA256_DIGEST_LENGTH];
+    uint32_t volume; // DIR_PENDING for an empty bucket
+    uint32_t index;  // an image of the volume with this content
+};
+
+static size_t content_home(const unsigned char* SHA, size_t capacity)
+{
+    uint64_t hash = 0; // a SHA-256 is as good a hash as any
+    memcpy(&hash, SHA, sizeof(hash));
+    return (size_t) hash & (capacity - 1);
+}
+
+static size_t content_find(const struct imgfs_store* store, const unsigned char* SHA, uint32_t volume)
+{
+    if (store->contents_capacity == 0) return SIZE_MAX;
+
+    const size_t mask = store->contents_capacity - 1;
+    for (size_t b = content_home(SHA, store->contents_capacity); store->contents[b].volume != DIR_PENDING;
+         b = (b + 1) & mask) {
+        if (store->contents[b].volume == volume &&
+            !memcmp(store->contents[b].SHA, SHA, SHA256_DIGEST_LENGTH)) {
+            return b;
+        }
+    }
+    return SIZE_MAX;
+}
+
+static void content_place(struct store_content_entry* contents, size_t capacity,
+                          const struct store_content_entry* entry)
+{
+    size_t b = content_home(entry->SHA, capacity);
+    while (contents[b].volume != DIR_PENDING) {
+        b = (b + 1) & (capacity - 1);
+    }
+    contents[b] = *entry;
+}
+
+static int content_grow(struct imgfs_store* store)
+{
+    const size_t capacity = store->contents_capacity > 0 ? 2 * store->contents_capacity : DIR_MIN_CAPACITY;
+    struct store_content_entry* contents = calloc(capacity, sizeof(*contents));
+    if (contents == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    for (size_t b = 0; b < capacity; b++) {
+        contents[b].volume = DIR_PENDING;
+    }
+    for (size_t b = 0; b < store->contents_capacity; b++) {
+        if (store->contents[b].volume != DIR_PENDING) {
+            content_place(contents, capacity, &store->contents[b]);
+        }
+    }
+    free(store->contents);
+    store->contents = contents;
+    store->contents_capacity = capacity;
+    return ERR_NONE;
+}
+
+// does nothing if the volume already has an image with this content
+static int content_add(struct imgfs_store* store, const unsigned char* SHA, uint32_t volume,
+                       uint32_t index)
+{
+    if (content_find(store, SHA, volume) != SIZE_MAX) {
+        return ERR_NONE;
+    }
+    if (2 * (store->contents_count + 1) > store->contents_capacity) {
+        int err = content_grow(store);
+        if (err != ERR_NONE) return err;
+    }
+
+    struct store_content_entry entry = { .volume = volume, .index = index };
+    memcpy(entry.SHA, SHA, SHA256_DIGEST_LENGTH);
+    content_place(store->contents, store->contents_capacity, &entry);
+    store->contents_count++;
+    return ERR_NONE;
+}
+
+static void content_remove(struct imgfs_store* store, size_t b)
+{
+    const size_t mask = store->contents_capacity - 1;
+    store->contents[b].volume = DIR_PENDING;
+    store->contents_count--;
+
+    // backward shift, as in dir_remove()
+    for (size_t next = (b + 1) & mask; store->contents[next].volume != DIR_PENDING; next = (next + 1) & mask) {
+        const size_t home = content_home(store->contents[next].SHA, store->contents_capacity);
+        if (((next - home) & mask) >= ((next - b) & mask)) {
+            store->contents[b] = store->contents[next];
+            store->contents[next].volume = DIR_PENDING;
+            b = next;
+        }
+    }
+}
+
+/*******************************************************************
+ * Another valid image of a volume with the given content, DIR_PENDING
+ * if none (volume lock held).
+ */
+static uint32_t volume_find_content(const struct imgfs_file* file, const unsigned char* SHA,
+                                    uint32_t except)
+{
+    const uint64_t prefix = imgfs_sha_prefix(SHA);
+    for (uint32_t i = 0; i < file->header.max_files; i++) {
+        if (i != except && imgfs_is_valid(file, i) && file->sha_prefix[i] == prefix &&
+            !memcmp(file->cold[i]->SHA, SHA, SHA256_DIGEST_LENGTH)) {
+            return i;
+        }
+    }
+    return DIR_PENDING;
+}
+
+/*******************************************************************
+ * Finds the volume of an image.
+ */
+static int store_locate(struct imgfs_store* store, const char* img_id, uint32_t* volume)
+{
+    pthread_rwlock_rdlock(&store->dir_lock);
+    const size_t b = dir_find(store, img_id, imgfs_id_hash(img_id));
+    *volume = b == SIZE_MAX ? DIR_PENDING : store->dir[b].volume;
+    pthread_rwlock_unlock(&store->dir_lock);
+
+    return *volume == DIR_PENDING ? ERR_IMAGE_NOT_FOUND : ERR_NONE;
+}
+
+/*******************************************************************
+ * Seals the volume if needed and publishes its free slots for placement;
+ * no_room seals it whatever its header says (do_insert() found no free
+ * slot). The caller holds the volume lock for writing.
+ */
+static void volume_update(struct imgfs_store* store, struct imgfs_volume* volume, int no_room)
+{
+    struct imgfs_file* file = &volume->file;
+    const int full = no_room || file->header.nb_files >= file->header.max_files ||
+                     (store->max_volume_size > 0 &&
+                      file->file_end + file->tier_end >= store->max_volume_size);
+
+    if (full && !(file->header.flags & IMGFS_FLAG_SEALED)) {
+        if (do_seal(file) == ERR_NONE) {
+            fprintf(stderr, "Volume %s sealed\n", volume->path);
+        }
+    }
+
+    const int closed = full || (file->header.flags & IMGFS_FLAG_SEALED);
+    atomic_store(&volume->free_slots, closed ? 0 : file->header.max_files - file->header.nb_files);
+}
+
+/*******************************************************************
+ * Cache key of one resolution of an image (volume lock held).
+ */
+static void volume_key(const struct imgfs_file* file, uint32_t index, int resolution,
+                       struct cache_key* key)
+{
+    memcpy(key->SHA, file->cold[index]->SHA, SHA256_DIGEST_LENGTH);
+    key->res[0] = resolution == ORIG_RES ? 0 : file->header.resized_res[2 * resolution];
+    key->res[1] = resolution == ORIG_RES ? 0 : file->header.resized_res[2 * resolution + 1];
+    key->format = IMAGE_JPEG;
+}
+
+/*******************************************************************
+ * Makings of missing variants in progress: one per image, the other
+ * readers of the image wait for it rather than make the same variants.
+ */
+struct resize_flight {
+    uint32_t index;
+    struct resize_flight* next;
+};
+
+// returns 1 if the caller is to make the variants, 0 after waiting for another maker
+static int resize_begin(struct imgfs_volume* volume, struct resize_flight* flight)
+{
+    pthread_mutex_lock(&volume->resize_lock);
+    int waited = 0;
+    for (const struct resize_flight* f = volume->resizing; f != NULL; ) {
+        if (f->index == flight->index) {
+            pthread_cond_wait(&volume->resized, &volume->resize_lock);
+            waited = 1;
+            f = volume->resizing;
+        } else {
+            f = f->next;
+        }
+    }
+    if (!waited) {
+        flight->next = volume->resizing;
+        volume->resizing = flight;
+    }
+    pthread_mutex_unlock(&volume->resize_lock);
+    return !waited;
+}
+
+static void resize_end(struct imgfs_volume* volume, const struct resize_flight* flight)
+{
+    pthread_mutex_lock(&volume->resize_lock);
+    for (struct resize_flight** f = &volume->resizing; *f != NULL; f = &(*f)->next) {
+        if (*f == flight) {
+            *f = flight->next;
+            break;
+        }
+    }
+    pthread_cond_broadcast(&volume->resized);
+    pthread_mutex_unlock(&volume->resize_lock);
+}
+
+/*******************************************************************
+ * Bytes saved by optimizing the originals of a volume, each stored
+ * original counted once however many images share it.
+ */
+static int offset_cmp(const void* a, const void* b)
+{
+    const uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+    return x < y ? -1 : x > y;
+}
+
+static uint64_t volume_saved(const struct imgfs_file* file)
+{
+    // (offset, saved KiB) pairs, sorted by offset
+    uint64_t* pairs = calloc(2 * (size_t) file->header.max_files + 2, sizeof(*pairs));
+    if (pairs == NULL) return 0;
+
+    size_t nb = 0;
+    for (uint32_t i = 0; i < file->header.max_files; i++) {
+        if (imgfs_is_valid(file, i) && file->cold[i]->saved_kib > 0) {
+            pairs[2 * nb] = file->offset[i][ORIG_RES];
+            pairs[2 * nb + 1] = file->cold[i]->saved_kib;
+            nb++;
+        }
+    }
+    qsort(pairs, nb, 2 * sizeof(*pairs), offset_cmp);
+
+    uint64_t saved = 0;
+    for (size_t p = 0; p < nb; p++) {
+        if (p == 0 || pairs[2 * p] != pairs[2 * p - 2]) {
+            saved += pairs[2 * p + 1] << 10;
+        }
+    }
+    free(pairs);
+    return saved;
+}
+
+/*******************************************************************
+ * Picks the open volume with the most free slots per request in flight.
+ */
+static uint32_t store_place(const struct imgfs_store* store)
+{
+    uint32_t best = DIR_PENDING;
+    uint64_t best_free = 0, best_load = 0;
+
+    for (uint32_t v = 0; v < store->nb_volumes; v++) {
+        const uint64_t free_slots = atomic_load(&store->volumes[v].free_slots);
+        const uint64_t load = 1 + atomic_load(&store->volumes[v].load);
+        if (free_slots > 0 && (best == DIR_PENDING || free_slots * best_load > best_free * load)) {
+            best = v;
+            best_free = free_slots;
+            best_load = load;
+        }
+    }
+    return best;
+}
+
+/********************************************************************
+ * See imgfs_store.h
+ */
+int store_open(struct imgfs_store* store, const char* const* paths, size_t nb_paths,
+               enum imgfs_backend_kind backend, uint64_t max_volume_size, size_t cache_size,
+               size_t variant_cache_size)
+{
+    M_REQUIRE_NON_NULL(store);
+    M_REQUIRE_NON_NULL(paths);
+    if (nb_paths == 0 || nb_paths >= DIR_PENDING) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    memset(store, 0, sizeof(*store));
+    store->max_volume_size = max_volume_size;
+    pthread_rwlock_init(&store->dir_lock, NULL);
+    int err = blob_cache_init(&store->cache, cache_size);
+    if (err == ERR_NONE) {
+        err = blob_cache_init(&store->variants, variant_cache_size);
+        if (err != ERR_NONE) {
+            blob_cache_free(&store->cache);
+        }
+    }
+    if (err != ERR_NONE) {
+        pthread_rwlock_destroy(&store->dir_lock);
+        return err;
+    }
+
+    store->volumes = calloc(nb_paths, sizeof(*store->volumes));
+    if (store->volumes == NULL) {
+        store_close(store);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    for (uint32_t v = 0; err == ERR_NONE && v < nb_paths; v++) {
+        struct imgfs_volume* volume = &store->volumes[v];
+        volume->path = paths[v];
+        pthread_rwlock_init(&volume->lock, NULL);
+        pthread_mutex_init(&volume->resize_lock, NULL);
+        pthread_cond_init(&volume->resized, NULL);
+        store->nb_volumes++;
+
+        err = do_open_backend(paths[v], "rb+", backend, &volume->file);
+        if (err != ERR_NONE) {
+            fprintf(stderr, "Cannot open volume %s\n", paths[v]);
+            break;
+        }
+        print_header(&volume->file.header);
+        volume_update(store, volume, 0);
+        atomic_fetch_add(&store->saved_stored, volume_saved(&volume->file));
+
+        for (uint32_t i = 0; err == ERR_NONE && i < volume->file.header.max_files; i++) {
+            if (imgfs_is_valid(&volume->file, i)) {
+                err = dir_add(store, volume->file.cold[i]->img_id, v);
+                if (err == ERR_NONE) {
+                    err = content_add(store, volume->file.cold[i]->SHA, v, i);
+                }
+            }
+        }
+    }
+
+    if (err != ERR_NONE) {
+        store_close(store);
+    }
+    return err;
+}
+
+/********************************************************************
+ * See imgfs_store.h
+ */
+void store_close(struct imgfs_store* store)
+{
+    if (store == NULL) return;
+
+    store_scrub_stop(store);
+    for (size_t v = 0; v < store->nb_volumes; v++) {
+        do_close(&store->volumes[v].file);
+        pthread_rwlock_destroy(&store->volumes[v].lock);
+        pthread_mutex_destroy(&store->volumes[v].resize_lock);
+        pthread_cond_destroy(&store->volumes[v].resized);
+    }
+    free(store->volumes);
+
+    for (size_t b = 0; b < store->dir_capacity; b++) {
+        free(store->dir[b].img_id);
+    }
+    free(store->dir);
+    free(store->contents);
+    pthread_rwlock_destroy(&store->dir_lock);
+    blob_cache_free(&store->cache);
+    blob_cache_free(&store->variants);
+    memset(store, 0, sizeof(*store));
+}
+
+/*******************************************************************
+ * Reads a variant in another encoding, deriving it from the JPEG one
+ * on a cache miss.
+ */
+static int store_read_derived(struct imgfs_store* store, const char* img_id, int resolution,
+                              int format, struct cache_blob** blob)
+{
+    struct cache_blob* jpeg = NULL;
+    int err = store_read(store, img_id, resolution, IMAGE_JPEG, &jpeg);
+    if (err != ERR_NONE) {
+        return err;
+    }
+
+    // kept with the arbitrary-size variants: they are as costly to make
+    // again, and must not evict the stored tiers and originals
+    struct cache_key key = jpeg->key;
+    key.format = (uint8_t) format;
+    *blob = blob_cache_get(&store->variants, &key);
+    if (*blob == NULL) {
+        char* encoded = NULL;
+        uint32_t size = 0;
+        IMGFS_PROBE4(resize__start, img_id, resolution, 0, 0);
+        phase_enter(PHASE_RESIZE);
+        err = transcode_variant(jpeg->data, jpeg->size, format, &encoded, &size);
+        phase_leave();
+        IMGFS_PROBE4(resize__done, img_id, resolution, size, err);
+        if (err == ERR_NONE) {
+            *blob = blob_cache_adopt(&store->variants, &key, encoded, size);
+            err = *blob != NULL ? ERR_NONE : ERR_OUT_OF_MEMORY;
+        }
+    }
+    blob_release(jpeg);
+    return err;
+}
+
+/********************************************************************
+ * See imgfs_store.h
+ */
+int store_read(struct imgfs_store* store, const char* img_id, int resolution, int format,
+               struct cache_blob** blob)
+{
+    M_REQUIRE_NON_NULL(store);
+    M_REQUIRE_NON_NULL(img_id);
+    M_REQUIRE_NON_NULL(blob);
+    if (resolution < 0 || resolution >= NB_RES) {
+        return ERR_RESOLUTIONS;
+    }
+    if (format < 0 || format >= NB_IMAGE_FORMATS || (format != IMAGE_JPEG && resolution == ORIG_RES)) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    if (format != IMAGE_JPEG) {
+        return store_read_derived(store, img_id, resolution, format, blob);
+    }
+
+    uint32_t v = 0;
+    int err = store_locate(store, img_id, &v);
+    if (err != ERR_NONE) {
+        return err;
+    }
+    struct imgfs_volume* volume = &store->volumes[v];
+
+    // the cache key and the bytes read are those of the same image: both
+    // are taken in a single critical section
+    struct cache_key key;
+    uint64_t saved = 0;
+    char* buffer = NULL;
+    uint32_t size = 0;
+    *blob = NULL;
+    uint32_t index = 0;
+    atomic_fetch_add(&volume->load, 1);
+    for (int attempt = 0; ; attempt++) {
+        pthread_rwlock_rdlock(&volume->lock);
+        err = imgfs_find_id(&volume->file, img_id, &index) == ERR_NONE ? ERR_NONE : ERR_IMAGE_NOT_FOUND;
+        if (err != ERR_NONE || volume->file.size[index][resolution] > 0) {
+            break;
+        }
+
+        // the missing variants are made without the lock, which is only
+        // taken, for writing, to store them
+        pthread_rwlock_unlock(&volume->lock);
+        struct resize_flight flight = { index, NULL };
+        if (!resize_begin(volume, &flight)) {
+            attempt--; // another reader made them: look again
+            continue;
+        }
+        struct variant_job job;
+        pthread_rwlock_rdlock(&volume->lock);
+        err = variants_prepare(&volume->file, index, variants_missing(&volume->file, index), 0, &job);
+        pthread_rwlock_unlock(&volume->lock);
+        if (err == ERR_NONE) {
+            phase_enter(PHASE_RESIZE);
+            err = variants_make(&job);
+            phase_leave();
+        }
+        if (err == ERR_NONE) {
+            pthread_rwlock_wrlock(&volume->lock);
+            err = variants_commit(&volume->file, &job);
+            pthread_rwlock_unlock(&volume->lock);
+        }
+        variants_free(&job);
+        resize_end(volume, &flight);
+        // ERR_IMAGE_NOT_FOUND: the image was replaced meanwhile, look again
+        if (err != ERR_NONE && (err != ERR_IMAGE_NOT_FOUND || attempt + 1 >= RESIZE_RETRIES)) {
+            atomic_fetch_sub(&volume->load, 1);
+            return err;
+        }
+    }
+    if (err == ERR_NONE) {
+        volume_key(&volume->file, index, resolution, &key);
+        if (resolution == ORIG_RES) {
+            saved = (uint64_t) volume->file.cold[index]->saved_kib << 10;
+        }
+        *blob = blob_cache_get(&store->cache, &key);
+        if (*blob == NULL) {
+            err = do_read(img_id, resolution, &buffer, &size, &volume->file);
+        }
+    }
+    pthread_rwlock_unlock(&volume->lock);
+    atomic_fetch_sub(&volume->load, 1);
+    if (err != ERR_NONE) {
+        return err;
+    }
+    atomic_fetch_add(&store->saved_served, saved);
+    if (*blob != NULL) {
+        return ERR_NONE;
+    }
+
+    *blob = blob_cache_adopt(&store->cache, &key, buffer, size);
+    return *blob != NULL ? ERR_NONE : ERR_OUT_OF_MEMORY;
+}
+
+/********************************************************************
+ * See imgfs_store.h
+ */
+int store_read_content(struct imgfs_store* store, const unsigned char* SHA, int resolution,
+                       struct content_tag* tag, struct cache_blob** blob)
+{
+    M_REQUIRE_NON_NULL(store);
+    M_REQUIRE_NON_NULL(SHA);
+    M_REQUIRE_NON_NULL(tag);
+    if (resolution < 0 || resolution >= NB_RES) {
+        return ERR_RESOLUTIONS;
+    }
+
+    int err = ERR_IMAGE_NOT_FOUND;
+    for (int attempt = 0; err == ERR_IMAGE_NOT_FOUND && attempt < CONTENT_RETRIES; attempt++) {
+        // the lowest-numbered volume with this content, so that a SHA-256 always gives the same variants
+        uint32_t v = DIR_PENDING, index = 0;
+        pthread_rwlock_rdlock(&store->dir_lock);
+        if (store->contents_capacity > 0) {
+            const size_t mask = store->contents_capacity - 1;
+            for (size_t b = content_home(SHA, store->contents_capacity);
+                 store->contents[b].volume != DIR_PENDING; b = (b + 1) & mask) {
+                if (store->contents[b].volume < v &&
+                    !memcmp(store->contents[b].SHA, SHA, SHA256_DIGEST_LENGTH)) {
+                    v = store->contents[b].volume;
+                    index = store->contents[b].index;
+                }
+            }
+        }
+        pthread_rwlock_unlock(&store->dir_lock);
+        if (v == DIR_PENDING) {
+            return ERR_IMAGE_NOT_FOUND;
+        }
+
+        // that image may have been deleted since: then look again
+        char img_id[MAX_IMG_ID + 1] = "";
+        struct imgfs_volume* volume = &store->volumes[v];
+        pthread_rwlock_rdlock(&volume->lock);
+        const struct imgfs_file* file = &volume->file;
+        if (index < file->header.max_files && imgfs_is_valid(file, index) &&
+            !memcmp(file->cold[index]->SHA, SHA, SHA256_DIGEST_LENGTH)) {
+            strncpy(img_id, file->cold[index]->img_id, MAX_IMG_ID);
+            memset(tag, 0, sizeof(*tag));
+            // nonzero whenever the stored bytes differ from the upload, see imgfs_saved_kib()
+            tag->optimized = resolution == ORIG_RES && file->cold[index]->saved_kib > 0;
+            tag->immutable = resolution == ORIG_RES && !tag->optimized;
+            if (resolution != ORIG_RES) {
+                tag->res[0] = file->header.resized_res[2 * resolution];
+                tag->res[1] = file->header.resized_res[2 * resolution + 1];
+                imgfs_get_profile(&file->header, resolution, &tag->profile);
+            }
+        }
+        pthread_rwlock_unlock(&volume->lock);
+
+        if (img_id[0] != '\0') {
+            err = blob != NULL ? store_read(store, img_id, resolution, IMAGE_JPEG, blob) : ERR_NONE;
+        }
+    }
+    return err;
+}
+
+/********************************************************************
+ * See imgfs_store.h
+ */
+int store_read_sized(struct imgfs_store* store, const char* img_id, uint16_t width,
+                     uint16_t height, int format, struct cache_blob** blob)
+{
+    M_REQUIRE_NON_NULL(store);
+    M_REQUIRE_NON_NULL(img_id);
+    M_REQUIRE_NON_NULL(blob);
+    if (width == 0 || height == 0 || format < 0 || format >= NB_IMAGE_FORMATS) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    uint32_t v = 0;
+    int err = store_locate(store, img_id, &v);
+    if (err != ERR_NONE) {
+        return err;
+    }
+    struct imgfs_volume* volume = &store->volumes[v];
+
+    // source: the smallest stored tier holding the box, else the original
+    struct cache_key key;
+    int source_res = ORIG_RES;
+    uint32_t orig_width = 0, orig_height = 0;
+    pthread_rwlock_rdlock(&volume->lock);
+    uint32_t index = 0;
+    const int found = imgfs_find_id(&volume->file, img_id, &index) == ERR_NONE;
+    if (found) {
+        const struct imgfs_file* file = &volume->file;
+        volume_key(file, index, ORIG_RES, &key);
+        orig_width = file->cold[index]->orig_res[WIDTH_I];
+        orig_height = file->cold[index]->orig_res[HEIGHT_I];
+        for (int res = 0; res < ORIG_RES; res++) {
+            const uint16_t side = file->header.resized_res[2 * res];
+            if (file->size[index][res] > 0 && side >= MAX(width, height) &&
+                (source_res == ORIG_RES || side < file->header.resized_res[2 * source_res])) {
+                source_res = res;
+            }
+        }
+    }
+    pthread_rwlock_unlock(&volume->lock);
+    if (!found) {
+        return ERR_IMAGE_NOT_FOUND;
+    }
+
+    // a box holding the whole original: nothing to make
+    if (format == IMAGE_JPEG && orig_width > 0 && orig_width <= width && orig_height <= height) {
+        return store_read(store, img_id, ORIG_RES, IMAGE_JPEG, blob);
+    }
+
+    key.res[0] = width;
+    key.res[1] = height;
+    key.format = (uint8_t) format;
+    *blob = blob_cache_get(&store->variants, &key);
+    if (*blob != NULL) {
+        return ERR_NONE;
+    }
+
+    struct cache_blob* source = NULL;
+    err = store_read(store, img_id, source_res, IMAGE_JPEG, &source);
+    if (err != ERR_NONE) {
+        return err;
+    }
+    char* buffer = NULL;
+    uint32_t size = 0;
+    // the image may have been replaced since the key was taken: the variant is that of the source
+    memcpy(key.SHA, source->key.SHA, SHA256_DIGEST_LENGTH);
+    IMGFS_PROBE4(resize__start, img_id, -1, width, height);
+    phase_enter(PHASE_RESIZE);
+    err = resize_variant(source->data, source->size, width, height, format, &buffer, &size);
+    phase_leave();
+    IMGFS_PROBE4(resize__done, img_id, -1, size, err);
+    blob_release(source);
+    if (err != ERR_NONE) {
+        return err;
+    }
+
+    *blob = blob_cache_adopt(&store->variants, &key, buffer, size);
+    return *blob != NULL ? ERR_NONE : ERR_OUT_OF_MEMORY;
+}
+
+/********************************************************************
+ * See imgfs_store.h
+ */
+int store_insert(struct imgfs_store* store, const char* image_buffer, size_t image_size,
+                 const char* img_id)
+{
+    M_REQUIRE_NON_NULL(store);
+    M_REQUIRE_NON_NULL(image_buffer);
+    M_REQUIRE_NON_NULL(img_id);
+    if (strlen(img_id) > MAX_IMG_ID) {
+        return ERR_INVALID_IMGID;
+    }
+
+    // reserve the ID, so that concurrent inserts of the same ID fail
+    pthread_rwlock_wrlock(&store->dir_lock);
+    int err = dir_add(store, img_id, DIR_PENDING);
+    pthread_rwlock_unlock(&store->dir_lock);
+    if (err != ERR_NONE) {
+        return err;
+    }
+
+    struct cache_key key;
+    uint32_t v = DIR_PENDING;
+    uint32_t stored_size = 0;
+    size_t attempts = 0;
+    do {
+        v = store_place(store);
+        if (v == DIR_PENDING) {
+            err = ERR_IMGFS_FULL;
+            break;
+        }
+        struct imgfs_volume* volume = &store->volumes[v];
+        atomic_fetch_add(&volume->load, 1);
+        pthread_rwlock_wrlock(&volume->lock);
+        const uint64_t end = volume->file.file_end;
+        err = do_insert(image_buffer, image_size, img_id, &volume->file);
+        uint32_t index = 0;
+        if (err == ERR_NONE && imgfs_find_id(&volume->file, img_id, &index) == ERR_NONE) {
+            volume_key(&volume->file, index, ORIG_RES, &key);
+            stored_size = volume->file.size[index][ORIG_RES];
+            if (volume->file.offset[index][ORIG_RES] >= end) { // not a duplicate
+                atomic_fetch_add(&store->saved_stored,
+                                 (uint64_t) volume->file.cold[index]->saved_kib << 10);
+            }
+            pthread_rwlock_wrlock(&store->dir_lock);
+            if (content_add(store, key.SHA, v, index) != ERR_NONE) {
+                // the image stays readable by ID: only reads by content miss it, until restart
+                fprintf(stderr, "Volume %s: cannot index the content of %s\n", volume->path, img_id);
+            }
+            pthread_rwlock_unlock(&store->dir_lock);
+        }
+        volume_update(store, volume, err == ERR_IMGFS_FULL);
+        pthread_rwlock_unlock(&volume->lock);
+        atomic_fetch_sub(&volume->load, 1);
+        // the volume is closed now, try another one (a deletion may open
+        // it again if sealing failed: bounded by the number of volumes)
+    } while (err == ERR_IMGFS_FULL && ++attempts < store->nb_volumes);
+
+    pthread_rwlock_wrlock(&store->dir_lock);
+    const size_t b = dir_find(store, img_id, imgfs_id_hash(img_id));
+    if (err == ERR_NONE) {
+        store->dir[b].volume = v;
+    } else {
+        dir_remove(store, b);
+    }
+    pthread_rwlock_unlock(&store->dir_lock);
+
+    // admit the new image: it is likely to be read soon (unless what is
+    // stored are optimized bytes)
+    if (err == ERR_NONE && store->cache.budget > 0 && stored_size == image_size) {
+        char* copy = malloc(image_size);
+        if (copy != NULL) {
+            memcpy(copy, image_buffer, image_size);
+            blob_release(blob_cache_adopt(&store->cache, &key, copy, (uint32_t) image_size));
+        }
+    }
+
+    return err;
+}
+
+/********************************************************************
+ * See imgfs_store.h
+ */
+int store_delete(struct imgfs_store* store, const char* img_id)
+{
+    M_REQUIRE_NON_NULL(store);
+    M_REQUIRE_NON_NULL(img_id);
+
+    uint32_t v = 0;
+    int err = store_locate(store, img_id, &v);
+    if (err != ERR_NONE) {
+        return err;
+    }
+    struct imgfs_volume* volume = &store->volumes[v];
+
+    atomic_fetch_add(&volume->load, 1);
+    pthread_rwlock_wrlock(&volume->lock);
+    uint32_t index = 0;
+    unsigned char SHA[SHA256_DIGEST_LENGTH];
+    const int found = imgfs_find_id(&volume->file, img_id, &index) == ERR_NONE;
+    if (found) {
+        memcpy(SHA, volume->file.cold[index]->SHA, SHA256_DIGEST_LENGTH);
+    }
+    err = do_delete(img_id, &volume->file);
+    if (err == ERR_NONE && found) {
+        // the content entry of the volume moves to another image with the same content, if any
+        const uint32_t other = volume_find_content(&volume->file, SHA, index);
+        pthread_rwlock_wrlock(&store->dir_lock);
+        const size_t b = content_find(store, SHA, v);
+        if (b != SIZE_MAX && other == DIR_PENDING) {
+            content_remove(store, b);
+        } else if (b != SIZE_MAX && store->contents[b].index == index) {
+            store->contents[b].index = other;
+        }
+        pthread_rwlock_unlock(&store->dir_lock);
+    }
+    volume_update(store, volume, 0);
+    pthread_rwlock_unlock(&volume->lock);
+    atomic_fetch_sub(&volume->load, 1);
+    if (err != ERR_NONE) {
+        return err;
+    }
+
+    pthread_rwlock_wrlock(&store->dir_lock);
+    const size_t b = dir_find(store, img_id, imgfs_id_hash(img_id));
+    if (b != SIZE_MAX && store->dir[b].volume == v) {
+        dir_remove(store, b);
+    }
+    pthread_rwlock_unlock(&store->dir_lock);
+
+    return ERR_NONE;
+}
+
+/********************************************************************
+ * See imgfs_store.h
+ */
+int store_list(struct imgfs_store* store, char** json)
+{
+    M_REQUIRE_NON_NULL(store);
+    M_REQUIRE_NON_NULL(json);
+
+    struct json_object* images = json_object_new_array();
+    if (images == NULL) {
+        return ERR_RUNTIME;
+    }
+
+    int err = ERR_NONE;
+    for (size_t v = 0; err == ERR_NONE && v < store->nb_volumes; v++) {
+        struct imgfs_volume* volume = &store->volumes[v];
+        pthread_rwlock_rdlock(&volume->lock);
+        for (uint32_t i = 0; err == ERR_NONE && i < volume->file.header.max_files; i++) {
+            if (imgfs_is_valid(&volume->file, i)) {
+                struct json_object* id = json_object_new_string(volume->file.cold[i]->img_id);
+                if (id == NULL || json_object_array_add(images, id) < 0) {
+                    json_object_put(id);
+                    err = ERR_RUNTIME;
+                }
+            }
+        }
+        pthread_rwlock_unlock(&volume->lock);
+    }
+
+    struct json_object* root = json_object_new_object();
+    if (err != ERR_NONE || root == NULL || json_object_object_add(root, "Images", images) < 0) {
+        json_object_put(root);
+        json_object_put(images);
+        return ERR_RUNTIME;
+    }
+
+    *json = strdup(json_object_to_json_string(root));
+    json_object_put(root);
+    return *json == NULL ? ERR_OUT_OF_MEMORY : ERR_NONE;
+}
+
+/********************************************************************
+ * See imgfs_store.h
+ */
+int store_volume_stats(struct imgfs_store* store, size_t volume, struct store_volume_stats* stats)
+{
+    M_REQUIRE_NON_NULL(store);
+    M_REQUIRE_NON_NULL(stats);
+    if (volume >= store->nb_volumes) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    struct imgfs_volume* v = &store->volumes[volume];
+    memset(stats, 0, sizeof(*stats));
+    stats->path = v->path;
+    stats->load = atomic_load(&v->load);
+
+    pthread_rwlock_rdlock(&v->lock);
+    const struct imgfs_file* file = &v->file;
+    stats->nb_files = file->header.nb_files;
+    stats->max_files = file->header.max_files;
+    stats->sealed = (file->header.flags & IMGFS_FLAG_SEALED) != 0;
+    stats->used_bytes = imgfs_used_bytes(file);
+    stats->table_memory = imgfs_table_memory(file);
+    struct imgfs_space space = { 0 };
+    const int err = imgfs_space_get(file, &space);
+    pthread_rwlock_unlock(&v->lock);
+    stats->live_bytes = space.live_bytes;
+    stats->shared_bytes = space.shared_bytes;
+    stats->dead_bytes = space.dead_bytes;
+    stats->scrub_passes = atomic_load(&v->scrub_passes);
+    stats->scrub_damaged = atomic_load(&v->scrub_damaged);
+    stats->scrub_time = atomic_load(&v->scrub_time);
+    return err;
+}
+
+/*******************************************************************
+ * Background scrubber
+ */
+static void scrub_volume(struct imgfs_store* store, struct imgfs_volume* volume)
+{
+    static const char* const resolution_names[NB_RES] = { "thumb", "small", "orig" };
+
+    struct scrub_config config = store->scrub;
+    config.lock = &volume->lock;
+    config.stop = &store->scrub_stop;
+
+    struct scrub_report report;
+    const int err = do_scrub(&volume->file, &config, &report);
+    if (err != ERR_NONE) {
+        fprintf(stderr, "scrub: %s: %s\n", volume->path, ERR_MSG(err));
+        return;
+    }
+    for (size_t d = 0; d < report.nb_damaged; d++) {
+        const struct scrub_damage* damage = &report.damaged[d];
+        fprintf(stderr, "scrub: %s: DAMAGED %s (slot %u) %s: %s\n", volume->path, damage->img_id,
+                damage->index, resolution_names[damage->resolution], ERR_MSG(damage->error));
+    }
+    if (!report.stopped) {
+        atomic_store(&volume->scrub_damaged, (unsigned) report.nb_damaged);
+        atomic_store(&volume->scrub_time, (unsigned long long) time(NULL));
+        atomic_fetch_add(&volume->scrub_passes, 1);
+    }
+    scrub_report_free(&report);
+}
+
+static void* store_scrubber(void* arg)
+{
+    struct imgfs_store* store = arg;
+    // signals are left to the main thread
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    const struct timespec wait = { 0, SCRUB_WAIT_MS * 1000000L };
+    while (!atomic_load(&store->scrub_stop)) {
+        const time_t start = time(NULL);
+        for (size_t v = 0; v < store->nb_volumes && !atomic_load(&store->scrub_stop); v++) {
+            scrub_volume(store, &store->volumes[v]);
+        }
+        while (!atomic_load(&store->scrub_stop) &&
+               time(NULL) - start < (time_t) store->scrub_interval) {
+            nanosleep(&wait, NULL);
+        }
+    }
+    return NULL;
+}
+
+/********************************************************************
+ * See imgfs_store.h
+ */
+int store_scrub_start(struct imgfs_store* store, const struct scrub_config* config, unsigned interval)
+{
+    M_REQUIRE_NON_NULL(store);
+    M_REQUIRE_NON_NULL(config);
+    if (store->scrubbing) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    store->scrub = *config;
+    store->scrub_interval = interval;
+    atomic_store(&store->scrub_stop, 0);
+    if (pthread_create(&store->scrubber, NULL, store_scrubber, store) != 0) {
+        return ERR_THREADING;
+    }
+    store->scrubbing = 1;
+    return ERR_NONE;
+}
+
+/********************************************************************
+ * See imgfs_store.h
+ */
+void store_scrub_stop(struct imgfs_store* store)
+{
+    if (store == NULL || !store->scrubbing) {
+        return;
+    }
+    atomic_store(&store->scrub_stop, 1);
+    pthread_join(store->scrubber, NULL);
+    store->scrubbing = 0;
+}
@@ -0,0 +1,257 @@
+/**
+ * @file imgfs_store.h
+ * @brief Logical imgFS store made of several imgFS volumes.
+ *
+ * Each volume is a regular imgFS file, typically one per disk. A
+ * directory maps every image ID to the volume holding it; it is rebuilt
+ * from the volumes' metadata at startup. New images go to the open
+ * (unsealed) volume with the best ratio of free slots to in-flight
+ * requests. A volume that gets full, or that grows past the configured
+ * size, is sealed: it keeps serving reads and deletions but gets no new
+ * images.
+ *
+ * Every volume has its own reader/writer lock, so requests on different
+ * volumes run in parallel, as do reads on the same volume. Content
+ * deduplication happens within a volume.
+ *
+ * A second index maps the SHA-256 of every stored image to the volumes
+ * holding it, each with one image of that content, so that images can be
+ * read by content whatever their IDs. It is rebuilt at startup too.
+ *
+ * Reads go through a blob cache shared by all volumes (see blob_cache.h).
+ * Newly inserted images and freshly resized variants are admitted too.
+ * Variants in other encodings than JPEG are not stored in the volumes:
+ * they live in the variant store (see below), keyed by content,
+ * resolution and format, and are derived again from the stored JPEG
+ * variant after eviction.
+ *
+ * Missing variants of the tiers are made without the volume lock, which
+ * is only taken for writing to store them (see struct variant_job); the
+ * other readers of the same image wait for them meanwhile.
+ *
+ * Variants of arbitrary size are made on demand from the smallest stored
+ * variant that is big enough. They are not written to the volumes either
+ * but kept in a second cache, the variant store, with its own budget, so
+ * that they never evict the tiers and originals.
+ *
+ * A background thread may scrub the volumes one after the other, at a
+ * limited rate (see imgfs_scrub.h), and log the damaged images it finds.
+ */
+
+#pragma once
+
+#include "imgfs.h"
+#include "blob_cache.h"
+#include "imgfs_scrub.h"
+
+#include <pthread.h>   // for pthread_rwlock_t
+#include <stdatomic.h> // for atomic_uint, atomic_ullong
+#include <stddef.h>    // for size_t
+#include <stdint.h>    // for uint32_t, uint64_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct imgfs_volume {
+    const char* path;
+    struct imgfs_file file;
+    pthread_rwlock_t lock;  // protects file
+    // images whose missing variants are being made, without the lock
+    pthread_mutex_t resize_lock;
+    pthread_cond_t resized;
+    struct resize_flight* resizing;
+    atomic_uint load;       // requests in flight on this volume
+    atomic_uint free_slots; // for placement, 0 once the volume is sealed
+    // last complete scrub
+    atomic_ullong scrub_passes;
+    atomic_uint scrub_damaged;  // damaged image variants it found
+    atomic_ullong scrub_time;   // when it ended (Unix time)
+};
+
+struct store_dir_entry;
+struct store_content_entry;
+struct resize_flight;
+
+struct store_volume_stats {
+    const char* path;
+    uint32_t nb_files;
+    uint32_t max_files;
+    int sealed;
+    unsigned load;         // requests in flight
+    uint64_t used_bytes;   // blob area of the imgFS file, plus the tier file
+    uint64_t live_bytes;   // stored variants some image refers to, shared ones counted once
+    uint64_t shared_bytes; // part of live_bytes several images refer to
+    uint64_t dead_bytes;   // stored variants no image refers to any more
+    size_t table_memory;   // see imgfs_table_memory()
+    uint64_t scrub_passes;  // complete scrubs since startup
+    unsigned scrub_damaged; // damaged image variants found by the last one
+    uint64_t scrub_time;    // when it ended (Unix time), 0 if none did
+};
+
+struct imgfs_store {
+    struct imgfs_volume* volumes;
+    size_t nb_volumes;
+    uint64_t max_volume_size; // seal volumes bigger than this (bytes), 0 for no limit
+
+    // directory: img_id -> volume, open addressing
+    pthread_rwlock_t dir_lock;
+    struct store_dir_entry* dir;
+    size_t dir_capacity; // power of two
+    size_t dir_count;
+    // content index: SHA-256 -> (volume, image), open addressing, under dir_lock
+    struct store_content_entry* contents;
+    size_t contents_capacity; // power of two
+    size_t contents_count;
+
+    struct blob_cache cache;
+    struct blob_cache variants; // arbitrary-size variants
+
+    // bytes saved by optimizing originals (IMGFS_FLAG_OPTIMIZE), KiB granularity, rounded up
+    atomic_ullong saved_stored; // by the stored originals
+    atomic_ullong saved_served; // by the originals read since startup
+
+    // background scrubber
+    struct scrub_config scrub;
+    unsigned scrub_interval; // seconds between the starts of two passes
+    atomic_int scrub_stop;
+    int scrubbing;
+    pthread_t scrubber;
+};
+
+/**
+ * @brief Opens all the volumes of a store and builds its directory.
+ *
+ * @param store The store to initialize
+ * @param paths The imgFS files, one per volume
+ * @param nb_paths The number of volumes
+ * @param backend The storage backend for all volumes
+ * @param max_volume_size Size (bytes) above which a volume gets sealed, 0 for no limit
+ * @param cache_size Byte budget of the blob cache, 0 to disable it
+ * @param variant_cache_size Byte budget of the variant store, 0 to disable it
+ * @return ERR_DUPLICATE_ID if an image ID is in several volumes,
+ *         some other error code on failure, 0 if no error.
+ */
+int store_open(struct imgfs_store* store, const char* const* paths, size_t nb_paths,
+               enum imgfs_backend_kind backend, uint64_t max_volume_size, size_t cache_size,
+               size_t variant_cache_size);
+
+/**
+ * @brief Closes all the volumes of a store and frees its directory,
+ *        after stopping the scrubber.
+ */
+void store_close(struct imgfs_store* store);
+
+/**
+ * @brief Reads an image, from the cache or from the volume holding img_id.
+ *
+ * @param store The store
+ * @param img_id The ID of the image to be read.
+ * @param resolution The desired resolution for the image read.
+ * @param format The desired encoding (enum image_format); only JPEG for originals
+ * @param blob Where to put the image content, to be released with blob_release()
+ * @return Some error code. 0 if no error.
+ */
+int store_read(struct imgfs_store* store, const char* img_id, int resolution, int format,
+               struct cache_blob** blob);
+
+/**
+ * @brief What the bytes served for a content, at a resolution, depend on.
+ *
+ * Nothing else: an optimized original never changes once written, and a
+ * tier is made again (re-encoded) only with another size or profile.
+ */
+struct content_tag {
+    int immutable;       // they are exactly the content named by its SHA-256
+    int optimized;       // an original optimized at insertion (IMGFS_FLAG_OPTIMIZE)
+    uint16_t res[2];     // bounding box of the tier, 0 for the original
+    struct encode_profile profile; // of the tier
+};
+
+/**
+ * @brief Reads an image by its content: one of the images with this
+ *        SHA-256, from the lowest-numbered volume holding one.
+ *
+ * Variants are those of that volume: they change if it gets re-encoded,
+ * or if its last image with this content is deleted and another volume
+ * serves it, which tag tells apart.
+ *
+ * @param store The store
+ * @param SHA The SHA-256 of the image, as inserted
+ * @param resolution The desired resolution for the image read.
+ * @param tag Where to describe what the content depends on
+ * @param blob Where to put the JPEG content, to be released with
+ *        blob_release(); NULL to only fill tag
+ * @return ERR_IMAGE_NOT_FOUND if no image has this content,
+ *         some other error code on failure, 0 if no error.
+ */
+int store_read_content(struct imgfs_store* store, const unsigned char* SHA, int resolution,
+                       struct content_tag* tag, struct cache_blob** blob);
+
+/**
+ * @brief Reads a variant of an image that fits a bounding box, from the
+ *        variant store or made from the smallest big enough stored variant.
+ *
+ * The box is used as given: callers restrict it to a small set of sizes,
+ * so that the variant store keeps popular variants.
+ *
+ * @param store The store
+ * @param img_id The ID of the image to be read.
+ * @param width The width of the bounding box
+ * @param height The height of the bounding box
+ * @param format The desired encoding (enum image_format)
+ * @param blob Where to put the image content, to be released with blob_release()
+ * @return Some error code. 0 if no error.
+ */
+int store_read_sized(struct imgfs_store* store, const char* img_id, uint16_t width,
+                     uint16_t height, int format, struct cache_blob** blob);
+
+/**
+ * @brief Same as do_insert(), on the best open volume.
+ */
+int store_insert(struct imgfs_store* store, const char* image_buffer, size_t image_size,
+                 const char* img_id);
+
+/**
+ * @brief Same as do_delete(), on the volume holding img_id.
+ */
+int store_delete(struct imgfs_store* store, const char* img_id);
+
+/**
+ * @brief Same as do_list() in JSON mode, over all the volumes.
+ */
+int store_list(struct imgfs_store* store, char** json);
+
+/**
+ * @brief Takes a snapshot of the state of one volume.
+ *
+ * The space figures are those of imgfs_space_get(), under the volume's
+ * read lock: kept up to date by volumes with IMGFS_FLAG_SPACE, from a
+ * scan of the metadata for older ones.
+ *
+ * @param store The store
+ * @param volume The index of the volume, below store->nb_volumes
+ * @param stats Where to put the snapshot
+ * @return Some error code. 0 if no error.
+ */
+int store_volume_stats(struct imgfs_store* store, size_t volume, struct store_volume_stats* stats);
+
+/**
+ * @brief Starts the background scrubber: it scrubs all the volumes, one
+ *        after the other, every interval seconds.
+ *
+ * @param store The store
+ * @param config How to scrub (its lock and stop fields are ignored)
+ * @param interval Seconds between the starts of two passes over the volumes
+ * @return Some error code. 0 if no error.
+ */
+int store_scrub_start(struct imgfs_store* store, const struct scrub_config* config, unsigned interval);
+
+/**
+ * @brief Stops the background scrubber, if it runs, and waits for it.
+ */
+void store_scrub_stop(struct imgfs_store* store);
+
+#ifdef __cplusplus
+}
+#endif
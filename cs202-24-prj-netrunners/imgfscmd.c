@@ -28,6 +28,11 @@ command_mapping commands[] = {
     {"insert", do_insert_cmd},
     {"read", do_read_cmd},
     {"delete", do_delete_cmd},
+    {"recover", do_recover_cmd},
+    {"seal", do_seal_cmd},
+    {"reencode", do_reencode_cmd},
+    {"stat", do_stat_cmd},
+    {"scrub", do_scrub_cmd},
     {"help", help}
 };
 
@@ -6,6 +6,7 @@
  */
 
 #include "imgfs.h"
+#include "imgfs_scrub.h"
 #include "imgfscmd_functions.h"
 #include "util.h"   // for _unused
 
@@ -30,6 +31,11 @@ static const uint32_t MAX_FLAG_MAX_FILES = 4294967295;
 #define MIN_NB_ARG 8
 #define MAX_FILE_ARGC 1
 #define SIZE_ARGC 2
+#define PREALLOC_ARGC 1
+#define PROFILE_ARGC 1
+#define SCRUB_ARGC 1
+
+static const char* const resolution_names[NB_RES] = { "thumb", "small", "orig" };
 
 /**********************************************************************
  * Displays some explanations.
@@ -51,16 +57,42 @@ int help(int useless _unused, char** useless_too _unused)
         "          -small_res <X_RES> <Y_RES>: resolution for small images.\n"
         "                                  default value is %ux%u\n"
         "                                  maximum value is %ux%u\n"
+        "          -prealloc <MB>: reserve disk space for MB megabytes of images.\n"
+        "                                  default value is 0\n"
+        "          -tiers: store thumbnail and small images packed in a separate\n"
+        "                                  <imgFS_filename>" IMGFS_TIER_SUFFIX " file.\n"
+        "          -optimize: losslessly optimize the original images when inserted\n"
+        "                                  (Huffman tables, progressive, no previews).\n"
+        "          -thumb_profile <PROFILE>: how thumbnail images are encoded.\n"
+        "          -small_profile <PROFILE>: how small images are encoded.\n"
+        "                                  PROFILE is \"default\" or a comma separated\n"
+        "                                  list of q=<1-100>, strip|keep,\n"
+        "                                  progressive|baseline, chroma=<auto|420|444>\n"
         "  read   <imgFS_filename> <imgID> [original|orig|thumbnail|thumb|small]:\n"
         "      read an image from the imgFS and save it to a file.\n"
         "      default resolution is \"original\".\n"
         "  insert <imgFS_filename> <imgID> <filename>: insert a new image in the imgFS.\n"
-        "  delete <imgFS_filename> <imgID>: delete image imgID from imgFS.\n",
+        "  delete <imgFS_filename> <imgID>: delete image imgID from imgFS.\n"
+        "  recover <imgFS_filename>: rebuild the imgFS metadata from its image data.\n"
+        "  seal <imgFS_filename>: make the imgFS read-only for new images.\n"
+        "  reencode <imgFS_filename> [-thumb_profile <PROFILE>] [-small_profile <PROFILE>]:\n"
+        "      change the encode profiles and apply them to the existing\n"
+        "      thumbnail and small images.\n"
+        "  stat <imgFS_filename>: show the live, shared and dead bytes of the imgFS.\n"
+        "  scrub <imgFS_filename> [options]: verify the stored images and report\n"
+        "      the damaged ones (originals against their SHA-256, the others\n"
+        "      by decoding them).\n"
+        "      options are:\n"
+        "          -threads <N>: number of threads. default value is %u\n"
+        "          -mbps <MB>: read at most MB megabytes per second.\n"
+        "                                  default value is 0 (no limit)\n"
+        "          -window <MB>: megabytes read at once. default value is %u\n",
         default_max_files, MAX_FLAG_MAX_FILES,
         default_thumb_res, default_thumb_res,
         MAX_THUMB_RES, MAX_THUMB_RES, 
         default_small_res, default_small_res,
-        MAX_SMALL_RES, MAX_SMALL_RES
+        MAX_SMALL_RES, MAX_SMALL_RES,
+        SCRUB_DEFAULT_THREADS, SCRUB_DEFAULT_WINDOW >> 20
     );    
     
     return help < 0 ? ERR_IO : ERR_NONE; 
@@ -97,6 +129,17 @@ int do_list_cmd(int argc, char** argv)
     return ERR_NONE;
 }
 
+/**********************************************************************
+ * Resolution set by a -thumb_profile or -small_profile option, -1 if
+ * the option is another one.
+ ********************************************************************** */
+static int profile_option(const char* option)
+{
+    if (!strcmp(option, "-thumb_profile")) return THUMB_RES;
+    if (!strcmp(option, "-small_profile")) return SMALL_RES;
+    return -1;
+}
+
 /**********************************************************************
  * Prepares and calls do_create command.
 ********************************************************************** */
@@ -111,6 +154,10 @@ int do_create_cmd(int argc, char** argv)
     uint32_t max_files = default_max_files;
     uint16_t thumb_width = default_thumb_res, thumb_height = default_thumb_res;
     uint16_t small_width = default_small_res, small_height = default_small_res;
+    uint32_t prealloc_mb = 0;
+    uint16_t flags = 0;
+    struct encode_profile profiles[ORIG_RES];
+    memset(profiles, 0, sizeof(profiles));
 
     const char * filename = argv[0];
     argc--; argv++;
@@ -144,6 +191,26 @@ int do_create_cmd(int argc, char** argv)
             if(small_width > MAX_SMALL_RES || small_height > MAX_SMALL_RES || small_width <= 0 || small_height <= 0) {
                 return ERR_RESOLUTIONS;
             }
+        } else if (!strcmp(argv[i], "-prealloc")) {
+            if (argc - i <= PREALLOC_ARGC) {
+                return ERR_NOT_ENOUGH_ARGUMENTS;
+            }
+            prealloc_mb = atouint32(argv[++i]);
+            if (prealloc_mb == 0) {
+                return ERR_INVALID_ARGUMENT;
+            }
+        } else if (!strcmp(argv[i], "-tiers")) {
+            flags |= IMGFS_FLAG_TIERS;
+        } else if (!strcmp(argv[i], "-optimize")) {
+            flags |= IMGFS_FLAG_OPTIMIZE;
+        } else if (profile_option(argv[i]) >= 0) {
+            if (argc - i <= PROFILE_ARGC) {
+                return ERR_NOT_ENOUGH_ARGUMENTS;
+            }
+            const int res = profile_option(argv[i]);
+            if (encode_profile_parse(argv[++i], &profiles[res]) != ERR_NONE) {
+                return ERR_INVALID_ARGUMENT;
+            }
         } else {
             return ERR_INVALID_ARGUMENT;
         }
@@ -151,10 +218,17 @@ int do_create_cmd(int argc, char** argv)
 
     struct imgfs_file imgfs_file = {
         .header.max_files = max_files,
-        .header.resized_res = { thumb_width, thumb_height, small_width, small_height }
+        .header.resized_res = { thumb_width, thumb_height, small_width, small_height },
+        .header.flags = flags
     };
+    for (int res = 0; res < ORIG_RES; res++) {
+        imgfs_set_profile(&imgfs_file.header, res, &profiles[res]);
+    }
 
     int result = do_create(filename, &imgfs_file);
+    if (result == ERR_NONE && prealloc_mb > 0) {
+        result = imgfs_preallocate(&imgfs_file, (uint64_t) prealloc_mb << 20);
+    }
 
     do_close(&imgfs_file);
 
@@ -197,6 +271,221 @@ int do_delete_cmd(int argc, char** argv)
     return delete; 
 }
 
+/**********************************************************************
+ * Rebuilds the metadata of an imgFS from its data region.
+ */
+int do_recover_cmd(int argc, char** argv)
+{
+    M_REQUIRE_NON_NULL(argv);
+
+    if (argc < 1) {
+        return ERR_NOT_ENOUGH_ARGUMENTS;
+    }
+    if (argc > 1) {
+        return ERR_INVALID_COMMAND;
+    }
+
+    struct imgfs_file imgfs_file;
+    zero_init_var(imgfs_file);
+
+    int error = do_open(argv[0], "rb+", &imgfs_file);
+    if (error != ERR_NONE) {
+        return error;
+    }
+
+    error = do_recover(&imgfs_file);
+    if (error == ERR_NONE) {
+        printf("%" PRIu32 " image(s) recovered\n", imgfs_file.header.nb_files);
+    }
+    do_close(&imgfs_file);
+
+    return error;
+}
+
+/**********************************************************************
+ * Seals an imgFS.
+ */
+int do_seal_cmd(int argc, char** argv)
+{
+    M_REQUIRE_NON_NULL(argv);
+
+    if (argc < 1) {
+        return ERR_NOT_ENOUGH_ARGUMENTS;
+    }
+    if (argc > 1) {
+        return ERR_INVALID_COMMAND;
+    }
+
+    struct imgfs_file imgfs_file;
+    zero_init_var(imgfs_file);
+
+    int error = do_open(argv[0], "rb+", &imgfs_file);
+    if (error != ERR_NONE) {
+        return error;
+    }
+
+    error = do_seal(&imgfs_file);
+    do_close(&imgfs_file);
+
+    return error;
+}
+
+/**********************************************************************
+ * Changes the encode profiles and re-encodes the resized images.
+ */
+int do_reencode_cmd(int argc, char** argv)
+{
+    M_REQUIRE_NON_NULL(argv);
+
+    if (argc < 1) {
+        return ERR_NOT_ENOUGH_ARGUMENTS;
+    }
+
+    struct encode_profile profiles[ORIG_RES];
+    const struct encode_profile* changed[ORIG_RES] = { NULL };
+    for (int i = 1; i < argc; i++) {
+        const int res = profile_option(argv[i]);
+        if (res < 0) {
+            return ERR_INVALID_ARGUMENT;
+        }
+        if (argc - i <= PROFILE_ARGC) {
+            return ERR_NOT_ENOUGH_ARGUMENTS;
+        }
+        if (encode_profile_parse(argv[++i], &profiles[res]) != ERR_NONE) {
+            return ERR_INVALID_ARGUMENT;
+        }
+        changed[res] = &profiles[res];
+    }
+
+    struct imgfs_file imgfs_file;
+    zero_init_var(imgfs_file);
+
+    int error = do_open(argv[0], "rb+", &imgfs_file);
+    if (error != ERR_NONE) {
+        return error;
+    }
+
+    struct reencode_stats stats;
+    error = do_reencode(&imgfs_file, changed, &stats);
+    if (error == ERR_NONE) {
+        printf("%" PRIu32 " variant(s) re-encoded: %" PRIu64 " -> %" PRIu64 " bytes\n",
+               stats.variants, stats.bytes_before, stats.bytes_after);
+    }
+    do_close(&imgfs_file);
+
+    return error;
+}
+
+/**********************************************************************
+ * Displays the space counters of an imgFS, checked against a scan.
+ */
+int do_stat_cmd(int argc, char** argv)
+{
+    M_REQUIRE_NON_NULL(argv);
+
+    if (argc < 1) {
+        return ERR_NOT_ENOUGH_ARGUMENTS;
+    }
+    if (argc > 1) {
+        return ERR_INVALID_COMMAND;
+    }
+
+    struct imgfs_file imgfs_file;
+    zero_init_var(imgfs_file);
+
+    int error = do_open(argv[0], "rb", &imgfs_file);
+    if (error != ERR_NONE) {
+        return error;
+    }
+
+    struct imgfs_space space, scan;
+    error = imgfs_space_get(&imgfs_file, &space);
+    if (error == ERR_NONE) {
+        error = imgfs_space_scan(&imgfs_file, &scan);
+    }
+    if (error == ERR_NONE) {
+        const int counted = (imgfs_file.header.flags & IMGFS_FLAG_SPACE) != 0;
+        const uint64_t used = imgfs_used_bytes(&imgfs_file);
+        const uint64_t accounted = space.live_bytes + space.dead_bytes;
+        printf("images:   %" PRIu32 " / %" PRIu32 "\n", imgfs_file.header.nb_files,
+               imgfs_file.header.max_files);
+        printf("used:     %" PRIu64 " bytes\n", used);
+        printf("live:     %" PRIu64 " bytes\n", space.live_bytes);
+        printf("shared:   %" PRIu64 " bytes\n", space.shared_bytes);
+        printf("dead:     %" PRIu64 " bytes%s\n", space.dead_bytes,
+               counted ? "" : " (estimated: no space counters in this imgFS)");
+        printf("overhead: %" PRIu64 " bytes (needle framing, tier padding)\n",
+               used > accounted ? used - accounted : 0);
+        printf("dead ratio: %.1f%%\n",
+               used > 0 ? 100.0 * (double) space.dead_bytes / (double) used : 0.0);
+        if (counted && (space.live_bytes != scan.live_bytes || space.shared_bytes != scan.shared_bytes)) {
+            printf("check: a scan finds %" PRIu64 " live and %" PRIu64 " shared bytes"
+                   " (run recover to reset the counters)\n", scan.live_bytes, scan.shared_bytes);
+        } else if (counted) {
+            printf("check: counters agree with the metadata\n");
+        }
+    }
+    do_close(&imgfs_file);
+
+    return error;
+}
+
+/**********************************************************************
+ * Scrubs an imgFS.
+ */
+int do_scrub_cmd(int argc, char** argv)
+{
+    M_REQUIRE_NON_NULL(argv);
+
+    if (argc < 1) {
+        return ERR_NOT_ENOUGH_ARGUMENTS;
+    }
+
+    struct scrub_config config = { 0, 0, 0, NULL, NULL };
+    for (int i = 1; i < argc; i++) {
+        if (argc - i <= SCRUB_ARGC) {
+            return ERR_NOT_ENOUGH_ARGUMENTS;
+        }
+        const uint32_t value = atouint32(argv[i + 1]);
+        if (!strcmp(argv[i], "-threads") && value > 0 && value <= SCRUB_MAX_THREADS) {
+            config.threads = value;
+        } else if (!strcmp(argv[i], "-mbps") && value > 0) {
+            config.max_rate = (uint64_t) value << 20;
+        } else if (!strcmp(argv[i], "-window") && value > 0 && value <= 1024) {
+            config.window = (size_t) value << 20;
+        } else {
+            return ERR_INVALID_ARGUMENT;
+        }
+        i++;
+    }
+
+    struct imgfs_file imgfs_file;
+    zero_init_var(imgfs_file);
+
+    int error = do_open(argv[0], "rb", &imgfs_file);
+    if (error != ERR_NONE) {
+        return error;
+    }
+
+    struct scrub_report report;
+    error = do_scrub(&imgfs_file, &config, &report);
+    if (error == ERR_NONE) {
+        for (size_t d = 0; d < report.nb_damaged; d++) {
+            const struct scrub_damage* damage = &report.damaged[d];
+            printf("DAMAGED %s (slot %" PRIu32 ") %s: %s\n", damage->img_id, damage->index,
+                   resolution_names[damage->resolution], ERR_MSG(damage->error));
+        }
+        const double seconds = (double) report.elapsed_ns / 1e9;
+        printf("%" PRIu64 " blob(s), %.1f MB verified in %.2f s (%.1f MB/s): %zu damaged image variant(s)\n",
+               report.blobs, (double) report.bytes / (1 << 20), seconds,
+               seconds > 0 ? (double) report.bytes / (1 << 20) / seconds : 0.0, report.nb_damaged);
+        scrub_report_free(&report);
+    }
+    do_close(&imgfs_file);
+
+    return error;
+}
+
 int do_read_cmd(int argc, char **argv)
 {
     M_REQUIRE_NON_NULL(argv);
@@ -251,8 +540,18 @@ int do_insert_cmd(int argc, char **argv)
         return error;
     }
 
+    const uint64_t end = myfile.file_end;
     error = do_insert(image_buffer, image_size, argv[1], &myfile);
     free(image_buffer);
+
+    // only for a new original: a duplicate stores nothing
+    uint32_t index = 0;
+    if (error == ERR_NONE && (myfile.header.flags & IMGFS_FLAG_OPTIMIZE) &&
+        imgfs_find_id(&myfile, argv[1], &index) == ERR_NONE &&
+        myfile.offset[index][ORIG_RES] >= end) {
+        printf("%" PRIu32 " byte(s) saved by optimization\n",
+               image_size - myfile.size[index][ORIG_RES]);
+    }
     do_close(&myfile);
     return error;
 }
@@ -36,3 +36,28 @@ int do_insert_cmd(int argc, char* argv[]);
  * Reads an image from the imgFS.
  *******************************************************************/
 int do_read_cmd(int argc, char* argv[]);
+
+/********************************************************************
+ * Rebuilds the metadata of an imgFS from its data region.
+ *******************************************************************/
+int do_recover_cmd(int argc, char* argv[]);
+
+/********************************************************************
+ * Seals an imgFS: it accepts no new images anymore.
+ *******************************************************************/
+int do_seal_cmd(int argc, char* argv[]);
+
+/********************************************************************
+ * Changes the encode profiles and re-encodes the resized images.
+ *******************************************************************/
+int do_reencode_cmd(int argc, char* argv[]);
+
+/********************************************************************
+ * Displays how the space of an imgFS is used.
+ *******************************************************************/
+int do_stat_cmd(int argc, char* argv[]);
+
+/********************************************************************
+ * Verifies the stored images of an imgFS and reports the damaged ones.
+ *******************************************************************/
+int do_scrub_cmd(int argc, char* argv[]);
@@ -0,0 +1,247 @@
+/**
+ * @file jpeg_optimize.c
+ * @brief Lossless size optimization of JPEG images, with libjpeg.
+ */
+
+#include "jpeg_optimize.h"
+#include "error.h"
+
+#include <setjmp.h> // for setjmp, longjmp
+#include <stdint.h> // for uint8_t, uint32_t
+#include <stdio.h>  // needed by jpeglib.h
+#include <stdlib.h> // for calloc, free
+#include <string.h> // for memcmp
+#include <jpeglib.h>
+
+#define EXIF_HEADER_SIZE 6 // "Exif\0\0", then the TIFF structure
+#define IFD_ENTRY_SIZE   12
+#define TAG_THUMB_OFFSET 0x0201 // JPEGInterchangeFormat
+#define TAG_THUMB_LENGTH 0x0202 // JPEGInterchangeFormatLength
+#define OUT_MIN_CAPACITY (64u << 10)
+
+struct optimize_job {
+    struct jpeg_decompress_struct src;
+    struct jpeg_compress_struct dst;
+    struct jpeg_error_mgr err;
+    struct jpeg_destination_mgr dest;
+    jmp_buf jump;
+    unsigned char* out;
+    size_t out_capacity;
+    size_t out_size;
+};
+
+/*******************************************************************
+ * libjpeg errors: jump back instead of exiting.
+ */
+static void optimize_error_exit(j_common_ptr cinfo)
+{
+    longjmp(((struct optimize_job*) cinfo->client_data)->jump, 1);
+}
+
+static void optimize_output_message(j_common_ptr cinfo)
+{
+    (void) cinfo; // warnings on odd but readable images are not worth a line each
+}
+
+/*******************************************************************
+ * Destination: a malloc()ed buffer, grown as needed
+ */
+static int dest_grow(struct optimize_job* job, size_t capacity)
+{
+    unsigned char* out = realloc(job->out, capacity);
+    if (out == NULL) {
+        return 0;
+    }
+    job->dest.next_output_byte = out + job->out_capacity;
+    job->dest.free_in_buffer = capacity - job->out_capacity;
+    job->out = out;
+    job->out_capacity = capacity;
+    return 1;
+}
+
+static void dest_init(j_compress_ptr cinfo)
+{
+    struct optimize_job* job = cinfo->client_data;
+    if (!dest_grow(job, OUT_MIN_CAPACITY)) {
+        optimize_error_exit((j_common_ptr) cinfo);
+    }
+}
+
+static boolean dest_empty(j_compress_ptr cinfo)
+{
+    struct optimize_job* job = cinfo->client_data;
+    if (!dest_grow(job, 2 * job->out_capacity)) {
+        optimize_error_exit((j_common_ptr) cinfo);
+    }
+    return TRUE;
+}
+
+static void dest_term(j_compress_ptr cinfo)
+{
+    struct optimize_job* job = cinfo->client_data;
+    job->out_size = job->out_capacity - job->dest.free_in_buffer;
+}
+
+/*******************************************************************
+ * EXIF thumbnail removal
+ */
+static uint32_t tiff_read(const uint8_t* p, int little_endian, int bytes)
+{
+    uint32_t value = 0;
+    for (int b = 0; b < bytes; b++) {
+        value |= (uint32_t) p[little_endian ? b : bytes - 1 - b] << (8 * b);
+    }
+    return value;
+}
+
+static void tiff_write32(uint8_t* p, int little_endian, uint32_t value)
+{
+    for (int b = 0; b < 4; b++) {
+        p[little_endian ? b : 3 - b] = (uint8_t) (value >> (8 * b));
+    }
+}
+
+/********************************************************************
+ * See jpeg_optimize.h
+ */
+unsigned exif_strip_thumbnail(uint8_t* data, unsigned length)
+{
+    if (length < EXIF_HEADER_SIZE + 8 || memcmp(data, "Exif\0\0", EXIF_HEADER_SIZE) != 0) {
+        return length;
+    }
+    uint8_t* tiff = data + EXIF_HEADER_SIZE;
+    const size_t tiff_size = length - EXIF_HEADER_SIZE;
+    const int le = tiff[0] == 'I' && tiff[1] == 'I';
+    if (!le && !(tiff[0] == 'M' && tiff[1] == 'M')) {
+        return length;
+    }
+
+    // offsets come from the upload: compare them with what is left, never add to them first
+    const size_t ifd0 = tiff_read(tiff + 4, le, 4);
+    if (ifd0 < 8 || ifd0 > tiff_size - 2) {
+        return length;
+    }
+    const size_t ifd0_count = tiff_read(tiff + ifd0, le, 2);
+    if (ifd0_count > (tiff_size - ifd0 - 2) / IFD_ENTRY_SIZE) {
+        return length;
+    }
+    const size_t next_at = ifd0 + 2 + IFD_ENTRY_SIZE * ifd0_count;
+    if (next_at > tiff_size - 4) {
+        return length;
+    }
+    const size_t ifd1 = tiff_read(tiff + next_at, le, 4);
+    if (ifd1 < 8 || ifd1 > tiff_size - 2) {
+        return length;
+    }
+
+    const size_t count = tiff_read(tiff + ifd1, le, 2);
+    const size_t room = (tiff_size - ifd1 - 2) / IFD_ENTRY_SIZE; // entries that fit
+    size_t thumb = 0, thumb_size = 0;
+    for (size_t e = 0; e < count && e < room; e++) {
+        const uint8_t* entry = tiff + ifd1 + 2 + IFD_ENTRY_SIZE * e;
+        const uint32_t tag = tiff_read(entry, le, 2);
+        if (tag == TAG_THUMB_OFFSET) thumb = tiff_read(entry + 8, le, 4);
+        if (tag == TAG_THUMB_LENGTH) thumb_size = tiff_read(entry + 8, le, 4);
+    }
+    if (thumb < 8 || thumb_size == 0 || thumb > tiff_size || thumb_size > tiff_size - thumb) {
+        return length;
+    }
+    // only padding may follow the thumbnail
+    for (size_t b = thumb + thumb_size; b < tiff_size; b++) {
+        if (tiff[b] != 0) return length;
+    }
+
+    tiff_write32(tiff + next_at, le, 0);
+    return EXIF_HEADER_SIZE + (unsigned) thumb;
+}
+
+/*******************************************************************
+ * Copies the saved markers, except those libjpeg writes itself and the
+ * previews.
+ */
+static void copy_markers(struct optimize_job* job)
+{
+    for (jpeg_saved_marker_ptr m = job->src.marker_list; m != NULL; m = m->next) {
+        unsigned length = m->data_length;
+        if (m->marker == JPEG_APP0 && job->dst.write_JFIF_header &&
+            length >= 5 && !memcmp(m->data, "JFIF", 5)) {
+            continue;
+        }
+        if (m->marker == JPEG_APP0 + 14 && job->dst.write_Adobe_marker &&
+            length >= 5 && !memcmp(m->data, "Adobe", 5)) {
+            continue;
+        }
+        if (m->marker == JPEG_APP0 + 2 && length >= 4 && !memcmp(m->data, "MPF", 4)) {
+            continue; // index of the secondary images, which are not copied
+        }
+        if (m->marker == JPEG_APP0 + 1) {
+            length = exif_strip_thumbnail(m->data, length);
+        }
+        jpeg_write_marker(&job->dst, m->marker, m->data, length);
+    }
+}
+
+/********************************************************************
+ * See jpeg_optimize.h
+ */
+int jpeg_optimize(const char* image_buffer, size_t image_size, char** out, size_t* out_size)
+{
+    M_REQUIRE_NON_NULL(image_buffer);
+    M_REQUIRE_NON_NULL(out);
+    M_REQUIRE_NON_NULL(out_size);
+    *out = NULL;
+    *out_size = 0;
+
+    struct optimize_job* job = calloc(1, sizeof(*job));
+    if (job == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    job->src.err = jpeg_std_error(&job->err);
+    job->dst.err = &job->err;
+    job->err.error_exit = optimize_error_exit;
+    job->err.output_message = optimize_output_message;
+    job->src.client_data = job;
+    job->dst.client_data = job;
+    job->dest.init_destination = dest_init;
+    job->dest.empty_output_buffer = dest_empty;
+    job->dest.term_destination = dest_term;
+
+    if (setjmp(job->jump)) {
+        jpeg_destroy_compress(&job->dst);
+        jpeg_destroy_decompress(&job->src);
+        free(job->out);
+        free(job);
+        return ERR_IMGLIB;
+    }
+
+    jpeg_create_decompress(&job->src);
+    jpeg_create_compress(&job->dst);
+    jpeg_mem_src(&job->src, (const unsigned char*) image_buffer, (unsigned long) image_size);
+    jpeg_save_markers(&job->src, JPEG_COM, 0xFFFF);
+    for (int app = 0; app < 16; app++) {
+        jpeg_save_markers(&job->src, JPEG_APP0 + app, 0xFFFF);
+    }
+    (void) jpeg_read_header(&job->src, TRUE);
+    jvirt_barray_ptr* coefficients = jpeg_read_coefficients(&job->src);
+
+    jpeg_copy_critical_parameters(&job->src, &job->dst);
+    job->dst.optimize_coding = TRUE;
+    jpeg_simple_progression(&job->dst);
+    job->dst.dest = &job->dest;
+    jpeg_write_coefficients(&job->dst, coefficients);
+    copy_markers(job);
+    jpeg_finish_compress(&job->dst);
+    (void) jpeg_finish_decompress(&job->src); // anything after EOI (MPF images) is dropped
+
+    jpeg_destroy_compress(&job->dst);
+    jpeg_destroy_decompress(&job->src);
+
+    if (job->out_size < image_size) {
+        *out = (char*) job->out;
+        *out_size = job->out_size;
+    } else {
+        free(job->out);
+    }
+    free(job);
+    return ERR_NONE;
+}
@@ -0,0 +1,48 @@
+/**
+ * @file jpeg_optimize.h
+ * @brief Lossless size optimization of JPEG images.
+ *
+ * The quantized DCT coefficients are copied as they are, so the decoded
+ * pixels do not change; only their entropy coding is redone, with
+ * optimized Huffman tables and progressive scans. Metadata (EXIF, XMP,
+ * ICC profile, comments) is kept, except for embedded previews: the EXIF
+ * thumbnail, when it sits at the end of the EXIF segment, and the MPF
+ * secondary images that phones append after the main image.
+ */
+
+#pragma once
+
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint8_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Optimizes a JPEG image.
+ *
+ * @param image_buffer The JPEG bytes
+ * @param image_size The number of bytes in image_buffer
+ * @param out Where to put the optimized image, to be freed with free(),
+ *        or NULL if it would not be smaller than the input
+ * @param out_size Where to put the size of out
+ * @return ERR_IMGLIB if the image cannot be read, some other error code
+ *         on failure, 0 if no error.
+ */
+int jpeg_optimize(const char* image_buffer, size_t image_size, char** out, size_t* out_size);
+
+/**
+ * @brief Drops the thumbnail of an EXIF segment (in place), if it is the
+ *        last thing in the segment: IFD1 gets unlinked and the segment cut
+ *        where the thumbnail starts. Other layouts are left alone.
+ *
+ * @param data The APP1 segment, after its length: "Exif\0\0", then TIFF
+ * @param length The number of bytes in data
+ * @return The new length of the segment.
+ */
+unsigned exif_strip_thumbnail(uint8_t* data, unsigned length);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,149 @@
+/**
+ * @file jpeg_probe.c
+ * @brief Reads the basic properties of a JPEG image from its markers.
+ */
+
+#include "jpeg_probe.h"
+#include "error.h"
+
+#include <string.h> // for memcmp, memset
+
+#define MARKER_SOI  0xD8
+#define MARKER_EOI  0xD9
+#define MARKER_SOS  0xDA
+#define MARKER_APP1 0xE1
+#define MARKER_TEM  0x01
+#define MARKER_DHT  0xC4
+#define MARKER_JPG  0xC8
+#define MARKER_DAC  0xCC
+#define MARKER_SOF0 0xC0 // baseline
+#define MARKER_SOF2 0xC2 // progressive
+
+#define EXIF_TAG_ORIENTATION 0x0112
+#define EXIF_TYPE_SHORT      3
+
+/*******************************************************************
+ * Big- and little-endian readers
+ */
+static uint16_t be16(const unsigned char* p)
+{
+    return (uint16_t) (p[0] << 8 | p[1]);
+}
+
+static uint16_t get16(const unsigned char* p, int little)
+{
+    return little ? (uint16_t) (p[1] << 8 | p[0]) : be16(p);
+}
+
+static uint32_t get32(const unsigned char* p, int little)
+{
+    return little ? (uint32_t) p[3] << 24 | (uint32_t) p[2] << 16 | (uint32_t) p[1] << 8 | p[0]
+                  : (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+}
+
+/*******************************************************************
+ * Whether a marker starts a frame (SOF0..SOF15, minus DHT, JPG and DAC).
+ */
+static int is_sof(unsigned char marker)
+{
+    return marker >= MARKER_SOF0 && marker <= 0xCF &&
+           marker != MARKER_DHT && marker != MARKER_JPG && marker != MARKER_DAC;
+}
+
+/*******************************************************************
+ * Orientation tag of an APP1 Exif segment; leaves it alone if absent.
+ */
+static void probe_exif(const unsigned char* seg, size_t len, struct jpeg_info* info)
+{
+    static const unsigned char exif_id[6] = { 'E', 'x', 'i', 'f', 0, 0 };
+    if (len < sizeof(exif_id) + 8 || memcmp(seg, exif_id, sizeof(exif_id)) != 0) return;
+
+    // TIFF structure: offsets are relative to its header
+    const unsigned char* tiff = seg + sizeof(exif_id);
+    const size_t tiff_len = len - sizeof(exif_id);
+    int little = 0;
+    if (tiff[0] == 'I' && tiff[1] == 'I') {
+        little = 1;
+    } else if (tiff[0] != 'M' || tiff[1] != 'M') {
+        return;
+    }
+
+    const uint32_t ifd = get32(tiff + 4, little);
+    if (ifd > tiff_len - 2) return;
+    const uint16_t nb_entries = get16(tiff + ifd, little);
+    for (uint32_t e = 0; e < nb_entries; e++) {
+        const size_t entry = ifd + 2 + (size_t) e * 12;
+        if (entry + 12 > tiff_len) return;
+        if (get16(tiff + entry, little) == EXIF_TAG_ORIENTATION &&
+            get16(tiff + entry + 2, little) == EXIF_TYPE_SHORT) {
+            const uint16_t orientation = get16(tiff + entry + 8, little);
+            if (orientation >= 1 && orientation <= 8) {
+                info->orientation = orientation;
+            }
+            return;
+        }
+    }
+}
+
+/********************************************************************
+ * See jpeg_probe.h
+ */
+int jpeg_probe(const char* image_buffer, size_t image_size, struct jpeg_info* info)
+{
+    M_REQUIRE_NON_NULL(image_buffer);
+    M_REQUIRE_NON_NULL(info);
+
+    const unsigned char* buf = (const unsigned char*) image_buffer;
+    memset(info, 0, sizeof(*info));
+    info->orientation = 1;
+
+    if (image_size < 4 || buf[0] != 0xFF || buf[1] != MARKER_SOI) {
+        return ERR_IMGLIB;
+    }
+
+    size_t pos = 2;
+    while (pos + 4 <= image_size) {
+        if (buf[pos] != 0xFF) {
+            return ERR_IMGLIB;
+        }
+        // any number of 0xFF fill bytes may precede a marker
+        while (pos < image_size && buf[pos] == 0xFF) {
+            pos++;
+        }
+        if (pos + 3 > image_size) break;
+        const unsigned char marker = buf[pos++];
+
+        if (marker == MARKER_TEM || (marker >= 0xD0 && marker <= 0xD7)) {
+            continue; // standalone markers: no segment
+        }
+        if (marker == MARKER_SOS || marker == MARKER_EOI) {
+            break; // entropy-coded data before any frame header
+        }
+
+        const uint16_t len = be16(buf + pos);
+        if (len < 2 || pos + len > image_size) {
+            return ERR_IMGLIB;
+        }
+        const unsigned char* seg = buf + pos + 2;
+        const size_t seg_len = (size_t) len - 2;
+
+        if (marker == MARKER_APP1) {
+            probe_exif(seg, seg_len, info);
+        } else if (is_sof(marker)) {
+            // precision, height, width, number of components
+            if (seg_len < 6) {
+                return ERR_IMGLIB;
+            }
+            if (marker > MARKER_SOF2) {
+                return ERR_IMGLIB; // lossless, hierarchical or arithmetic-coded
+            }
+            info->height = be16(seg + 1);
+            info->width = be16(seg + 3);
+            info->components = seg[5];
+            info->progressive = marker == MARKER_SOF2;
+            return info->height > 0 && info->width > 0 ? ERR_NONE : ERR_IMGLIB;
+        }
+        pos += len;
+    }
+    return ERR_IMGLIB;
+}
@@ -0,0 +1,48 @@
+/**
+ * @file jpeg_probe.h
+ * @brief Reads the basic properties of a JPEG image from its markers.
+ *
+ * Walks the marker segments up to the first SOFn frame header, which in
+ * practice sits in the first few hundred bytes (after the APPn segments),
+ * without decoding anything. This is much cheaper than opening the image
+ * with vips, which sets up a full decoder.
+ */
+
+#pragma once
+
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint8_t, uint16_t, uint32_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct jpeg_info {
+    uint32_t width;
+    uint32_t height;
+    uint16_t orientation; // EXIF orientation, 1 (upright) if none
+    uint8_t  progressive; // whether the frame is progressive
+    uint8_t  components;  // 1 for grayscale, 3 for YCbCr, 4 for CMYK
+};
+
+/**
+ * @brief Reads the dimensions, orientation and coding of a JPEG image.
+ *
+ * Dimensions are those of the stored frame, before any EXIF rotation.
+ *
+ * @param image_buffer The JPEG bytes
+ * @param image_size The number of bytes in image_buffer
+ * @param info Where to put the result
+ * Only Huffman-coded sequential and progressive frames (SOF0, SOF1 and
+ * SOF2) are accepted: the others (lossless, hierarchical, arithmetic
+ * coding) are seldom decodable, so callers must not size work on them.
+ *
+ * @return ERR_IMGLIB if the markers are malformed or have no usable frame
+ *         header (e.g. a height only given by a later DNL marker, or a frame
+ *         of another kind), 0 if no error.
+ */
+int jpeg_probe(const char* image_buffer, size_t image_size, struct jpeg_info* info);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,149 @@
+/**
+ * @file needle.c
+ * @brief Self-describing blob format: append and verification.
+ */
+
+#include "needle.h"
+#include "crc32c.h"
+#include "error.h"
+
+#include <stdint.h> // for uintptr_t
+#include <string.h> // for strlen, memcpy
+
+/********************************************************************
+ * See needle.h
+ */
+uint64_t needle_total_size(uint32_t size, uint16_t id_len)
+{
+    const uint64_t raw = sizeof(struct needle_header) + (uint64_t) size + id_len;
+    return (raw + NEEDLE_ALIGN - 1) / NEEDLE_ALIGN * NEEDLE_ALIGN;
+}
+
+/*******************************************************************
+ * Where a blob of the given size goes in the tier file: right at the
+ * end if it fits in the current page, else at the start of the next one.
+ */
+static uint64_t tier_place(uint64_t end, uint64_t size)
+{
+    const uint64_t room = IMGFS_TIER_PAGE - end % IMGFS_TIER_PAGE;
+    if (room == IMGFS_TIER_PAGE || size <= room) {
+        return end;
+    }
+    return end + room;
+}
+
+/********************************************************************
+ * See needle.h
+ */
+int needle_append(struct imgfs_file* imgfs_file, const char* img_id,
+                  int resolution, uint8_t flags,
+                  const void* payload, uint32_t size, uint64_t* offset)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(img_id);
+    M_REQUIRE_NON_NULL(offset);
+    if (size > 0) M_REQUIRE_NON_NULL(payload);
+
+    const int tier = imgfs_in_tier(imgfs_file, resolution);
+    const uint64_t end = tier ? imgfs_file->tier_end : imgfs_file->file_end;
+
+    if (imgfs_file->header.format != IMGFS_FORMAT_NEEDLE) {
+        const uint64_t start = tier ? tier_place(end, size) : end;
+        if (size > 0 && imgfs_res_pwrite(imgfs_file, resolution, payload, size, start) != ERR_NONE) {
+            return ERR_IO;
+        }
+        *offset = start;
+        return ERR_NONE;
+    }
+
+    const size_t id_len = strlen(img_id);
+    if (id_len == 0 || id_len > MAX_IMG_ID) {
+        return ERR_INVALID_IMGID;
+    }
+
+    const struct needle_header header = {
+        .magic      = NEEDLE_MAGIC,
+        .crc        = crc32c(0, payload, size),
+        .id_hash    = imgfs_id_hash(img_id),
+        .size       = size,
+        .resolution = (uint8_t) resolution,
+        .flags      = flags,
+        .id_len     = (uint16_t) id_len
+    };
+
+    // a torn previous append may have left the end unaligned
+    uint64_t start = (end + NEEDLE_ALIGN - 1) / NEEDLE_ALIGN * NEEDLE_ALIGN;
+    if (tier) {
+        start = tier_place(start, needle_total_size(size, header.id_len));
+    }
+    const uint64_t payload_offset = start + sizeof(header);
+
+    // img_id trailer and padding go out in one write
+    char trailer[MAX_IMG_ID + NEEDLE_ALIGN] = { 0 };
+    memcpy(trailer, img_id, id_len);
+    const size_t trailer_len = (size_t) (needle_total_size(size, header.id_len) - sizeof(header) - size);
+
+    // the whole needle in one write, so that a crash rarely tears it
+    const struct iovec iov[3] = {
+        { (void*) (uintptr_t) &header, sizeof(header) },
+        { (void*) (uintptr_t) payload, size },
+        { trailer, trailer_len }
+    };
+    if (imgfs_res_pwritev(imgfs_file, resolution, iov, 3, start) != ERR_NONE) {
+        return ERR_IO;
+    }
+
+    *offset = payload_offset;
+    return ERR_NONE;
+}
+
+/********************************************************************
+ * See needle.h
+ */
+int needle_read(const struct imgfs_file* imgfs_file, int resolution, uint64_t offset,
+                void* payload, uint32_t size)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    if (size > 0) M_REQUIRE_NON_NULL(payload);
+
+    if (imgfs_file->header.format != IMGFS_FORMAT_NEEDLE) {
+        return size == 0 || imgfs_res_pread(imgfs_file, resolution, payload, size, offset) == ERR_NONE ?
+               ERR_NONE : ERR_IO;
+    }
+
+    const uint64_t data_start = imgfs_in_tier(imgfs_file, resolution) ?
+                                IMGFS_TIER_PAGE : imgfs_data_start(&imgfs_file->header);
+    if (offset < data_start + sizeof(struct needle_header)) {
+        return ERR_CORRUPTED;
+    }
+
+    // the header right before the payload, in the same read
+    struct needle_header header;
+    const struct iovec iov[2] = {
+        { &header, sizeof(header) },
+        { payload, size }
+    };
+    if (imgfs_res_preadv(imgfs_file, resolution, iov, 2, offset - sizeof(header)) != ERR_NONE) {
+        return ERR_IO;
+    }
+
+    return needle_verify(&header, resolution, payload, size);
+}
+
+/********************************************************************
+ * See needle.h
+ */
+int needle_verify(const struct needle_header* header, int resolution, const void* payload, uint32_t size)
+{
+    M_REQUIRE_NON_NULL(header);
+    if (size > 0) M_REQUIRE_NON_NULL(payload);
+
+    // the id hash is not checked: an alias shares the blob of another image
+    if (header->magic != NEEDLE_MAGIC || header->flags != NEEDLE_BLOB ||
+        header->resolution != resolution || header->size != size ||
+        header->crc != crc32c(0, payload, size)) {
+        return ERR_CORRUPTED;
+    }
+
+    return ERR_NONE;
+}
@@ -0,0 +1,107 @@
+/**
+ * @file needle.h
+ * @brief Self-describing blob format (IMGFS_FORMAT_NEEDLE).
+ *
+ * In needle format every blob appended to the data region is laid out as
+ *
+ *     [struct needle_header][payload: size bytes][img_id: id_len bytes][pad]
+ *
+ * padded to NEEDLE_ALIGN bytes. The metadata offsets point to the payload,
+ * so readers that do not care about needles are unaffected. The header
+ * carries enough information to verify a blob (CRC-32C) and, together
+ * with the img_id trailer, to rebuild the metadata table with a single
+ * sequential scan (see do_recover()).
+ */
+
+#pragma once
+
+#include "imgfs.h" // for struct imgfs_file
+
+#include <stdint.h> // for uint16_t, uint32_t, uint64_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define NEEDLE_MAGIC 0x4C44454Eu // "NEDL" on disk
+#define NEEDLE_ALIGN 8
+
+// For flags in needle_header
+#define NEEDLE_BLOB   0x00 // payload is image content
+#define NEEDLE_ALIAS  0x01 // payload is the SHA-256 of already stored content
+#define NEEDLE_DELETE 0x02 // no payload, img_id was deleted
+#define NEEDLE_DIGEST 0x03 // payload is a struct needle_digest for the optimized
+                           // original of img_id appended just before
+
+/*
+ * With IMGFS_FLAG_OPTIMIZE, the stored original differs from the uploaded
+ * one, yet its metadata keeps the SHA-256 of the upload (so that uploading
+ * it again deduplicates). The digest needle lets do_recover() restore it.
+ */
+struct needle_digest {
+    unsigned char SHA[SHA256_DIGEST_LENGTH]; // of the original as uploaded
+    uint32_t saved;                          // bytes saved by the optimization
+};
+
+struct needle_header {
+    uint32_t magic;
+    uint32_t crc;        // CRC-32C of the payload
+    uint64_t id_hash;    // imgfs_id_hash() of the owner img_id
+    uint32_t size;       // payload size
+    uint8_t  resolution;
+    uint8_t  flags;
+    uint16_t id_len;     // length of the img_id trailer
+};
+
+/**
+ * @brief Total on-disk size of a needle, padding included.
+ */
+uint64_t needle_total_size(uint32_t size, uint16_t id_len);
+
+/**
+ * @brief Appends a blob at the end of the imgFS file, or of its tier file
+ *        for resized variants (see IMGFS_FLAG_TIERS).
+ *
+ * In IMGFS_FORMAT_RAW files, the payload is written as-is.
+ *
+ * @param imgfs_file The main in-memory structure
+ * @param img_id The ID of the image owning the blob
+ * @param resolution The resolution of the blob
+ * @param flags One of NEEDLE_BLOB, NEEDLE_ALIAS, NEEDLE_DELETE, NEEDLE_DIGEST
+ * @param payload The bytes to store (may be NULL if size is 0)
+ * @param size The payload size
+ * @param offset Where to put the offset of the stored payload
+ * @return Some error code. 0 if no error.
+ */
+int needle_append(struct imgfs_file* imgfs_file, const char* img_id,
+                  int resolution, uint8_t flags,
+                  const void* payload, uint32_t size, uint64_t* offset);
+
+/**
+ * @brief Reads a payload from the imgFS and verifies it against its
+ *        needle header, both in a single read.
+ *
+ * Only reads on IMGFS_FORMAT_RAW files.
+ *
+ * @param imgfs_file The main in-memory structure
+ * @param resolution The resolution of the blob
+ * @param offset The offset of the payload, as stored in the metadata
+ * @param payload Where to put the payload, size bytes
+ * @param size The payload size, as stored in the metadata
+ * @return ERR_CORRUPTED if it does not match, some other error code
+ *         on failure, 0 if the blob is sound.
+ */
+int needle_read(const struct imgfs_file* imgfs_file, int resolution, uint64_t offset,
+                void* payload, uint32_t size);
+
+/**
+ * @brief Verifies a payload against its needle header, already read: it
+ *        must be the blob of this resolution, of this size and checksum.
+ *
+ * @return ERR_CORRUPTED if it does not match, 0 if the blob is sound.
+ */
+int needle_verify(const struct needle_header* header, int resolution, const void* payload, uint32_t size);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,371 @@
+/**
+ * @file request_phases.c
+ * @brief Where the time of each request goes: per-phase span timing.
+ */
+
+#include "request_phases.h"
+#include "error.h"
+#include "util.h" // for now_ns
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h> // for strftime
+
+#define MAX_DEPTH 8          // nested phases; deeper ones are not timed
+#define MAX_SPANS 64         // spans of a request kept as trace events
+#define DEFAULT_MAX_EVENTS (1u << 20)
+#define EVENT_NAME 96        // bytes of an event name, with its '\0'
+#define LOGGED_TARGET 512    // bytes of the target written to the slow log
+#define REQUEST_EVENT (-1)   // phase of the event spanning a whole request
+
+static const char* const phase_names[NB_PHASES] = {
+    [PHASE_RECV]   = "recv",
+    [PHASE_PARSE]  = "parse",
+    [PHASE_HANDLE] = "handle",
+    [PHASE_LOOKUP] = "lookup",
+    [PHASE_DISK]   = "disk",
+    [PHASE_RESIZE] = "resize",
+    [PHASE_SEND]   = "send"
+};
+
+struct trace_event {
+    atomic_int ready; // set once the event is filled
+    int phase;        // REQUEST_EVENT or a request_phase
+    uint32_t tid;
+    uint64_t start, duration;
+    char name[EVENT_NAME];
+};
+
+struct frame {
+    int phase;
+    uint64_t start;
+    uint64_t children; // time spent in nested phases
+};
+
+struct span {
+    int phase;
+    uint64_t start, end;
+};
+
+// the request served by the calling thread
+static _Thread_local struct {
+    int active;
+    uint32_t tid; // 0 until the thread serves its first request
+    uint64_t start;
+    uint64_t self[NB_PHASES];
+    struct frame stack[MAX_DEPTH];
+    unsigned depth;
+    unsigned overflow; // phases entered beyond MAX_DEPTH
+    struct span spans[MAX_SPANS];
+    size_t nb_spans;
+} current;
+
+static struct {
+    atomic_int enabled;
+    uint64_t origin; // CLOCK_MONOTONIC time of the trace events at 0
+    atomic_uint tids;
+
+    uint64_t slow_ns;
+    unsigned slow_sample;
+    atomic_uint_fast64_t slow; // slow requests seen
+    pthread_mutex_t log_lock;
+    FILE* slow_log;            // NULL once closed
+    int own_log;               // not stderr
+
+    // the events are never freed: requests still being served may write them
+    int keep_events;
+    const char* chrome_path;
+    struct trace_event* events;
+    size_t max_events;
+    atomic_size_t next;
+    atomic_uint_fast64_t dropped;
+} phases = { .log_lock = PTHREAD_MUTEX_INITIALIZER };
+
+/********************************************************************
+ * See request_phases.h
+ */
+const char* phase_name(enum request_phase phase)
+{
+    return phase >= 0 && phase < NB_PHASES ? phase_names[phase] : "unknown";
+}
+
+/********************************************************************
+ * See request_phases.h
+ */
+int phases_init(const struct phases_config* config)
+{
+    M_REQUIRE_NON_NULL(config);
+    if (atomic_load(&phases.enabled)) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    phases.slow_ns = config->slow_ns;
+    phases.slow_sample = config->slow_sample > 0 ? config->slow_sample : 1;
+    phases.slow_log = stderr;
+    phases.own_log = 0;
+    if (config->slow_log != NULL) {
+        phases.slow_log = fopen(config->slow_log, "a");
+        if (phases.slow_log == NULL) {
+            return ERR_IO;
+        }
+        setvbuf(phases.slow_log, NULL, _IOLBF, 0);
+        phases.own_log = 1;
+    }
+
+    if (config->chrome_path != NULL) {
+        phases.max_events = config->max_events > 0 ? config->max_events : DEFAULT_MAX_EVENTS;
+        phases.events = calloc(phases.max_events, sizeof(struct trace_event));
+        if (phases.events == NULL) {
+            if (phases.own_log) fclose(phases.slow_log);
+            phases.slow_log = NULL;
+            return ERR_OUT_OF_MEMORY;
+        }
+        phases.chrome_path = config->chrome_path;
+        phases.keep_events = 1;
+    }
+
+    phases.origin = now_ns();
+    atomic_store(&phases.enabled, 1);
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Chrome trace-event output
+ */
+static void write_json_string(FILE* out, const char* text)
+{
+    putc('"', out);
+    for (const unsigned char* c = (const unsigned char*) text; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\') {
+            fprintf(out, "\\%c", *c);
+        } else if (*c < 0x20 || *c >= 0x7f) { // targets may hold any byte
+            fprintf(out, "\\u%04x", *c);
+        } else {
+            putc(*c, out);
+        }
+    }
+    putc('"', out);
+}
+
+static int write_chrome_trace(void)
+{
+    // later requests no longer get room for their events
+    size_t nb_events = atomic_exchange(&phases.next, SIZE_MAX / 2);
+    if (nb_events > phases.max_events) {
+        nb_events = phases.max_events;
+    }
+
+    FILE* out = fopen(phases.chrome_path, "w");
+    if (out == NULL) {
+        return ERR_IO;
+    }
+    fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    int first = 1;
+    for (size_t i = 0; i < nb_events; i++) {
+        const struct trace_event* event = &phases.events[i];
+        if (!atomic_load_explicit(&event->ready, memory_order_acquire)) {
+            continue; // still being written
+        }
+        fprintf(out, "%s{\"name\":", first ? "" : ",\n");
+        write_json_string(out, event->name);
+        fprintf(out, ",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+                event->phase == REQUEST_EVENT ? "request" : "phase", event->tid,
+                (double) (event->start - phases.origin) / 1e3, (double) event->duration / 1e3);
+        first = 0;
+    }
+    fprintf(out, "\n],\"otherData\":{\"dropped_events\":%llu}}\n",
+            (unsigned long long) atomic_load(&phases.dropped));
+    return fclose(out) == 0 ? ERR_NONE : ERR_IO;
+}
+
+/********************************************************************
+ * See request_phases.h
+ */
+int phases_shutdown(void)
+{
+    if (!atomic_exchange(&phases.enabled, 0)) {
+        return ERR_NONE;
+    }
+
+    int err = ERR_NONE;
+    if (phases.keep_events) {
+        err = write_chrome_trace();
+    }
+
+    pthread_mutex_lock(&phases.log_lock);
+    if (phases.own_log) {
+        fclose(phases.slow_log);
+    }
+    phases.slow_log = NULL;
+    pthread_mutex_unlock(&phases.log_lock);
+    return err;
+}
+
+/********************************************************************
+ * See request_phases.h
+ */
+void phases_request_begin(void)
+{
+    if (current.active || !atomic_load_explicit(&phases.enabled, memory_order_relaxed)) {
+        return;
+    }
+    if (current.tid == 0) {
+        current.tid = atomic_fetch_add(&phases.tids, 1) + 1;
+    }
+    for (int p = 0; p < NB_PHASES; p++) {
+        current.self[p] = 0;
+    }
+    current.depth = 0;
+    current.overflow = 0;
+    current.nb_spans = 0;
+    current.active = 1;
+    current.start = now_ns();
+}
+
+/********************************************************************
+ * See request_phases.h
+ */
+void phase_enter(enum request_phase phase)
+{
+    if (!current.active) {
+        return;
+    }
+    if (current.depth >= MAX_DEPTH) {
+        current.overflow++;
+        return;
+    }
+    struct frame* frame = &current.stack[current.depth++];
+    frame->phase = phase;
+    frame->children = 0;
+    frame->start = now_ns();
+}
+
+/********************************************************************
+ * See request_phases.h
+ */
+void phase_leave(void)
+{
+    if (!current.active) {
+        return;
+    }
+    if (current.overflow > 0) {
+        current.overflow--;
+        return;
+    }
+    if (current.depth == 0) { // entered before the request started
+        return;
+    }
+
+    const uint64_t end = now_ns();
+    const struct frame* frame = &current.stack[--current.depth];
+    const uint64_t duration = end - frame->start;
+    current.self[frame->phase] += duration > frame->children ? duration - frame->children : 0;
+    if (current.depth > 0) {
+        current.stack[current.depth - 1].children += duration;
+    }
+    if (phases.keep_events && current.nb_spans < MAX_SPANS) {
+        current.spans[current.nb_spans++] = (struct span) { frame->phase, frame->start, end };
+    }
+}
+
+/*******************************************************************
+ * Ends of requests
+ */
+static void log_slow(uint64_t total, const char* method, size_t method_len,
+                     const char* target, size_t target_len)
+{
+    const uint64_t seen = atomic_fetch_add(&phases.slow, 1);
+    if (seen % phases.slow_sample != 0) {
+        return;
+    }
+
+    char breakdown[NB_PHASES * 24 + 32];
+    size_t len = 0;
+    uint64_t accounted = 0;
+    for (int p = 0; p < NB_PHASES; p++) {
+        accounted += current.self[p];
+        len += (size_t) snprintf(breakdown + len, sizeof(breakdown) - len, " %s %.3f",
+                                 phase_names[p], (double) current.self[p] / 1e6);
+    }
+    snprintf(breakdown + len, sizeof(breakdown) - len, " other %.3f",
+             (double) (total > accounted ? total - accounted : 0) / 1e6);
+
+    char when[32];
+    const time_t now = time(NULL);
+    struct tm tm;
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime_r(&now, &tm));
+
+    pthread_mutex_lock(&phases.log_lock);
+    if (phases.slow_log != NULL) {
+        fprintf(phases.slow_log, "%s slow request #%llu: %.3f ms %.*s %.*s |%s ms\n",
+                when, (unsigned long long) seen + 1, (double) total / 1e6,
+                (int) method_len, method,
+                (int) (target_len < LOGGED_TARGET ? target_len : LOGGED_TARGET), target,
+                breakdown);
+    }
+    pthread_mutex_unlock(&phases.log_lock);
+}
+
+static void fill_event(struct trace_event* event, int phase, uint64_t start, uint64_t end)
+{
+    event->phase = phase;
+    event->tid = current.tid;
+    event->start = start;
+    event->duration = end - start;
+}
+
+static void keep_events(uint64_t end, const char* method, size_t method_len,
+                        const char* target, size_t target_len)
+{
+    const size_t count = current.nb_spans + 1;
+    const size_t first = atomic_fetch_add(&phases.next, count);
+    if (first + count > phases.max_events) {
+        atomic_fetch_add(&phases.dropped, count);
+        return;
+    }
+
+    struct trace_event* event = &phases.events[first];
+    fill_event(event, REQUEST_EVENT, current.start, end);
+    snprintf(event->name, sizeof(event->name), "%.*s %.*s",
+             (int) method_len, method, (int) target_len, target);
+    atomic_store_explicit(&event->ready, 1, memory_order_release);
+
+    for (size_t s = 0; s < current.nb_spans; s++) {
+        const struct span* span = &current.spans[s];
+        event = &phases.events[first + 1 + s];
+        fill_event(event, span->phase, span->start, span->end);
+        snprintf(event->name, sizeof(event->name), "%s", phase_names[span->phase]);
+        atomic_store_explicit(&event->ready, 1, memory_order_release);
+    }
+}
+
+/********************************************************************
+ * See request_phases.h
+ */
+void phases_request_end(const char* method, size_t method_len,
+                        const char* target, size_t target_len)
+{
+    if (!current.active) {
+        return;
+    }
+    const uint64_t end = now_ns();
+    current.active = 0;
+    if (method == NULL) {
+        method = "";
+        method_len = 0;
+    }
+    if (target == NULL) {
+        target = "";
+        target_len = 0;
+    }
+
+    const uint64_t total = end - current.start;
+    if (phases.slow_ns > 0 && total >= phases.slow_ns) {
+        log_slow(total, method, method_len, target, target_len);
+    }
+    if (phases.keep_events) {
+        keep_events(end, method, method_len, target, target_len);
+    }
+}
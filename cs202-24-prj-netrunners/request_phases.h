@@ -0,0 +1,103 @@
+/**
+ * @file request_phases.h
+ * @brief Where the time of each request goes: per-phase span timing.
+ *
+ * The HTTP layer starts a request when its first bytes arrive and ends
+ * it once the reply is sent; in between, the code marks the phases it
+ * runs with phase_enter() / phase_leave() (CLOCK_MONOTONIC at every
+ * boundary). Phases nest: each one is accounted its own time, without
+ * the phases it contains, so the times of a request add up to its total.
+ *
+ * Requests slower than a threshold are written to the slow-request log,
+ * one in every slow_sample of them. Optionally, the spans of every
+ * request are also kept in memory, up to a number of events, and written
+ * at shutdown in the Chrome trace-event format (chrome://tracing,
+ * Perfetto).
+ *
+ * Until phases_init() is called, or on threads serving no request,
+ * phase_enter() and phase_leave() only test a thread-local flag: the
+ * command-line tool pays nothing for the marks in the core.
+ */
+
+#pragma once
+
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint64_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum request_phase {
+    PHASE_RECV,   // reading the rest of the request from the socket
+    PHASE_PARSE,  // http_parse_message()
+    PHASE_HANDLE, // the imgFS service, when in no other phase (locks, caches...)
+    PHASE_LOOKUP, // scans of the metadata
+    PHASE_DISK,   // reads and writes of the imgFS files
+    PHASE_RESIZE, // making variants, waiting for a resize slot included
+    PHASE_SEND,   // writing the reply to the socket
+    NB_PHASES
+};
+
+struct phases_config {
+    uint64_t slow_ns;        // requests at least this long are slow, 0 for none
+    unsigned slow_sample;    // log one slow request in slow_sample, 0 for all
+    const char* slow_log;    // where to log slow requests, NULL for stderr
+    const char* chrome_path; // where to write the trace events, NULL for none
+    size_t max_events;       // trace events kept, 0 for the default
+};
+
+/**
+ * @brief Starts phase timing in this process. To be called before the
+ *        threads serving requests are started.
+ *
+ * @param config What to do with the timings
+ * @return Some error code. 0 if no error.
+ */
+int phases_init(const struct phases_config* config);
+
+/**
+ * @brief Writes the trace events, if asked for, and closes the slow log.
+ *        Requests still being served are no longer timed.
+ *
+ * @return Some error code. 0 if no error.
+ */
+int phases_shutdown(void);
+
+/**
+ * @brief Starts a request on the calling thread, unless one is already
+ *        started. Does nothing if phase timing is off.
+ */
+void phases_request_begin(void);
+
+/**
+ * @brief Ends the request of the calling thread: logs it if it is slow,
+ *        keeps its trace events. Does nothing if no request is started.
+ *
+ * @param method The request method (not NUL-terminated)
+ * @param method_len Its length
+ * @param target The request target (not NUL-terminated)
+ * @param target_len Its length
+ */
+void phases_request_end(const char* method, size_t method_len,
+                        const char* target, size_t target_len);
+
+/**
+ * @brief Enters a phase of the request of the calling thread.
+ *        Each call must be matched by a phase_leave().
+ */
+void phase_enter(enum request_phase phase);
+
+/**
+ * @brief Leaves the phase entered last.
+ */
+void phase_leave(void);
+
+/**
+ * @brief The name of a phase, e.g. "disk".
+ */
+const char* phase_name(enum request_phase phase);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,148 @@
+/**
+ * @file resize_engine.c
+ * @brief Admission control and tuning for image resizing.
+ */
+
+#include "resize_engine.h"
+#include "error.h"
+#include "util.h" // for now_ns
+
+#include <pthread.h> // for pthread_mutex_t, pthread_cond_t
+#include <string.h>  // for memset
+#include <unistd.h>  // for sysconf
+#include <vips/vips.h>
+
+#define DEFAULT_QUEUE_PER_JOB  4
+#define DEFAULT_JOB_MEMORY     (256u << 20) // 256 MiB, about a 90 Mpixel RGB image
+#define DECODED_BYTES_PER_PIXEL 3
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t slot_free;
+    struct resize_limits limits;
+    int enabled;
+    struct resize_stats stats;
+} engine = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, { 0, 0, 0, 0 }, 0, { 0, 0, 0, 0, 0, 0, 0 } };
+
+static struct histogram run_times; // of the completed jobs, under engine.lock
+
+/********************************************************************
+ * See resize_engine.h
+ */
+int resize_engine_init(const struct resize_limits* limits)
+{
+    struct resize_limits l = { 0, 0, DEFAULT_JOB_MEMORY, 1 };
+    if (limits != NULL) {
+        l = *limits;
+    }
+    if (l.max_jobs == 0) {
+        const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        l.max_jobs = cpus > 0 ? (unsigned) cpus : 1;
+    }
+    if (l.max_queue == 0) {
+        l.max_queue = DEFAULT_QUEUE_PER_JOB * l.max_jobs;
+    }
+    if (l.vips_concurrency <= 0) {
+        l.vips_concurrency = 1;
+    }
+
+    // parallelism comes from concurrent jobs; sources are never reused
+    vips_concurrency_set(l.vips_concurrency);
+    vips_cache_set_max(0);
+    vips_cache_set_max_mem(0);
+    vips_cache_set_max_files(0);
+
+    pthread_mutex_lock(&engine.lock);
+    engine.limits = l;
+    engine.enabled = 1;
+    memset(&engine.stats, 0, sizeof(engine.stats));
+    pthread_mutex_unlock(&engine.lock);
+    return ERR_NONE;
+}
+
+/********************************************************************
+ * See resize_engine.h
+ */
+int resize_engine_enter(uint32_t width, uint32_t height, uint64_t* start)
+{
+    M_REQUIRE_NON_NULL(start);
+
+    const uint64_t requested = now_ns();
+    *start = requested;
+
+    pthread_mutex_lock(&engine.lock);
+    if (!engine.enabled) {
+        pthread_mutex_unlock(&engine.lock);
+        return ERR_NONE;
+    }
+
+    const uint64_t memory = (uint64_t) width * height * DECODED_BYTES_PER_PIXEL;
+    if (engine.limits.max_job_memory > 0 && memory > engine.limits.max_job_memory) {
+        engine.stats.rejected++;
+        pthread_mutex_unlock(&engine.lock);
+        return ERR_IMAGE_TOO_LARGE;
+    }
+
+    if (engine.stats.running >= engine.limits.max_jobs) {
+        if (engine.stats.queued >= engine.limits.max_queue) {
+            engine.stats.rejected++;
+            pthread_mutex_unlock(&engine.lock);
+            return ERR_BUSY;
+        }
+        engine.stats.queued++;
+        if (engine.stats.queued > engine.stats.max_queued) {
+            engine.stats.max_queued = engine.stats.queued;
+        }
+        while (engine.stats.running >= engine.limits.max_jobs) {
+            pthread_cond_wait(&engine.slot_free, &engine.lock);
+        }
+        engine.stats.queued--;
+    }
+    engine.stats.running++;
+    *start = now_ns();
+    engine.stats.wait_ns += *start - requested;
+    pthread_mutex_unlock(&engine.lock);
+    return ERR_NONE;
+}
+
+/********************************************************************
+ * See resize_engine.h
+ */
+void resize_engine_leave(uint64_t start)
+{
+    const uint64_t end = now_ns();
+
+    pthread_mutex_lock(&engine.lock);
+    if (engine.enabled) {
+        engine.stats.running--;
+        engine.stats.completed++;
+        engine.stats.run_ns += end - start;
+        histogram_record(&run_times, end - start);
+        pthread_cond_signal(&engine.slot_free);
+    }
+    pthread_mutex_unlock(&engine.lock);
+}
+
+/********************************************************************
+ * See resize_engine.h
+ */
+void resize_engine_stats(struct resize_stats* stats)
+{
+    if (stats == NULL) return;
+
+    pthread_mutex_lock(&engine.lock);
+    *stats = engine.stats;
+    pthread_mutex_unlock(&engine.lock);
+}
+
+/********************************************************************
+ * See resize_engine.h
+ */
+void resize_engine_durations(struct histogram* into)
+{
+    if (into == NULL) return;
+
+    pthread_mutex_lock(&engine.lock);
+    histogram_merge(into, &run_times);
+    pthread_mutex_unlock(&engine.lock);
+}
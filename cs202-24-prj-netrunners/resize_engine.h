@@ -0,0 +1,80 @@
+/**
+ * @file resize_engine.h
+ * @brief Admission control and tuning for image resizing.
+ *
+ * Resizing runs on the thread that needs the variant (with no volume
+ * lock held, see variants_make()), but only max_jobs resizes run at once; up to max_queue more
+ * wait for a slot, and any further one is refused with ERR_BUSY instead
+ * of piling up. Every job is also checked against a memory cap before
+ * decoding. libvips itself is set up for this: per-job thread count, and
+ * no operation cache (every source buffer is used once).
+ *
+ * Until resize_engine_init() is called, jobs are neither limited nor
+ * counted, which is what the command-line tool wants.
+ */
+
+#pragma once
+
+#include "histogram.h"
+
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint64_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct resize_limits {
+    unsigned max_jobs;        // resizes running at once, 0 for the number of CPUs
+    unsigned max_queue;       // resizes waiting for a slot
+    uint64_t max_job_memory;  // bytes of decoded pixels per job, 0 for no limit
+    int vips_concurrency;     // libvips worker threads per job
+};
+
+struct resize_stats {
+    uint64_t running;   // jobs holding a slot now
+    uint64_t queued;    // jobs waiting for a slot now
+    uint64_t max_queued; // high-water mark of queued
+    uint64_t completed;
+    uint64_t rejected;  // refused: queue full or image too large
+    uint64_t wait_ns;   // total time spent waiting for a slot
+    uint64_t run_ns;    // total time spent holding a slot
+};
+
+/**
+ * @brief Sets the limits and configures libvips accordingly.
+ *
+ * @param limits The limits, NULL for the defaults
+ * @return Some error code. 0 if no error.
+ */
+int resize_engine_init(const struct resize_limits* limits);
+
+/**
+ * @brief Waits for a resize slot.
+ *
+ * @param width The width of the original image
+ * @param height The height of the original image
+ * @param start Where to put the start time of the job, for resize_engine_leave()
+ * @return ERR_BUSY if too many jobs are waiting, ERR_IMAGE_TOO_LARGE if
+ *         the image exceeds the per-job memory cap, 0 once the slot is held.
+ */
+int resize_engine_enter(uint32_t width, uint32_t height, uint64_t* start);
+
+/**
+ * @brief Releases the slot taken by resize_engine_enter().
+ */
+void resize_engine_leave(uint64_t start);
+
+/**
+ * @brief Takes a snapshot of the engine counters.
+ */
+void resize_engine_stats(struct resize_stats* stats);
+
+/**
+ * @brief Adds the run times (nanoseconds) of the completed jobs to a histogram.
+ */
+void resize_engine_durations(struct histogram* into);
+
+#ifdef __cplusplus
+}
+#endif
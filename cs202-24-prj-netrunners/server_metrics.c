@@ -0,0 +1,557 @@
+/**
+ * @file server_metrics.c
+ * @brief Request metrics of the imgFS server, and the /imgfs/stats page.
+ */
+
+#include "server_metrics.h"
+#include "access_log.h"
+#include "error.h"
+#include "histogram.h"
+#include "resize_engine.h"
+#include "thread_slots.h"
+#include "util.h" // for now_ns
+
+#include <json-c/json.h>
+#include <stdarg.h>    // for va_list
+#include <stdatomic.h> // for atomic_int, atomic_ullong
+#include <stdio.h>     // for vsnprintf
+#include <stdlib.h>    // for calloc, free, realloc
+#include <string.h>    // for strdup
+
+#define NB_STATUS_CLASSES 6 // no reply sent, then 1xx to 5xx
+#define TEXT_MIN_CAPACITY 4096
+
+// Prometheus histogram buckets: one per power of two, 2^12 ns (4 us) to 2^35 ns (34 s)
+#define EXPORT_MIN_SHIFT 12
+#define EXPORT_MAX_SHIFT 35
+
+static const char* const endpoint_names[NB_METRICS_ENDPOINTS] = {
+    "list", "read", "blob", "insert", "delete", "stats", "other"
+};
+static const char* const status_names[NB_STATUS_CLASSES] = {
+    "none", "1xx", "2xx", "3xx", "4xx", "5xx"
+};
+static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+#define NB_QUANTILES (sizeof(quantiles) / sizeof(quantiles[0]))
+
+/**
+ * @brief The counters of one thread. Only the owner thread writes them.
+ */
+struct metrics_shard {
+    struct thread_slot slot;
+    atomic_int busy;            // a request is in progress
+    atomic_ullong responses[NB_METRICS_ENDPOINTS][NB_STATUS_CLASSES];
+    atomic_ullong bytes_in;
+    atomic_ullong bytes_out;
+    struct histogram latency[NB_METRICS_ENDPOINTS];
+};
+
+/**
+ * @brief All the shards, merged.
+ */
+struct metrics_snapshot {
+    uint64_t responses[NB_METRICS_ENDPOINTS][NB_STATUS_CLASSES];
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t in_flight;
+    struct histogram latency[NB_METRICS_ENDPOINTS];
+};
+
+static struct thread_slots shards = THREAD_SLOTS_INIT(struct metrics_shard);
+static _Thread_local struct metrics_shard* local_shard;
+
+/*******************************************************************
+ * Shards: one per thread, handed over when the thread exits
+ */
+static struct metrics_shard* shard_get(void)
+{
+    if (local_shard == NULL) {
+        local_shard = thread_slot_get(&shards); // NULL: this thread goes unaccounted
+    }
+    return local_shard;
+}
+
+/********************************************************************
+ * See server_metrics.h
+ */
+uint64_t metrics_request_begin(void)
+{
+    struct metrics_shard* shard = shard_get();
+    if (shard != NULL) {
+        atomic_store_explicit(&shard->busy, 1, memory_order_relaxed);
+    }
+    return now_ns();
+}
+
+/********************************************************************
+ * See server_metrics.h
+ */
+void metrics_request_end(enum metrics_endpoint endpoint, uint64_t start, unsigned status,
+                         size_t bytes_in, size_t bytes_out)
+{
+    struct metrics_shard* shard = local_shard;
+    if (shard == NULL || (unsigned) endpoint >= NB_METRICS_ENDPOINTS) {
+        return;
+    }
+
+    const unsigned status_class = status / 100;
+    histogram_record(&shard->latency[endpoint], now_ns() - start);
+    counter_add(&shard->responses[endpoint][status_class < NB_STATUS_CLASSES ? status_class : 0], 1);
+    counter_add(&shard->bytes_in, bytes_in);
+    counter_add(&shard->bytes_out, bytes_out);
+    atomic_store_explicit(&shard->busy, 0, memory_order_relaxed);
+}
+
+static void snapshot_take(struct metrics_snapshot* snapshot)
+{
+    for (struct thread_slot* slot = thread_slots_head(&shards); slot != NULL; slot = slot->next) {
+        const struct metrics_shard* shard = (const struct metrics_shard*) slot;
+        for (int e = 0; e < NB_METRICS_ENDPOINTS; e++) {
+            for (int c = 0; c < NB_STATUS_CLASSES; c++) {
+                snapshot->responses[e][c] += counter_get(&shard->responses[e][c]);
+            }
+            histogram_merge(&snapshot->latency[e], &shard->latency[e]);
+        }
+        snapshot->bytes_in += counter_get(&shard->bytes_in);
+        snapshot->bytes_out += counter_get(&shard->bytes_out);
+        snapshot->in_flight += (uint64_t) atomic_load_explicit(&shard->busy, memory_order_relaxed);
+    }
+}
+
+/**
+ * @brief Everything a page shows, gathered before rendering.
+ */
+struct metrics_page {
+    struct metrics_snapshot requests;
+    struct resize_stats resize;
+    struct histogram resize_durations;
+    struct blob_cache_stats caches[2];
+    struct access_log_stats access_log;
+    uint64_t saved_stored;
+    uint64_t saved_served;
+    struct store_volume_stats* volumes;
+    size_t nb_volumes;
+};
+
+static const char* const cache_names[2] = { "blobs", "variants" };
+
+static int page_gather(struct imgfs_store* store, struct metrics_page* page)
+{
+    snapshot_take(&page->requests);
+    resize_engine_stats(&page->resize);
+    resize_engine_durations(&page->resize_durations);
+    blob_cache_stats(&store->cache, &page->caches[0]);
+    blob_cache_stats(&store->variants, &page->caches[1]);
+    access_log_stats(&page->access_log);
+    page->saved_stored = atomic_load(&store->saved_stored);
+    page->saved_served = atomic_load(&store->saved_served);
+
+    page->volumes = calloc(store->nb_volumes, sizeof(*page->volumes));
+    if (page->volumes == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    page->nb_volumes = store->nb_volumes;
+    for (size_t v = 0; v < store->nb_volumes; v++) {
+        const int err = store_volume_stats(store, v, &page->volumes[v]);
+        if (err != ERR_NONE) {
+            return err;
+        }
+    }
+    return ERR_NONE;
+}
+
+static double hit_ratio(const struct blob_cache_stats* cache)
+{
+    const uint64_t lookups = cache->hits + cache->misses;
+    return lookups > 0 ? (double) cache->hits / (double) lookups : 0.0;
+}
+
+/*******************************************************************
+ * Prometheus text format
+ */
+struct text {
+    char* buf;
+    size_t len;
+    size_t capacity;
+    int err;
+};
+
+__attribute__((format(printf, 2, 3)))
+static void text_printf(struct text* text, const char* fmt, ...)
+{
+    while (text->err == ERR_NONE) {
+        va_list ap;
+        va_start(ap, fmt);
+        const int n = vsnprintf(text->buf + text->len, text->capacity - text->len, fmt, ap);
+        va_end(ap);
+        if (n < 0) {
+            text->err = ERR_RUNTIME;
+        } else if ((size_t) n < text->capacity - text->len) {
+            text->len += (size_t) n;
+            return;
+        } else {
+            const size_t capacity = 2 * text->capacity + (size_t) n;
+            char* buf = realloc(text->buf, capacity);
+            if (buf == NULL) {
+                text->err = ERR_OUT_OF_MEMORY;
+            } else {
+                text->buf = buf;
+                text->capacity = capacity;
+            }
+        }
+    }
+}
+
+static void text_family(struct text* text, const char* name, const char* type, const char* help)
+{
+    text_printf(text, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+// label values escaped as the format wants: backslash, double quote, newline
+static void text_label_value(struct text* text, const char* value)
+{
+    for (const char* c = value; *c != '\0'; c++) {
+        if (*c == '\\' || *c == '"') {
+            text_printf(text, "\\%c", *c);
+        } else if (*c == '\n') {
+            text_printf(text, "\\n");
+        } else {
+            text_printf(text, "%c", *c);
+        }
+    }
+}
+
+static void text_volume_series(struct text* text, const char* name, const char* path, uint64_t value)
+{
+    text_printf(text, "%s{volume=\"", name);
+    text_label_value(text, path);
+    text_printf(text, "\"} %llu\n", (unsigned long long) value);
+}
+
+static void text_histogram(struct text* text, const char* name, const char* labels,
+                           const struct histogram* histogram)
+{
+    const char* sep = labels[0] != '\0' ? "," : "";
+    for (int shift = EXPORT_MIN_SHIFT; shift <= EXPORT_MAX_SHIFT; shift++) {
+        text_printf(text, "%s_bucket{%s%sle=\"%.9g\"} %llu\n", name, labels, sep,
+                    (double) (1ull << shift) * 1e-9,
+                    (unsigned long long) histogram_count_below(histogram, 1ull << shift));
+    }
+    const uint64_t count = atomic_load(&histogram->count);
+    const uint64_t sum = atomic_load(&histogram->sum);
+    text_printf(text, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, sep, (unsigned long long) count);
+    text_printf(text, "%s_sum%s%s%s %.9g\n", name, sep[0] ? "{" : "", labels, sep[0] ? "}" : "",
+                (double) sum * 1e-9);
+    text_printf(text, "%s_count%s%s%s %llu\n", name, sep[0] ? "{" : "", labels, sep[0] ? "}" : "",
+                (unsigned long long) count);
+}
+
+static void render_prometheus(const struct metrics_page* page, struct text* text)
+{
+    const struct metrics_snapshot* r = &page->requests;
+    char labels[64];
+
+    text_family(text, "imgfs_requests_total", "counter", "Requests served, by endpoint and status class.");
+    for (int e = 0; e < NB_METRICS_ENDPOINTS; e++) {
+        for (int c = 0; c < NB_STATUS_CLASSES; c++) {
+            if (r->responses[e][c] == 0 && c != 2) continue;
+            text_printf(text, "imgfs_requests_total{endpoint=\"%s\",code=\"%s\"} %llu\n",
+                        endpoint_names[e], status_names[c], (unsigned long long) r->responses[e][c]);
+        }
+    }
+    text_family(text, "imgfs_request_duration_seconds", "histogram",
+                "Time from the parsed request to the reply sent.");
+    for (int e = 0; e < NB_METRICS_ENDPOINTS; e++) {
+        snprintf(labels, sizeof(labels), "endpoint=\"%s\"", endpoint_names[e]);
+        text_histogram(text, "imgfs_request_duration_seconds", labels, &r->latency[e]);
+    }
+    text_family(text, "imgfs_request_duration_quantile_seconds", "gauge",
+                "Request duration quantiles since startup, within 12.5%.");
+    for (int e = 0; e < NB_METRICS_ENDPOINTS; e++) {
+        for (size_t q = 0; q < NB_QUANTILES; q++) {
+            const uint64_t ns = histogram_quantile(&r->latency[e], quantiles[q]);
+            text_printf(text, "imgfs_request_duration_quantile_seconds{endpoint=\"%s\",quantile=\"%g\"} %.9g\n",
+                        endpoint_names[e], quantiles[q], (double) ns * 1e-9);
+        }
+    }
+    text_family(text, "imgfs_requests_in_flight", "gauge", "Requests being served.");
+    text_printf(text, "imgfs_requests_in_flight %llu\n", (unsigned long long) r->in_flight);
+    text_family(text, "imgfs_request_body_bytes_total", "counter", "Bytes received in request bodies.");
+    text_printf(text, "imgfs_request_body_bytes_total %llu\n", (unsigned long long) r->bytes_in);
+    text_family(text, "imgfs_response_body_bytes_total", "counter", "Bytes sent in response bodies.");
+    text_printf(text, "imgfs_response_body_bytes_total %llu\n", (unsigned long long) r->bytes_out);
+
+    const struct resize_stats* z = &page->resize;
+    text_family(text, "imgfs_resize_jobs_total", "counter", "Resize jobs, by outcome.");
+    text_printf(text, "imgfs_resize_jobs_total{outcome=\"completed\"} %llu\n"
+                "imgfs_resize_jobs_total{outcome=\"rejected\"} %llu\n",
+                (unsigned long long) z->completed, (unsigned long long) z->rejected);
+    text_family(text, "imgfs_resize_running", "gauge", "Resize jobs holding a slot.");
+    text_printf(text, "imgfs_resize_running %llu\n", (unsigned long long) z->running);
+    text_family(text, "imgfs_resize_queued", "gauge", "Resize jobs waiting for a slot.");
+    text_printf(text, "imgfs_resize_queued %llu\n", (unsigned long long) z->queued);
+    text_family(text, "imgfs_resize_queued_max", "gauge", "Most resize jobs ever waiting at once.");
+    text_printf(text, "imgfs_resize_queued_max %llu\n", (unsigned long long) z->max_queued);
+    text_family(text, "imgfs_resize_wait_seconds_total", "counter", "Time resize jobs spent waiting for a slot.");
+    text_printf(text, "imgfs_resize_wait_seconds_total %.9g\n", (double) z->wait_ns * 1e-9);
+    text_family(text, "imgfs_resize_duration_seconds", "histogram", "Run time of the completed resize jobs.");
+    text_histogram(text, "imgfs_resize_duration_seconds", "", &page->resize_durations);
+
+    static const struct {
+        const char* name;
+        const char* type;
+        const char* help;
+    } cache_families[] = {
+        { "imgfs_cache_hits_total", "counter", "Cache lookups that found the blob." },
+        { "imgfs_cache_misses_total", "counter", "Cache lookups that did not." },
+        { "imgfs_cache_evictions_total", "counter", "Blobs evicted to stay within the budget." },
+        { "imgfs_cache_rejected_total", "counter", "Blobs too big for the cache, served uncached." },
+        { "imgfs_cache_hit_ratio", "gauge", "Hits over lookups since startup." },
+        { "imgfs_cache_entries", "gauge", "Blobs cached." },
+        { "imgfs_cache_bytes", "gauge", "Bytes charged to the budget." },
+        { "imgfs_cache_budget_bytes", "gauge", "Byte budget of the cache." },
+    };
+    for (size_t f = 0; f < sizeof(cache_families) / sizeof(cache_families[0]); f++) {
+        text_family(text, cache_families[f].name, cache_families[f].type, cache_families[f].help);
+        for (int c = 0; c < 2; c++) {
+            const struct blob_cache_stats* cache = &page->caches[c];
+            const uint64_t values[] = {
+                cache->hits, cache->misses, cache->evictions, cache->rejected, 0,
+                cache->entries, cache->bytes, cache->budget
+            };
+            if (f == 4) {
+                text_printf(text, "%s{cache=\"%s\"} %.6f\n", cache_families[f].name, cache_names[c], hit_ratio(cache));
+            } else {
+                text_printf(text, "%s{cache=\"%s\"} %llu\n", cache_families[f].name, cache_names[c],
+                            (unsigned long long) values[f]);
+            }
+        }
+    }
+
+    text_family(text, "imgfs_access_log_records_total", "counter", "Access log records, by outcome.");
+    text_printf(text, "imgfs_access_log_records_total{outcome=\"written\"} %llu\n"
+                "imgfs_access_log_records_total{outcome=\"dropped\"} %llu\n",
+                (unsigned long long) page->access_log.written,
+                (unsigned long long) page->access_log.dropped);
+
+    text_family(text, "imgfs_optimize_saved_stored_bytes", "gauge",
+                "Bytes saved on disk by optimizing the stored originals.");
+    text_printf(text, "imgfs_optimize_saved_stored_bytes %llu\n", (unsigned long long) page->saved_stored);
+    text_family(text, "imgfs_optimize_saved_served_bytes_total", "counter",
+                "Bytes saved by optimizing the originals served.");
+    text_printf(text, "imgfs_optimize_saved_served_bytes_total %llu\n", (unsigned long long) page->saved_served);
+
+    static const struct {
+        const char* name;
+        const char* help;
+    } volume_families[] = {
+        { "imgfs_volume_files", "Images in the volume." },
+        { "imgfs_volume_max_files", "Slots of the volume." },
+        { "imgfs_volume_sealed", "1 if the volume takes no new images." },
+        { "imgfs_volume_requests_in_flight", "Requests being served by the volume." },
+        { "imgfs_volume_used_bytes", "Bytes after the metadata table, tier file included." },
+        { "imgfs_volume_live_bytes", "Bytes of variants some image refers to." },
+        { "imgfs_volume_shared_bytes", "Live bytes several images refer to." },
+        { "imgfs_volume_dead_bytes", "Bytes of variants no image refers to any more." },
+        { "imgfs_volume_table_memory_bytes", "Memory taken by the metadata table." },
+        { "imgfs_volume_scrub_passes", "Complete scrubs since startup." },
+        { "imgfs_volume_scrub_damaged", "Damaged image variants found by the last scrub." },
+        { "imgfs_volume_scrub_time_seconds", "When the last scrub ended (Unix time), 0 if none did." },
+    };
+    for (size_t f = 0; f < sizeof(volume_families) / sizeof(volume_families[0]); f++) {
+        text_family(text, volume_families[f].name, "gauge", volume_families[f].help);
+        for (size_t v = 0; v < page->nb_volumes; v++) {
+            const struct store_volume_stats* volume = &page->volumes[v];
+            const uint64_t values[] = {
+                volume->nb_files, volume->max_files, (uint64_t) volume->sealed, volume->load,
+                volume->used_bytes, volume->live_bytes, volume->shared_bytes, volume->dead_bytes,
+                volume->table_memory, volume->scrub_passes, volume->scrub_damaged,
+                volume->scrub_time
+            };
+            text_volume_series(text, volume_families[f].name, volume->path, values[f]);
+        }
+    }
+}
+
+/*******************************************************************
+ * JSON
+ */
+static void json_add(struct json_object* object, const char* key, struct json_object* value, int* err)
+{
+    if (value == NULL || json_object_object_add(object, key, value) < 0) {
+        json_object_put(value);
+        *err = ERR_RUNTIME;
+    }
+}
+
+static void json_add_u64(struct json_object* object, const char* key, uint64_t value, int* err)
+{
+    json_add(object, key, json_object_new_int64((int64_t) value), err);
+}
+
+// durations in microseconds
+static struct json_object* json_latency(const struct histogram* histogram, int* err)
+{
+    struct json_object* latency = json_object_new_object();
+    if (latency == NULL) {
+        *err = ERR_RUNTIME;
+        return NULL;
+    }
+    const uint64_t count = atomic_load(&histogram->count);
+    const uint64_t sum = atomic_load(&histogram->sum);
+    const uint64_t max = atomic_load(&histogram->max);
+    json_add(latency, "mean", json_object_new_double(count > 0 ? (double) sum / (double) count / 1e3 : 0.0), err);
+    static const char* const names[NB_QUANTILES] = { "p50", "p90", "p99", "p999" };
+    for (size_t q = 0; q < NB_QUANTILES; q++) {
+        const uint64_t ns = histogram_quantile(histogram, quantiles[q]);
+        json_add(latency, names[q], json_object_new_double((double) ns / 1e3), err);
+    }
+    json_add(latency, "max", json_object_new_double((double) max / 1e3), err);
+    return latency;
+}
+
+static struct json_object* render_json(const struct metrics_page* page, int* err)
+{
+    struct json_object* root = json_object_new_object();
+    if (root == NULL) {
+        *err = ERR_RUNTIME;
+        return NULL;
+    }
+
+    const struct metrics_snapshot* r = &page->requests;
+    struct json_object* requests = json_object_new_object();
+    json_add(root, "requests", requests, err);
+    for (int e = 0; requests != NULL && e < NB_METRICS_ENDPOINTS; e++) {
+        struct json_object* endpoint = json_object_new_object();
+        json_add(requests, endpoint_names[e], endpoint, err);
+        if (endpoint == NULL) break;
+        json_add_u64(endpoint, "count", atomic_load(&r->latency[e].count), err);
+        struct json_object* responses = json_object_new_object();
+        json_add(endpoint, "responses", responses, err);
+        for (int c = 0; responses != NULL && c < NB_STATUS_CLASSES; c++) {
+            if (r->responses[e][c] > 0) json_add_u64(responses, status_names[c], r->responses[e][c], err);
+        }
+        json_add(endpoint, "latency_us", json_latency(&r->latency[e], err), err);
+    }
+    json_add_u64(root, "in_flight", r->in_flight, err);
+    json_add_u64(root, "bytes_in", r->bytes_in, err);
+    json_add_u64(root, "bytes_out", r->bytes_out, err);
+
+    const struct resize_stats* z = &page->resize;
+    struct json_object* resize = json_object_new_object();
+    json_add(root, "resize", resize, err);
+    if (resize != NULL) {
+        json_add_u64(resize, "completed", z->completed, err);
+        json_add_u64(resize, "rejected", z->rejected, err);
+        json_add_u64(resize, "running", z->running, err);
+        json_add_u64(resize, "queued", z->queued, err);
+        json_add_u64(resize, "max_queued", z->max_queued, err);
+        json_add(resize, "wait_ms", json_object_new_double((double) z->wait_ns / 1e6), err);
+        json_add(resize, "run_ms", json_object_new_double((double) z->run_ns / 1e6), err);
+        json_add(resize, "duration_us", json_latency(&page->resize_durations, err), err);
+    }
+
+    struct json_object* caches = json_object_new_object();
+    json_add(root, "caches", caches, err);
+    for (int c = 0; caches != NULL && c < 2; c++) {
+        const struct blob_cache_stats* stats = &page->caches[c];
+        struct json_object* cache = json_object_new_object();
+        json_add(caches, cache_names[c], cache, err);
+        if (cache == NULL) break;
+        json_add_u64(cache, "hits", stats->hits, err);
+        json_add_u64(cache, "misses", stats->misses, err);
+        json_add_u64(cache, "evictions", stats->evictions, err);
+        json_add_u64(cache, "rejected", stats->rejected, err);
+        json_add(cache, "hit_ratio", json_object_new_double(hit_ratio(stats)), err);
+        json_add_u64(cache, "entries", stats->entries, err);
+        json_add_u64(cache, "bytes", stats->bytes, err);
+        json_add_u64(cache, "budget", stats->budget, err);
+    }
+
+    struct json_object* access_log = json_object_new_object();
+    json_add(root, "access_log", access_log, err);
+    if (access_log != NULL) {
+        json_add_u64(access_log, "written", page->access_log.written, err);
+        json_add_u64(access_log, "dropped", page->access_log.dropped, err);
+    }
+
+    struct json_object* optimize = json_object_new_object();
+    json_add(root, "optimize", optimize, err);
+    if (optimize != NULL) {
+        json_add_u64(optimize, "saved_stored", page->saved_stored, err);
+        json_add_u64(optimize, "saved_served", page->saved_served, err);
+    }
+
+    struct json_object* volumes = json_object_new_array();
+    json_add(root, "volumes", volumes, err);
+    for (size_t v = 0; volumes != NULL && v < page->nb_volumes; v++) {
+        const struct store_volume_stats* stats = &page->volumes[v];
+        struct json_object* volume = json_object_new_object();
+        if (volume == NULL || json_object_array_add(volumes, volume) < 0) {
+            json_object_put(volume);
+            *err = ERR_RUNTIME;
+            break;
+        }
+        json_add(volume, "path", json_object_new_string(stats->path), err);
+        json_add_u64(volume, "nb_files", stats->nb_files, err);
+        json_add_u64(volume, "max_files", stats->max_files, err);
+        json_add(volume, "sealed", json_object_new_boolean(stats->sealed), err);
+        json_add_u64(volume, "in_flight", stats->load, err);
+        json_add_u64(volume, "used_bytes", stats->used_bytes, err);
+        json_add_u64(volume, "live_bytes", stats->live_bytes, err);
+        json_add_u64(volume, "shared_bytes", stats->shared_bytes, err);
+        json_add_u64(volume, "dead_bytes", stats->dead_bytes, err);
+        json_add_u64(volume, "table_memory", stats->table_memory, err);
+        json_add_u64(volume, "scrub_passes", stats->scrub_passes, err);
+        json_add_u64(volume, "scrub_damaged", stats->scrub_damaged, err);
+        json_add_u64(volume, "scrub_time", stats->scrub_time, err);
+    }
+    return root;
+}
+
+/********************************************************************
+ * See server_metrics.h
+ */
+int metrics_render(struct imgfs_store* store, enum metrics_format format, char** out, size_t* out_len)
+{
+    M_REQUIRE_NON_NULL(store);
+    M_REQUIRE_NON_NULL(out);
+    M_REQUIRE_NON_NULL(out_len);
+    if ((unsigned) format >= NB_METRICS_FORMATS) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    // histograms make it too big for the stack
+    struct metrics_page* page = calloc(1, sizeof(*page));
+    if (page == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    int err = page_gather(store, page);
+
+    if (err == ERR_NONE && format == METRICS_PROMETHEUS) {
+        struct text text = { malloc(TEXT_MIN_CAPACITY), 0, TEXT_MIN_CAPACITY, ERR_NONE };
+        if (text.buf == NULL) {
+            text.err = ERR_OUT_OF_MEMORY;
+        }
+        render_prometheus(page, &text);
+        err = text.err;
+        if (err == ERR_NONE) {
+            *out = text.buf;
+            *out_len = text.len;
+        } else {
+            free(text.buf);
+        }
+    } else if (err == ERR_NONE) {
+        struct json_object* root = render_json(page, &err);
+        if (err == ERR_NONE) {
+            *out = strdup(json_object_to_json_string(root));
+            *out_len = *out != NULL ? strlen(*out) : 0;
+            err = *out != NULL ? ERR_NONE : ERR_OUT_OF_MEMORY;
+        }
+        json_object_put(root);
+    }
+
+    free(page->volumes);
+    free(page);
+    return err;
+}
@@ -0,0 +1,72 @@
+/**
+ * @file server_metrics.h
+ * @brief Request metrics of the imgFS server, and the /imgfs/stats page.
+ *
+ * Every thread serving requests gets its own shard of counters and
+ * latency histograms, written without locks nor shared cache lines. A
+ * scrape merges all the shards, then adds the state of the store, its
+ * caches and the resize engine. Shards of finished threads are handed
+ * over to new ones, so counters never go back.
+ */
+
+#pragma once
+
+#include "imgfs_store.h"
+
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint64_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum metrics_endpoint {
+    METRICS_LIST,
+    METRICS_READ,
+    METRICS_BLOB, // reads by content
+    METRICS_INSERT,
+    METRICS_DELETE,
+    METRICS_STATS,
+    METRICS_OTHER, // index page, unknown URIs
+    NB_METRICS_ENDPOINTS
+};
+
+enum metrics_format {
+    METRICS_PROMETHEUS, // text exposition format 0.0.4
+    METRICS_JSON,
+    NB_METRICS_FORMATS
+};
+
+/**
+ * @brief Starts timing a request on the calling thread.
+ *
+ * @return The start time, for metrics_request_end()
+ */
+uint64_t metrics_request_begin(void);
+
+/**
+ * @brief Accounts a request started by metrics_request_begin().
+ *
+ * @param endpoint What was requested
+ * @param start The value returned by metrics_request_begin()
+ * @param status The HTTP status code of the reply, 0 if none was sent
+ * @param bytes_in The size of the request body
+ * @param bytes_out The size of the reply body
+ */
+void metrics_request_end(enum metrics_endpoint endpoint, uint64_t start, unsigned status,
+                         size_t bytes_in, size_t bytes_out);
+
+/**
+ * @brief Renders all the metrics.
+ *
+ * @param store The store served
+ * @param format The output format
+ * @param out Where to put the text, to be freed with free()
+ * @param out_len Where to put the length of the text
+ * @return Some error code. 0 if no error.
+ */
+int metrics_render(struct imgfs_store* store, enum metrics_format format, char** out, size_t* out_len);
+
+#ifdef __cplusplus
+}
+#endif
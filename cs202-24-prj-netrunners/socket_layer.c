@@ -1,3 +1,4 @@
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -58,4 +59,29 @@ ssize_t tcp_send(int active_socket, const char* response, size_t response_len) {
     M_REQUIRE_NON_NULL(response);
     if(active_socket < 0 || response_len <= 0) { return ERR_INVALID_ARGUMENT;}
     return send(active_socket, response, response_len, 0); 
-}
\ No newline at end of file
+}
+
+int tcp_sendv(int active_socket, struct iovec* iov, int iovcnt) {
+    M_REQUIRE_NON_NULL(iov);
+    if (active_socket < 0 || iovcnt <= 0) { return ERR_INVALID_ARGUMENT; }
+
+    while (iovcnt > 0) {
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = (size_t) iovcnt };
+        // MSG_NOSIGNAL: a client that hung up must not kill the server
+        const ssize_t sent = sendmsg(active_socket, &msg, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) return ERR_IO;
+
+        size_t left = (size_t) sent;
+        while (iovcnt > 0 && left >= iov->iov_len) {
+            left -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char*) iov->iov_base + left;
+            iov->iov_len -= left;
+        }
+    }
+    return ERR_NONE;
+}
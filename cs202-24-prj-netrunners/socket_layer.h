@@ -10,6 +10,7 @@
 #include <stddef.h> // size_t
 #include <stdint.h> // uint16_t
 #include <sys/types.h> // ssize_t
+#include <sys/uio.h> // struct iovec
 
 int tcp_server_init(uint16_t port);
 
@@ -47,3 +48,16 @@ ssize_t tcp_read(int active_socket, char* buf, size_t buflen);
  * @return The number of bytes sent on success, or an error code on failure.
  */
 ssize_t tcp_send(int active_socket, const char* response, size_t response_len);
+
+/**
+ * @brief Sends several buffers as one TCP message, without copying them.
+ *
+ * Retries partial writes until everything is sent. The iovec array is
+ * modified in the process.
+ *
+ * @param active_socket The active socket to send the message on.
+ * @param iov The buffers to send, in order.
+ * @param iovcnt The number of buffers.
+ * @return ERR_NONE on success, ERR_IO on failure.
+ */
+int tcp_sendv(int active_socket, struct iovec* iov, int iovcnt);
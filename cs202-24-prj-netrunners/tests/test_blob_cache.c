@@ -0,0 +1,215 @@
+/**
+ * @file test_blob_cache.c
+ * @brief Unit tests of blob_cache.c
+ */
+
+#include "blob_cache.h"
+#include "error.h"
+#include "unit_test.h"
+
+#include <stdlib.h> // for malloc
+#include <string.h> // for memset
+
+#define SHARD_BUDGET (64u << 10)
+#define BUDGET       (BLOB_CACHE_SHARDS * SHARD_BUDGET)
+#define BLOB_SIZE    1000
+#define SCAN         200 // blobs of BLOB_SIZE: a few times a shard's budget
+
+/*
+ * Keys of the original (0 x 0, format 0) of SHA i: they all land in the
+ * first shard (the top bits of the hash are those of SHA[7]), each in a
+ * ghost slot of its own (the low bits are i).
+ */
+static struct cache_key key_of(unsigned i)
+{
+    struct cache_key key;
+    memset(&key, 0, sizeof(key));
+    key.SHA[0] = (unsigned char) i;
+    key.SHA[1] = (unsigned char) (i >> 8);
+    return key;
+}
+
+static char* data_of(unsigned i, uint32_t size)
+{
+    char* data = malloc(size);
+    if (data != NULL) memset(data, (int) (i & 0xFF), size);
+    return data;
+}
+
+// adopts a blob for i and releases it at once
+static int adopt(struct blob_cache* cache, unsigned i, uint32_t size)
+{
+    const struct cache_key key = key_of(i);
+    struct cache_blob* blob = blob_cache_adopt(cache, &key, data_of(i, size), size);
+    blob_release(blob);
+    return blob != NULL;
+}
+
+static int cached(struct blob_cache* cache, unsigned i)
+{
+    const struct cache_key key = key_of(i);
+    struct cache_blob* blob = blob_cache_get(cache, &key);
+    blob_release(blob);
+    return blob != NULL;
+}
+
+TEST(test_get_adopt)
+{
+    struct blob_cache cache;
+    TEST_ASSERT(blob_cache_init(&cache, BUDGET) == ERR_NONE);
+
+    const struct cache_key key = key_of(1);
+    TEST_ASSERT(blob_cache_get(&cache, &key) == NULL);
+
+    struct cache_blob* blob = blob_cache_adopt(&cache, &key, data_of(1, BLOB_SIZE), BLOB_SIZE);
+    TEST_ASSERT(blob != NULL && blob->size == BLOB_SIZE && blob->data[0] == 1);
+    TEST_ASSERT(atomic_load(&blob->refs) == 2); // the caller's and the cache's
+
+    struct cache_blob* hit = blob_cache_get(&cache, &key);
+    TEST_ASSERT(hit == blob && atomic_load(&blob->refs) == 3);
+    blob_release(hit);
+
+    // a second adopt of the same key returns the cached blob
+    struct cache_blob* again = blob_cache_adopt(&cache, &key, data_of(2, BLOB_SIZE), BLOB_SIZE);
+    TEST_ASSERT(again == blob && again->data[0] == 1);
+    blob_release(again);
+    blob_release(blob);
+    TEST_ASSERT(atomic_load(&blob->refs) == 1);
+
+    struct blob_cache_stats stats;
+    blob_cache_stats(&cache, &stats);
+    TEST_ASSERT(stats.hits == 1 && stats.misses == 1 && stats.entries == 1);
+    TEST_ASSERT(stats.bytes > BLOB_SIZE && stats.budget == BUDGET);
+
+    blob_cache_free(&cache);
+    return 0;
+}
+
+TEST(test_budget)
+{
+    struct blob_cache cache;
+    TEST_ASSERT(blob_cache_init(&cache, BUDGET) == ERR_NONE);
+
+    for (unsigned i = 0; i < SCAN; i++) {
+        TEST_ASSERT(adopt(&cache, i, BLOB_SIZE));
+        struct blob_cache_stats stats;
+        blob_cache_stats(&cache, &stats);
+        TEST_ASSERT(stats.bytes <= SHARD_BUDGET);
+    }
+    struct blob_cache_stats stats;
+    blob_cache_stats(&cache, &stats);
+    TEST_ASSERT(stats.evictions > 0 && stats.entries + stats.evictions == SCAN);
+    TEST_ASSERT(!cached(&cache, 0) && cached(&cache, SCAN - 1));
+
+    blob_cache_free(&cache);
+    return 0;
+}
+
+// a blob in use stays valid when it is evicted, and when the cache is freed
+TEST(test_evicted_while_held)
+{
+    struct blob_cache cache;
+    TEST_ASSERT(blob_cache_init(&cache, BUDGET) == ERR_NONE);
+
+    const struct cache_key key = key_of(0);
+    struct cache_blob* held = blob_cache_adopt(&cache, &key, data_of(7, BLOB_SIZE), BLOB_SIZE);
+    TEST_ASSERT(held != NULL);
+    for (unsigned i = 1; i < SCAN; i++) {
+        TEST_ASSERT(adopt(&cache, i, BLOB_SIZE));
+    }
+    TEST_ASSERT(!cached(&cache, 0));
+    TEST_ASSERT(atomic_load(&held->refs) == 1);
+    TEST_ASSERT(held->data[0] == 7 && held->data[BLOB_SIZE - 1] == 7);
+
+    const struct cache_key last = key_of(SCAN - 1);
+    struct cache_blob* kept = blob_cache_get(&cache, &last);
+    TEST_ASSERT(kept != NULL);
+    blob_cache_free(&cache);
+    TEST_ASSERT(kept->data[0] == (char) ((SCAN - 1) & 0xFF));
+    blob_release(kept);
+    blob_release(held);
+    return 0;
+}
+
+// S3-FIFO: a blob hit while in the small queue, or remembered by the
+// ghost table, goes to the main queue and outlives a scan
+TEST(test_scan_resistance)
+{
+    struct blob_cache cache;
+    TEST_ASSERT(blob_cache_init(&cache, BUDGET) == ERR_NONE);
+
+    TEST_ASSERT(adopt(&cache, 0, BLOB_SIZE));
+    TEST_ASSERT(cached(&cache, 0)); // a hit while still in the small queue
+    TEST_ASSERT(adopt(&cache, 1, BLOB_SIZE));
+    for (unsigned i = 2; i < SCAN; i++) {
+        TEST_ASSERT(adopt(&cache, i, BLOB_SIZE));
+    }
+    TEST_ASSERT(cached(&cache, 0));
+    TEST_ASSERT(!cached(&cache, 1));
+
+    // 1 is in the ghost table now: admitted straight into the main queue
+    TEST_ASSERT(adopt(&cache, 1, BLOB_SIZE));
+    for (unsigned i = SCAN; i < 2 * SCAN; i++) {
+        TEST_ASSERT(adopt(&cache, i, BLOB_SIZE));
+    }
+    TEST_ASSERT(cached(&cache, 0) && cached(&cache, 1));
+    TEST_ASSERT(!cached(&cache, SCAN));
+
+    blob_cache_free(&cache);
+    return 0;
+}
+
+// a blob over half of its shard's budget is served, not cached
+TEST(test_rejected)
+{
+    struct blob_cache cache;
+    TEST_ASSERT(blob_cache_init(&cache, BUDGET) == ERR_NONE);
+
+    const uint32_t big = SHARD_BUDGET / 2;
+    const struct cache_key key = key_of(1);
+    struct cache_blob* blob = blob_cache_adopt(&cache, &key, data_of(1, big), big);
+    TEST_ASSERT(blob != NULL && blob->size == big && atomic_load(&blob->refs) == 1);
+    blob_release(blob);
+    TEST_ASSERT(!cached(&cache, 1));
+
+    const uint32_t fits = SHARD_BUDGET / 2 - 1024;
+    TEST_ASSERT(adopt(&cache, 2, fits) && cached(&cache, 2));
+
+    struct blob_cache_stats stats;
+    blob_cache_stats(&cache, &stats);
+    TEST_ASSERT(stats.rejected == 1 && stats.entries == 1);
+
+    blob_cache_free(&cache);
+    return 0;
+}
+
+TEST(test_disabled)
+{
+    struct blob_cache cache;
+    TEST_ASSERT(blob_cache_init(&cache, 0) == ERR_NONE);
+
+    const struct cache_key key = key_of(1);
+    struct cache_blob* blob = blob_cache_adopt(&cache, &key, data_of(1, BLOB_SIZE), BLOB_SIZE);
+    TEST_ASSERT(blob != NULL && atomic_load(&blob->refs) == 1);
+    blob_release(blob);
+    TEST_ASSERT(blob_cache_get(&cache, &key) == NULL);
+
+    struct blob_cache_stats stats;
+    blob_cache_stats(&cache, &stats);
+    TEST_ASSERT(stats.entries == 0 && stats.rejected == 0);
+
+    blob_cache_free(&cache);
+    return 0;
+}
+
+int main(void)
+{
+    int failures = 0;
+    RUN_TEST(test_get_adopt, failures);
+    RUN_TEST(test_budget, failures);
+    RUN_TEST(test_evicted_while_held, failures);
+    RUN_TEST(test_scan_resistance, failures);
+    RUN_TEST(test_rejected, failures);
+    RUN_TEST(test_disabled, failures);
+    return failures;
+}
@@ -0,0 +1,85 @@
+/**
+ * @file test_crc32c.c
+ * @brief Unit tests of crc32c.c
+ */
+
+#include "crc32c.h"
+#include "unit_test.h"
+
+#include <string.h> // for memset
+
+// bit by bit, straight from the definition
+static uint32_t crc32c_reference(uint32_t crc, const unsigned char* p, size_t len)
+{
+    crc = ~crc;
+    while (len-- > 0) {
+        crc ^= *p++;
+        for (int k = 0; k < 8; k++) {
+            crc = (crc & 1) ? (crc >> 1) ^ 0x82F63B78u : crc >> 1;
+        }
+    }
+    return ~crc;
+}
+
+TEST(test_check_value)
+{
+    TEST_ASSERT(crc32c(0, "123456789", 9) == 0xE3069283u);
+    TEST_ASSERT(crc32c(0, "", 0) == 0);
+    return 0;
+}
+
+// RFC 3720 (iSCSI), appendix B.4
+TEST(test_iscsi_vectors)
+{
+    unsigned char buf[32];
+
+    memset(buf, 0, sizeof(buf));
+    TEST_ASSERT(crc32c(0, buf, sizeof(buf)) == 0x8A9136AAu);
+
+    memset(buf, 0xFF, sizeof(buf));
+    TEST_ASSERT(crc32c(0, buf, sizeof(buf)) == 0x62A8AB43u);
+
+    for (size_t i = 0; i < sizeof(buf); i++) buf[i] = (unsigned char) i;
+    TEST_ASSERT(crc32c(0, buf, sizeof(buf)) == 0x46DD794Eu);
+
+    for (size_t i = 0; i < sizeof(buf); i++) buf[i] = (unsigned char) (31 - i);
+    TEST_ASSERT(crc32c(0, buf, sizeof(buf)) == 0x113FDB5Cu);
+    return 0;
+}
+
+// every alignment and tail length of the word-at-a-time loops
+TEST(test_alignments)
+{
+    unsigned char buf[1100];
+    for (size_t i = 0; i < sizeof(buf); i++) buf[i] = (unsigned char) (i * 131 + 7);
+
+    for (size_t start = 0; start < 16; start++) {
+        for (size_t len = 0; len < 70; len++) {
+            TEST_ASSERT(crc32c(0, buf + start, len) == crc32c_reference(0, buf + start, len));
+        }
+        TEST_ASSERT(crc32c(0, buf + start, 1024) == crc32c_reference(0, buf + start, 1024));
+    }
+    return 0;
+}
+
+TEST(test_chunks)
+{
+    unsigned char buf[4096];
+    for (size_t i = 0; i < sizeof(buf); i++) buf[i] = (unsigned char) (i ^ i >> 3);
+
+    const uint32_t whole = crc32c(0, buf, sizeof(buf));
+    for (size_t cut = 0; cut <= sizeof(buf); cut += 509) {
+        TEST_ASSERT(crc32c(crc32c(0, buf, cut), buf + cut, sizeof(buf) - cut) == whole);
+    }
+    return 0;
+}
+
+int main(void)
+{
+    int failures = 0;
+    RUN_TEST(test_check_value, failures);
+    RUN_TEST(test_iscsi_vectors, failures);
+    RUN_TEST(test_alignments, failures);
+    RUN_TEST(test_chunks, failures);
+    return failures;
+}
@@ -0,0 +1,224 @@
+/**
+ * @file test_jpeg_optimize.c
+ * @brief Unit tests of jpeg_optimize.c
+ */
+
+#include "error.h"
+#include "jpeg_optimize.h"
+#include "jpeg_probe.h"
+#include "unit_test.h"
+
+#include <stdlib.h> // for free, malloc
+#include <string.h> // for memcmp, memcpy, memset
+
+/*
+ * An EXIF segment laid out as cameras do, offsets relative to the TIFF
+ * header (after "Exif\0\0"):
+ *   0  TIFF header, IFD0 at 8
+ *   8  IFD0: one entry, then the offset of IFD1 (at NEXT_AT)
+ *  26  IFD1: thumbnail offset and length, then 0
+ *  56  thumbnail (THUMB_SIZE bytes), then padding
+ */
+#define EXIF_HEADER 6
+#define IFD0        8
+#define NEXT_AT     22
+#define IFD1        26
+#define THUMB       56
+#define THUMB_SIZE  40
+#define MAX_SEGMENT 256
+
+struct segment {
+    uint8_t bytes[MAX_SEGMENT];
+    unsigned length;
+    int little;
+};
+
+static void tiff16(struct segment* s, unsigned at, uint16_t value)
+{
+    uint8_t* p = s->bytes + EXIF_HEADER + at;
+    p[s->little ? 0 : 1] = (uint8_t) value;
+    p[s->little ? 1 : 0] = (uint8_t) (value >> 8);
+}
+
+static void tiff32(struct segment* s, unsigned at, uint32_t value)
+{
+    tiff16(s, at + (s->little ? 0 : 2), (uint16_t) value);
+    tiff16(s, at + (s->little ? 2 : 0), (uint16_t) (value >> 16));
+}
+
+static void entry(struct segment* s, unsigned at, uint16_t tag, uint16_t type, uint32_t value)
+{
+    tiff16(s, at, tag);
+    tiff16(s, at + 2, type);
+    tiff32(s, at + 4, 1);
+    tiff32(s, at + 8, value);
+}
+
+static void segment_make(struct segment* s, int little, unsigned padding)
+{
+    memset(s, 0, sizeof(*s));
+    s->little = little;
+    memcpy(s->bytes, "Exif\0\0", EXIF_HEADER);
+    s->bytes[EXIF_HEADER] = s->bytes[EXIF_HEADER + 1] = little ? 'I' : 'M';
+    tiff16(s, 2, 42);
+    tiff32(s, 4, IFD0);
+    tiff16(s, IFD0, 1);
+    entry(s, IFD0 + 2, 0x0112, 3, 1); // orientation
+    tiff32(s, NEXT_AT, IFD1);
+    tiff16(s, IFD1, 2);
+    entry(s, IFD1 + 2, 0x0201, 4, THUMB);
+    entry(s, IFD1 + 14, 0x0202, 4, THUMB_SIZE);
+    for (unsigned b = 0; b < THUMB_SIZE; b++) {
+        s->bytes[EXIF_HEADER + THUMB + b] = (uint8_t) (0xD8 + b);
+    }
+    s->length = EXIF_HEADER + THUMB + THUMB_SIZE + padding;
+}
+
+static uint32_t read32(const struct segment* s, unsigned at)
+{
+    const uint8_t* p = s->bytes + EXIF_HEADER + at;
+    return s->little ? (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24
+                     : (uint32_t) p[3] | (uint32_t) p[2] << 8 | (uint32_t) p[1] << 16 | (uint32_t) p[0] << 24;
+}
+
+/*
+ * Strips from an exactly sized copy, so that the sanitizer catches any
+ * overread; *unchanged tells whether the bytes were left alone.
+ */
+static unsigned strip(struct segment* s, int* unchanged)
+{
+    uint8_t* copy = malloc(s->length > 0 ? s->length : 1);
+    if (copy == NULL) return 0;
+    memcpy(copy, s->bytes, s->length);
+    const unsigned length = exif_strip_thumbnail(copy, s->length);
+    *unchanged = memcmp(copy, s->bytes, s->length) == 0;
+    memcpy(s->bytes, copy, s->length);
+    free(copy);
+    return length;
+}
+
+TEST(test_strip)
+{
+    for (int little = 0; little <= 1; little++) {
+        for (unsigned padding = 0; padding <= 16; padding += 16) {
+            struct segment s;
+            segment_make(&s, little, padding);
+            int unchanged = 0;
+            TEST_ASSERT(strip(&s, &unchanged) == EXIF_HEADER + THUMB);
+            TEST_ASSERT(!unchanged && read32(&s, NEXT_AT) == 0); // IFD1 unlinked
+            TEST_ASSERT(read32(&s, 4) == IFD0);
+        }
+    }
+    return 0;
+}
+
+// layouts the thumbnail cannot just be cut from are left alone
+TEST(test_left_alone)
+{
+    struct segment s;
+    int unchanged = 0;
+
+    segment_make(&s, 1, 16);
+    s.bytes[s.length - 1] = 1; // something after the thumbnail
+    TEST_ASSERT(strip(&s, &unchanged) == s.length && unchanged);
+
+    segment_make(&s, 1, 0);
+    tiff32(&s, NEXT_AT, 0); // no IFD1
+    TEST_ASSERT(strip(&s, &unchanged) == s.length && unchanged);
+
+    segment_make(&s, 1, 0);
+    memcpy(s.bytes, "XMP\0\0\0", EXIF_HEADER);
+    TEST_ASSERT(strip(&s, &unchanged) == s.length && unchanged);
+
+    segment_make(&s, 1, 0);
+    s.bytes[EXIF_HEADER] = 'X';
+    TEST_ASSERT(strip(&s, &unchanged) == s.length && unchanged);
+    return 0;
+}
+
+// offsets and counts that would wrap around 32 bits, or point past the end
+TEST(test_hostile)
+{
+    static const uint32_t huge[] = { 0xFFFFFFFFu, 0xFFFFFFFEu, 0xFFFFFFF4u, 0x80000000u, 0x10000u };
+    static const unsigned fields[] = { 4, NEXT_AT, IFD1 + 10, IFD1 + 22 }; // ifd0, ifd1, thumb, thumb_size
+    for (size_t f = 0; f < sizeof(fields) / sizeof(fields[0]); f++) {
+        for (size_t h = 0; h < sizeof(huge) / sizeof(huge[0]); h++) {
+            struct segment s;
+            segment_make(&s, f % 2, 8);
+            tiff32(&s, fields[f], huge[h]);
+            int unchanged = 0;
+            TEST_ASSERT(strip(&s, &unchanged) == s.length && unchanged);
+        }
+    }
+
+    // entry counts past the end of the segment
+    static const uint16_t counts[] = { 0xFFFF, 0x1555, 7 };
+    for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+        struct segment s;
+        segment_make(&s, 0, 0);
+        tiff16(&s, IFD0, counts[c]);
+        int unchanged = 0;
+        TEST_ASSERT(strip(&s, &unchanged) == s.length && unchanged);
+    }
+
+    // an IFD1 count past the end is bounded by what fits: the thumbnail is still found
+    struct segment s;
+    segment_make(&s, 1, 0);
+    tiff16(&s, IFD1, 0xFFFF);
+    int unchanged = 0;
+    TEST_ASSERT(strip(&s, &unchanged) == EXIF_HEADER + THUMB);
+
+    // IFD offsets inside the TIFF header
+    segment_make(&s, 1, 0);
+    tiff32(&s, NEXT_AT, 4);
+    TEST_ASSERT(strip(&s, &unchanged) == s.length && unchanged);
+    return 0;
+}
+
+// a segment cut anywhere is left alone, and never read past its end
+TEST(test_truncated)
+{
+    struct segment full;
+    segment_make(&full, 0, 0);
+    for (unsigned length = 0; length < full.length; length++) {
+        struct segment s = full;
+        s.length = length;
+        int unchanged = 0;
+        TEST_ASSERT(strip(&s, &unchanged) == length && unchanged);
+    }
+    return 0;
+}
+
+// the pixels are kept: only the entropy coding changes
+TEST(test_optimize_lossless)
+{
+    char* image = NULL;
+    size_t size = 0;
+    TEST_ASSERT(test_make_jpeg(200, 150, 3, &image, &size) == 0);
+
+    char* out = NULL;
+    size_t out_size = 0;
+    const int err = jpeg_optimize(image, size, &out, &out_size);
+    struct jpeg_info before, after;
+    const int ok = err == ERR_NONE &&
+                   (out == NULL || (out_size < size &&
+                                    jpeg_probe(image, size, &before) == ERR_NONE &&
+                                    jpeg_probe(out, out_size, &after) == ERR_NONE &&
+                                    before.width == after.width && before.height == after.height &&
+                                    after.progressive));
+    free(image);
+    free(out);
+    TEST_ASSERT(ok);
+    return 0;
+}
+
+int main(void)
+{
+    int failures = 0;
+    RUN_TEST(test_strip, failures);
+    RUN_TEST(test_left_alone, failures);
+    RUN_TEST(test_hostile, failures);
+    RUN_TEST(test_truncated, failures);
+    RUN_TEST(test_optimize_lossless, failures);
+    return failures;
+}
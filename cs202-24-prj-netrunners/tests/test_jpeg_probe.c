@@ -0,0 +1,244 @@
+/**
+ * @file test_jpeg_probe.c
+ * @brief Unit tests of jpeg_probe.c
+ */
+
+#include "error.h"
+#include "jpeg_probe.h"
+#include "unit_test.h"
+
+#include <stdlib.h> // for free, malloc
+#include <string.h> // for memcpy
+
+#define MAX_STREAM 512
+
+/*
+ * Hand-made marker streams: the probe never looks past the frame header,
+ * so SOI, a few segments and EOI are enough.
+ */
+struct stream {
+    unsigned char bytes[MAX_STREAM];
+    size_t size;
+};
+
+static void put(struct stream* s, const void* bytes, size_t len)
+{
+    memcpy(s->bytes + s->size, bytes, len);
+    s->size += len;
+}
+
+static void put_segment(struct stream* s, unsigned char marker, const void* payload, size_t len)
+{
+    const unsigned char head[4] = { 0xFF, marker, (unsigned char) ((len + 2) >> 8), (unsigned char) (len + 2) };
+    put(s, head, sizeof(head));
+    put(s, payload, len);
+}
+
+static void put_sof(struct stream* s, unsigned char marker, uint16_t width, uint16_t height,
+                    unsigned char components)
+{
+    unsigned char sof[6 + 3 * 4] = { 8, (unsigned char) (height >> 8), (unsigned char) height,
+                                     (unsigned char) (width >> 8), (unsigned char) width, components };
+    put_segment(s, marker, sof, 6 + 3 * (size_t) components);
+}
+
+static void tiff16(unsigned char* p, int little, uint16_t value)
+{
+    p[little ? 0 : 1] = (unsigned char) value;
+    p[little ? 1 : 0] = (unsigned char) (value >> 8);
+}
+
+static void tiff32(unsigned char* p, int little, uint32_t value)
+{
+    tiff16(p + (little ? 0 : 2), little, (uint16_t) value);
+    tiff16(p + (little ? 2 : 0), little, (uint16_t) (value >> 16));
+}
+
+// an Exif segment whose IFD0, said to be at ifd, has one orientation entry at 8
+static void put_exif(struct stream* s, int little, uint32_t ifd, uint16_t nb_entries,
+                     uint16_t type, uint16_t value)
+{
+    unsigned char exif[6 + 8 + 2 + 12 + 4] = { 'E', 'x', 'i', 'f', 0, 0 };
+    unsigned char* tiff = exif + 6;
+    tiff[0] = tiff[1] = little ? 'I' : 'M';
+    tiff16(tiff + 2, little, 42);
+    tiff32(tiff + 4, little, ifd);
+    tiff16(tiff + 8, little, nb_entries);
+    tiff16(tiff + 10, little, 0x0112); // orientation
+    tiff16(tiff + 12, little, type);
+    tiff32(tiff + 14, little, 1);      // count
+    tiff16(tiff + 18, little, value);
+    put_segment(s, 0xE1, exif, sizeof(exif));
+}
+
+static void put_soi(struct stream* s)
+{
+    s->size = 0;
+    put(s, "\xFF\xD8", 2);
+}
+
+static int probe(const struct stream* s, struct jpeg_info* info)
+{
+    // exactly sized, so that the sanitizer catches any overread
+    char* copy = malloc(s->size > 0 ? s->size : 1);
+    if (copy == NULL) return ERR_OUT_OF_MEMORY;
+    memcpy(copy, s->bytes, s->size);
+    const int err = jpeg_probe(copy, s->size, info);
+    free(copy);
+    return err;
+}
+
+TEST(test_encoded_image)
+{
+    char* image = NULL;
+    size_t size = 0;
+    TEST_ASSERT(test_make_jpeg(123, 45, 1, &image, &size) == 0);
+
+    struct jpeg_info info;
+    const int err = jpeg_probe(image, size, &info);
+    free(image);
+    TEST_ASSERT(err == ERR_NONE);
+    TEST_ASSERT(info.width == 123 && info.height == 45);
+    TEST_ASSERT(info.components == 1 && !info.progressive && info.orientation == 1);
+    return 0;
+}
+
+TEST(test_frame_kinds)
+{
+    struct stream s;
+    struct jpeg_info info;
+
+    put_soi(&s);
+    put_sof(&s, 0xC2, 640, 480, 3);
+    TEST_ASSERT(probe(&s, &info) == ERR_NONE);
+    TEST_ASSERT(info.width == 640 && info.height == 480 && info.components == 3 && info.progressive);
+
+    put_soi(&s);
+    put_segment(&s, 0xC4, "\0", 1); // DHT: not a frame
+    put(&s, "\xFF\xFF\xFF", 3);      // fill bytes
+    put_sof(&s, 0xC1, 65535, 1, 4);
+    TEST_ASSERT(probe(&s, &info) == ERR_NONE);
+    TEST_ASSERT(info.width == 65535 && info.height == 1 && info.components == 4 && !info.progressive);
+
+    // lossless, hierarchical and arithmetic-coded frames: libjpeg may not decode them
+    static const unsigned char others[] = { 0xC3, 0xC5, 0xC7, 0xC9, 0xCA, 0xCB, 0xCF };
+    for (size_t i = 0; i < sizeof(others); i++) {
+        put_soi(&s);
+        put_sof(&s, others[i], 640, 480, 3);
+        TEST_ASSERT(probe(&s, &info) == ERR_IMGLIB);
+    }
+    return 0;
+}
+
+TEST(test_orientation)
+{
+    struct stream s;
+    struct jpeg_info info;
+
+    for (int little = 0; little <= 1; little++) {
+        put_soi(&s);
+        put_exif(&s, little, 8, 1, 3, 6);
+        put_sof(&s, 0xC0, 10, 20, 3);
+        TEST_ASSERT(probe(&s, &info) == ERR_NONE && info.orientation == 6);
+    }
+
+    // out of range, or not a SHORT: ignored
+    put_soi(&s);
+    put_exif(&s, 1, 8, 1, 3, 9);
+    put_sof(&s, 0xC0, 10, 20, 3);
+    TEST_ASSERT(probe(&s, &info) == ERR_NONE && info.orientation == 1);
+
+    put_soi(&s);
+    put_exif(&s, 1, 8, 1, 4, 6);
+    put_sof(&s, 0xC0, 10, 20, 3);
+    TEST_ASSERT(probe(&s, &info) == ERR_NONE && info.orientation == 1);
+    return 0;
+}
+
+// offsets and counts pointing out of the segment are ignored, not followed
+TEST(test_hostile_exif)
+{
+    const uint32_t ifds[] = { 0xFFFFFFFFu, 0xFFFFFFF0u, 25, 24 }; // the TIFF part is 26 bytes
+    for (size_t i = 0; i < sizeof(ifds) / sizeof(ifds[0]); i++) {
+        struct stream s;
+        struct jpeg_info info;
+        put_soi(&s);
+        put_exif(&s, 1, ifds[i], 1, 3, 6);
+        put_sof(&s, 0xC0, 10, 20, 3);
+        TEST_ASSERT(probe(&s, &info) == ERR_NONE && info.orientation == 1);
+    }
+
+    struct stream s;
+    struct jpeg_info info;
+    put_soi(&s);
+    put_exif(&s, 1, 8, 0xFFFF, 0, 0); // entries past the first one would overrun
+    put_sof(&s, 0xC0, 10, 20, 3);
+    TEST_ASSERT(probe(&s, &info) == ERR_NONE && info.orientation == 1);
+    return 0;
+}
+
+TEST(test_malformed)
+{
+    struct stream s;
+    struct jpeg_info info;
+
+    put_soi(&s);
+    TEST_ASSERT(probe(&s, &info) == ERR_IMGLIB);
+
+    s.size = 0;
+    put(&s, "\x89PNG\r\n\x1a\n", 8);
+    TEST_ASSERT(probe(&s, &info) == ERR_IMGLIB);
+
+    // a segment longer than the buffer
+    put_soi(&s);
+    put(&s, "\xFF\xE0\x40\x00", 4);
+    put_sof(&s, 0xC0, 10, 20, 3);
+    TEST_ASSERT(probe(&s, &info) == ERR_IMGLIB);
+
+    // scan data before any frame header
+    put_soi(&s);
+    put_segment(&s, 0xDA, "\0\0\0\0", 4);
+    put_sof(&s, 0xC0, 10, 20, 3);
+    TEST_ASSERT(probe(&s, &info) == ERR_IMGLIB);
+
+    // no height (it would come in a DNL marker)
+    put_soi(&s);
+    put_sof(&s, 0xC0, 10, 0, 3);
+    TEST_ASSERT(probe(&s, &info) == ERR_IMGLIB);
+
+    // a frame header too short
+    put_soi(&s);
+    put_segment(&s, 0xC0, "\x08\x00", 2);
+    TEST_ASSERT(probe(&s, &info) == ERR_IMGLIB);
+    return 0;
+}
+
+// any image cut before the end of its frame header is rejected
+TEST(test_truncated)
+{
+    struct stream s;
+    put_soi(&s);
+    put_exif(&s, 0, 8, 1, 3, 3);
+    put_segment(&s, 0xDB, "\0\0\0\0\0\0\0\0", 8);
+    put_sof(&s, 0xC0, 300, 200, 3);
+    const size_t full = s.size;
+
+    struct jpeg_info info;
+    for (s.size = 0; s.size < full; s.size++) {
+        TEST_ASSERT(probe(&s, &info) == ERR_IMGLIB);
+    }
+    TEST_ASSERT(probe(&s, &info) == ERR_NONE && info.width == 300 && info.orientation == 3);
+    return 0;
+}
+
+int main(void)
+{
+    int failures = 0;
+    RUN_TEST(test_encoded_image, failures);
+    RUN_TEST(test_frame_kinds, failures);
+    RUN_TEST(test_orientation, failures);
+    RUN_TEST(test_hostile_exif, failures);
+    RUN_TEST(test_malformed, failures);
+    RUN_TEST(test_truncated, failures);
+    return failures;
+}
@@ -0,0 +1,193 @@
+/**
+ * @file test_recover.c
+ * @brief Unit tests of do_recover() (imgfs_recover.c)
+ */
+
+#include "error.h"
+#include "imgfs.h"
+#include "unit_test.h"
+
+#include <stdlib.h> // for free
+#include <string.h> // for memcmp, memset
+#include <unistd.h> // for truncate
+
+#define MAX_FILES 10
+
+struct fixture {
+    char* image[2];
+    size_t size[2];
+    uint64_t end_of_first; // file size after the first insert
+    uint64_t end;          // after both
+};
+
+static void fixture_free(struct fixture* f)
+{
+    free(f->image[0]);
+    free(f->image[1]);
+}
+
+// an imgFS holding "first" then "second", and a duplicate of "first" in between
+static int fixture_make(const char* path, struct fixture* f)
+{
+    memset(f, 0, sizeof(*f));
+    for (unsigned i = 0; i < 2; i++) {
+        if (test_make_jpeg(96, 64, i + 1, &f->image[i], &f->size[i]) != 0) return 1;
+    }
+
+    struct imgfs_file imgfs_file = {
+        .header.max_files = MAX_FILES,
+        .header.resized_res = { 32, 32, 64, 64 }
+    };
+    int err = do_create(path, &imgfs_file);
+    if (err == ERR_NONE) err = do_insert(f->image[0], f->size[0], "first", &imgfs_file);
+    if (err == ERR_NONE) err = do_insert(f->image[0], f->size[0], "first_again", &imgfs_file);
+    f->end_of_first = imgfs_file.file_end;
+    if (err == ERR_NONE) err = do_insert(f->image[1], f->size[1], "second", &imgfs_file);
+    f->end = imgfs_file.file_end;
+    do_close(&imgfs_file);
+    return err != ERR_NONE;
+}
+
+static int read_equals(struct imgfs_file* imgfs_file, const char* img_id,
+                       const char* expected, size_t expected_size)
+{
+    char* buffer = NULL;
+    uint32_t size = 0;
+    const int err = do_read(img_id, ORIG_RES, &buffer, &size, imgfs_file);
+    const int equal = err == ERR_NONE && size == expected_size &&
+                      memcmp(buffer, expected, size) == 0;
+    free(buffer);
+    return equal;
+}
+
+// recovers after cutting the file at cut bytes
+static int recover_cut(const char* path, uint64_t cut, struct imgfs_file* imgfs_file)
+{
+    if (truncate(path, (off_t) cut) != 0) return ERR_IO;
+    memset(imgfs_file, 0, sizeof(*imgfs_file));
+    int err = do_open(path, "rb+", imgfs_file);
+    if (err != ERR_NONE) return err;
+    // as after a crash before the table was written back
+    for (uint32_t i = 0; i < MAX_FILES; i++) {
+        imgfs_clear_slot(imgfs_file, i);
+    }
+    imgfs_file->header.nb_files = 0;
+    return do_recover(imgfs_file);
+}
+
+TEST(test_recover_intact)
+{
+    const char* path = test_scratch_path("intact.imgfs");
+    struct fixture f;
+    TEST_ASSERT(path != NULL && fixture_make(path, &f) == 0);
+
+    struct imgfs_file imgfs_file;
+    const int err = recover_cut(path, f.end, &imgfs_file);
+    const int ok = err == ERR_NONE && imgfs_file.header.nb_files == 3 &&
+                   read_equals(&imgfs_file, "first", f.image[0], f.size[0]) &&
+                   read_equals(&imgfs_file, "first_again", f.image[0], f.size[0]) &&
+                   read_equals(&imgfs_file, "second", f.image[1], f.size[1]);
+    do_close(&imgfs_file);
+    fixture_free(&f);
+    TEST_ASSERT(ok);
+    return 0;
+}
+
+// a needle cut short, in its payload then in its header, is dropped alone
+TEST(test_recover_truncated)
+{
+    const uint64_t into_last[] = { 100, 10, 1 };
+    for (size_t c = 0; c < sizeof(into_last) / sizeof(into_last[0]); c++) {
+        const char* path = test_scratch_path("truncated.imgfs");
+        struct fixture f;
+        TEST_ASSERT(path != NULL && fixture_make(path, &f) == 0);
+
+        struct imgfs_file imgfs_file;
+        const int err = recover_cut(path, f.end_of_first + into_last[c], &imgfs_file);
+        uint32_t index = 0;
+        struct imgfs_space scanned;
+        const int ok = err == ERR_NONE && imgfs_file.header.nb_files == 2 &&
+                       read_equals(&imgfs_file, "first", f.image[0], f.size[0]) &&
+                       read_equals(&imgfs_file, "first_again", f.image[0], f.size[0]) &&
+                       imgfs_find_id(&imgfs_file, "second", &index) == ERR_IMAGE_NOT_FOUND &&
+                       imgfs_space_scan(&imgfs_file, &scanned) == ERR_NONE &&
+                       imgfs_file.space.live_bytes == scanned.live_bytes &&
+                       imgfs_file.space.shared_bytes == scanned.shared_bytes;
+        do_close(&imgfs_file);
+        fixture_free(&f);
+        TEST_ASSERT(ok);
+    }
+    return 0;
+}
+
+// deletions, and insertions reusing their slots and content, replay to the same table
+TEST(test_recover_replay)
+{
+    const char* path = test_scratch_path("replay.imgfs");
+    struct fixture f;
+    TEST_ASSERT(path != NULL && fixture_make(path, &f) == 0);
+
+    struct imgfs_file imgfs_file;
+    memset(&imgfs_file, 0, sizeof(imgfs_file));
+    int err = do_open(path, "rb+", &imgfs_file);
+    if (err == ERR_NONE) err = do_delete("first", &imgfs_file);
+    if (err == ERR_NONE) err = do_insert(f.image[1], f.size[1], "third", &imgfs_file);
+    if (err == ERR_NONE) err = do_delete("second", &imgfs_file);
+    if (err == ERR_NONE) err = do_insert(f.image[0], f.size[0], "first", &imgfs_file);
+    if (err == ERR_NONE) err = do_delete("first_again", &imgfs_file);
+    if (err == ERR_NONE) err = do_insert(f.image[1], f.size[1], "second", &imgfs_file);
+    struct img_metadata before[MAX_FILES];
+    const uint32_t nb_files = imgfs_file.header.nb_files;
+    for (uint32_t i = 0; i < MAX_FILES; i++) {
+        imgfs_get_metadata(&imgfs_file, i, &before[i]);
+    }
+    const uint64_t end = imgfs_file.file_end;
+    do_close(&imgfs_file);
+    TEST_ASSERT(err == ERR_NONE && nb_files == 3);
+
+    err = recover_cut(path, end, &imgfs_file);
+    int ok = err == ERR_NONE && imgfs_file.header.nb_files == nb_files;
+    for (uint32_t i = 0; ok && i < MAX_FILES; i++) {
+        struct img_metadata after;
+        imgfs_get_metadata(&imgfs_file, i, &after);
+        ok = memcmp(&before[i], &after, sizeof(after)) == 0;
+    }
+    ok = ok && read_equals(&imgfs_file, "first", f.image[0], f.size[0]) &&
+         read_equals(&imgfs_file, "second", f.image[1], f.size[1]) &&
+         read_equals(&imgfs_file, "third", f.image[1], f.size[1]);
+    do_close(&imgfs_file);
+    fixture_free(&f);
+    TEST_ASSERT(ok);
+    return 0;
+}
+
+TEST(test_recover_no_needle)
+{
+    const char* path = test_scratch_path("empty.imgfs");
+    struct fixture f;
+    TEST_ASSERT(path != NULL && fixture_make(path, &f) == 0);
+
+    struct imgfs_file imgfs_file;
+    memset(&imgfs_file, 0, sizeof(imgfs_file));
+    TEST_ASSERT(do_open(path, "rb", &imgfs_file) == ERR_NONE);
+    const uint64_t data_start = imgfs_data_start(&imgfs_file.header);
+    do_close(&imgfs_file);
+
+    const int err = recover_cut(path, data_start, &imgfs_file);
+    const uint32_t nb_files = imgfs_file.header.nb_files;
+    do_close(&imgfs_file);
+    fixture_free(&f);
+    TEST_ASSERT(err == ERR_NONE && nb_files == 0);
+    return 0;
+}
+
+int main(void)
+{
+    int failures = 0;
+    RUN_TEST(test_recover_intact, failures);
+    RUN_TEST(test_recover_truncated, failures);
+    RUN_TEST(test_recover_replay, failures);
+    RUN_TEST(test_recover_no_needle, failures);
+    test_cleanup();
+    return failures;
+}
@@ -0,0 +1,168 @@
+/**
+ * @file test_space.c
+ * @brief Unit tests of imgfs_space.c: the counters kept up to date on
+ *        every change must match those imgfs_space_scan() computes.
+ */
+
+#include "error.h"
+#include "imgfs.h"
+#include "unit_test.h"
+
+#include <stdlib.h> // for free
+#include <string.h> // for memcpy, memset
+
+#define MAX_FILES 32
+#define NB_STEPS  3000
+
+static uint64_t rng_next(uint64_t* state) // xorshift64*
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+static int matches_scan(const struct imgfs_file* imgfs_file)
+{
+    struct imgfs_space scanned;
+    return imgfs_space_scan(imgfs_file, &scanned) == ERR_NONE &&
+           imgfs_file->space.live_bytes == scanned.live_bytes &&
+           imgfs_file->space.shared_bytes == scanned.shared_bytes;
+}
+
+static int pick_valid(const struct imgfs_file* imgfs_file, uint64_t* rng, uint32_t* index)
+{
+    if (imgfs_file->header.nb_files == 0) return 0;
+    uint32_t skip = (uint32_t) (rng_next(rng) % imgfs_file->header.nb_files);
+    for (uint32_t i = 0; i < MAX_FILES; i++) {
+        if (imgfs_is_valid(imgfs_file, i) && skip-- == 0) {
+            *index = i;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * The table alone, changed the way insert, dedup, lazy resize and delete
+ * change it, in a random order.
+ */
+TEST(test_random_changes)
+{
+    struct imgfs_file imgfs_file = {
+        .header.max_files = MAX_FILES,
+        .header.flags = IMGFS_FLAG_SPACE
+    };
+    TEST_ASSERT(imgfs_alloc_table(&imgfs_file) == ERR_NONE);
+
+    uint64_t rng = 0x9E3779B97F4A7C15ULL;
+    uint64_t next_offset = 4096;
+    int ok = 1;
+    for (int step = 0; ok && step < NB_STEPS; step++) {
+        const uint64_t op = rng_next(&rng) % 4;
+        uint32_t index = 0, other = 0;
+        if (op <= 1 && imgfs_find_free(&imgfs_file, &index) == ERR_NONE) {
+            char img_id[16];
+            snprintf(img_id, sizeof(img_id), "img%d", step);
+            ok = imgfs_fill_slot(&imgfs_file, index, img_id) == ERR_NONE;
+            if (op == 1 && pick_valid(&imgfs_file, &rng, &other) && other != index) {
+                // same content: refers to all the variants of the other one
+                memcpy(imgfs_file.size[index], imgfs_file.size[other], sizeof(imgfs_file.size[index]));
+                memcpy(imgfs_file.offset[index], imgfs_file.offset[other], sizeof(imgfs_file.offset[index]));
+                imgfs_space_ref(&imgfs_file, index, (1u << NB_RES) - 1);
+            } else {
+                const uint32_t size = 1000 + (uint32_t) (rng_next(&rng) % 1000);
+                imgfs_file.size[index][ORIG_RES] = size;
+                imgfs_file.offset[index][ORIG_RES] = next_offset;
+                next_offset += size;
+                imgfs_space_new_blob(&imgfs_file, size);
+            }
+            imgfs_file.header.nb_files++;
+        } else if (op == 2 && pick_valid(&imgfs_file, &rng, &index)) {
+            // a resized variant, made again if there is one already
+            const int res = (int) (rng_next(&rng) % ORIG_RES);
+            if (imgfs_file.size[index][res] != 0) {
+                imgfs_space_unref(&imgfs_file, index, 1u << res);
+            }
+            const uint32_t size = 100 + (uint32_t) (rng_next(&rng) % 100);
+            imgfs_file.size[index][res] = size;
+            imgfs_file.offset[index][res] = next_offset;
+            next_offset += size;
+            imgfs_space_new_blob(&imgfs_file, size);
+        } else if (op == 3 && pick_valid(&imgfs_file, &rng, &index)) {
+            imgfs_space_unref(&imgfs_file, index, (1u << NB_RES) - 1);
+            imgfs_clear_slot(&imgfs_file, index);
+            imgfs_file.header.nb_files--;
+        }
+        ok = ok && matches_scan(&imgfs_file);
+        if (!ok) fprintf(stderr, "mismatch at step %d (operation %d)\n", step, (int) op);
+    }
+    imgfs_free_table(&imgfs_file);
+    TEST_ASSERT(ok);
+    return 0;
+}
+
+// the same through the commands, on disk, and across reopening
+TEST(test_commands)
+{
+    const char* path = test_scratch_path("space.imgfs");
+    TEST_ASSERT(path != NULL);
+
+    char* image[3] = { NULL, NULL, NULL };
+    size_t size[3] = { 0, 0, 0 };
+    for (unsigned i = 0; i < 3; i++) {
+        TEST_ASSERT(test_make_jpeg(120, 80, i, &image[i], &size[i]) == 0);
+    }
+
+    struct imgfs_file imgfs_file = {
+        .header.max_files = MAX_FILES,
+        .header.resized_res = { 32, 32, 64, 64 }
+    };
+    int ok = do_create(path, &imgfs_file) == ERR_NONE && matches_scan(&imgfs_file);
+    static const char* const ids[] = { "a", "b", "a_again", "c", "a_third" };
+    static const unsigned content[] = { 0, 1, 0, 2, 0 };
+    for (size_t i = 0; ok && i < sizeof(ids) / sizeof(ids[0]); i++) {
+        ok = do_insert(image[content[i]], size[content[i]], ids[i], &imgfs_file) == ERR_NONE &&
+             matches_scan(&imgfs_file);
+    }
+
+    // lazily resized variants, shared by the duplicates
+    static const char* const reads[] = { "a", "a_again", "b" };
+    for (size_t i = 0; ok && i < sizeof(reads) / sizeof(reads[0]); i++) {
+        char* buffer = NULL;
+        uint32_t buffer_size = 0;
+        ok = do_read(reads[i], THUMB_RES, &buffer, &buffer_size, &imgfs_file) == ERR_NONE &&
+             matches_scan(&imgfs_file);
+        free(buffer);
+    }
+
+    const uint64_t dead_before = imgfs_file.space.dead_bytes;
+    static const char* const deletes[] = { "a", "b", "a_again" };
+    for (size_t i = 0; ok && i < sizeof(deletes) / sizeof(deletes[0]); i++) {
+        ok = do_delete(deletes[i], &imgfs_file) == ERR_NONE && matches_scan(&imgfs_file);
+    }
+    // b alone held its blobs: they are dead now
+    ok = ok && imgfs_file.space.dead_bytes > dead_before + size[1];
+    const struct imgfs_space kept = imgfs_file.space;
+    do_close(&imgfs_file);
+
+    memset(&imgfs_file, 0, sizeof(imgfs_file));
+    ok = ok && do_open(path, "rb", &imgfs_file) == ERR_NONE &&
+         memcmp(&imgfs_file.space, &kept, sizeof(kept)) == 0 && matches_scan(&imgfs_file);
+    do_close(&imgfs_file);
+
+    for (unsigned i = 0; i < 3; i++) {
+        free(image[i]);
+    }
+    TEST_ASSERT(ok);
+    return 0;
+}
+
+int main(void)
+{
+    int failures = 0;
+    RUN_TEST(test_random_changes, failures);
+    RUN_TEST(test_commands, failures);
+    test_cleanup();
+    return failures;
+}
@@ -0,0 +1,281 @@
+/**
+ * @file test_store.c
+ * @brief Unit tests of imgfs_store.c: the directory, the content index
+ *        and the placement of new images on the volumes.
+ */
+
+#include "error.h"
+#include "image_content.h" // for IMAGE_JPEG
+#include "imgfs_store.h"
+#include "unit_test.h"
+
+#include <stdlib.h> // for free
+#include <string.h> // for memcpy, memset
+
+#define NB_IMAGES  6
+#define MAX_PROBES (1u << 20) // IDs tried to find colliding ones
+
+struct images {
+    char* data[NB_IMAGES];
+    size_t size[NB_IMAGES];
+};
+
+static int images_make(struct images* images)
+{
+    memset(images, 0, sizeof(*images));
+    for (unsigned i = 0; i < NB_IMAGES; i++) {
+        if (test_make_jpeg(64, 48, i + 1, &images->data[i], &images->size[i]) != 0) return 1;
+    }
+    return 0;
+}
+
+static void images_free(struct images* images)
+{
+    for (unsigned i = 0; i < NB_IMAGES; i++) {
+        free(images->data[i]);
+    }
+}
+
+// an empty volume; its size is put in end if not NULL
+static int volume_make(const char* path, uint32_t max_files, uint64_t* end)
+{
+    struct imgfs_file imgfs_file = {
+        .header.max_files = max_files,
+        .header.resized_res = { 32, 32, 64, 64 }
+    };
+    const int err = do_create(path, &imgfs_file);
+    if (end != NULL) *end = imgfs_file.file_end + imgfs_file.tier_end;
+    do_close(&imgfs_file);
+    return err;
+}
+
+static int readable(struct imgfs_store* store, const char* img_id, size_t size)
+{
+    struct cache_blob* blob = NULL;
+    const int err = store_read(store, img_id, ORIG_RES, IMAGE_JPEG, &blob);
+    const int ok = err == ERR_NONE && blob->size == size;
+    blob_release(blob);
+    return ok;
+}
+
+static int sealed(struct imgfs_store* store, size_t volume, uint32_t* nb_files)
+{
+    struct store_volume_stats stats;
+    if (store_volume_stats(store, volume, &stats) != ERR_NONE) return 0;
+    if (nb_files != NULL) *nb_files = stats.nb_files;
+    return stats.sealed;
+}
+
+// a new ID whose home bucket in the directory is home
+static int id_at(char* img_id, size_t len, uint64_t home, size_t mask)
+{
+    static unsigned next = 0;
+    for (unsigned k = 0; k < MAX_PROBES; k++) {
+        snprintf(img_id, len, "c%u", next++);
+        if ((imgfs_id_hash(img_id) & mask) == home) return 1;
+    }
+    return 0;
+}
+
+/*
+ * Three IDs with the same home bucket, then one whose home is the next
+ * bucket (so it sits past them): deleting the first ones shifts the
+ * others back, and every one must stay reachable from its home.
+ */
+TEST(test_colliding_ids)
+{
+    const char* path = test_scratch_path("collide.imgfs");
+    TEST_ASSERT(path != NULL && volume_make(path, 16, NULL) == ERR_NONE);
+    struct images images;
+    TEST_ASSERT(images_make(&images) == 0);
+
+    struct imgfs_store store;
+    TEST_ASSERT(store_open(&store, &path, 1, IMGFS_BACKEND_FILE, 0, 0, 0) == ERR_NONE);
+
+    char ids[4][MAX_IMG_ID + 1] = { "c" };
+    int ok = store_insert(&store, images.data[0], images.size[0], ids[0]) == ERR_NONE;
+    // a few images: the directory keeps its first capacity
+    const size_t mask = store.dir_capacity - 1;
+    const uint64_t home = imgfs_id_hash(ids[0]) & mask;
+    ok = ok && id_at(ids[1], sizeof(ids[1]), home, mask) && id_at(ids[2], sizeof(ids[2]), home, mask) &&
+         id_at(ids[3], sizeof(ids[3]), (home + 1) & mask, mask);
+    for (unsigned i = 1; ok && i < 4; i++) {
+        ok = store_insert(&store, images.data[i], images.size[i], ids[i]) == ERR_NONE;
+    }
+
+    ok = ok && store_delete(&store, ids[0]) == ERR_NONE;
+    ok = ok && !readable(&store, ids[0], images.size[0]);
+    for (unsigned i = 1; ok && i < 4; i++) {
+        ok = readable(&store, ids[i], images.size[i]);
+    }
+    ok = ok && store_delete(&store, ids[1]) == ERR_NONE &&
+         readable(&store, ids[2], images.size[2]) && readable(&store, ids[3], images.size[3]);
+
+    // back in, past the others now, and the duplicate ID is still seen
+    ok = ok && store_insert(&store, images.data[0], images.size[0], ids[0]) == ERR_NONE &&
+         readable(&store, ids[0], images.size[0]) &&
+         store_insert(&store, images.data[4], images.size[4], ids[3]) == ERR_DUPLICATE_ID &&
+         store.dir_count == 3;
+    ok = ok && store_delete(&store, ids[2]) == ERR_NONE && store_delete(&store, ids[3]) == ERR_NONE &&
+         store_delete(&store, ids[0]) == ERR_NONE && store.dir_count == 0;
+
+    store_close(&store);
+    images_free(&images);
+    TEST_ASSERT(ok);
+    return 0;
+}
+
+static int content_size(struct imgfs_store* store, const unsigned char* SHA, uint32_t* size)
+{
+    struct content_tag tag;
+    struct cache_blob* blob = NULL;
+    const int err = store_read_content(store, SHA, ORIG_RES, &tag, &blob);
+    *size = err == ERR_NONE ? blob->size : 0;
+    blob_release(blob);
+    return err;
+}
+
+// the entry of a content moves to another image with it, and goes with the last one
+TEST(test_content_index)
+{
+    const char* path = test_scratch_path("content.imgfs");
+    TEST_ASSERT(path != NULL && volume_make(path, 8, NULL) == ERR_NONE);
+    struct images images;
+    TEST_ASSERT(images_make(&images) == 0);
+
+    struct imgfs_store store;
+    TEST_ASSERT(store_open(&store, &path, 1, IMGFS_BACKEND_FILE, 0, 0, 0) == ERR_NONE);
+    int ok = store_insert(&store, images.data[0], images.size[0], "x") == ERR_NONE &&
+             store_insert(&store, images.data[0], images.size[0], "x_again") == ERR_NONE &&
+             store_insert(&store, images.data[1], images.size[1], "y") == ERR_NONE;
+
+    unsigned char SHA[2][SHA256_DIGEST_LENGTH];
+    static const char* const owners[2] = { "x", "y" };
+    for (unsigned i = 0; ok && i < 2; i++) {
+        uint32_t index = 0;
+        ok = imgfs_find_id(&store.volumes[0].file, owners[i], &index) == ERR_NONE;
+        if (ok) memcpy(SHA[i], store.volumes[0].file.cold[index]->SHA, SHA256_DIGEST_LENGTH);
+    }
+
+    uint32_t size = 0;
+    ok = ok && store.contents_count == 2 &&
+         content_size(&store, SHA[0], &size) == ERR_NONE && size == images.size[0];
+    ok = ok && store_delete(&store, "x") == ERR_NONE &&
+         content_size(&store, SHA[0], &size) == ERR_NONE && size == images.size[0];
+    ok = ok && store_delete(&store, "x_again") == ERR_NONE &&
+         content_size(&store, SHA[0], &size) == ERR_IMAGE_NOT_FOUND && store.contents_count == 1 &&
+         content_size(&store, SHA[1], &size) == ERR_NONE && size == images.size[1];
+
+    store_close(&store);
+    images_free(&images);
+    TEST_ASSERT(ok);
+    return 0;
+}
+
+// volumes are sealed once full, or once too big, and inserts go to the others
+TEST(test_rollover)
+{
+    const char* paths[2] = { test_scratch_path("full0.imgfs"), test_scratch_path("full1.imgfs") };
+    TEST_ASSERT(paths[0] != NULL && paths[1] != NULL);
+    struct images images;
+    TEST_ASSERT(images_make(&images) == 0);
+
+    int ok = volume_make(paths[0], 2, NULL) == ERR_NONE && volume_make(paths[1], 2, NULL) == ERR_NONE;
+    struct imgfs_store store;
+    ok = ok && store_open(&store, paths, 2, IMGFS_BACKEND_FILE, 0, 0, 0) == ERR_NONE;
+    if (!ok) {
+        images_free(&images);
+        TEST_ASSERT(ok);
+    }
+    static const char* const ids[] = { "a", "b", "c", "d", "e" };
+    for (unsigned i = 0; ok && i < 4; i++) {
+        ok = store_insert(&store, images.data[i], images.size[i], ids[i]) == ERR_NONE;
+    }
+    uint32_t nb_files[2] = { 0, 0 };
+    ok = ok && sealed(&store, 0, &nb_files[0]) && sealed(&store, 1, &nb_files[1]) &&
+         nb_files[0] == 2 && nb_files[1] == 2;
+    ok = ok && store_insert(&store, images.data[4], images.size[4], ids[4]) == ERR_IMGFS_FULL &&
+         store.dir_count == 4;
+    // sealed for good: a deletion does not open it again
+    ok = ok && store_delete(&store, ids[0]) == ERR_NONE &&
+         store_insert(&store, images.data[4], images.size[4], ids[4]) == ERR_IMGFS_FULL &&
+         readable(&store, ids[3], images.size[3]);
+    store_close(&store);
+
+    // one image is enough to go past max_volume_size
+    uint64_t end = 0;
+    ok = ok && volume_make(paths[0], 8, &end) == ERR_NONE && volume_make(paths[1], 8, NULL) == ERR_NONE &&
+         store_open(&store, paths, 2, IMGFS_BACKEND_FILE, end + 1, 0, 0) == ERR_NONE;
+    if (ok) {
+        ok = !sealed(&store, 0, NULL) && !sealed(&store, 1, NULL);
+        for (unsigned i = 0; ok && i < 2; i++) {
+            ok = store_insert(&store, images.data[i], images.size[i], ids[i]) == ERR_NONE &&
+                 sealed(&store, i, &nb_files[i]) && nb_files[i] == 1;
+        }
+        ok = ok && store_insert(&store, images.data[2], images.size[2], ids[2]) == ERR_IMGFS_FULL;
+        store_close(&store);
+    }
+
+    images_free(&images);
+    TEST_ASSERT(ok);
+    return 0;
+}
+
+/*
+ * A volume whose nb_files lags behind its table (a crash between their
+ * writes) looks open, yet do_insert() finds no free slot: the insert must
+ * seal it and go to another volume rather than pick it again.
+ */
+TEST(test_lagging_count)
+{
+    const char* paths[2] = { test_scratch_path("lag0.imgfs"), test_scratch_path("lag1.imgfs") };
+    TEST_ASSERT(paths[0] != NULL && paths[1] != NULL);
+    struct images images;
+    TEST_ASSERT(images_make(&images) == 0);
+
+    struct imgfs_file imgfs_file = {
+        .header.max_files = 2,
+        .header.resized_res = { 32, 32, 64, 64 }
+    };
+    int ok = do_create(paths[0], &imgfs_file) == ERR_NONE &&
+             do_insert(images.data[0], images.size[0], "a", &imgfs_file) == ERR_NONE &&
+             do_insert(images.data[1], images.size[1], "b", &imgfs_file) == ERR_NONE;
+    do_close(&imgfs_file);
+    ok = ok && volume_make(paths[1], 1, NULL) == ERR_NONE;
+
+    struct imgfs_store store;
+    ok = ok && store_open(&store, paths, 2, IMGFS_BACKEND_FILE, 0, 0, 0) == ERR_NONE;
+    if (!ok) {
+        images_free(&images);
+        TEST_ASSERT(ok);
+    }
+    // do_open_backend() recounts nb_files: make it lag in memory, and the
+    // volume open with as many free slots as the other one (placed first)
+    struct imgfs_volume* volume = &store.volumes[0];
+    volume->file.header.nb_files = 1;
+    volume->file.header.flags &= (uint16_t) ~IMGFS_FLAG_SEALED;
+    atomic_store(&volume->free_slots, 1);
+
+    uint32_t nb_files = 0;
+    ok = store_insert(&store, images.data[2], images.size[2], "c") == ERR_NONE &&
+         sealed(&store, 0, NULL) && sealed(&store, 1, &nb_files) && nb_files == 1 &&
+         readable(&store, "a", images.size[0]) && readable(&store, "c", images.size[2]);
+    ok = ok && store_insert(&store, images.data[3], images.size[3], "d") == ERR_IMGFS_FULL &&
+         store.dir_count == 3;
+
+    store_close(&store);
+    images_free(&images);
+    TEST_ASSERT(ok);
+    return 0;
+}
+
+int main(void)
+{
+    int failures = 0;
+    RUN_TEST(test_colliding_ids, failures);
+    RUN_TEST(test_content_index, failures);
+    RUN_TEST(test_rollover, failures);
+    RUN_TEST(test_lagging_count, failures);
+    test_cleanup();
+    return failures;
+}
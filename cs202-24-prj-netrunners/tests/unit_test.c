@@ -0,0 +1,90 @@
+/**
+ * @file unit_test.c
+ * @brief Helpers of the unit tests.
+ */
+
+#include "unit_test.h"
+
+#include <stdlib.h>   // for free, malloc, mkdtemp
+#include <string.h>   // for memcpy
+#include <unistd.h>   // for rmdir, unlink
+#include <jpeglib.h>
+
+#define MAX_SCRATCH 16
+
+static char scratch_dir[] = "/tmp/imgfs-test-XXXXXX";
+static char scratch[MAX_SCRATCH][64];
+static size_t nb_scratch;
+
+/********************************************************************
+ * See unit_test.h
+ */
+int test_make_jpeg(uint32_t width, uint32_t height, unsigned seed, char** out, size_t* out_size)
+{
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+
+    unsigned char* mem = NULL;
+    unsigned long mem_size = 0;
+    jpeg_mem_dest(&cinfo, &mem, &mem_size);
+    cinfo.image_width = width;
+    cinfo.image_height = height;
+    cinfo.input_components = 1;
+    cinfo.in_color_space = JCS_GRAYSCALE;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, 90, TRUE);
+    jpeg_start_compress(&cinfo, TRUE);
+
+    JSAMPLE* row = malloc(width);
+    if (row == NULL) {
+        jpeg_destroy_compress(&cinfo);
+        return 1;
+    }
+    while (cinfo.next_scanline < height) {
+        for (uint32_t x = 0; x < width; x++) {
+            row[x] = (JSAMPLE) ((x * 7 + cinfo.next_scanline * 3 + seed * 31) & 0xFF);
+        }
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+    free(row);
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+
+    *out = malloc(mem_size);
+    if (*out != NULL) {
+        memcpy(*out, mem, mem_size);
+        *out_size = mem_size;
+    }
+    free(mem);
+    return *out == NULL;
+}
+
+/********************************************************************
+ * See unit_test.h
+ */
+const char* test_scratch_path(const char* name)
+{
+    if (nb_scratch == MAX_SCRATCH ||
+        (nb_scratch == 0 && mkdtemp(scratch_dir) == NULL)) {
+        return NULL;
+    }
+    snprintf(scratch[nb_scratch], sizeof(scratch[nb_scratch]), "%s/%s", scratch_dir, name);
+    return scratch[nb_scratch++];
+}
+
+/********************************************************************
+ * See unit_test.h
+ */
+void test_cleanup(void)
+{
+    for (size_t i = 0; i < nb_scratch; i++) {
+        unlink(scratch[i]);
+    }
+    if (nb_scratch > 0) {
+        rmdir(scratch_dir);
+        memcpy(scratch_dir + sizeof(scratch_dir) - 7, "XXXXXX", 6);
+    }
+    nb_scratch = 0;
+}
@@ -0,0 +1,54 @@
+/**
+ * @file unit_test.h
+ * @brief Minimal unit test harness of the imgFS modules: make local-tests
+ *
+ * Each tests/test_<module>.c is a program made of TEST() functions and a
+ * main() that runs them with RUN_TEST(); a failed TEST_ASSERT() ends its
+ * test with the file and line, and the program exits with the number of
+ * failed tests.
+ */
+
+#pragma once
+
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint32_t
+#include <stdio.h>  // for fprintf
+
+#define TEST(name) static int name(void)
+
+#define TEST_ASSERT(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: assertion failed: %s\n", __FILE__, __LINE__, #cond); \
+            return 1; \
+        } \
+    } while (0)
+
+#define TEST_ASSERT_ERR(expr, err) TEST_ASSERT((expr) == (err))
+
+#define RUN_TEST(name, failures) \
+    do { \
+        const int failed = name(); \
+        fprintf(stderr, "%-50s %s\n", #name, failed ? "FAILED" : "ok"); \
+        (failures) += failed; \
+    } while (0)
+
+/**
+ * @brief Encodes a width x height gray gradient as a baseline JPEG, with
+ *        seed changing the pixels (and so the SHA-256).
+ *
+ * @param out Where to put the image, to be freed with free()
+ * @param out_size Where to put its size
+ * @return 0 if no error.
+ */
+int test_make_jpeg(uint32_t width, uint32_t height, unsigned seed, char** out, size_t* out_size);
+
+/**
+ * @brief A path for a scratch file, removed by test_cleanup().
+ */
+const char* test_scratch_path(const char* name);
+
+/**
+ * @brief Removes the scratch files.
+ */
+void test_cleanup(void);
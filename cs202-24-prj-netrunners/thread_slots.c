@@ -0,0 +1,63 @@
+/**
+ * @file thread_slots.c
+ * @brief Per-thread slots, handed over when their thread exits.
+ */
+
+#include "thread_slots.h"
+
+#include <stdlib.h> // for aligned_alloc
+#include <string.h> // for memset
+
+// creates the keys of all the sets: taken once per set
+static pthread_mutex_t key_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void slot_release(void* slot)
+{
+    atomic_store_explicit(&((struct thread_slot*) slot)->in_use, 0, memory_order_release);
+}
+
+static int key_create(struct thread_slots* slots)
+{
+    if (atomic_load_explicit(&slots->key_ready, memory_order_acquire)) {
+        return 1;
+    }
+    pthread_mutex_lock(&key_lock);
+    if (!atomic_load_explicit(&slots->key_ready, memory_order_relaxed) &&
+        pthread_key_create(&slots->key, slot_release) == 0) {
+        atomic_store_explicit(&slots->key_ready, 1, memory_order_release);
+    }
+    pthread_mutex_unlock(&key_lock);
+    return atomic_load_explicit(&slots->key_ready, memory_order_acquire);
+}
+
+/********************************************************************
+ * See thread_slots.h
+ */
+void* thread_slot_get(struct thread_slots* slots)
+{
+    if (slots == NULL || !key_create(slots)) {
+        return NULL;
+    }
+
+    struct thread_slot* slot = atomic_load(&slots->head);
+    for (; slot != NULL; slot = slot->next) {
+        int expected = 0;
+        if (atomic_compare_exchange_strong(&slot->in_use, &expected, 1)) {
+            break;
+        }
+    }
+    if (slot == NULL) {
+        const size_t size = (slots->size + slots->align - 1) / slots->align * slots->align;
+        slot = aligned_alloc(slots->align, size);
+        if (slot == NULL) {
+            return NULL;
+        }
+        memset(slot, 0, size);
+        atomic_init(&slot->in_use, 1);
+        slot->next = atomic_load(&slots->head);
+        while (!atomic_compare_exchange_weak(&slots->head, &slot->next, slot));
+    }
+
+    pthread_setspecific(slots->key, slot);
+    return slot;
+}
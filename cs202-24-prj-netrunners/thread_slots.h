@@ -0,0 +1,83 @@
+/**
+ * @file thread_slots.h
+ * @brief Per-thread slots, and the single-writer counters they hold.
+ *
+ * A set of slots hands each thread a slot of its own, found again
+ * without any lock. When a thread exits, its slot is handed over to the
+ * next thread asking for one, with its content: slots are never freed, so
+ * readers may walk them at any time.
+ *
+ * Slot types start with a struct thread_slot:
+ *
+ *     struct my_slot {
+ *         struct thread_slot slot;
+ *         atomic_ullong count;
+ *     };
+ *     static struct thread_slots my_slots = THREAD_SLOTS_INIT(struct my_slot);
+ */
+
+#pragma once
+
+#include <pthread.h>   // for pthread_key_t
+#include <stdatomic.h> // for atomic_int, atomic_ullong
+#include <stddef.h>    // for size_t
+#include <stdint.h>    // for uint64_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct thread_slot {
+    struct thread_slot* next; // set once, before the slot is published
+    atomic_int in_use;        // owned by a live thread
+};
+
+struct thread_slots {
+    _Atomic(struct thread_slot*) head;
+    pthread_key_t key; // hands the slot of an exiting thread over
+    atomic_int key_ready;
+    size_t size;  // of a slot
+    size_t align; // of a slot
+};
+
+#define THREAD_SLOTS_INIT(type) { .size = sizeof(type), .align = _Alignof(type) }
+
+/**
+ * @brief The slot of the calling thread, zeroed when first allocated.
+ *
+ * Callers keep the result in a _Thread_local pointer: a slot stays the
+ * thread's until it exits.
+ *
+ * @return The slot, or NULL if out of memory.
+ */
+void* thread_slot_get(struct thread_slots* slots);
+
+/**
+ * @brief The most recent slot; the others follow through next.
+ */
+static inline struct thread_slot* thread_slots_head(struct thread_slots* slots)
+{
+    return atomic_load(&slots->head);
+}
+
+/**
+ * @brief Adds to a counter that only its owner thread writes: a plain
+ *        load and store, no locked instruction.
+ */
+static inline void counter_add(atomic_ullong* counter, uint64_t n)
+{
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+/**
+ * @brief Reads a counter, possibly a few updates behind its writer.
+ */
+static inline uint64_t counter_get(const atomic_ullong* counter)
+{
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -10,7 +10,8 @@
 
 #include <assert.h>   // see TO_BE_IMPLEMENTED
 #include <stddef.h>   // for size_t
-#include <stdint.h>   // for uint16_t, uint32_t
+#include <stdint.h>   // for uint16_t, uint32_t, uint64_t
+#include <time.h>     // for clock_gettime
 
 /**
  * @brief tag a variable as POTENTIALLY unused, to avoid compiler warnings
@@ -60,6 +61,24 @@
 #define zero_init_var(X) memset(&X, 0, sizeof(X))
 #define zero_init_ptr(X) memset(X, 0, sizeof(*X))
 
+/**
+ * @brief reads a clock, in nanoseconds
+ */
+static inline uint64_t clock_ns(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+/**
+ * @brief the monotonic clock, in nanoseconds: for durations
+ */
+static inline uint64_t now_ns(void)
+{
+    return clock_ns(CLOCK_MONOTONIC);
+}
+
 /**
  * @brief String to uint16_t conversion function
  *